@@ -51,6 +51,22 @@ extern "C" {
   void __sanitizer_unaligned_store32(void *p, uint32_t x);
   void __sanitizer_unaligned_store64(void *p, uint64_t x);
 
+  // Prints up to max_sites (all if 0) allocation stacks holding the most
+  // live heap memory. Requires heap_profile_sample_interval to be set in the
+  // tool options: on average one allocation per that many bytes allocated is
+  // sampled, and the reported numbers are estimates.
+  void __sanitizer_print_heap_profile(size_t max_sites);
+
+  // Writes the heap profile with unsymbolized stacks to "path.<pid>".
+  // Returns 0 if the profiler is disabled or the file can't be written.
+  int __sanitizer_dump_heap_profile(const char *path);
+
+  // Writes all stack traces stored by the tool and the list of loaded
+  // modules to "path.<pid>". The stacks can then be symbolized offline with
+  // sanitizer_common/scripts/stack_depot_snapshot.py. Returns 0 if the file
+  // can't be written.
+  int __sanitizer_dump_stack_depot(const char *path);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -37,6 +37,15 @@ extern "C" {
   // most once per process. This function will terminate the process if there
   // are memory leaks and the exit_code flag is non-zero.
   void __lsan_do_leak_check();
+  // Check for leaks now, and report only the ones not reported by earlier
+  // calls. Unlike __lsan_do_leak_check(), this function may be called many
+  // times (e.g. periodically by a long-running server) and doesn't terminate
+  // the process. Where the kernel tracks writes to the pages, the check only
+  // looks for leaks among the objects allocated since the previous call, and
+  // so its cost follows the recent allocations; see the full_check_period
+  // flag. Returns 1 if new leaks were found, 0 otherwise. If any were found,
+  // the end-of-process leak check exits with the exitcode flag.
+  int __lsan_do_recoverable_leak_check();
 #ifdef __cplusplus
 }  // extern "C"
 
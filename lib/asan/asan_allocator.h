@@ -17,6 +17,7 @@
 
 #include "asan_internal.h"
 #include "asan_interceptors.h"
+#include "sanitizer_common/sanitizer_heap_profile.h"
 #include "sanitizer_common/sanitizer_list.h"
 
 namespace __asan {
@@ -43,6 +44,9 @@ class AsanChunkView {
   uptr FreeTid();
   void GetAllocStack(StackTrace *stack);
   void GetFreeStack(StackTrace *stack);
+  // The stack depot ids of the stacks, or 0 without use_stack_depot.
+  u32 GetAllocStackId();
+  u32 GetFreeStackId();
   bool AddrIsInside(uptr addr, uptr access_size, sptr *offset) {
     if (addr >= Beg() && (addr + access_size) <= End()) {
       *offset = addr - Beg();
@@ -99,6 +103,7 @@ struct AsanThreadLocalMallocStorage {
 
   uptr quarantine_cache[16];
   uptr allocator2_cache[96 * (512 * 8 + 16)];  // Opaque.
+  HeapProfileThreadState heap_profile_state;
   void CommitBack();
 };
 
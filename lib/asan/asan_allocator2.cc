@@ -22,6 +22,7 @@
 #include "asan_thread.h"
 #include "sanitizer_common/sanitizer_allocator.h"
 #include "sanitizer_common/sanitizer_flags.h"
+#include "sanitizer_common/sanitizer_heap_profile.h"
 #include "sanitizer_common/sanitizer_internal_defs.h"
 #include "sanitizer_common/sanitizer_list.h"
 #include "sanitizer_common/sanitizer_stackdepot.h"
@@ -226,11 +227,9 @@ uptr AsanChunkView::FreeTid() { return chunk_->free_tid; }
 
 static void GetStackTraceFromId(u32 id, StackTrace *stack) {
   CHECK(id);
-  uptr size = 0;
-  const uptr *trace = StackDepotGet(id, &size);
+  uptr size = StackDepotGetSize(id);
   CHECK_LT(size, kStackTraceMax);
-  internal_memcpy(stack->trace, trace, sizeof(uptr) * size);
-  stack->size = size;
+  stack->size = StackDepotGet(id, stack->trace, size);
 }
 
 void AsanChunkView::GetAllocStack(StackTrace *stack) {
@@ -249,12 +248,21 @@ void AsanChunkView::GetFreeStack(StackTrace *stack) {
                                 chunk_->FreeStackSize());
 }
 
+u32 AsanChunkView::GetAllocStackId() {
+  return flags()->use_stack_depot ? chunk_->alloc_context_id : 0;
+}
+
+u32 AsanChunkView::GetFreeStackId() {
+  return flags()->use_stack_depot ? chunk_->free_context_id : 0;
+}
+
 struct QuarantineCallback;
 typedef Quarantine<QuarantineCallback, AsanChunk> AsanQuarantine;
 typedef AsanQuarantine::Cache QuarantineCache;
 static AsanQuarantine quarantine(LINKER_INITIALIZED);
 static QuarantineCache fallback_quarantine_cache(LINKER_INITIALIZED);
 static AllocatorCache fallback_allocator_cache;
+static HeapProfileThreadState fallback_heap_profile_state;
 static SpinMutex fallback_mutex;
 
 QuarantineCache *GetQuarantineCache(AsanThreadLocalMallocStorage *ms) {
@@ -268,30 +276,73 @@ struct QuarantineCallback {
       : cache_(cache) {
   }
 
-  void Recycle(AsanChunk *m) {
-    CHECK_EQ(m->chunk_state, CHUNK_QUARANTINE);
-    atomic_store((atomic_uint8_t*)m, CHUNK_AVAILABLE, memory_order_relaxed);
-    CHECK_NE(m->alloc_tid, kInvalidTid);
-    CHECK_NE(m->free_tid, kInvalidTid);
-    PoisonShadow(m->Beg(),
-                 RoundUpTo(m->UsedSize(), SHADOW_GRANULARITY),
-                 kAsanHeapLeftRedzoneMagic);
-    void *p = reinterpret_cast<void *>(m->AllocBeg());
-    if (p != m) {
-      uptr *alloc_magic = reinterpret_cast<uptr *>(p);
-      CHECK_EQ(alloc_magic[0], kAllocBegMagic);
-      // Clear the magic value, as allocator internals may overwrite the
-      // contents of deallocated chunk, confusing GetAsanChunk lookup.
-      alloc_magic[0] = 0;
-      CHECK_EQ(alloc_magic[1], reinterpret_cast<uptr>(m));
+  // class_id is the allocator size class of all the chunks, or 0 if they
+  // come from the secondary allocator or from several size classes.
+  void Recycle(AsanChunk **chunks, uptr count, uptr class_id) {
+    const uptr kPrefetch = 16;
+    for (uptr i = 0; i < kPrefetch && i < count; i++)
+      PREFETCH(chunks[i]);
+    uptr really_freed = 0;
+    for (uptr i = 0; i < count; i++) {
+      if (i + kPrefetch < count)
+        PREFETCH(chunks[i + kPrefetch]);
+      AsanChunk *m = chunks[i];
+      CHECK_EQ(m->chunk_state, CHUNK_QUARANTINE);
+      atomic_store((atomic_uint8_t*)m, CHUNK_AVAILABLE, memory_order_relaxed);
+      CHECK_NE(m->alloc_tid, kInvalidTid);
+      CHECK_NE(m->free_tid, kInvalidTid);
+      really_freed += m->UsedSize();
+      void *p = reinterpret_cast<void *>(m->AllocBeg());
+      if (p != m) {
+        uptr *alloc_magic = reinterpret_cast<uptr *>(p);
+        CHECK_EQ(alloc_magic[0], kAllocBegMagic);
+        // Clear the magic value, as allocator internals may overwrite the
+        // contents of deallocated chunk, confusing GetAsanChunk lookup.
+        alloc_magic[0] = 0;
+        CHECK_EQ(alloc_magic[1], reinterpret_cast<uptr>(m));
+      }
+      if (!class_id) {
+        PoisonShadow(m->Beg(),
+                     RoundUpTo(m->UsedSize(), SHADOW_GRANULARITY),
+                     kAsanHeapLeftRedzoneMagic);
+        allocator.Deallocate(cache_, p);
+      }
+      // The batch now holds the allocator chunks.
+      chunks[i] = reinterpret_cast<AsanChunk *>(p);
     }
 
     // Statistics.
     AsanStats &thread_stats = GetCurrentThreadStats();
-    thread_stats.real_frees++;
-    thread_stats.really_freed += m->UsedSize();
+    thread_stats.real_frees += count;
+    thread_stats.really_freed += really_freed;
 
-    allocator.Deallocate(cache_, p);
+    if (class_id) {
+      void **ptrs = reinterpret_cast<void **>(chunks);
+      PoisonFreeChunks(ptrs, count, SizeClassMap::Size(class_id));
+      allocator.BulkDeallocate(cache_, class_id, ptrs, count);
+    }
+  }
+
+  // Poisons whole allocator chunks of the given size, which is the state
+  // they were mapped in. Chunks freed one after another are often adjacent,
+  // so their shadow is poisoned with a single memset.
+  static void PoisonFreeChunks(void **ptrs, uptr count, uptr size) {
+    uptr run_beg = 0, run_end = 0;
+    for (uptr i = 0; i < count; i++) {
+      uptr p = reinterpret_cast<uptr>(ptrs[i]);
+      if (p == run_end) {
+        run_end += size;
+      } else if (p + size == run_beg) {
+        run_beg = p;
+      } else {
+        if (run_beg != run_end)
+          PoisonShadow(run_beg, run_end - run_beg, kAsanHeapLeftRedzoneMagic);
+        run_beg = p;
+        run_end = p + size;
+      }
+    }
+    if (run_beg != run_end)
+      PoisonShadow(run_beg, run_end - run_beg, kAsanHeapLeftRedzoneMagic);
   }
 
   void *Allocate(uptr size) {
@@ -307,7 +358,14 @@ struct QuarantineCallback {
 
 void InitializeAllocator() {
   allocator.Init();
+#if SANITIZER_WORDSIZE == 64
+  allocator.SetReleaseToOSThreshold((uptr)flags()->release_to_os_threshold);
+#endif
+  allocator.SetMappingCacheSize((uptr)flags()->large_mmap_cache_size);
   quarantine.Init((uptr)flags()->quarantine_size, kMaxThreadLocalQuarantine);
+  CHECK_GE(common_flags()->heap_profile_sample_interval, 0);
+  HeapProfileInit((uptr)common_flags()->heap_profile_sample_interval);
+  StackDepotSetUseTrie(common_flags()->stack_depot_trie);
 }
 
 static void *Allocate(uptr size, uptr alignment, StackTrace *stack,
@@ -398,6 +456,14 @@ static void *Allocate(uptr size, uptr alignment, StackTrace *stack,
     m->alloc_context_id = 0;
     StackTrace::CompressStack(stack, m->AllocStackBeg(), m->AllocStackSize());
   }
+  if (t) {
+    HeapProfileMalloc(&t->malloc_storage().heap_profile_state, user_beg, size,
+                      stack->trace, stack->size);
+  } else {
+    SpinMutexLock l(&fallback_mutex);
+    HeapProfileMalloc(&fallback_heap_profile_state, user_beg, size,
+                      stack->trace, stack->size);
+  }
 
   uptr size_rounded_down_to_granularity = RoundDownTo(size, SHADOW_GRANULARITY);
   // Unpoison the bulk of the memory region.
@@ -455,6 +521,7 @@ static void AtomicallySetQuarantineFlag(AsanChunk *m,
 static void QuarantineChunk(AsanChunk *m, void *ptr,
                             StackTrace *stack, AllocType alloc_type) {
   CHECK_EQ(m->chunk_state, CHUNK_QUARANTINE);
+  HeapProfileFree(m->Beg());
 
   if (m->alloc_type != alloc_type && flags()->alloc_dealloc_mismatch)
     ReportAllocTypeMismatch((uptr)ptr, stack,
@@ -480,17 +547,18 @@ static void QuarantineChunk(AsanChunk *m, void *ptr,
   thread_stats.frees++;
   thread_stats.freed += m->UsedSize();
 
-  // Push into quarantine.
+  // Push into quarantine, keeping chunks of different size classes apart.
+  uptr class_id = allocator.GetSizeClass(m->AllocBeg());
   if (t) {
     AsanThreadLocalMallocStorage *ms = &t->malloc_storage();
     AllocatorCache *ac = GetAllocatorCache(ms);
     quarantine.Put(GetQuarantineCache(ms), QuarantineCallback(ac),
-                   m, m->UsedSize());
+                   m, m->UsedSize(), class_id);
   } else {
     SpinMutexLock l(&fallback_mutex);
     AllocatorCache *ac = &fallback_allocator_cache;
     quarantine.Put(&fallback_quarantine_cache, QuarantineCallback(ac),
-                   m, m->UsedSize());
+                   m, m->UsedSize(), class_id);
   }
 }
 
@@ -550,13 +618,6 @@ static AsanChunk *GetAsanChunkByAddr(uptr p) {
   return GetAsanChunk(alloc_beg);
 }
 
-// Allocator must be locked when this function is called.
-static AsanChunk *GetAsanChunkByAddrFastLocked(uptr p) {
-  void *alloc_beg =
-      allocator.GetBlockBeginFastLocked(reinterpret_cast<void *>(p));
-  return GetAsanChunk(alloc_beg);
-}
-
 static uptr AllocationSize(uptr p) {
   AsanChunk *m = GetAsanChunkByAddr(p);
   if (!m) return 0;
@@ -718,9 +779,15 @@ void GetAllocatorGlobalRange(uptr *begin, uptr *end) {
   *end = *begin + sizeof(__asan::allocator);
 }
 
+void GetHeapRangesLocked(uptr *primary_beg, uptr *primary_end,
+                         uptr *secondary_beg, uptr *secondary_end) {
+  __asan::allocator.GetAddressRangesLocked(primary_beg, primary_end,
+                                           secondary_beg, secondary_end);
+}
+
 uptr PointsIntoChunk(void* p) {
   uptr addr = reinterpret_cast<uptr>(p);
-  __asan::AsanChunk *m = __asan::GetAsanChunkByAddrFastLocked(addr);
+  __asan::AsanChunk *m = __asan::GetAsanChunkByAddr(addr);
   if (!m) return 0;
   uptr chunk = m->Beg();
   if ((m->chunk_state == __asan::CHUNK_ALLOCATED) && m->AddrIsInside(addr))
@@ -729,8 +796,7 @@ uptr PointsIntoChunk(void* p) {
 }
 
 uptr GetUserBegin(uptr chunk) {
-  __asan::AsanChunk *m =
-      __asan::GetAsanChunkByAddrFastLocked(chunk);
+  __asan::AsanChunk *m = __asan::GetAsanChunkByAddr(chunk);
   CHECK(m);
   return m->Beg();
 }
@@ -754,6 +820,22 @@ void LsanMetadata::set_tag(ChunkTag value) {
   m->lsan_tag = value;
 }
 
+bool LsanMetadata::CompareAndSetTag(ChunkTag old_tag, ChunkTag new_tag) {
+  // The tag shares the first 8 bytes of the header with the other fields,
+  // which don't change while the world is stopped.
+  atomic_uint64_t *word = reinterpret_cast<atomic_uint64_t *>(metadata_);
+  u64 cmp = atomic_load(word, memory_order_relaxed);
+  __asan::ChunkHeader h;
+  internal_memcpy(&h, &cmp, sizeof(cmp));
+  if (h.lsan_tag != old_tag)
+    return false;
+  h.lsan_tag = new_tag;
+  u64 xchg;
+  internal_memcpy(&xchg, &h, sizeof(xchg));
+  return atomic_compare_exchange_strong(word, &cmp, xchg,
+                                        memory_order_relaxed);
+}
+
 uptr LsanMetadata::requested_size() const {
   __asan::AsanChunk *m = reinterpret_cast<__asan::AsanChunk *>(metadata_);
   return m->UsedSize();
@@ -106,6 +106,17 @@ struct Flags {
   // If true, assume that dynamic initializers can never access globals from
   // other modules, even if the latter are already initialized.
   bool strict_init_order;
+  // If not zero, a size class of the (64-bit) allocator returns its free
+  // pages to the OS once this many bytes have been freed into it (on the
+  // next refill of a thread cache from it).
+  int release_to_os_threshold;
+  // Size (in bytes) of the cache of freed large mappings reused by later
+  // large allocations instead of calling mmap/munmap. 0 disables the cache.
+  int large_mmap_cache_size;
+  // If set, the threads keep a shadow stack of the functions instrumented
+  // with -finstrument-functions, and malloc/free stacks are copied from it
+  // instead of unwinding the stack. The stacks skip uninstrumented frames.
+  bool shadow_stack_unwind;
 };
 
 extern Flags asan_flags_dont_use_directly;
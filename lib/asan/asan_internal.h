@@ -60,6 +60,12 @@
 # endif
 #endif
 
+// If set, ASan may take the malloc stacks from a shadow stack maintained by
+// the -finstrument-functions hooks (see the shadow_stack_unwind flag).
+#ifndef ASAN_SHADOW_STACK
+# define ASAN_SHADOW_STACK (SANITIZER_LINUX && !SANITIZER_ANDROID)
+#endif
+
 #ifndef ASAN_USE_PREINIT_ARRAY
 # define ASAN_USE_PREINIT_ARRAY (SANITIZER_LINUX && !SANITIZER_ANDROID)
 #endif
@@ -381,12 +381,12 @@ void DescribeHeapAddress(uptr addr, uptr access_size) {
            d.EndAllocation());
     StackTrace free_stack;
     chunk.GetFreeStack(&free_stack);
-    PrintStack(&free_stack);
+    PrintStack(&free_stack, chunk.GetFreeStackId());
     Printf("%spreviously allocated by thread T%d%s here:%s\n",
            d.Allocation(), alloc_thread->tid,
            ThreadNameWithParenthesis(alloc_thread, tname, sizeof(tname)),
            d.EndAllocation());
-    PrintStack(&alloc_stack);
+    PrintStack(&alloc_stack, chunk.GetAllocStackId());
     DescribeThread(t->context());
     DescribeThread(free_thread);
     DescribeThread(alloc_thread);
@@ -395,7 +395,7 @@ void DescribeHeapAddress(uptr addr, uptr access_size) {
            alloc_thread->tid,
            ThreadNameWithParenthesis(alloc_thread, tname, sizeof(tname)),
            d.EndAllocation());
-    PrintStack(&alloc_stack);
+    PrintStack(&alloc_stack, chunk.GetAllocStackId());
     DescribeThread(t->context());
     DescribeThread(alloc_thread);
   }
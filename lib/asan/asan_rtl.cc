@@ -23,6 +23,7 @@
 #include "sanitizer_common/sanitizer_atomic.h"
 #include "sanitizer_common/sanitizer_flags.h"
 #include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_stackdepot.h"
 #include "sanitizer_common/sanitizer_symbolizer.h"
 #include "lsan/lsan_common.h"
 
@@ -40,6 +41,8 @@ static void AsanDie() {
     Report("Sleeping for %d second(s)\n", flags()->sleep_before_dying);
     SleepForSeconds(flags()->sleep_before_dying);
   }
+  // Before the shadow is unmapped and the process is left barely usable.
+  StackDepotDumpSnapshot();
   if (flags()->unmap_shadow_on_exit) {
     if (kMidMemBeg) {
       UnmapOrDie((void*)kLowShadowBeg, kMidMemBeg - kLowShadowBeg);
@@ -124,13 +127,20 @@ static void ParseFlagsFromString(Flags *f, const char *str) {
   ParseFlag(str, &f->use_stack_depot, "use_stack_depot");
   ParseFlag(str, &f->strict_memcmp, "strict_memcmp");
   ParseFlag(str, &f->strict_init_order, "strict_init_order");
+  ParseFlag(str, &f->release_to_os_threshold, "release_to_os_threshold");
+  CHECK_GE(f->release_to_os_threshold, 0);
+  ParseFlag(str, &f->large_mmap_cache_size, "large_mmap_cache_size");
+  CHECK_GE(f->large_mmap_cache_size, 0);
+  ParseFlag(str, &f->shadow_stack_unwind, "shadow_stack_unwind");
 }
 
 void InitializeFlags(Flags *f, const char *env) {
   CommonFlags *cf = common_flags();
   cf->external_symbolizer_path = GetEnv("ASAN_SYMBOLIZER_PATH");
   cf->symbolize = true;
+  cf->symbolize_in_process = false;
   cf->malloc_context_size = kDefaultMallocContextSize;
+  cf->malloc_context_prefix_size = 0;
   cf->fast_unwind_on_fatal = false;
   cf->fast_unwind_on_malloc = true;
   cf->strip_path_prefix = "";
@@ -138,6 +148,10 @@ void InitializeFlags(Flags *f, const char *env) {
   cf->log_path = 0;
   cf->detect_leaks = false;
   cf->leak_check_at_exit = true;
+  cf->heap_profile_sample_interval = 0;
+  cf->stack_depot_trie = false;
+  cf->stack_depot_snapshot_path = 0;
+  cf->eh_frame_unwind = false;
 
   internal_memset(f, 0, sizeof(*f));
   f->quarantine_size = (ASAN_LOW_MEMORY) ? 1UL << 26 : 1UL << 28;
@@ -174,6 +188,9 @@ void InitializeFlags(Flags *f, const char *env) {
   f->use_stack_depot = true;
   f->strict_memcmp = true;
   f->strict_init_order = false;
+  f->release_to_os_threshold = 0;
+  f->large_mmap_cache_size = 0;
+  f->shadow_stack_unwind = false;
 
   // Override from compile definition.
   ParseFlagsFromString(f, MaybeUseAsanDefaultOptionsCompileDefiniton());
@@ -561,6 +578,9 @@ void __asan_init() {
     Atexit(__lsan::DoLeakCheck);
   }
 #endif  // CAN_SANITIZE_LEAKS
+  // Registered after the leak checker, so that it runs before it.
+  if (common_flags()->stack_depot_snapshot_path)
+    Atexit(StackDepotDumpSnapshot);
 
   if (flags()->verbosity) {
     Report("AddressSanitizer Init done\n");
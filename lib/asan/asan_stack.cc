@@ -24,9 +24,34 @@ static bool MaybeCallAsanSymbolize(const void *pc, char *out_buffer,
                              : false;
 }
 
-void PrintStack(StackTrace *stack) {
-  stack->PrintStack(stack->trace, stack->size, common_flags()->symbolize,
-                    common_flags()->strip_path_prefix, MaybeCallAsanSymbolize);
+void PrintStack(StackTrace *stack, u32 depot_id) {
+  uptr n = stack->PrintStack(stack->trace, stack->size,
+                             common_flags()->symbolize,
+                             common_flags()->strip_path_prefix,
+                             MaybeCallAsanSymbolize);
+  if (depot_id)
+    PrintDeepStackTail(depot_id, n, common_flags()->symbolize,
+                       common_flags()->strip_path_prefix,
+                       MaybeCallAsanSymbolize);
+}
+
+void GetMallocStackTrace(StackTrace *stack, uptr pc, uptr bp,
+                         uptr caller_pc) {
+  uptr max_s = common_flags()->malloc_context_size;
+  if (ShadowStack *s = GetCurrentShadowStack()) {
+    s->CopyTo(stack, max_s, pc, caller_pc);
+    return;
+  }
+  uptr stack_top = 0, stack_bottom = 0;
+  AsanThread *t;
+  if (asan_inited && (t = GetCurrentThread())) {
+    stack_top = t->stack_top();
+    stack_bottom = t->stack_bottom();
+  }
+  GetTruncatedStackTrace(stack, max_s,
+                         common_flags()->malloc_context_prefix_size, pc, bp,
+                         stack_top, stack_bottom,
+                         common_flags()->fast_unwind_on_malloc);
 }
 
 }  // namespace __asan
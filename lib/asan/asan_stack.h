@@ -21,7 +21,15 @@
 
 namespace __asan {
 
-void PrintStack(StackTrace *stack);
+// If the stack was retrieved from the stack depot by depot_id, also prints
+// the deeper frames linked to it (see PrintDeepStackTail).
+void PrintStack(StackTrace *stack, u32 depot_id = 0);
+
+// Gets the stack of an allocation or deallocation, pc being in the
+// allocator entry point which user code called at caller_pc. Copies the
+// shadow stack of the current thread if it is maintained, and unwinds the
+// stack otherwise (see malloc_context_prefix_size).
+void GetMallocStackTrace(StackTrace *stack, uptr pc, uptr bp, uptr caller_pc);
 
 }  // namespace __asan
 
@@ -66,8 +74,9 @@ void PrintStack(StackTrace *stack);
   GET_STACK_TRACE(kStackTraceMax, true)
 
 #define GET_STACK_TRACE_MALLOC                                    \
-  GET_STACK_TRACE(common_flags()->malloc_context_size,            \
-                  common_flags()->fast_unwind_on_malloc)
+  StackTrace stack;                                               \
+  GetMallocStackTrace(&stack, StackTrace::GetCurrentPc(),         \
+                      GET_CURRENT_FRAME(), GET_CALLER_PC())
 
 #define GET_STACK_TRACE_FREE GET_STACK_TRACE_MALLOC
 
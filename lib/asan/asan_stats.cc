@@ -63,8 +63,10 @@ static void PrintAccumulatedStats() {
   BlockingMutexLock lock(&print_lock);
   stats.Print();
   StackDepotStats *stack_depot_stats = StackDepotGetStats();
-  Printf("Stats: StackDepot: %zd ids; %zdM mapped\n",
-         stack_depot_stats->n_uniq_ids, stack_depot_stats->mapped >> 20);
+  Printf("Stats: StackDepot: %zd ids; %zdM mapped; "
+         "%zd cache hits, %zd misses\n",
+         stack_depot_stats->n_uniq_ids, stack_depot_stats->mapped >> 20,
+         stack_depot_stats->cache_hits, stack_depot_stats->cache_misses);
   PrintInternalAllocatorStats();
 }
 
@@ -69,6 +69,59 @@ AsanThreadContext *GetThreadContextByTidLocked(u32 tid) {
       asanThreadRegistry().GetThreadLocked(tid));
 }
 
+// ShadowStack implementation.
+
+#if ASAN_SHADOW_STACK
+static THREADLOCAL ShadowStack *current_shadow_stack;
+#endif
+
+ShadowStack *GetCurrentShadowStack() {
+#if ASAN_SHADOW_STACK
+  return current_shadow_stack;
+#else
+  return 0;
+#endif
+}
+
+void ShadowStack::Init() {
+  uptr size = RoundUpTo(3 * kMaxSize * sizeof(uptr), GetPageSizeCached());
+  fns_ = (uptr*)MmapOrDie(size, "ShadowStack");
+  pcs_ = fns_ + kMaxSize;
+  frames_ = pcs_ + kMaxSize;
+  size_ = 0;
+}
+
+void ShadowStack::Destroy() {
+  if (!inited())
+    return;
+  UnmapOrDie(fns_, RoundUpTo(3 * kMaxSize * sizeof(uptr),
+                             GetPageSizeCached()));
+  fns_ = 0;
+  pcs_ = 0;
+}
+
+void ShadowStack::CopyTo(StackTrace *stack, uptr max_depth, uptr pc,
+                         uptr caller_pc) {
+  max_depth = Min(max_depth, kStackTraceMax);
+  stack->max_size = max_depth;
+  stack->size = 0;
+  if (max_depth == 0)
+    return;
+  stack->trace[stack->size++] = pc;
+  if (max_depth > 1)
+    stack->trace[stack->size++] = caller_pc;
+  if (size_ && stack->size < max_depth) {
+    // The frames are symbolized at GetPreviousInstructionPc(frame), so
+    // shift the entry point forward by the same amount.
+    uptr fn = fns_[size_ - 1];
+    stack->trace[stack->size++] =
+        fn + (fn - StackTrace::GetPreviousInstructionPc(fn));
+  }
+  uptr n = Min(size_, max_depth - stack->size);
+  for (uptr i = 0; i < n; i++)
+    stack->trace[stack->size++] = pcs_[size_ - 1 - i];
+}
+
 // AsanThread implementation.
 
 AsanThread *AsanThread::Create(thread_callback_t start_routine,
@@ -103,6 +156,12 @@ void AsanThread::Destroy() {
   // and we don't want it to have any poisoned stack.
   ClearShadowForThreadStackAndTLS();
   DeleteFakeStack();
+#if ASAN_SHADOW_STACK
+  // The later TSD destructors may still call instrumented functions.
+  if (current_shadow_stack == &shadow_stack_)
+    current_shadow_stack = 0;
+#endif
+  shadow_stack_.Destroy();
   uptr size = RoundUpTo(sizeof(AsanThread), GetPageSizeCached());
   UnmapOrDie(this, size);
 }
@@ -119,6 +178,12 @@ void AsanThread::Init() {
            stack_top_ - stack_bottom_, &local);
   }
   fake_stack_ = 0;  // Will be initialized lazily if needed.
+#if ASAN_SHADOW_STACK
+  if (flags()->shadow_stack_unwind) {
+    shadow_stack_.Init();
+    current_shadow_stack = &shadow_stack_;
+  }
+#endif
   AsanPlatformThreadInit();
 }
 
@@ -264,6 +329,28 @@ void EnsureMainThreadIDIsCorrect() {
 }
 }  // namespace __asan
 
+// --- Function entry/exit hooks for -finstrument-functions --- {{{1
+#if ASAN_SHADOW_STACK
+using namespace __asan;  // NOLINT
+
+// Weak, so that hooks defined in the main executable take precedence. The
+// hooks are exported from the runtime, so they still preempt the ones of
+// the users that define their own hooks in a shared library.
+extern "C" {
+SANITIZER_WEAK_ATTRIBUTE SANITIZER_INTERFACE_ATTRIBUTE
+void __cyg_profile_func_enter(void *this_fn, void *call_site) {
+  if (ShadowStack *s = current_shadow_stack)
+    s->Enter((uptr)this_fn, (uptr)call_site, GET_CURRENT_FRAME());
+}
+
+SANITIZER_WEAK_ATTRIBUTE SANITIZER_INTERFACE_ATTRIBUTE
+void __cyg_profile_func_exit(void *this_fn, void *call_site) {
+  if (ShadowStack *s = current_shadow_stack)
+    s->Exit(GET_CURRENT_FRAME());
+}
+}  // extern "C"
+#endif  // ASAN_SHADOW_STACK
+
 // --- Implementation of LSan-specific functions --- {{{1
 namespace __lsan {
 bool GetThreadRangesLocked(uptr os_id, uptr *stack_begin, uptr *stack_end,
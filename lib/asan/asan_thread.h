@@ -50,6 +50,54 @@ class AsanThreadContext : public ThreadContextBase {
 // AsanThreadContext objects are never freed, so we need many of them.
 COMPILER_CHECK(sizeof(AsanThreadContext) <= 4096);
 
+// Entry points and return addresses of the active functions instrumented
+// with -finstrument-functions, outermost first. They are pushed and popped
+// by the __cyg_profile_func_enter/__cyg_profile_func_exit hooks when the
+// shadow_stack_unwind flag is set. Every entry also keeps the frame address
+// of the hook, so the entries of the frames left by longjmp or exceptions
+// are dropped as soon as a function at the same or an outer level enters
+// or exits.
+class ShadowStack {
+ public:
+  void Init();
+  void Destroy();
+  bool inited() { return pcs_ != 0; }
+
+  void Enter(uptr fn, uptr pc, uptr frame) {
+    Exit(frame);
+    // Frames deeper than kMaxSize are not recorded.
+    if (size_ < kMaxSize) {
+      fns_[size_] = fn;
+      pcs_[size_] = pc;
+      frames_[size_] = frame;
+      size_++;
+    }
+  }
+  void Exit(uptr frame) {
+    while (size_ && frames_[size_ - 1] <= frame)
+      size_--;
+  }
+
+  // Stores pc, caller_pc, the entry point of the innermost instrumented
+  // function and the return addresses from the shadow stack, innermost
+  // first, into stack. The entry point keeps that function in the stack
+  // when it reached pc through uninstrumented code (e.g. operator new or
+  // strdup), in which case caller_pc is in that code and the function's
+  // own return address is not known. When it called pc directly, the
+  // function shows up twice: at caller_pc and at its entry point.
+  void CopyTo(StackTrace *stack, uptr max_depth, uptr pc, uptr caller_pc);
+
+ private:
+  static const uptr kMaxSize = 1 << 14;
+  uptr *fns_;
+  uptr *pcs_;
+  uptr *frames_;
+  uptr size_;
+};
+
+// Returns the shadow stack of the current thread if it is maintained, or 0.
+ShadowStack *GetCurrentShadowStack();
+
 // AsanThread are stored in TSD and destroyed when the thread dies.
 class AsanThread {
  public:
@@ -89,6 +137,7 @@ class AsanThread {
 
   AsanThreadLocalMallocStorage &malloc_storage() { return malloc_storage_; }
   AsanStats &stats() { return stats_; }
+  ShadowStack &shadow_stack() { return shadow_stack_; }
 
  private:
   AsanThread() {}
@@ -105,6 +154,7 @@ class AsanThread {
   FakeStack *fake_stack_;
   AsanThreadLocalMallocStorage malloc_storage_;
   AsanStats stats_;
+  ShadowStack shadow_stack_;
 };
 
 struct CreateThreadContextArgs {
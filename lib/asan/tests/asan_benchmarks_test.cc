@@ -79,6 +79,27 @@ TEST(AddressSanitizer, FakeStackBenchmark) {
     Ident(&FunctionWithLargeStack)();
 }
 
+__attribute__((noinline))
+static void MallocAtDepth(int depth, size_t n_iter) {
+  if (depth) {
+    MallocAtDepth(depth - 1, n_iter);
+    break_optimization(0);
+    return;
+  }
+  for (size_t i = 0; i < n_iter; i++) {
+    void *p = malloc(16);
+    break_optimization(p);
+    free(p);
+  }
+}
+
+// Compares the malloc stack unwinders: run with ASAN_OPTIONS=
+// shadow_stack_unwind=1 to take the stacks from the shadow stack kept by
+// the -finstrument-functions hooks, and without it to walk the frames.
+TEST(AddressSanitizer, DeepMallocBenchmark) {
+  MallocAtDepth(30, 1 << 22);
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -15,6 +15,7 @@
 #include "asan_allocator.h"
 #include "asan_internal.h"
 #include "asan_mapping.h"
+#include "asan_thread.h"
 #include "asan_test_utils.h"
 
 #include <assert.h>
@@ -257,6 +258,44 @@ TEST(AddressSanitizer, CompressStackTraceBenchmark) {
   CompressStackTraceBenchmark(1 << 24);
 }
 
+TEST(AddressSanitizer, ShadowStackTest) {
+  __asan::ShadowStack s;
+  memset(&s, 0, sizeof(s));
+  s.Init();
+  uptr fn_delta = 0x1000 - StackTrace::GetPreviousInstructionPc(0x1000);
+  // Frames grow down.
+  s.Enter(0x1000, 0x100, 0x7000);
+  s.Enter(0x2000, 0x200, 0x6000);
+  s.Enter(0x3000, 0x300, 0x5000);
+  StackTrace stack;
+  s.CopyTo(&stack, kStackTraceMax, 0x10, 0x20);
+  EXPECT_EQ(6U, stack.size);
+  EXPECT_EQ(0x10U, stack.trace[0]);
+  EXPECT_EQ(0x20U, stack.trace[1]);
+  EXPECT_EQ(0x3000U + fn_delta, stack.trace[2]);
+  EXPECT_EQ(0x300U, stack.trace[3]);
+  EXPECT_EQ(0x100U, stack.trace[5]);
+  s.CopyTo(&stack, 3, 0x10, 0x20);
+  EXPECT_EQ(3U, stack.size);
+  EXPECT_EQ(0x3000U + fn_delta, stack.trace[2]);
+  s.Exit(0x5000);
+  s.CopyTo(&stack, kStackTraceMax, 0x10, 0x20);
+  EXPECT_EQ(5U, stack.size);
+  EXPECT_EQ(0x2000U + fn_delta, stack.trace[2]);
+  EXPECT_EQ(0x200U, stack.trace[3]);
+  // A longjmp out of the frame 0x6000: its entry is dropped when a sibling
+  // enters.
+  s.Enter(0x4000, 0x400, 0x6000);
+  s.CopyTo(&stack, kStackTraceMax, 0x10, 0x20);
+  EXPECT_EQ(5U, stack.size);
+  EXPECT_EQ(0x4000U + fn_delta, stack.trace[2]);
+  EXPECT_EQ(0x400U, stack.trace[3]);
+  s.Exit(0x7000);
+  s.CopyTo(&stack, kStackTraceMax, 0x10, 0x20);
+  EXPECT_EQ(2U, stack.size);
+  s.Destroy();
+}
+
 TEST(AddressSanitizer, QuarantineTest) {
   StackTrace stack;
   stack.trace[0] = 0x890;
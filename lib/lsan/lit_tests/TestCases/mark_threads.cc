@@ -0,0 +1,34 @@
+// Test that the parallel flood fill finds the same leaks as the serial one.
+// RUN: LSAN_BASE="report_objects=1:use_stacks=0:use_registers=0"
+// RUN: %clangxx_lsan %s -o %t
+// RUN: LSAN_OPTIONS=$LSAN_BASE:"mark_threads=1" %t 2>&1 | FileCheck %s
+// RUN: LSAN_OPTIONS=$LSAN_BASE:"mark_threads=4" %t 2>&1 | FileCheck %s
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Node {
+  Node *kids[4];
+};
+
+Node *root;
+
+Node *Build(int depth) {
+  Node *n = (Node *)calloc(1, sizeof(Node));
+  if (depth > 0)
+    for (int i = 0; i < 4; i++)
+      n->kids[i] = Build(depth - 1);
+  return n;
+}
+
+int main() {
+  root = Build(6);
+  Node *leaked = root->kids[3]->kids[2]->kids[1];
+  fprintf(stderr, "Test alloc: %p.\n", leaked);
+  root->kids[3]->kids[2]->kids[1] = 0;
+  return 0;
+}
+// CHECK: Test alloc: [[ADDR:.*]].
+// CHECK: Directly leaked 32 byte object at [[ADDR]]
+// CHECK: LeakSanitizer: detected memory leaks
+// CHECK: SUMMARY: LeakSanitizer: 2720 byte(s) leaked in 85 allocation(s)
@@ -0,0 +1,39 @@
+// Test for __lsan_do_recoverable_leak_check(). Every leak is reported only by
+// the first check which finds it.
+// RUN: LSAN_BASE="use_stacks=0:use_registers=0"
+// RUN: %clangxx_lsan %s -o %t
+// RUN: LSAN_OPTIONS=$LSAN_BASE %t 2>&1 | FileCheck %s
+// RUN: LSAN_OPTIONS=$LSAN_BASE:"full_check_period=1" %t 2>&1 | FileCheck %s
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sanitizer/lsan_interface.h>
+
+struct Node {
+  Node *next;
+  char data[1000];
+};
+
+Node *list;
+
+int main() {
+  list = (Node *)calloc(1, sizeof(Node));
+  void *p = malloc(1337);
+  p = 0;
+  fprintf(stderr, "First check: %d\n", __lsan_do_recoverable_leak_check());
+  fprintf(stderr, "Second check: %d\n", __lsan_do_recoverable_leak_check());
+  // A new object reachable only from an old one.
+  list->next = (Node *)calloc(1, sizeof(Node));
+  p = malloc(42);
+  p = 0;
+  fprintf(stderr, "Third check: %d\n", __lsan_do_recoverable_leak_check());
+  return 0;
+}
+
+// CHECK: SUMMARY: LeakSanitizer: 1337 byte(s) leaked in 1 allocation(s)
+// CHECK: First check: 1
+// CHECK-NOT: LeakSanitizer
+// CHECK: Second check: 0
+// CHECK: SUMMARY: LeakSanitizer: 42 byte(s) leaked in 1 allocation(s)
+// CHECK: Third check: 1
+// CHECK: LeakSanitizer: no new leaks, but earlier leak checks have found some
@@ -15,6 +15,7 @@
 #include "lsan.h"
 
 #include "sanitizer_common/sanitizer_flags.h"
+#include "sanitizer_common/sanitizer_stackdepot.h"
 #include "sanitizer_common/sanitizer_stacktrace.h"
 #include "lsan_allocator.h"
 #include "lsan_common.h"
@@ -43,6 +44,7 @@ void Init() {
   inited = true;
   SanitizerToolName = "LeakSanitizer";
   InitializeCommonFlags();
+  StackDepotSetUseTrie(common_flags()->stack_depot_trie);
   InitializeAllocator();
   InitTlsSize();
   InitializeInterceptors();
@@ -62,6 +64,9 @@ void Init() {
   InitCommonLsan();
   if (common_flags()->detect_leaks && common_flags()->leak_check_at_exit)
     Atexit(DoLeakCheck);
+  // Registered after the leak checker, so that it runs before it.
+  if (common_flags()->stack_depot_snapshot_path)
+    Atexit(StackDepotDumpSnapshot);
 }
 
 }  // namespace __lsan
@@ -129,9 +129,15 @@ void GetAllocatorGlobalRange(uptr *begin, uptr *end) {
   *end = *begin + sizeof(allocator);
 }
 
+void GetHeapRangesLocked(uptr *primary_beg, uptr *primary_end,
+                         uptr *secondary_beg, uptr *secondary_end) {
+  allocator.GetAddressRangesLocked(primary_beg, primary_end, secondary_beg,
+                                   secondary_end);
+}
+
 uptr PointsIntoChunk(void* p) {
   uptr addr = reinterpret_cast<uptr>(p);
-  uptr chunk = reinterpret_cast<uptr>(allocator.GetBlockBeginFastLocked(p));
+  uptr chunk = reinterpret_cast<uptr>(allocator.GetBlockBegin(p));
   if (!chunk) return 0;
   // LargeMmapAllocator considers pointers to the meta-region of a chunk to be
   // valid, but we don't want that.
@@ -164,6 +170,22 @@ void LsanMetadata::set_tag(ChunkTag value) {
   reinterpret_cast<ChunkMetadata *>(metadata_)->tag = value;
 }
 
+bool LsanMetadata::CompareAndSetTag(ChunkTag old_tag, ChunkTag new_tag) {
+  // The tag shares the first word with the other fields, which don't change
+  // while the world is stopped.
+  atomic_uint64_t *word = reinterpret_cast<atomic_uint64_t *>(metadata_);
+  u64 cmp = atomic_load(word, memory_order_relaxed);
+  ChunkMetadata m;
+  internal_memcpy(&m, &cmp, sizeof(cmp));
+  if (m.tag != old_tag)
+    return false;
+  m.tag = new_tag;
+  u64 xchg;
+  internal_memcpy(&xchg, &m, sizeof(xchg));
+  return atomic_compare_exchange_strong(word, &cmp, xchg,
+                                        memory_order_relaxed);
+}
+
 uptr LsanMetadata::requested_size() const {
   return reinterpret_cast<ChunkMetadata *>(metadata_)->requested_size;
 }
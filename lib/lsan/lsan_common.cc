@@ -14,9 +14,12 @@
 
 #include "lsan_common.h"
 
+#include "sanitizer_common/sanitizer_atomic.h"
 #include "sanitizer_common/sanitizer_common.h"
 #include "sanitizer_common/sanitizer_flags.h"
+#include "sanitizer_common/sanitizer_mutex.h"
 #include "sanitizer_common/sanitizer_placement_new.h"
+#include "sanitizer_common/sanitizer_pointer_filter.h"
 #include "sanitizer_common/sanitizer_stackdepot.h"
 #include "sanitizer_common/sanitizer_stacktrace.h"
 #include "sanitizer_common/sanitizer_stoptheworld.h"
@@ -46,6 +49,8 @@ static void InitializeFlags() {
   f->use_stacks = true;
   f->use_tls = true;
   f->use_unaligned = false;
+  f->mark_threads = 1;
+  f->full_check_period = 0;
   f->verbosity = 0;
   f->log_pointers = false;
   f->log_threads = false;
@@ -57,6 +62,10 @@ static void InitializeFlags() {
     ParseFlag(options, &f->use_stacks, "use_stacks");
     ParseFlag(options, &f->use_tls, "use_tls");
     ParseFlag(options, &f->use_unaligned, "use_unaligned");
+    ParseFlag(options, &f->mark_threads, "mark_threads");
+    CHECK_GE(f->mark_threads, 1);
+    ParseFlag(options, &f->full_check_period, "full_check_period");
+    CHECK_GE(f->full_check_period, 0);
     ParseFlag(options, &f->report_objects, "report_objects");
     ParseFlag(options, &f->resolution, "resolution");
     CHECK_GE(&f->resolution, 0);
@@ -96,6 +105,10 @@ void InitCommonLsan() {
   InitializePlatformSpecificModules();
 }
 
+// Passes the words in the heap ranges, set up for each leak check. Passes
+// every word before the first one.
+static PointerFilter pointer_filter;  // Linker initialized.
+
 static inline bool CanBeAHeapPointer(uptr p) {
   // Since our heap is located in mmap-ed memory, we can assume a sensible lower
   // bound on heap addresses.
@@ -109,6 +122,18 @@ static inline bool CanBeAHeapPointer(uptr p) {
 #endif
 }
 
+// Sets the tag unless the chunk already has this or a stronger one. Reachable
+// beats ignored beats leaked. Several marker threads may find the chunk at
+// once, and only the one which sets the tag adds the chunk to its frontier.
+static inline bool UpgradeTag(LsanMetadata *m, ChunkTag tag) {
+  for (;;) {
+    ChunkTag old_tag = m->tag();
+    if (old_tag == kReachable) return false;
+    if (old_tag == kIgnored && tag != kReachable) return false;
+    if (m->CompareAndSetTag(old_tag, tag)) return true;
+  }
+}
+
 // Scans the memory range, looking for byte patterns that point into allocator
 // chunks. Marks those chunks with |tag| and adds them to |frontier|.
 // There are two usage modes for this function: finding reachable or ignored
@@ -125,15 +150,18 @@ void ScanRangeForPointers(uptr begin, uptr end,
   if (pp % alignment)
     pp = pp + alignment - pp % alignment;
   for (; pp + sizeof(void *) <= end; pp += alignment) {  // NOLINT
+    // Skip the words which can't point into the heap several at a time.
+    if (alignment == sizeof(uptr)) {
+      pp = pointer_filter.FindCandidate(pp, end);
+      if (pp + sizeof(void *) > end) break;
+    }
     void *p = *reinterpret_cast<void **>(pp);
+    if (!pointer_filter.MayBeHeapPointer(reinterpret_cast<uptr>(p))) continue;
     if (!CanBeAHeapPointer(reinterpret_cast<uptr>(p))) continue;
     uptr chunk = PointsIntoChunk(p);
     if (!chunk) continue;
     LsanMetadata m(chunk);
-    // Reachable beats ignored beats leaked.
-    if (m.tag() == kReachable) continue;
-    if (m.tag() == kIgnored && tag != kReachable) continue;
-    m.set_tag(tag);
+    if (!UpgradeTag(&m, tag)) continue;
     if (flags()->log_pointers)
       Report("%p: found %p pointing into chunk %p-%p of size %zu.\n", pp, p,
              chunk, chunk + m.requested_size(), m.requested_size());
@@ -211,14 +239,199 @@ static void ProcessThreads(SuspendedThreadsList const &suspended_threads,
   }
 }
 
-static void FloodFillTag(Frontier *frontier, ChunkTag tag) {
-  while (frontier->size()) {
-    uptr next_chunk = frontier->back();
-    frontier->pop_back();
-    LsanMetadata m(next_chunk);
-    ScanRangeForPointers(next_chunk, next_chunk + m.requested_size(), frontier,
-                         "HEAP", tag);
+static void ScanNextChunk(Frontier *frontier, ChunkTag tag) {
+  uptr next_chunk = frontier->back();
+  frontier->pop_back();
+  LsanMetadata m(next_chunk);
+  ScanRangeForPointers(next_chunk, next_chunk + m.requested_size(), frontier,
+                       "HEAP", tag);
+}
+
+// Flood fill with flags()->mark_threads threads. Every marker scans the
+// chunks of its private frontier and moves a part of it to its shared
+// frontier when another marker is idle. An idle marker steals from the shared
+// frontiers; the fill is done when all markers are idle.
+class ParallelMarker {
+ public:
+  ParallelMarker(uptr n_markers, ChunkTag tag)
+      : n_markers_(n_markers), tag_(tag) {
+    markers_ = (Marker *)MmapOrDie(n_markers * sizeof(Marker),
+                                   "ParallelMarker");
+    for (uptr i = 0; i < n_markers; i++)
+      new(&markers_[i]) Marker(this, i);
+    atomic_store(&n_idle_, 0, memory_order_relaxed);
+    atomic_store(&failed_, 0, memory_order_relaxed);
+  }
+
+  ~ParallelMarker() {
+    for (uptr i = 0; i < n_markers_; i++)
+      markers_[i].~Marker();
+    UnmapOrDie(markers_, n_markers_ * sizeof(Marker));
+  }
+
+  // Empties the frontier. Returns false if a marker thread failed.
+  bool Run(Frontier *frontier) {
+    // Hand out the chunks before starting the threads, so that they don't
+    // find everybody idle.
+    for (uptr i = 0; frontier->size(); i++) {
+      markers_[i % n_markers_].shared.push_back(frontier->back());
+      frontier->pop_back();
+    }
+    for (uptr i = 0; i < n_markers_; i++) {
+      atomic_store(&markers_[i].shared_size, markers_[i].shared.size(),
+                   memory_order_relaxed);
+    }
+    for (uptr i = 1; i < n_markers_; i++) {
+      Marker *m = &markers_[i];
+      m->running = StartMarkerThread(&m->thread, MarkerThreadFunc, m);
+      // The others will steal the chunks of a marker which isn't running.
+      if (!m->running)
+        atomic_fetch_add(&n_idle_, 1, memory_order_seq_cst);
+    }
+    Mark(&markers_[0]);
+    for (uptr i = 1; i < n_markers_; i++) {
+      bool success;
+      if (markers_[i].running &&
+          JoinMarkerThread(&markers_[i].thread, /* block */ true, &success) &&
+          !success)
+        atomic_store(&failed_, 1, memory_order_relaxed);
+    }
+    return !atomic_load(&failed_, memory_order_relaxed);
+  }
+
+ private:
+  // Move a part of the private frontier to the shared one when it's at least
+  // this big.
+  static const uptr kMinShare = 64;
+
+  struct Marker {
+    Marker(ParallelMarker *parent, uptr idx)
+        : parent(parent), idx(idx), running(false),
+          local(GetPageSizeCached()), shared(GetPageSizeCached()) {
+      atomic_store(&shared_size, 0, memory_order_relaxed);
+    }
+
+    ParallelMarker *parent;
+    uptr idx;
+    bool running;
+    MarkerThread thread;
+    Frontier local;
+    SpinMutex mutex;
+    Frontier shared;  // Guarded by mutex.
+    atomic_uintptr_t shared_size;
+  };
+
+  static int MarkerThreadFunc(void *arg) {
+    Marker *m = reinterpret_cast<Marker *>(arg);
+    m->parent->Mark(m);
+    return 0;
+  }
+
+  void Mark(Marker *m) {
+    do {
+      while (m->local.size()) {
+        ScanNextChunk(&m->local, tag_);
+        if (m->local.size() >= 2 * kMinShare &&
+            atomic_load(&n_idle_, memory_order_relaxed) &&
+            !atomic_load(&m->shared_size, memory_order_relaxed))
+          Share(m);
+      }
+    } while (GetWork(m));
+  }
+
+  void Share(Marker *m) {
+    SpinMutexLock l(&m->mutex);
+    for (uptr n = m->local.size() / 2; n; n--) {
+      m->shared.push_back(m->local.back());
+      m->local.pop_back();
+    }
+    atomic_store(&m->shared_size, m->shared.size(), memory_order_release);
+  }
+
+  // Moves chunks from the shared frontier of victim to the private frontier
+  // of m: all of them if it's m's own, half of them otherwise.
+  bool Take(Marker *victim, Marker *m) {
+    SpinMutexLock l(&victim->mutex);
+    uptr size = victim->shared.size();
+    if (!size)
+      return false;
+    uptr n = victim == m ? size : (size + 1) / 2;
+    for (; n; n--) {
+      m->local.push_back(victim->shared.back());
+      victim->shared.pop_back();
+    }
+    atomic_store(&victim->shared_size, victim->shared.size(),
+                 memory_order_release);
+    return true;
+  }
+
+  // Returns true if a marker thread has crashed, and so its chunks will
+  // never be scanned. A marker thread exits with 0 only after the end of the
+  // flood fill.
+  bool PollMarkerThreads() {
+    for (uptr i = 1; i < n_markers_; i++) {
+      Marker *m = &markers_[i];
+      bool success;
+      if (m->running &&
+          JoinMarkerThread(&m->thread, /* block */ false, &success)) {
+        m->running = false;
+        if (!success)
+          return true;
+      }
+    }
+    return false;
+  }
+
+  // Refills the private frontier of m. Returns false if all markers are idle
+  // and so the flood fill is done. Nobody adds to the shared frontier of an
+  // idle marker, and a marker only becomes idle when both its frontiers are
+  // empty.
+  bool GetWork(Marker *m) {
+    if (Take(m, m))
+      return true;
+    atomic_fetch_add(&n_idle_, 1, memory_order_seq_cst);
+    for (;;) {
+      if (atomic_load(&failed_, memory_order_relaxed))
+        return false;
+      // Only the tracer watches the marker threads.
+      if (m->idx == 0 && PollMarkerThreads()) {
+        atomic_store(&failed_, 1, memory_order_relaxed);
+        return false;
+      }
+      for (uptr i = 1; i < n_markers_; i++) {
+        Marker *victim = &markers_[(m->idx + i) % n_markers_];
+        if (!atomic_load(&victim->shared_size, memory_order_acquire))
+          continue;
+        atomic_fetch_sub(&n_idle_, 1, memory_order_seq_cst);
+        if (Take(victim, m))
+          return true;
+        atomic_fetch_add(&n_idle_, 1, memory_order_seq_cst);
+      }
+      if (atomic_load(&n_idle_, memory_order_seq_cst) == n_markers_)
+        return false;
+      internal_sched_yield();
+    }
+  }
+
+  uptr n_markers_;
+  ChunkTag tag_;
+  Marker *markers_;
+  atomic_uintptr_t n_idle_;
+  // Set if a marker thread has crashed.
+  atomic_uint8_t failed_;
+};
+
+// Empties the frontier, tagging every chunk reachable from it. Returns false
+// if the parallel flood fill failed.
+static bool FloodFillTag(Frontier *frontier, ChunkTag tag) {
+  uptr n_markers = flags()->mark_threads;
+  if (n_markers == 1 || frontier->size() == 0) {
+    while (frontier->size())
+      ScanNextChunk(frontier, tag);
+    return true;
   }
+  ParallelMarker marker(n_markers, tag);
+  return marker.Run(frontier);
 }
 
 // ForEachChunk callback. If the chunk is marked as leaked, marks all chunks
@@ -226,7 +439,8 @@ static void FloodFillTag(Frontier *frontier, ChunkTag tag) {
 static void MarkIndirectlyLeakedCb(uptr chunk, void *arg) {
   chunk = GetUserBegin(chunk);
   LsanMetadata m(chunk);
-  if (m.allocated() && m.tag() != kReachable) {
+  if (m.allocated() &&
+      (m.tag() == kDirectlyLeaked || m.tag() == kIndirectlyLeaked)) {
     ScanRangeForPointers(chunk, chunk + m.requested_size(),
                          /* frontier */ 0, "HEAP", kIndirectlyLeaked);
   }
@@ -242,40 +456,105 @@ static void CollectIgnoredCb(uptr chunk, void *arg) {
     reinterpret_cast<Frontier *>(arg)->push_back(chunk);
 }
 
-// Sets the appropriate tag on each chunk.
-static void ClassifyAllChunks(SuspendedThreadsList const &suspended_threads) {
+// ForEachChunk callback. Forgets the reachability found by the previous leak
+// check. Leaks reported by it stay ignored.
+static void ResetTagCb(uptr chunk, void *arg) {
+  chunk = GetUserBegin(chunk);
+  LsanMetadata m(chunk);
+  if (m.allocated() && m.tag() != kIgnored)
+    m.set_tag(kDirectlyLeaked);
+}
+
+struct ScanDirtyPartsParam {
+  Frontier *frontier;
+  ChunkTag tag;
+};
+
+// ForEachChunk callback. If the chunk is marked with param->tag, scans the
+// pages of it written since the previous leak check.
+static void ScanDirtyPartsCb(uptr chunk, void *arg) {
+  CHECK(arg);
+  ScanDirtyPartsParam *param = reinterpret_cast<ScanDirtyPartsParam *>(arg);
+  chunk = GetUserBegin(chunk);
+  LsanMetadata m(chunk);
+  if (!m.allocated() || m.tag() != param->tag) return;
+  uptr page_size = GetPageSizeCached();
+  uptr end = chunk + m.requested_size();
+  for (uptr page = RoundDownTo(chunk, page_size); page < end;
+       page += page_size) {
+    if (!IsPageDirty(page)) continue;
+    // An unaligned pointer may start on the previous page.
+    uptr begin = Max(chunk, page - (sizeof(uptr) - 1));
+    ScanRangeForPointers(begin, Min(page + page_size, end), param->frontier,
+                         "HEAP", param->tag);
+  }
+}
+
+// Adds the chunks reachable from the parts of the chunks marked with tag
+// written since the previous leak check to the frontier. In an incremental
+// leak check the old chunks found reachable or ignored by earlier checks keep
+// their tags and aren't flood filled from the root set again, so the pointers
+// they hold to the newer chunks must be found this way.
+static void ScanDirtyParts(Frontier *frontier, ChunkTag tag) {
+  ScanDirtyPartsParam param = { frontier, tag };
+  ForEachChunk(ScanDirtyPartsCb, &param);
+}
+
+// Sets the appropriate tag on each chunk. If incremental is set, only the
+// chunks allocated since the previous leak check are classified. Returns
+// false if the flood fill failed.
+static bool ClassifyAllChunks(SuspendedThreadsList const &suspended_threads,
+                              bool incremental) {
   // Holds the flood fill frontier.
   Frontier frontier(GetPageSizeCached());
-
+  uptr primary_beg, primary_end, secondary_beg, secondary_end;
+  GetHeapRangesLocked(&primary_beg, &primary_end, &secondary_beg,
+                      &secondary_end);
+  pointer_filter.Init(primary_beg, primary_end, secondary_beg, secondary_end);
+
+  // Before anything else, while only the old chunks are marked reachable.
+  if (incremental)
+    ScanDirtyParts(&frontier, kReachable);
+  else
+    ForEachChunk(ResetTagCb, 0 /* arg */);
   if (flags()->use_globals)
     ProcessGlobalRegions(&frontier);
   ProcessThreads(suspended_threads, &frontier);
-  FloodFillTag(&frontier, kReachable);
+  if (!FloodFillTag(&frontier, kReachable))
+    return false;
   // The check here is relatively expensive, so we do this in a separate flood
   // fill. That way we can skip the check for chunks that are reachable
   // otherwise.
   ProcessPlatformSpecificAllocations(&frontier);
-  FloodFillTag(&frontier, kReachable);
+  if (!FloodFillTag(&frontier, kReachable))
+    return false;
 
   if (flags()->log_pointers)
     Report("Scanning ignored chunks.\n");
   CHECK_EQ(0, frontier.size());
-  ForEachChunk(CollectIgnoredCb, &frontier);
-  FloodFillTag(&frontier, kIgnored);
+  if (incremental)
+    ScanDirtyParts(&frontier, kIgnored);
+  else
+    ForEachChunk(CollectIgnoredCb, &frontier);
+  if (!FloodFillTag(&frontier, kIgnored))
+    return false;
 
   // Iterate over leaked chunks and mark those that are reachable from other
   // leaked chunks.
   if (flags()->log_pointers)
     Report("Scanning leaked chunks.\n");
   ForEachChunk(MarkIndirectlyLeakedCb, 0 /* arg */);
+  return true;
 }
 
 static void PrintStackTraceById(u32 stack_trace_id) {
   CHECK(stack_trace_id);
-  uptr size = 0;
-  const uptr *trace = StackDepotGet(stack_trace_id, &size);
-  StackTrace::PrintStack(trace, size, common_flags()->symbolize,
-                         common_flags()->strip_path_prefix, 0);
+  uptr trace[kStackTraceMax];
+  uptr size = StackDepotGet(stack_trace_id, trace, kStackTraceMax);
+  uptr n = StackTrace::PrintStack(trace, size, common_flags()->symbolize,
+                                  common_flags()->strip_path_prefix, 0);
+  PrintDeepStackTail(stack_trace_id, n, common_flags()->symbolize,
+                     common_flags()->strip_path_prefix, 0);
 }
 
 // ForEachChunk callback. Aggregates unreachable chunks into a LeakReport.
@@ -288,9 +567,9 @@ static void CollectLeaksCb(uptr chunk, void *arg) {
   if (m.tag() == kDirectlyLeaked || m.tag() == kIndirectlyLeaked) {
     uptr resolution = flags()->resolution;
     if (resolution > 0) {
-      uptr size = 0;
-      const uptr *trace = StackDepotGet(m.stack_trace_id(), &size);
-      size = Min(size, resolution);
+      uptr trace[kStackTraceMax];
+      uptr size = StackDepotGet(m.stack_trace_id(), trace,
+                                Min(resolution, kStackTraceMax));
       leak_report->Add(StackDepotPut(trace, size), m.requested_size(), m.tag());
     } else {
       leak_report->Add(m.stack_trace_id(), m.requested_size(), m.tag());
@@ -331,35 +610,56 @@ static void PrintLeaked() {
   ForEachChunk(PrintLeakedCb, 0 /* arg */);
 }
 
+// ForEachChunk callback. Marks the leaked chunks as ignored, so that later leak
+// checks don't report them again.
+static void MarkReportedCb(uptr chunk, void *arg) {
+  chunk = GetUserBegin(chunk);
+  LsanMetadata m(chunk);
+  if (m.allocated() &&
+      (m.tag() == kDirectlyLeaked || m.tag() == kIndirectlyLeaked))
+    m.set_tag(kIgnored);
+}
+
 struct DoLeakCheckParam {
   bool success;
+  // Only look for leaks among the chunks allocated since the previous check.
+  bool incremental;
+  // Track the pages written until the next check.
+  bool reset_dirty_pages;
   LeakReport leak_report;
 };
 
+// Set if the pages written since the end of the previous leak check are known,
+// and so the next check may be incremental.
+static bool dirty_pages_valid;
+// Set if a recoverable leak check has found unsuppressed leaks.
+static bool recoverable_check_found_leaks;
+
 static void DoLeakCheckCallback(const SuspendedThreadsList &suspended_threads,
                                 void *arg) {
   DoLeakCheckParam *param = reinterpret_cast<DoLeakCheckParam *>(arg);
   CHECK(param);
   CHECK(!param->success);
   CHECK(param->leak_report.IsEmpty());
-  ClassifyAllChunks(suspended_threads);
+  if (!ClassifyAllChunks(suspended_threads, param->incremental))
+    return;
   ForEachChunk(CollectLeaksCb, &param->leak_report);
   if (!param->leak_report.IsEmpty() && flags()->report_objects)
     PrintLeaked();
+  ForEachChunk(MarkReportedCb, 0 /* arg */);
+  // The world is still stopped, so no writes are missed.
+  if (param->reset_dirty_pages)
+    dirty_pages_valid = ResetDirtyPages();
   param->success = true;
 }
 
-void DoLeakCheck() {
-  EnsureMainThreadIDIsCorrect();
-  BlockingMutexLock l(&global_mutex);
-  static bool already_done;
-  if (already_done) return;
-  already_done = true;
-  if (&__lsan_is_turned_off && __lsan_is_turned_off())
-    return;
-
+// Reports the leaks not reported by the previous checks. Returns true if
+// there are unsuppressed ones.
+static bool CheckForLeaks(bool incremental, bool reset_dirty_pages) {
   DoLeakCheckParam param;
   param.success = false;
+  param.incremental = incremental;
+  param.reset_dirty_pages = reset_dirty_pages;
   LockThreadRegistry();
   LockAllocator();
   StopTheWorld(DoLeakCheckCallback, &param);
@@ -382,10 +682,47 @@ void DoLeakCheck() {
     PrintMatchedSuppressions();
     param.leak_report.PrintSummary();
   }
-  if (have_unsuppressed && flags()->exitcode)
+  return have_unsuppressed;
+}
+
+void DoLeakCheck() {
+  EnsureMainThreadIDIsCorrect();
+  BlockingMutexLock l(&global_mutex);
+  static bool already_done;
+  if (already_done) return;
+  already_done = true;
+  if (&__lsan_is_turned_off && __lsan_is_turned_off())
+    return;
+
+  bool have_leaks = CheckForLeaks(/* incremental */ false,
+                                  /* reset_dirty_pages */ false);
+  if (!have_leaks && recoverable_check_found_leaks) {
+    Report("LeakSanitizer: no new leaks, but earlier leak checks have "
+           "found some.\n");
+    have_leaks = true;
+  }
+  if (have_leaks && flags()->exitcode)
     internal__exit(flags()->exitcode);
 }
 
+bool DoRecoverableLeakCheck() {
+  EnsureMainThreadIDIsCorrect();
+  BlockingMutexLock l(&global_mutex);
+  if (&__lsan_is_turned_off && __lsan_is_turned_off())
+    return false;
+  static uptr n_checks;
+  n_checks++;
+  uptr period = flags()->full_check_period;
+  bool incremental = dirty_pages_valid && (!period || n_checks % period);
+  if (flags()->verbosity >= 1)
+    Report("LeakSanitizer: %s leak check.\n",
+           incremental ? "incremental" : "full");
+  bool have_leaks = CheckForLeaks(incremental, /* reset_dirty_pages */ true);
+  if (have_leaks)
+    recoverable_check_found_leaks = true;
+  return have_leaks;
+}
+
 static Suppression *GetSuppressionForAddr(uptr addr) {
   static const uptr kMaxAddrFrames = 16;
   InternalScopedBuffer<AddressInfo> addr_frames(kMaxAddrFrames);
@@ -403,11 +740,13 @@ static Suppression *GetSuppressionForAddr(uptr addr) {
 }
 
 static Suppression *GetSuppressionForStack(u32 stack_trace_id) {
-  uptr size = 0;
-  const uptr *trace = StackDepotGet(stack_trace_id, &size);
+  uptr trace[kStackTraceMax];
+  uptr size = StackDepotGet(stack_trace_id, trace, kStackTraceMax);
+  for (uptr i = 0; i < size; i++)
+    trace[i] = StackTrace::GetPreviousInstructionPc(trace[i]);
+  PrefetchSymbolizeCode(trace, size);
   for (uptr i = 0; i < size; i++) {
-    Suppression *s =
-        GetSuppressionForAddr(StackTrace::GetPreviousInstructionPc(trace[i]));
+    Suppression *s = GetSuppressionForAddr(trace[i]);
     if (s) return s;
   }
   return 0;
@@ -445,6 +784,33 @@ static bool LeakComparator(const Leak &leak1, const Leak &leak2) {
     return leak1.is_directly_leaked;
 }
 
+// Symbolizes the frames of the unsuppressed leaks starting with the begin-th
+// one in one batch, up to max_leaks leaks if it's not 0. Returns the index
+// of the first leak not symbolized.
+uptr LeakReport::SymbolizeStacks(uptr begin, uptr max_leaks) {
+  // Fits into the symbolizer cache.
+  static const uptr kMaxFrames = 1024;
+  InternalScopedBuffer<uptr> pcs(kMaxFrames);
+  uptr n = 0;
+  uptr n_leaks = 0;
+  uptr i = begin;
+  for (; i < leaks_.size(); i++) {
+    if (leaks_[i].is_suppressed) continue;
+    if (max_leaks && n_leaks == max_leaks) break;
+    uptr size = StackDepotGetSize(leaks_[i].stack_trace_id);
+    // Symbolize at least one leak.
+    if (n_leaks && n + size > kMaxFrames) break;
+    size = StackDepotGet(leaks_[i].stack_trace_id, pcs.data() + n,
+                         Min(size, kMaxFrames - n));
+    for (uptr j = n; j < n + size; j++)
+      pcs[j] = StackTrace::GetPreviousInstructionPc(pcs[j]);
+    n += size;
+    n_leaks++;
+  }
+  PrefetchSymbolizeCode(pcs.data(), n);
+  return i;
+}
+
 void LeakReport::PrintLargest(uptr num_leaks_to_print) {
   CHECK(leaks_.size() <= kMaxLeaksConsidered);
   Printf("\n");
@@ -460,8 +826,13 @@ void LeakReport::PrintLargest(uptr num_leaks_to_print) {
     Printf("The %zu largest leak(s):\n", num_leaks_to_print);
   InternalSort(&leaks_, leaks_.size(), LeakComparator);
   uptr leaks_printed = 0;
+  uptr symbolized_end = 0;
   for (uptr i = 0; i < leaks_.size(); i++) {
     if (leaks_[i].is_suppressed) continue;
+    if (i >= symbolized_end && common_flags()->symbolize) {
+      symbolized_end = SymbolizeStacks(
+          i, num_leaks_to_print ? num_leaks_to_print - leaks_printed : 0);
+    }
     Printf("%s leak of %zu byte(s) in %zu object(s) allocated from:\n",
            leaks_[i].is_directly_leaked ? "Direct" : "Indirect",
            leaks_[i].total_size, leaks_[i].hit_count);
@@ -555,6 +926,15 @@ void __lsan_do_leak_check() {
 #endif  // CAN_SANITIZE_LEAKS
 }
 
+SANITIZER_INTERFACE_ATTRIBUTE
+int __lsan_do_recoverable_leak_check() {
+#if CAN_SANITIZE_LEAKS
+  if (common_flags()->detect_leaks)
+    return __lsan::DoRecoverableLeakCheck();
+#endif  // CAN_SANITIZE_LEAKS
+  return 0;
+}
+
 #if !SANITIZER_SUPPORTS_WEAK_HOOKS
 SANITIZER_WEAK_ATTRIBUTE SANITIZER_INTERFACE_ATTRIBUTE
 int __lsan_is_turned_off() {
@@ -67,6 +67,14 @@ struct Flags {
   // Consider unaligned pointers valid.
   bool use_unaligned;
 
+  // Number of threads flood filling the heap from the root set.
+  int mark_threads;
+
+  // Every this many recoverable leak checks rescan all chunks, rather than
+  // only the new ones and the parts of the old ones written since the
+  // previous check. If zero, only the leak check at exit rescans all chunks.
+  int full_check_period;
+
   // User-visible verbosity.
   int verbosity;
 
@@ -96,6 +104,7 @@ class LeakReport {
   bool IsEmpty() { return leaks_.size() == 0; }
   uptr ApplySuppressions();
  private:
+  uptr SymbolizeStacks(uptr begin, uptr max_leaks);
   InternalMmapVector<Leak> leaks_;
 };
 
@@ -106,6 +115,26 @@ void InitializePlatformSpecificModules();
 void ProcessGlobalRegions(Frontier *frontier);
 void ProcessPlatformSpecificAllocations(Frontier *frontier);
 
+// A thread of the parallel flood fill, started from the StopTheWorld tracer.
+struct MarkerThread {
+  uptr pid;
+  uptr stack;
+};
+// Runs fn(arg) in a new task sharing the address space with the tracer.
+// Returns false if the task can't be started.
+bool StartMarkerThread(MarkerThread *thread, int (*fn)(void *arg), void *arg);
+// Reaps the task if it has exited, waiting for it if block is set. Returns
+// false if it's still running. Sets *success to whether it exited with 0.
+bool JoinMarkerThread(MarkerThread *thread, bool block, bool *success);
+// Forgets the pages written so far, so that the next leak check can skip the
+// parts of the old chunks which haven't changed since this one. Returns false
+// if writes to the pages can't be tracked. Only called while the world is
+// stopped.
+bool ResetDirtyPages();
+// Returns true if the page containing addr may have been written since the
+// last successful ResetDirtyPages().
+bool IsPageDirty(uptr addr);
+
 void ScanRangeForPointers(uptr begin, uptr end,
                           Frontier *frontier,
                           const char *region_type, ChunkTag tag);
@@ -119,6 +148,7 @@ enum IgnoreObjectResult {
 // Functions called from the parent tool.
 void InitCommonLsan();
 void DoLeakCheck();
+bool DoRecoverableLeakCheck();
 bool DisabledInThisThread();
 
 // The following must be implemented in the parent tool.
@@ -126,6 +156,10 @@ bool DisabledInThisThread();
 void ForEachChunk(ForEachChunkCallback callback, void *arg);
 // Returns the address range occupied by the global allocator object.
 void GetAllocatorGlobalRange(uptr *begin, uptr *end);
+// Returns the address ranges containing all the chunks of the primary and of
+// the secondary allocator. The allocator must be locked.
+void GetHeapRangesLocked(uptr *primary_beg, uptr *primary_end,
+                         uptr *secondary_beg, uptr *secondary_end);
 // Wrappers for allocator's ForceLock()/ForceUnlock().
 void LockAllocator();
 void UnlockAllocator();
@@ -157,6 +191,9 @@ class LsanMetadata {
   bool allocated() const;
   ChunkTag tag() const;
   void set_tag(ChunkTag value);
+  // Atomically replaces the tag if it's equal to old_tag. Returns false if it
+  // isn't. Only used while the world is stopped.
+  bool CompareAndSetTag(ChunkTag old_tag, ChunkTag new_tag);
   uptr requested_size() const;
   u32 stack_trace_id() const;
  private:
@@ -22,6 +22,10 @@
 #include "sanitizer_common/sanitizer_linux.h"
 #include "sanitizer_common/sanitizer_stackdepot.h"
 
+#include <sched.h>  // for CLONE_* definitions
+#include <sys/wait.h>  // for __WALL
+#include <unistd.h>  // for SEEK_SET
+
 namespace __lsan {
 
 static const char kLinkerName[] = "ld";
@@ -92,8 +96,8 @@ void ProcessGlobalRegions(Frontier *frontier) {
 
 static uptr GetCallerPC(u32 stack_id) {
   CHECK(stack_id);
-  uptr size = 0;
-  const uptr *trace = StackDepotGet(stack_id, &size);
+  uptr trace[2];
+  uptr size = StackDepotGet(stack_id, trace, ARRAY_SIZE(trace));
   // The top frame is our malloc/calloc/etc. The next frame is the caller.
   if (size >= 2)
     return trace[1];
@@ -122,5 +126,106 @@ void ProcessPlatformSpecificAllocations(Frontier *frontier) {
   ForEachChunk(ProcessPlatformSpecificAllocationsCb, frontier);
 }
 
+static const uptr kMarkerStackSize = 64 * 1024;
+
+bool StartMarkerThread(MarkerThread *thread, int (*fn)(void *arg),
+                       void *arg) {
+  uptr guard_size = GetPageSizeCached();
+  thread->stack = (uptr)MmapOrDie(guard_size + kMarkerStackSize,
+                                  "LSan marker stack");
+  CHECK_EQ(thread->stack, (uptr)Mprotect(thread->stack, guard_size));
+  // The tracer can't call clone() from libc.
+  thread->pid = internal_clone(
+      fn, (void *)(thread->stack + guard_size + kMarkerStackSize),
+      CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_UNTRACED, arg);
+  int clone_errno;
+  if (internal_iserror(thread->pid, &clone_errno)) {
+    Report("Failed spawning a marker thread (errno %d).\n", clone_errno);
+    UnmapOrDie((void *)thread->stack, guard_size + kMarkerStackSize);
+    return false;
+  }
+  return true;
+}
+
+bool JoinMarkerThread(MarkerThread *thread, bool block, bool *success) {
+  int status = 0;
+  uptr waitpid_status = internal_waitpid(thread->pid, &status,
+                                         __WALL | (block ? 0 : WNOHANG));
+  int wperrno;
+  if (internal_iserror(waitpid_status, &wperrno)) {
+    // The task may still be running on its stack, so it's leaked.
+    Report("Waiting on a marker thread failed (errno %d).\n", wperrno);
+    *success = false;
+    return true;
+  }
+  if (waitpid_status == 0)
+    return false;
+  *success = (status == 0);
+  if (!*success)
+    Report("Marker thread failed (status %d).\n", status);
+  UnmapOrDie((void *)thread->stack, GetPageSizeCached() + kMarkerStackSize);
+  return true;
+}
+
+// Bit 55 of a /proc/self/pagemap entry is the soft-dirty bit of the page. The
+// kernel sets it on every write to the page, and clears the bits of all pages
+// on a write of "4" to /proc/self/clear_refs.
+static const u64 kPagemapSoftDirty = 1ULL << 55;
+// The pagemap entries of the last looked up pages, read in one go.
+static const uptr kPagemapCacheSize = 512;
+static u64 pagemap_cache[kPagemapCacheSize];
+static uptr pagemap_cache_beg, pagemap_cache_end;  // Page numbers.
+static fd_t pagemap_fd = kInvalidFd;
+
+bool ResetDirtyPages() {
+  if (pagemap_fd != kInvalidFd) {
+    internal_close(pagemap_fd);
+    pagemap_fd = kInvalidFd;
+  }
+  pagemap_cache_beg = pagemap_cache_end = 0;
+  uptr fd = OpenFile("/proc/self/clear_refs", /* write */ true);
+  if (internal_iserror(fd))
+    return false;
+  bool cleared = internal_write(fd, "4", 1) == 1;
+  internal_close(fd);
+  if (!cleared)
+    return false;
+  // Without CONFIG_MEM_SOFT_DIRTY the write succeeds, but the bits are never
+  // set, so check that a write right after it is seen.
+  static volatile char *probe;
+  if (!probe)
+    probe = (char *)MmapOrDie(GetPageSizeCached(), "LSan dirty page probe");
+  probe[0]++;
+  bool dirty = IsPageDirty((uptr)probe);
+  pagemap_cache_beg = pagemap_cache_end = 0;
+  return dirty;
+}
+
+bool IsPageDirty(uptr addr) {
+  uptr page = addr / GetPageSizeCached();
+  if (page < pagemap_cache_beg || page >= pagemap_cache_end) {
+    pagemap_cache_beg = pagemap_cache_end = 0;
+    if (pagemap_fd == kInvalidFd) {
+      uptr fd = OpenFile("/proc/self/pagemap", /* write */ false);
+      if (internal_iserror(fd))
+        return true;
+      pagemap_fd = fd;
+    }
+    uptr beg = RoundDownTo(page, kPagemapCacheSize);
+    if (internal_iserror(internal_lseek(pagemap_fd, beg * sizeof(u64),
+                                        SEEK_SET)))
+      return true;
+    uptr read_len =
+        internal_read(pagemap_fd, pagemap_cache, sizeof(pagemap_cache));
+    if (internal_iserror(read_len) || read_len < sizeof(u64))
+      return true;
+    pagemap_cache_beg = beg;
+    pagemap_cache_end = beg + read_len / sizeof(u64);
+    if (page >= pagemap_cache_end)
+      return true;
+  }
+  return pagemap_cache[page - pagemap_cache_beg] & kPagemapSoftDirty;
+}
+
 }  // namespace __lsan
 #endif  // CAN_SANITIZE_LEAKS && SANITIZER_LINUX
@@ -18,6 +18,7 @@
 #include "sanitizer_common/sanitizer_flags.h"
 #include "sanitizer_common/sanitizer_libc.h"
 #include "sanitizer_common/sanitizer_procmaps.h"
+#include "sanitizer_common/sanitizer_stackdepot.h"
 #include "sanitizer_common/sanitizer_stacktrace.h"
 #include "sanitizer_common/sanitizer_symbolizer.h"
 
@@ -140,6 +141,7 @@ static void InitializeFlags(Flags *f, const char *options) {
   cf->fast_unwind_on_fatal = false;
   cf->fast_unwind_on_malloc = true;
   cf->malloc_context_size = 20;
+  cf->malloc_context_prefix_size = 0;
   cf->handle_ioctl = true;
   cf->log_path = 0;
 
@@ -188,6 +190,17 @@ void GetStackTrace(StackTrace *stack, uptr max_s, uptr pc, uptr bp,
   stack->FastUnwindStack(pc, bp, stack_top, stack_bottom);
 }
 
+void GetTruncatedStackTrace(StackTrace *stack, uptr max_s, uptr prefix_size,
+                            uptr pc, uptr bp, bool fast) {
+  uptr stack_top = 0, stack_bottom = 0;
+  if (fast)
+    GetCurrentStackBounds(&stack_top, &stack_bottom);
+  // Block reports from our interceptors during _Unwind_Backtrace.
+  SymbolizerScope sym_scope;
+  __sanitizer::GetTruncatedStackTrace(stack, max_s, prefix_size, pc, bp,
+                                      stack_top, stack_bottom, fast);
+}
+
 void PrintWarning(uptr pc, uptr bp) {
   PrintWarningWithOrigin(pc, bp, __msan_origin_tls);
 }
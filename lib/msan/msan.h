@@ -69,6 +69,9 @@ void PrintWarningWithOrigin(uptr pc, uptr bp, u32 origin);
 
 void GetStackTrace(StackTrace *stack, uptr max_s, uptr pc, uptr bp,
                    bool fast);
+// See GetTruncatedStackTrace in sanitizer_common.
+void GetTruncatedStackTrace(StackTrace *stack, uptr max_s, uptr prefix_size,
+                            uptr pc, uptr bp, bool fast);
 
 void ReportUMR(StackTrace *stack, u32 origin);
 void ReportExpectedUMRNotFound(StackTrace *stack);
@@ -81,7 +84,8 @@ void UnpoisonParam(uptr n);
   StackTrace stack;                                                \
   stack.size = 0;                                                  \
   if (__msan_get_track_origins() && msan_inited)                   \
-    GetStackTrace(&stack, common_flags()->malloc_context_size,     \
+    GetTruncatedStackTrace(&stack, common_flags()->malloc_context_size, \
+        common_flags()->malloc_context_prefix_size,                \
         StackTrace::GetCurrentPc(), GET_CURRENT_FRAME(),           \
         common_flags()->fast_unwind_on_malloc)
 
@@ -13,6 +13,8 @@
 //===----------------------------------------------------------------------===//
 
 #include "sanitizer_common/sanitizer_allocator.h"
+#include "sanitizer_common/sanitizer_flags.h"
+#include "sanitizer_common/sanitizer_heap_profile.h"
 #include "sanitizer_common/sanitizer_stackdepot.h"
 #include "msan.h"
 
@@ -34,6 +36,7 @@ typedef CombinedAllocator<PrimaryAllocator, AllocatorCache,
                           SecondaryAllocator> Allocator;
 
 static THREADLOCAL AllocatorCache cache;
+static THREADLOCAL HeapProfileThreadState heap_profile_state;
 static Allocator allocator;
 
 static int inited = 0;
@@ -43,6 +46,9 @@ static inline void Init() {
   __msan_init();
   inited = true;  // this must happen before any threads are created.
   allocator.Init();
+  CHECK_GE(common_flags()->heap_profile_sample_interval, 0);
+  HeapProfileInit((uptr)common_flags()->heap_profile_sample_interval);
+  StackDepotSetUseTrie(common_flags()->stack_depot_trie);
 }
 
 static void *MsanAllocate(StackTrace *stack, uptr size,
@@ -61,6 +67,8 @@ static void *MsanAllocate(StackTrace *stack, uptr size,
     CHECK_EQ((stack_id >> 31), 0);  // Higher bit is occupied by stack origins.
     __msan_set_origin(res, size, stack_id);
   }
+  HeapProfileMalloc(&heap_profile_state, reinterpret_cast<uptr>(res), size,
+                    stack->trace, stack->size);
   MSAN_MALLOC_HOOK(res, size);
   return res;
 }
@@ -69,6 +77,7 @@ void MsanDeallocate(void *p) {
   CHECK(p);
   Init();
   MSAN_FREE_HOOK(p);
+  HeapProfileFree(reinterpret_cast<uptr>(p));
   Metadata *meta = reinterpret_cast<Metadata*>(allocator.GetMetaData(p));
   uptr size = meta->requested_size;
   meta->requested_size = 0;
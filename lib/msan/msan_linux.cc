@@ -30,6 +30,7 @@
 
 #include "sanitizer_common/sanitizer_common.h"
 #include "sanitizer_common/sanitizer_procmaps.h"
+#include "sanitizer_common/sanitizer_stackdepot.h"
 
 namespace __msan {
 
@@ -76,10 +77,12 @@ bool InitShadow(bool prot1, bool prot2, bool map_shadow, bool init_origins) {
 }
 
 void MsanDie() {
+  StackDepotDumpSnapshot();
   _exit(flags()->exit_code);
 }
 
 static void MsanAtExit(void) {
+  StackDepotDumpSnapshot();
   if (msan_report_count > 0) {
     ReportAtExitStatistics();
     if (flags()->exit_code)
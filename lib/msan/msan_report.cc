@@ -44,10 +44,15 @@ class Decorator: private __sanitizer::AnsiColorDecorator {
   const char *End()    { return Default(); }
 };
 
-static void PrintStack(const uptr *trace, uptr size) {
+// If the stack was retrieved from the stack depot by depot_id, also prints
+// the deeper frames linked to it (see PrintDeepStackTail).
+static void PrintStack(const uptr *trace, uptr size, u32 depot_id = 0) {
   SymbolizerScope sym_scope;
-  StackTrace::PrintStack(trace, size, true,
-                         common_flags()->strip_path_prefix, 0);
+  uptr n = StackTrace::PrintStack(trace, size, true,
+                                  common_flags()->strip_path_prefix, 0);
+  if (depot_id)
+    PrintDeepStackTail(depot_id, n, true, common_flags()->strip_path_prefix,
+                       0);
 }
 
 static void DescribeOrigin(u32 origin) {
@@ -66,11 +71,11 @@ static void DescribeOrigin(u32 origin) {
            d.Origin(), d.End());
     InternalFree(s);
   } else {
-    uptr size = 0;
-    const uptr *trace = StackDepotGet(origin, &size);
+    uptr trace[kStackTraceMax];
+    uptr size = StackDepotGet(origin, trace, kStackTraceMax);
     Printf("  %sUninitialized value was created by a heap allocation%s\n",
            d.Origin(), d.End());
-    PrintStack(trace, size);
+    PrintStack(trace, size, origin);
   }
 }
 
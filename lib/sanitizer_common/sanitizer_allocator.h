@@ -33,9 +33,16 @@ namespace __sanitizer {
 // Last class corresponds to kMaxSize = 1 << kMaxSizeLog.
 //
 // This structure of the size class map gives us:
-//   - Efficient table-free class-to-size and size-to-class functions.
+//   - Efficient class-to-size and size-to-class functions. Sizes up to
+//     kClassIDTableMaxSize are mapped to classes with a single load from a
+//     table computed at compile time.
 //   - Difference between two consequent size classes is betweed 14% and 25%
 //
+// The number of classes per power of two is 1 << kStepsLog (4 by default).
+// With kStepsLog == 3 there are 8 classes per power of two and the difference
+// between two consequent size classes is between 7% and 12.5%, at the cost
+// of more classes (and more memory cached in per-thread caches).
+//
 // This class also gives a hint to a thread-caching allocator about the amount
 // of chunks that need to be cached per-thread:
 //  - kMaxNumCached is the maximal number of chunks per size class.
@@ -84,15 +91,42 @@ namespace __sanitizer {
 //
 // c52 => s: 131072 diff: +16384 14% l 17 cached: 1 131072; id 52
 
-template <uptr kMaxSizeLog, uptr kMaxNumCachedT, uptr kMaxBytesCachedLog>
+// Compile-time floor(log2(kValue)); 0 for 0.
+template <uptr kValue>
+struct ConstLog2 {
+  static const uptr value = 1 + ConstLog2<kValue / 2>::value;
+};
+template <> struct ConstLog2<1> { static const uptr value = 0; };
+template <> struct ConstLog2<0> { static const uptr value = 0; };
+
+template <uptr kMaxSizeLog, uptr kMaxNumCachedT, uptr kMaxBytesCachedLog,
+          uptr kStepsLog = 2>
 class SizeClassMap {
   static const uptr kMinSizeLog = 4;
   static const uptr kMidSizeLog = kMinSizeLog + 4;
   static const uptr kMinSize = 1 << kMinSizeLog;
   static const uptr kMidSize = 1 << kMidSizeLog;
   static const uptr kMidClass = kMidSize / kMinSize;
-  static const uptr S = 2;
+  static const uptr S = kStepsLog;
   static const uptr M = (1 << S) - 1;
+  // Steps between kMidSize and 2 * kMidSize must be multiples of kMinSize.
+  COMPILER_CHECK(S >= 1 && S <= kMidSizeLog - kMinSizeLog);
+
+  // Same as ClassID(), but usable in constant expressions.
+  template <uptr kSize>
+  struct ConstClassID {
+    static const uptr l = ConstLog2<kSize>::value;
+    static const uptr ls = l > S ? l - S : 0;
+    static const uptr value =
+        kSize > (1ULL << kMaxSizeLog) ? 0 :
+        kSize <= kMidSize ? (kSize + kMinSize - 1) >> kMinSizeLog :
+        kMidClass + ((l - kMidSizeLog) << S) + ((kSize >> ls) & M) +
+            ((kSize & ((1ULL << ls) - 1)) > 0);
+  };
+
+  // kClassIDTable[i] is the class of sizes ((i - 1) * kMinSize, i * kMinSize].
+  static const uptr kClassIDTableSize = 257;
+  static const u8 kClassIDTable[kClassIDTableSize];
 
  public:
   static const uptr kMaxNumCached = kMaxNumCachedT;
@@ -122,9 +156,12 @@ class SizeClassMap {
     return t + (t >> S) * (class_id & M);
   }
 
+  static const uptr kClassIDTableMaxSize =
+      (kClassIDTableSize - 1) << kMinSizeLog;
+
   static uptr ClassID(uptr size) {
-    if (size <= kMidSize)
-      return (size + kMinSize - 1) >> kMinSizeLog;
+    if (size <= kClassIDTableMaxSize)
+      return kClassIDTable[(size + kMinSize - 1) >> kMinSizeLog];
     if (size > kMaxSize) return 0;
     uptr l = MostSignificantSetBitIndex(size);
     uptr hbits = (size >> (l - S)) & M;
@@ -177,6 +214,7 @@ class SizeClassMap {
         CHECK_GT(Size(c), Size(c-1));
     }
     CHECK_EQ(ClassID(kMaxSize + 1), 0);
+    CHECK_EQ(ClassID(0), 0);
 
     for (uptr s = 1; s <= kMaxSize; s++) {
       uptr c = ClassID(s);
@@ -189,8 +227,35 @@ class SizeClassMap {
   }
 };
 
+#define SIZE_CLASS_MAP_ENTRY(i) ConstClassID<(i) * kMinSize>::value
+#define SIZE_CLASS_MAP_ENTRY4(i) \
+    SIZE_CLASS_MAP_ENTRY(i), SIZE_CLASS_MAP_ENTRY((i) + 1), \
+    SIZE_CLASS_MAP_ENTRY((i) + 2), SIZE_CLASS_MAP_ENTRY((i) + 3)
+#define SIZE_CLASS_MAP_ENTRY16(i) \
+    SIZE_CLASS_MAP_ENTRY4(i), SIZE_CLASS_MAP_ENTRY4((i) + 4), \
+    SIZE_CLASS_MAP_ENTRY4((i) + 8), SIZE_CLASS_MAP_ENTRY4((i) + 12)
+#define SIZE_CLASS_MAP_ENTRY64(i) \
+    SIZE_CLASS_MAP_ENTRY16(i), SIZE_CLASS_MAP_ENTRY16((i) + 16), \
+    SIZE_CLASS_MAP_ENTRY16((i) + 32), SIZE_CLASS_MAP_ENTRY16((i) + 48)
+
+template <uptr kMaxSizeLog, uptr kMaxNumCachedT, uptr kMaxBytesCachedLog,
+          uptr kStepsLog>
+const u8 SizeClassMap<kMaxSizeLog, kMaxNumCachedT, kMaxBytesCachedLog,
+                      kStepsLog>::kClassIDTable[kClassIDTableSize] = {
+  SIZE_CLASS_MAP_ENTRY64(0), SIZE_CLASS_MAP_ENTRY64(64),
+  SIZE_CLASS_MAP_ENTRY64(128), SIZE_CLASS_MAP_ENTRY64(192),
+  SIZE_CLASS_MAP_ENTRY(256)
+};
+
+#undef SIZE_CLASS_MAP_ENTRY64
+#undef SIZE_CLASS_MAP_ENTRY16
+#undef SIZE_CLASS_MAP_ENTRY4
+#undef SIZE_CLASS_MAP_ENTRY
+
 typedef SizeClassMap<17, 128, 16> DefaultSizeClassMap;
 typedef SizeClassMap<17, 64,  14> CompactSizeClassMap;
+// 8 classes per power of two: less internal fragmentation, more classes.
+typedef SizeClassMap<17, 128, 16, 3> DenseSizeClassMap;
 template<class SizeClassAllocator> struct SizeClassAllocatorLocalCache;
 
 // Memory allocator statistics
@@ -199,6 +264,13 @@ enum AllocatorStat {
   AllocatorStatFreed,
   AllocatorStatMmapped,
   AllocatorStatUnmapped,
+  // Number of times a thread populating a size class had to retry or wait
+  // for another thread mapping memory for the same size class.
+  AllocatorStatPopulateContended,
+  // Large allocations served from (or missing) the mapping cache of
+  // LargeMmapAllocator. Not counted while the cache is disabled.
+  AllocatorStatLargeCacheHit,
+  AllocatorStatLargeCacheMiss,
   AllocatorStatCount
 };
 
@@ -298,6 +370,11 @@ typedef void (*ForEachChunkCallback)(uptr chunk, void *arg);
 //
 // A Region looks like this:
 // UserChunk1 ... UserChunkN <gap> MetaChunkN ... MetaChunk1
+//
+// Regions grow without serializing the threads that populate them: a thread
+// claims chunks with an atomic increment of allocated_user, claims the memory
+// it has to map with a CAS on reserved_map, and publishes the mapped memory
+// (mapped_user, mapped_meta) in the order it was reserved.
 template <const uptr kSpaceBeg, const uptr kSpaceSize,
           const uptr kMetadataSize, class SizeClassMap,
           class MapUnmapCallback = NoOpMapUnmapCallback>
@@ -312,6 +389,15 @@ class SizeClassAllocator64 {
     CHECK_EQ(kSpaceBeg,
              reinterpret_cast<uptr>(Mprotect(kSpaceBeg, kSpaceSize)));
     MapWithCallback(kSpaceEnd, AdditionalSize());
+    release_to_os_threshold_ = 0;
+  }
+
+  // If threshold is not zero, a size class returns its free pages to the OS
+  // (see ReleaseToOS) once that many bytes have been freed into it. This is
+  // done by the next cache refill from that class rather than by the
+  // deallocation, so free() never waits for the release.
+  void SetReleaseToOSThreshold(uptr threshold) {
+    release_to_os_threshold_ = threshold;
   }
 
   void MapWithCallback(uptr beg, uptr size) {
@@ -337,6 +423,14 @@ class SizeClassAllocator64 {
     if (b == 0)
       b = PopulateFreeList(stat, c, class_id, region);
     region->n_allocated += b->count;
+    // Somebody else may be releasing this region already; don't wait.
+    if (release_to_os_threshold_ &&
+        atomic_load(&region->freed_since_release, memory_order_relaxed) >=
+            release_to_os_threshold_ &&
+        region->release_mutex.TryLock()) {
+      ReleaseFreePagesLocked(class_id, region);
+      region->release_mutex.Unlock();
+    }
     return b;
   }
 
@@ -345,12 +439,40 @@ class SizeClassAllocator64 {
     CHECK_GT(b->count, 0);
     region->free_list.Push(b);
     region->n_freed += b->count;
+    if (release_to_os_threshold_)
+      atomic_fetch_add(&region->freed_since_release,
+                       b->count * SizeClassMap::Size(class_id),
+                       memory_order_relaxed);
+  }
+
+  // Returns to the OS the pages which are completely covered by chunks
+  // sitting in the free lists of the allocator. Chunks cached by
+  // SizeClassAllocatorLocalCache are not considered free.
+  void ReleaseToOS() {
+    for (uptr class_id = 1; class_id < kNumClasses; class_id++) {
+      RegionInfo *region = GetRegionInfo(class_id);
+      SpinMutexLock l(&region->release_mutex);
+      ReleaseFreePagesLocked(class_id, region);
+    }
+  }
+
+  uptr TotalReleasedBytes() {
+    uptr res = 0;
+    for (uptr i = 0; i < kNumClasses; i++)
+      res += GetRegionInfo(i)->released_bytes;
+    return res;
   }
 
   static bool PointerIsMine(const void *p) {
     return reinterpret_cast<uptr>(p) / kSpaceSize == kSpaceBeg / kSpaceSize;
   }
 
+  // Returns the range of addresses which may belong to the allocator.
+  static void GetSpaceRange(uptr *beg, uptr *end) {
+    *beg = kSpaceBeg;
+    *end = kSpaceEnd;
+  }
+
   static uptr GetSizeClass(const void *p) {
     return (reinterpret_cast<uptr>(p) / kRegionSize) % kNumClassesRounded;
   }
@@ -365,7 +487,7 @@ class SizeClassAllocator64 {
     uptr next_beg = beg + size;
     if (class_id >= kNumClasses) return 0;
     RegionInfo *region = GetRegionInfo(class_id);
-    if (region->mapped_user >= next_beg)
+    if (atomic_load(&region->mapped_user, memory_order_acquire) >= next_beg)
       return reinterpret_cast<void*>(reg_beg + beg);
     return 0;
   }
@@ -388,12 +510,18 @@ class SizeClassAllocator64 {
   uptr TotalMemoryUsed() {
     uptr res = 0;
     for (uptr i = 0; i < kNumClasses; i++)
-      res += GetRegionInfo(i)->allocated_user;
+      res += AllocatedUser(GetRegionInfo(i));
     return res;
   }
 
   // Test-only.
   void TestOnlyUnmap() {
+    for (uptr class_id = 0; class_id < kNumClasses; class_id++) {
+      RegionInfo *region = GetRegionInfo(class_id);
+      if (region->release_scratch)
+        UnmapOrDie(region->release_scratch,
+                   region->release_scratch_pages * sizeof(u32));
+    }
     UnmapWithCallback(kSpaceBeg, kSpaceSize + AdditionalSize());
   }
 
@@ -401,24 +529,32 @@ class SizeClassAllocator64 {
     uptr total_mapped = 0;
     uptr n_allocated = 0;
     uptr n_freed = 0;
+    uptr total_released = 0;
     for (uptr class_id = 1; class_id < kNumClasses; class_id++) {
       RegionInfo *region = GetRegionInfo(class_id);
-      total_mapped += region->mapped_user;
+      total_mapped += atomic_load(&region->mapped_user, memory_order_relaxed);
       n_allocated += region->n_allocated;
       n_freed += region->n_freed;
+      total_released += region->released_bytes;
     }
     Printf("Stats: SizeClassAllocator64: %zdM mapped in %zd allocations; "
-           "remains %zd\n",
-           total_mapped >> 20, n_allocated, n_allocated - n_freed);
+           "remains %zd; released to OS %zdM\n",
+           total_mapped >> 20, n_allocated, n_allocated - n_freed,
+           total_released >> 20);
     for (uptr class_id = 1; class_id < kNumClasses; class_id++) {
       RegionInfo *region = GetRegionInfo(class_id);
-      if (region->mapped_user == 0) continue;
-      Printf("  %02zd (%zd): total: %zd K allocs: %zd remains: %zd\n",
+      uptr mapped_user =
+          atomic_load(&region->mapped_user, memory_order_relaxed);
+      if (mapped_user == 0) continue;
+      Printf("  %02zd (%zd): total: %zd K allocs: %zd remains: %zd "
+             "released: %zd K in %zd rounds\n",
              class_id,
              SizeClassMap::Size(class_id),
-             region->mapped_user >> 10,
+             mapped_user >> 10,
              region->n_allocated,
-             region->n_allocated - region->n_freed);
+             region->n_allocated - region->n_freed,
+             region->released_bytes >> 10,
+             region->n_release_rounds);
     }
   }
 
@@ -443,8 +579,12 @@ class SizeClassAllocator64 {
       RegionInfo *region = GetRegionInfo(class_id);
       uptr chunk_size = SizeClassMap::Size(class_id);
       uptr region_beg = kSpaceBeg + class_id * kRegionSize;
+      // A thread stopped in the middle of PopulateFreeList may have claimed
+      // chunks which are not mapped yet; skip them.
+      uptr region_end = region_beg + Min(AllocatedUser(region),
+          atomic_load(&region->mapped_user, memory_order_acquire));
       for (uptr chunk = region_beg;
-           chunk < region_beg + region->allocated_user;
+           chunk < region_end;
            chunk += chunk_size) {
         // Too slow: CHECK_EQ((void *)chunk, GetBlockBegin((void *)chunk));
         callback(chunk, arg);
@@ -469,18 +609,47 @@ class SizeClassAllocator64 {
   static const uptr kUserMapSize = 1 << 16;
   // Call mmap for metadata memory with at least this size.
   static const uptr kMetaMapSize = 1 << 16;
+  // reserved_map keeps the reserved user and metadata sizes of a region
+  // (in kUserMapSize and kMetaMapSize units) in the low and high halves.
+  COMPILER_CHECK(kRegionSize / kUserMapSize <= (1ULL << 32));
+  COMPILER_CHECK(kRegionSize / kMetaMapSize <= (1ULL << 32));
 
   struct RegionInfo {
-    BlockingMutex mutex;
+    // Populating threads hold it for reading, ForceLock() for writing.
+    RWMutex mutex;
     LFStack<Batch> free_list;
-    uptr allocated_user;  // Bytes allocated for user memory.
-    uptr allocated_meta;  // Bytes allocated for metadata.
-    uptr mapped_user;  // Bytes mapped for user memory.
-    uptr mapped_meta;  // Bytes mapped for metadata.
+    atomic_uintptr_t allocated_user;  // Bytes allocated for user memory.
+    atomic_uint64_t reserved_map;  // Bytes being mapped for user and metadata.
+    atomic_uintptr_t mapped_user;  // Bytes mapped for user memory.
+    atomic_uintptr_t mapped_meta;  // Bytes mapped for metadata.
     uptr n_allocated, n_freed;  // Just stats.
+    // Serializes ReleaseFreePagesLocked() calls for this region.
+    StaticSpinMutex release_mutex;
+    atomic_uintptr_t freed_since_release;  // Bytes.
+    // Per-page free byte counts, kept between the rounds.
+    u32 *release_scratch;
+    uptr release_scratch_pages;
+    uptr released_bytes, n_release_rounds;  // Just stats.
   };
   COMPILER_CHECK(sizeof(RegionInfo) >= kCacheLineSize);
 
+  static uptr AllocatedUser(RegionInfo *region) {
+    // allocated_user may run past the end of the region right before we die
+    // of OOM; never report more than the region size.
+    return Min(kRegionSize,
+               atomic_load(&region->allocated_user, memory_order_relaxed));
+  }
+
+  static u64 PackReserved(uptr user, uptr meta) {
+    return (u64)(user / kUserMapSize) | ((u64)(meta / kMetaMapSize) << 32);
+  }
+  static uptr ReservedUser(u64 reserved) {
+    return (uptr)(reserved & 0xffffffffULL) * kUserMapSize;
+  }
+  static uptr ReservedMeta(u64 reserved) {
+    return (uptr)(reserved >> 32) * kMetaMapSize;
+  }
+
   static uptr AdditionalSize() {
     return RoundUpTo(sizeof(RegionInfo) * kNumClassesRounded,
                      GetPageSizeCached());
@@ -501,65 +670,179 @@ class SizeClassAllocator64 {
     return (u32)offset / (u32)size;
   }
 
+  // Waits until all memory reserved before [old_size, new_size) is mapped,
+  // then publishes [old_size, new_size) as mapped.
+  static void PublishMapped(atomic_uintptr_t *mapped, uptr old_size,
+                            uptr new_size, bool *contended) {
+    while (atomic_load(mapped, memory_order_acquire) != old_size) {
+      *contended = true;
+      internal_sched_yield();
+    }
+    atomic_store(mapped, new_size, memory_order_release);
+  }
+
+  // Makes sure that the first user_end bytes of the region and the last
+  // meta_end bytes (metadata grows down from the region end) are mapped.
+  void EnsureMapped(AllocatorStats *stat, uptr class_id, RegionInfo *region,
+                    uptr user_end, uptr meta_end) {
+    uptr region_beg = kSpaceBeg + kRegionSize * class_id;
+    bool contended = false;
+    RWMutexReadLock l(&region->mutex);
+    for (;;) {
+      if (atomic_load(&region->mapped_user, memory_order_acquire) >= user_end &&
+          atomic_load(&region->mapped_meta, memory_order_acquire) >= meta_end)
+        break;
+      u64 cmp = atomic_load(&region->reserved_map, memory_order_relaxed);
+      uptr old_user = ReservedUser(cmp);
+      uptr old_meta = ReservedMeta(cmp);
+      if (old_user >= user_end && old_meta >= meta_end) {
+        // Another thread is mapping the memory we need.
+        contended = true;
+        internal_sched_yield();
+        continue;
+      }
+      uptr new_user = Max(old_user, RoundUpTo(user_end, kUserMapSize));
+      uptr new_meta = Max(old_meta, RoundUpTo(meta_end, kMetaMapSize));
+      if (new_user + new_meta > kRegionSize) {
+        Printf("%s: Out of memory. Dying. ", SanitizerToolName);
+        Printf("The process has exhausted %zuMB for size class %zu.\n",
+            kRegionSize / 1024 / 1024, SizeClassMap::Size(class_id));
+        Die();
+      }
+      if (!atomic_compare_exchange_strong(&region->reserved_map, &cmp,
+                                          PackReserved(new_user, new_meta),
+                                          memory_order_relaxed)) {
+        contended = true;
+        continue;
+      }
+      if (new_user > old_user) {
+        // Do the mmap for the user memory.
+        MapWithCallback(region_beg + old_user, new_user - old_user);
+        stat->Add(AllocatorStatMmapped, new_user - old_user);
+        PublishMapped(&region->mapped_user, old_user, new_user, &contended);
+      }
+      if (new_meta > old_meta) {
+        // Do the mmap for the metadata.
+        MapWithCallback(region_beg + kRegionSize - new_meta,
+                        new_meta - old_meta);
+        PublishMapped(&region->mapped_meta, old_meta, new_meta, &contended);
+      }
+    }
+    if (contended)
+      stat->Add(AllocatorStatPopulateContended, 1);
+  }
+
+  // Detaches all batches from the free list of the region and builds a
+  // per-page count of free bytes out of them. Pages whose count equals the
+  // page size are released with ReleaseMemoryToOS(). Chunks holding the
+  // batches themselves are in use. The batches are put back afterwards;
+  // meanwhile the other threads may have to populate the region. The counts
+  // live in a buffer of the region which only grows, so that a round does
+  // not have to mmap.
+  NOINLINE void ReleaseFreePagesLocked(uptr class_id, RegionInfo *region) {
+    atomic_store(&region->freed_since_release, 0, memory_order_relaxed);
+    uptr page_size = GetPageSizeCached();
+    uptr size = SizeClassMap::Size(class_id);
+    uptr region_beg = kSpaceBeg + kRegionSize * class_id;
+    uptr n_pages = Min(AllocatedUser(region),
+        atomic_load(&region->mapped_user, memory_order_acquire)) / page_size;
+    if (n_pages == 0)
+      return;
+    if (n_pages > region->release_scratch_pages) {
+      if (region->release_scratch)
+        UnmapOrDie(region->release_scratch,
+                   region->release_scratch_pages * sizeof(u32));
+      uptr new_size = RoundUpTo(
+          Max(n_pages, 2 * region->release_scratch_pages) * sizeof(u32),
+          page_size);
+      region->release_scratch =
+          (u32 *)MmapOrDie(new_size, "ReleaseFreePages");
+      region->release_scratch_pages = new_size / sizeof(u32);
+    }
+    u32 *free_bytes = region->release_scratch;
+    Batch *batches = 0;
+    while (Batch *b = region->free_list.Pop()) {
+      b->next = batches;
+      batches = b;
+    }
+    if (batches == 0)
+      return;
+    internal_memset(free_bytes, 0, n_pages * sizeof(u32));
+    for (Batch *b = batches; b; b = b->next) {
+      for (uptr i = 0; i < b->count; i++) {
+        uptr beg = reinterpret_cast<uptr>(b->batch[i]);
+        if (beg == reinterpret_cast<uptr>(b))
+          continue;
+        beg -= region_beg;
+        uptr end = beg + size;
+        for (uptr page = beg / page_size; page < n_pages; page++) {
+          uptr page_beg = page * page_size;
+          if (page_beg >= end)
+            break;
+          free_bytes[page] += Min(end, page_beg + page_size) -
+                              Max(beg, page_beg);
+        }
+      }
+    }
+    uptr released = 0;
+    for (uptr page = 0; page < n_pages; ) {
+      if (free_bytes[page] != page_size) {
+        page++;
+        continue;
+      }
+      uptr run_end = page + 1;
+      while (run_end < n_pages && free_bytes[run_end] == page_size)
+        run_end++;
+      ReleaseMemoryToOS(region_beg + page * page_size,
+                        (run_end - page) * page_size);
+      released += (run_end - page) * page_size;
+      page = run_end;
+    }
+    while (batches) {
+      Batch *next = batches->next;
+      region->free_list.Push(batches);
+      batches = next;
+    }
+    region->released_bytes += released;
+    region->n_release_rounds++;
+  }
+
   NOINLINE Batch* PopulateFreeList(AllocatorStats *stat, AllocatorCache *c,
                                    uptr class_id, RegionInfo *region) {
-    BlockingMutexLock l(&region->mutex);
     Batch *b = region->free_list.Pop();
     if (b)
       return b;
     uptr size = SizeClassMap::Size(class_id);
     uptr count = size < kPopulateSize ? SizeClassMap::MaxCached(class_id) : 1;
-    uptr beg_idx = region->allocated_user;
-    uptr end_idx = beg_idx + count * size;
+    // Carve out about kUserMapSize bytes at once so that the threads coming
+    // after us find batches on the free list.
+    uptr n_batches = Max<uptr>(1, kUserMapSize / (count * size));
+    uptr total_size = n_batches * count * size;
+    uptr beg_idx = atomic_fetch_add(&region->allocated_user, total_size,
+                                    memory_order_relaxed);
+    uptr end_idx = beg_idx + total_size;
+    EnsureMapped(stat, class_id, region, end_idx,
+                 end_idx / size * kMetadataSize);
     uptr region_beg = kSpaceBeg + kRegionSize * class_id;
-    if (end_idx + size > region->mapped_user) {
-      // Do the mmap for the user memory.
-      uptr map_size = kUserMapSize;
-      while (end_idx + size > region->mapped_user + map_size)
-        map_size += kUserMapSize;
-      CHECK_GE(region->mapped_user + map_size, end_idx);
-      MapWithCallback(region_beg + region->mapped_user, map_size);
-      stat->Add(AllocatorStatMmapped, map_size);
-      region->mapped_user += map_size;
-    }
-    uptr total_count = (region->mapped_user - beg_idx - size)
-        / size / count * count;
-    region->allocated_meta += total_count * kMetadataSize;
-    if (region->allocated_meta > region->mapped_meta) {
-      uptr map_size = kMetaMapSize;
-      while (region->allocated_meta > region->mapped_meta + map_size)
-        map_size += kMetaMapSize;
-      // Do the mmap for the metadata.
-      CHECK_GE(region->mapped_meta + map_size, region->allocated_meta);
-      MapWithCallback(region_beg + kRegionSize -
-                      region->mapped_meta - map_size, map_size);
-      region->mapped_meta += map_size;
-    }
-    CHECK_LE(region->allocated_meta, region->mapped_meta);
-    if (region->mapped_user + region->mapped_meta > kRegionSize) {
-      Printf("%s: Out of memory. Dying. ", SanitizerToolName);
-      Printf("The process has exhausted %zuMB for size class %zu.\n",
-          kRegionSize / 1024 / 1024, size);
-      Die();
-    }
-    for (;;) {
+    for (uptr i = 0; i < n_batches; i++) {
       if (SizeClassMap::SizeClassRequiresSeparateTransferBatch(class_id))
         b = (Batch*)c->Allocate(this, SizeClassMap::ClassID(sizeof(Batch)));
       else
         b = (Batch*)(region_beg + beg_idx);
       b->count = count;
-      for (uptr i = 0; i < count; i++)
-        b->batch[i] = (void*)(region_beg + beg_idx + i * size);
-      region->allocated_user += count * size;
-      CHECK_LE(region->allocated_user, region->mapped_user);
+      for (uptr j = 0; j < count; j++)
+        b->batch[j] = (void*)(region_beg + beg_idx + j * size);
       beg_idx += count * size;
-      if (beg_idx + count * size + size > region->mapped_user)
+      if (i + 1 == n_batches)
         break;
       CHECK_GT(b->count, 0);
       region->free_list.Push(b);
     }
+    CHECK_EQ(beg_idx, end_idx);
     return b;
   }
+
+  uptr release_to_os_threshold_;
 };
 
 // Maps integers in rage [0, kSize) to u8 values.
@@ -580,11 +863,72 @@ class FlatByteMap {
     // FIXME: CHECK may be too expensive here.
     return map_[idx];
   }
+  void TestOnlyUnmap() {}
  private:
   u8 map_[kSize];
 };
 
-// FIXME: Also implement TwoLevelByteMap.
+// Maps integers in rage [0, kSize1 * kSize2) to u8 values.
+// The first level is an array of kSize1 pointers to second-level arrays of
+// kSize2 bytes each, which are mmap-ed on first write. Unlike FlatByteMap,
+// its memory footprint is proportional to the part of the index range that
+// is actually used, so it suits a large (e.g. 47-bit) address space.
+// Reads take no locks.
+template <u64 kSize1, u64 kSize2, class MapUnmapCallback = NoOpMapUnmapCallback>
+class TwoLevelByteMap {
+ public:
+  void TestOnlyInit() {
+    internal_memset(map1_, 0, sizeof(map1_));
+    mu_.Init();
+  }
+
+  void TestOnlyUnmap() {
+    for (uptr i = 0; i < kSize1; i++) {
+      u8 *p = Get(i);
+      if (!p) continue;
+      MapUnmapCallback().OnUnmap(reinterpret_cast<uptr>(p), kSize2);
+      UnmapOrDie(p, kSize2);
+    }
+  }
+
+  void set(uptr idx, u8 val) {
+    CHECK_LT(idx, kSize1 * kSize2);
+    u8 *map2 = GetOrCreate(idx / kSize2);
+    CHECK_EQ(0U, map2[idx % kSize2]);
+    map2[idx % kSize2] = val;
+  }
+
+  u8 operator[] (uptr idx) const {
+    CHECK_LT(idx, kSize1 * kSize2);
+    u8 *map2 = Get(idx / kSize2);
+    if (!map2) return 0;
+    return map2[idx % kSize2];
+  }
+
+ private:
+  u8 *Get(uptr idx) const {
+    CHECK_LT(idx, kSize1);
+    return reinterpret_cast<u8 *>(
+        atomic_load(&map1_[idx], memory_order_acquire));
+  }
+
+  u8 *GetOrCreate(uptr idx) {
+    u8 *res = Get(idx);
+    if (!res) {
+      SpinMutexLock l(&mu_);
+      if (!(res = Get(idx))) {
+        res = (u8*)MmapOrDie(kSize2, "TwoLevelByteMap");
+        MapUnmapCallback().OnMap(reinterpret_cast<uptr>(res), kSize2);
+        atomic_store(&map1_[idx], reinterpret_cast<uptr>(res),
+                     memory_order_release);
+      }
+    }
+    return res;
+  }
+
+  atomic_uintptr_t map1_[kSize1];
+  StaticSpinMutex mu_;
+};
 
 // SizeClassAllocator32 -- allocator for 32-bit address space.
 // This allocator can theoretically be used on 64-bit arch, but there it is less
@@ -599,6 +943,8 @@ class FlatByteMap {
 // kNumPossibleRegions possible regions in the address space and so we keep
 // a ByteMap possible_regions to store the size classes of each Region.
 // 0 size class means the region is not used by the allocator.
+// FlatByteMap is fine for a 32-bit address space; use TwoLevelByteMap when
+// kSpaceSize is large.
 //
 // One Region is used to allocate chunks of a single size class.
 // A Region looks like this:
@@ -676,6 +1022,14 @@ class SizeClassAllocator32 {
     return GetSizeClass(p) != 0;
   }
 
+  // Returns the range of addresses which may belong to the allocator. The
+  // space may extend to the end of the address space, which is cut off by
+  // one byte then.
+  static void GetSpaceRange(uptr *beg, uptr *end) {
+    *beg = kSpaceBeg;
+    *end = (uptr)Min<u64>(kSpaceBeg + kSpaceSize, (uptr)-1);
+  }
+
   uptr GetSizeClass(const void *p) {
     return possible_regions[ComputeRegionId(reinterpret_cast<uptr>(p))];
   }
@@ -711,6 +1065,7 @@ class SizeClassAllocator32 {
     for (uptr i = 0; i < kNumPossibleRegions; i++)
       if (possible_regions[i])
         UnmapWithCallback((i * kRegionSize), kRegionSize);
+    possible_regions.TestOnlyUnmap();
   }
 
   // ForceLock() and ForceUnlock() are needed to implement Darwin malloc zone
@@ -865,6 +1220,27 @@ struct SizeClassAllocatorLocalCache {
     c->batch[c->count++] = p;
   }
 
+  // Same as calling Deallocate for each of the chunks, which all belong to
+  // class_id.
+  void BulkDeallocate(SizeClassAllocator *allocator, uptr class_id,
+                      void **chunks, uptr count) {
+    CHECK_NE(class_id, 0UL);
+    CHECK_LT(class_id, kNumClasses);
+    InitCache();
+    stats_.Add(AllocatorStatFreed, SizeClassMap::Size(class_id) * count);
+    PerClass *c = &per_class_[class_id];
+    CHECK_NE(c->max_count, 0UL);
+    while (count > 0) {
+      if (c->count == c->max_count)
+        Drain(allocator, class_id);
+      uptr n = Min(count, c->max_count - c->count);
+      internal_memcpy(&c->batch[c->count], chunks, n * sizeof(chunks[0]));
+      c->count += n;
+      chunks += n;
+      count -= n;
+    }
+  }
+
   void Drain(SizeClassAllocator *allocator) {
     for (uptr class_id = 0; class_id < kNumClasses; class_id++) {
       PerClass *c = &per_class_[class_id];
@@ -925,9 +1301,125 @@ struct SizeClassAllocatorLocalCache {
   }
 };
 
+// SizeClassAllocatorPerCPUCache can be used instead of
+// SizeClassAllocatorLocalCache as the AllocatorCache of CombinedAllocator.
+// A single object is shared by all threads: it holds one local cache per CPU,
+// each guarded by its own spin mutex. The amount of cached memory is thus
+// proportional to the number of CPUs instead of the number of threads, and
+// exiting threads have nothing to drain (do not call DestroyCache for them).
+// Where THREADLOCAL is available, each thread remembers the CPU it last ran
+// on and asks the kernel again every kCPURefreshPeriod uses, so that it
+// follows migrations, and whenever the cache of that CPU is busy (another
+// thread runs there now, or the thread was preempted or migrated while
+// holding it); then we try the caches of the current CPU and of its
+// neighbours. Elsewhere we ask on every use.
+// Like SizeClassAllocatorLocalCache, it has to be POD and zero-initialized.
+template<class SizeClassAllocator, uptr kMaxCPUs = 64>
+struct SizeClassAllocatorPerCPUCache {
+  typedef SizeClassAllocator Allocator;
+  typedef SizeClassAllocatorLocalCache<SizeClassAllocator> LocalCache;
+  static const uptr kNumClasses = SizeClassAllocator::kNumClasses;
+  COMPILER_CHECK(kMaxCPUs > 0);
+
+  void Init(AllocatorGlobalStats *s) {
+    for (uptr i = 0; i < kMaxCPUs; i++) {
+      per_cpu_[i].mutex.Init();
+      per_cpu_[i].cache.Init(s);
+    }
+  }
+
+  void Destroy(SizeClassAllocator *allocator, AllocatorGlobalStats *s) {
+    for (uptr i = 0; i < kMaxCPUs; i++) {
+      SpinMutexLock l(&per_cpu_[i].mutex);
+      per_cpu_[i].cache.Destroy(allocator, s);
+    }
+  }
+
+  void *Allocate(SizeClassAllocator *allocator, uptr class_id) {
+    PerCPU *pc = LockCurrentCPU();
+    void *res = pc->cache.Allocate(allocator, class_id);
+    pc->mutex.Unlock();
+    return res;
+  }
+
+  void Deallocate(SizeClassAllocator *allocator, uptr class_id, void *p) {
+    PerCPU *pc = LockCurrentCPU();
+    pc->cache.Deallocate(allocator, class_id, p);
+    pc->mutex.Unlock();
+  }
+
+  void BulkDeallocate(SizeClassAllocator *allocator, uptr class_id,
+                      void **chunks, uptr count) {
+    PerCPU *pc = LockCurrentCPU();
+    pc->cache.BulkDeallocate(allocator, class_id, chunks, count);
+    pc->mutex.Unlock();
+  }
+
+  void Drain(SizeClassAllocator *allocator) {
+    for (uptr i = 0; i < kMaxCPUs; i++) {
+      SpinMutexLock l(&per_cpu_[i].mutex);
+      per_cpu_[i].cache.Drain(allocator);
+    }
+  }
+
+  struct PerCPU {
+    StaticSpinMutex mutex;
+    LocalCache cache;
+    // Keep the hot head of the next PerCPU away from the tail of this one.
+    char padding[kCacheLineSize];
+  };
+  PerCPU per_cpu_[kMaxCPUs];
+
+  static const uptr kCPURefreshPeriod = 64;
+
+  // GetCurrentCPU() is a system call, too slow to make on every allocation.
+  static uptr CurrentCPU(bool refresh) {
+#if SANITIZER_CAN_USE_THREADLOCAL
+    static THREADLOCAL uptr cpu_hint, cpu_hint_uses;
+    if (!refresh && cpu_hint_uses++ % kCPURefreshPeriod != 0)
+      return cpu_hint;
+    cpu_hint = GetCurrentCPU();
+    return cpu_hint;
+#else
+    return GetCurrentCPU();
+#endif
+  }
+
+  PerCPU *LockCurrentCPU() {
+    uptr hint = CurrentCPU(false);
+    PerCPU *pc = &per_cpu_[hint % kMaxCPUs];
+    if (pc->mutex.TryLock())
+      return pc;
+    uptr cpu = CurrentCPU(true);
+    for (uptr i = 0; i < kMaxCPUs; i++) {
+      pc = &per_cpu_[(cpu + i) % kMaxCPUs];
+      if (pc->mutex.TryLock())
+        return pc;
+    }
+    pc = &per_cpu_[cpu % kMaxCPUs];
+    pc->mutex.Lock();
+    return pc;
+  }
+};
+
 // This class can (de)allocate only large chunks of memory using mmap/unmap.
 // The main purpose of this allocator is to cover large and rare allocation
 // sizes not covered by more efficient allocators (e.g. SizeClassAllocator64).
+//
+// Consecutive ranges of address space belong to consecutive shards (out of
+// kNumShards). Each shard keeps the chunks which overlap its ranges in an
+// array sorted by address, so a chunk spanning several ranges is kept by
+// several shards, and a pointer is looked up with a binary search in the
+// shard of its own range only. The chunk counts and stats belong to the
+// shard of the chunk header (the home shard). Writers of a shard are
+// serialized by its mutex; readers (GetBlockBegin) take no locks: they
+// validate what they have read against the sequence number of the shard,
+// which is odd while the shard is being modified.
+//
+// Optionally, freed mappings are kept in a small cache (see
+// SetMappingCacheSize) and reused by later allocations of about the same
+// size, which saves a mmap/munmap pair per allocation. Cached mappings are
+// released to the OS with ReleaseMemoryToOS, so they hold no physical memory.
 template <class MapUnmapCallback = NoOpMapUnmapCallback>
 class LargeMmapAllocator {
  public:
@@ -942,8 +1434,12 @@ class LargeMmapAllocator {
     if (alignment > page_size_)
       map_size += alignment;
     if (map_size < size) return 0;  // Overflow.
-    uptr map_beg = reinterpret_cast<uptr>(
-        MmapOrDie(map_size, "LargeMmapAllocator"));
+    uptr map_beg = TakeFromMappingCache(stat, &map_size);
+    if (!map_beg) {
+      map_beg = reinterpret_cast<uptr>(
+          MmapOrDie(map_size, "LargeMmapAllocator"));
+      stat->Add(AllocatorStatMmapped, map_size);
+    }
     MapUnmapCallback().OnMap(map_beg, map_size);
     uptr map_end = map_beg + map_size;
     uptr res = map_beg + page_size_;
@@ -956,51 +1452,77 @@ class LargeMmapAllocator {
     h->map_beg = map_beg;
     h->map_size = map_size;
     uptr size_log = MostSignificantSetBitIndex(map_size);
-    CHECK_LT(size_log, ARRAY_SIZE(stats.by_size_log));
-    {
-      SpinMutexLock l(&mutex_);
-      uptr idx = n_chunks_++;
-      chunks_sorted_ = false;
-      CHECK_LT(idx, kMaxNumChunks);
-      h->chunk_idx = idx;
-      chunks_[idx] = h;
-      stats.n_allocs++;
-      stats.currently_allocated += map_size;
-      stats.max_allocated = Max(stats.max_allocated, stats.currently_allocated);
-      stats.by_size_log[size_log]++;
+    CHECK_LT(size_log, ARRAY_SIZE(shards_[0].stats.by_size_log));
+    uptr beg = reinterpret_cast<uptr>(h);
+    for (uptr i = 0, n = NumShardsOf(beg, map_end); i < n; i++) {
+      Shard *s = GetShard(beg + (i << kShardRangeSizeLog));
+      SpinMutexLock l(&s->mutex);
+      InsertLocked(s, beg, map_end);
+      if (i) continue;
+      s->stats.n_allocs++;
+      s->stats.currently_allocated += map_size;
+      s->stats.max_allocated =
+          Max(s->stats.max_allocated, s->stats.currently_allocated);
+      s->stats.by_size_log[size_log]++;
       stat->Add(AllocatorStatMalloced, map_size);
-      stat->Add(AllocatorStatMmapped, map_size);
     }
     return reinterpret_cast<void*>(res);
   }
 
   void Deallocate(AllocatorStats *stat, void *p) {
     Header *h = GetHeader(p);
+    uptr map_beg = h->map_beg;
+    uptr map_size = h->map_size;
+    uptr beg = reinterpret_cast<uptr>(h);
+    for (uptr i = 0, n = NumShardsOf(beg, map_beg + map_size); i < n; i++) {
+      Shard *s = GetShard(beg + (i << kShardRangeSizeLog));
+      SpinMutexLock l(&s->mutex);
+      RemoveLocked(s, beg);
+      if (i) continue;
+      s->stats.n_frees++;
+      s->stats.currently_allocated -= map_size;
+      stat->Add(AllocatorStatFreed, map_size);
+    }
+    MapUnmapCallback().OnUnmap(map_beg, map_size);
+    if (!PutToMappingCache(stat, map_beg, map_size)) {
+      UnmapOrDie(reinterpret_cast<void*>(map_beg), map_size);
+      stat->Add(AllocatorStatUnmapped, map_size);
+    }
+  }
+
+  // Keeps up to max_cached_bytes bytes of freed mappings for reuse.
+  // Zero (the default) disables the cache.
+  void SetMappingCacheSize(uptr max_cached_bytes) {
+    SpinMutexLock l(&cache_mutex_);
+    atomic_store(&cache_max_bytes_, max_cached_bytes, memory_order_relaxed);
+  }
+
+  // Unmaps all cached mappings.
+  void ReleaseToOS(AllocatorStats *stat) {
+    CachedMapping evicted[kMaxCachedMappings];
+    uptr n_evicted;
     {
-      SpinMutexLock l(&mutex_);
-      uptr idx = h->chunk_idx;
-      CHECK_EQ(chunks_[idx], h);
-      CHECK_LT(idx, n_chunks_);
-      chunks_[idx] = chunks_[n_chunks_ - 1];
-      chunks_[idx]->chunk_idx = idx;
-      n_chunks_--;
-      chunks_sorted_ = false;
-      stats.n_frees++;
-      stats.currently_allocated -= h->map_size;
-      stat->Add(AllocatorStatFreed, h->map_size);
-      stat->Add(AllocatorStatUnmapped, h->map_size);
+      SpinMutexLock l(&cache_mutex_);
+      n_evicted = n_cached_;
+      internal_memcpy(evicted, cache_, n_cached_ * sizeof(cache_[0]));
+      n_cached_ = 0;
+      cached_bytes_ = 0;
     }
-    MapUnmapCallback().OnUnmap(h->map_beg, h->map_size);
-    UnmapOrDie(reinterpret_cast<void*>(h->map_beg), h->map_size);
+    UnmapEvicted(stat, evicted, n_evicted);
   }
 
   uptr TotalMemoryUsed() {
-    SpinMutexLock l(&mutex_);
     uptr res = 0;
-    for (uptr i = 0; i < n_chunks_; i++) {
-      Header *h = chunks_[i];
-      CHECK_EQ(h->chunk_idx, i);
-      res += RoundUpMapSize(h->size);
+    for (uptr i = 0; i < kNumShards; i++) {
+      Shard *s = &shards_[i];
+      SpinMutexLock l(&s->mutex);
+      ChunkArray *a = GetChunkArray(s);
+      uptr n = atomic_load(&s->n_chunks, memory_order_relaxed);
+      for (uptr j = 0; j < n; j++) {
+        if (GetShard(a->chunks[j].beg) != s) continue;
+        Header *h = reinterpret_cast<Header*>(a->chunks[j].beg);
+        res += RoundUpMapSize(h->size);
+      }
     }
     return res;
   }
@@ -1020,75 +1542,33 @@ class LargeMmapAllocator {
     return GetHeader(p) + 1;
   }
 
+  // Takes no locks and does not touch the chunk headers, so it is safe to
+  // call while other threads allocate and deallocate.
   void *GetBlockBegin(const void *ptr) {
     uptr p = reinterpret_cast<uptr>(ptr);
-    SpinMutexLock l(&mutex_);
-    uptr nearest_chunk = 0;
-    // Cache-friendly linear search.
-    for (uptr i = 0; i < n_chunks_; i++) {
-      uptr ch = reinterpret_cast<uptr>(chunks_[i]);
-      if (p < ch) continue;  // p is at left to this chunk, skip it.
-      if (p - ch < p - nearest_chunk)
-        nearest_chunk = ch;
-    }
-    if (!nearest_chunk)
-      return 0;
-    Header *h = reinterpret_cast<Header *>(nearest_chunk);
-    CHECK_GE(nearest_chunk, h->map_beg);
-    CHECK_LT(nearest_chunk, h->map_beg + h->map_size);
-    CHECK_LE(nearest_chunk, p);
-    if (h->map_beg + h->map_size <= p)
-      return 0;
-    return GetUser(h);
-  }
-
-  // This function does the same as GetBlockBegin, but is much faster.
-  // Must be called with the allocator locked.
-  void *GetBlockBeginFastLocked(void *ptr) {
-    uptr p = reinterpret_cast<uptr>(ptr);
-    uptr n = n_chunks_;
-    if (!n) return 0;
-    if (!chunks_sorted_) {
-      // Do one-time sort. chunks_sorted_ is reset in Allocate/Deallocate.
-      SortArray(reinterpret_cast<uptr*>(chunks_), n);
-      for (uptr i = 0; i < n; i++)
-        chunks_[i]->chunk_idx = i;
-      chunks_sorted_ = true;
-      min_mmap_ = reinterpret_cast<uptr>(chunks_[0]);
-      max_mmap_ = reinterpret_cast<uptr>(chunks_[n - 1]) +
-          chunks_[n - 1]->map_size;
-    }
-    if (p < min_mmap_ || p >= max_mmap_)
-      return 0;
-    uptr beg = 0, end = n - 1;
-    // This loop is a log(n) lower_bound. It does not check for the exact match
-    // to avoid expensive cache-thrashing loads.
-    while (end - beg >= 2) {
-      uptr mid = (beg + end) / 2;  // Invariant: mid >= beg + 1
-      if (p < reinterpret_cast<uptr>(chunks_[mid]))
-        end = mid - 1;  // We are not interested in chunks_[mid].
-      else
-        beg = mid;  // chunks_[mid] may still be what we want.
-    }
-
-    if (beg < end) {
-      CHECK_EQ(beg + 1, end);
-      // There are 2 chunks left, choose one.
-      if (p >= reinterpret_cast<uptr>(chunks_[end]))
-        beg = end;
-    }
-
-    Header *h = chunks_[beg];
-    if (h->map_beg + h->map_size <= p || p < h->map_beg)
-      return 0;
-    return GetUser(h);
+    uptr h = FindChunk(GetShard(p), p);
+    return h ? reinterpret_cast<void*>(h + page_size_) : 0;
   }
 
   void PrintStats() {
+    Stats stats;
+    internal_memset(&stats, 0, sizeof(stats));
+    for (uptr i = 0; i < kNumShards; i++) {
+      Stats *s = &shards_[i].stats;
+      stats.n_allocs += s->n_allocs;
+      stats.n_frees += s->n_frees;
+      stats.currently_allocated += s->currently_allocated;
+      // Sum of per-shard maximums: an upper bound of the real maximum.
+      stats.max_allocated += s->max_allocated;
+      for (uptr j = 0; j < ARRAY_SIZE(stats.by_size_log); j++)
+        stats.by_size_log[j] += s->by_size_log[j];
+    }
     Printf("Stats: LargeMmapAllocator: allocated %zd times, "
-           "remains %zd (%zd K) max %zd M; by size logs: ",
+           "remains %zd (%zd K) max %zd M; cached %zd (%zd K); "
+           "by size logs: ",
            stats.n_allocs, stats.n_allocs - stats.n_frees,
-           stats.currently_allocated >> 10, stats.max_allocated >> 20);
+           stats.currently_allocated >> 10, stats.max_allocated >> 20,
+           n_cached_, cached_bytes_ >> 10);
     for (uptr i = 0; i < ARRAY_SIZE(stats.by_size_log); i++) {
       uptr c = stats.by_size_log[i];
       if (!c) continue;
@@ -1100,29 +1580,207 @@ class LargeMmapAllocator {
   // ForceLock() and ForceUnlock() are needed to implement Darwin malloc zone
   // introspection API.
   void ForceLock() {
-    mutex_.Lock();
+    for (uptr i = 0; i < kNumShards; i++)
+      shards_[i].mutex.Lock();
+    cache_mutex_.Lock();
   }
 
   void ForceUnlock() {
-    mutex_.Unlock();
+    cache_mutex_.Unlock();
+    for (int i = (int)kNumShards - 1; i >= 0; i--)
+      shards_[i].mutex.Unlock();
   }
 
   // Iterate over all existing chunks.
   // The allocator must be locked when calling this function.
   void ForEachChunk(ForEachChunkCallback callback, void *arg) {
-    for (uptr i = 0; i < n_chunks_; i++)
-      callback(reinterpret_cast<uptr>(GetUser(chunks_[i])), arg);
+    for (uptr i = 0; i < kNumShards; i++) {
+      Shard *s = &shards_[i];
+      ChunkArray *a = GetChunkArray(s);
+      uptr n = atomic_load(&s->n_chunks, memory_order_relaxed);
+      for (uptr j = 0; j < n; j++) {
+        if (GetShard(a->chunks[j].beg) == s)
+          callback(a->chunks[j].beg + page_size_, arg);
+      }
+    }
+  }
+
+  // Returns the smallest range containing all the chunks, empty if there
+  // are none. The allocator must be locked.
+  void GetAddressRangeLocked(uptr *beg, uptr *end) {
+    *beg = *end = 0;
+    for (uptr i = 0; i < kNumShards; i++) {
+      Shard *s = &shards_[i];
+      uptr n = atomic_load(&s->n_chunks, memory_order_relaxed);
+      if (!n)
+        continue;
+      // The chunk arrays are sorted.
+      ChunkArray *a = GetChunkArray(s);
+      if (*beg == *end) {
+        *beg = a->chunks[0].beg;
+        *end = a->chunks[n - 1].end;
+      } else {
+        *beg = Min(*beg, a->chunks[0].beg);
+        *end = Max(*end, a->chunks[n - 1].end);
+      }
+    }
   }
 
  private:
-  static const int kMaxNumChunks = 1 << FIRST_32_SECOND_64(15, 18);
+  static const uptr kNumShards = 16;
+  // Consecutive kShardRangeSize-byte ranges of address space belong to
+  // consecutive shards.
+  static const uptr kShardRangeSizeLog = 20;
+  static const uptr kInitialChunkArraySize = 1 << 16;
+  static const uptr kMaxCachedMappings = 32;
+  // A cached mapping is reused for a request at most 1/kMaxCacheWaste
+  // smaller than it.
+  static const uptr kMaxCacheWaste = 8;
+
   struct Header {
     uptr map_beg;
     uptr map_size;
     uptr size;
-    uptr chunk_idx;
   };
 
+  struct Chunk {
+    uptr beg;  // Address of the Header.
+    uptr end;  // End of the mapping.
+  };
+
+  struct ChunkArray {
+    uptr capacity;
+    Chunk chunks[1];  // Actually, capacity elements.
+  };
+
+  struct Stats {
+    uptr n_allocs, n_frees, currently_allocated, max_allocated, by_size_log[64];
+  };
+
+  struct CachedMapping {
+    uptr map_beg;
+    uptr map_size;
+  };
+
+  struct Shard {
+    StaticSpinMutex mutex;
+    atomic_uint32_t seq;  // Odd while the chunk array is being modified.
+    atomic_uintptr_t chunk_array;  // ChunkArray*.
+    atomic_uintptr_t n_chunks;
+    Stats stats;
+    char padding[kCacheLineSize];
+  };
+
+  Shard *GetShard(uptr p) {
+    return &shards_[(p >> kShardRangeSizeLog) % kNumShards];
+  }
+
+  // Returns the number of shards keeping the chunk [beg, end).
+  static uptr NumShardsOf(uptr beg, uptr end) {
+    uptr n = ((end - 1) >> kShardRangeSizeLog) - (beg >> kShardRangeSizeLog);
+    return Min(n + 1, kNumShards);
+  }
+
+  static ChunkArray *GetChunkArray(Shard *s) {
+    return reinterpret_cast<ChunkArray*>(
+        atomic_load(&s->chunk_array, memory_order_acquire));
+  }
+
+  static void BeginWrite(Shard *s) {
+    atomic_store(&s->seq, atomic_load(&s->seq, memory_order_relaxed) + 1,
+                 memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+  }
+
+  static void EndWrite(Shard *s) {
+    atomic_store(&s->seq, atomic_load(&s->seq, memory_order_relaxed) + 1,
+                 memory_order_release);
+  }
+
+  // Returns the index of the first chunk which begins after p.
+  static uptr UpperBound(ChunkArray *a, uptr n, uptr p) {
+    uptr beg = 0, end = n;
+    while (beg < end) {
+      uptr mid = (beg + end) / 2;
+      if (p < a->chunks[mid].beg)
+        end = mid;
+      else
+        beg = mid + 1;
+    }
+    return beg;
+  }
+
+  // Returns the header of the chunk of s containing p, or 0.
+  uptr FindChunk(Shard *s, uptr p) {
+    for (;;) {
+      u32 seq = atomic_load(&s->seq, memory_order_acquire);
+      if (seq & 1) {
+        proc_yield(10);
+        continue;
+      }
+      uptr res = 0;
+      ChunkArray *a = GetChunkArray(s);
+      // n_chunks may already be updated for a new array we haven't seen;
+      // the old arrays are never unmapped, but they may be shorter.
+      uptr n = atomic_load(&s->n_chunks, memory_order_relaxed);
+      if (a && n > a->capacity)
+        n = a->capacity;
+      if (a && n > 0) {
+        uptr idx = UpperBound(a, n, p);
+        if (idx > 0 && p < a->chunks[idx - 1].end)
+          res = a->chunks[idx - 1].beg;
+      }
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load(&s->seq, memory_order_relaxed) == seq)
+        return res;
+    }
+  }
+
+  void InsertLocked(Shard *s, uptr beg, uptr end) {
+    ChunkArray *a = GetChunkArray(s);
+    uptr n = atomic_load(&s->n_chunks, memory_order_relaxed);
+    ChunkArray *new_a = 0;
+    if (!a || n == a->capacity) {
+      uptr new_size = a ? 2 * (sizeof(uptr) + a->capacity * sizeof(Chunk))
+                        : kInitialChunkArraySize;
+      new_a = reinterpret_cast<ChunkArray*>(
+          MmapOrDie(new_size, "LargeMmapAllocator chunks"));
+      new_a->capacity = (new_size - sizeof(uptr)) / sizeof(Chunk);
+      if (n)
+        internal_memcpy(new_a->chunks, a->chunks, n * sizeof(Chunk));
+      // The old array is never unmapped: lock-free readers may be reading
+      // it. Doubling keeps the total waste below the size of the new array.
+    }
+    uptr idx = UpperBound(new_a ? new_a : a, n, beg);
+    BeginWrite(s);
+    if (new_a) {
+      atomic_store(&s->chunk_array, reinterpret_cast<uptr>(new_a),
+                   memory_order_release);
+      a = new_a;
+    }
+    internal_memmove(&a->chunks[idx + 1], &a->chunks[idx],
+                     (n - idx) * sizeof(Chunk));
+    a->chunks[idx].beg = beg;
+    a->chunks[idx].end = end;
+    atomic_store(&s->n_chunks, n + 1, memory_order_relaxed);
+    EndWrite(s);
+  }
+
+  void RemoveLocked(Shard *s, uptr beg) {
+    ChunkArray *a = GetChunkArray(s);
+    uptr n = atomic_load(&s->n_chunks, memory_order_relaxed);
+    CHECK(a);
+    uptr idx = UpperBound(a, n, beg);
+    CHECK_GT(idx, 0);
+    idx--;
+    CHECK_EQ(a->chunks[idx].beg, beg);
+    BeginWrite(s);
+    internal_memmove(&a->chunks[idx], &a->chunks[idx + 1],
+                     (n - idx - 1) * sizeof(Chunk));
+    atomic_store(&s->n_chunks, n - 1, memory_order_relaxed);
+    EndWrite(s);
+  }
+
   Header *GetHeader(uptr p) {
     CHECK(IsAligned(p, page_size_));
     return reinterpret_cast<Header*>(p - page_size_);
@@ -1140,22 +1798,96 @@ class LargeMmapAllocator {
     return RoundUpTo(size, page_size_) + page_size_;
   }
 
+  // Returns the smallest cached mapping of at least *map_size bytes and
+  // stores its size to *map_size, or returns 0.
+  uptr TakeFromMappingCache(AllocatorStats *stat, uptr *map_size) {
+    if (!atomic_load(&cache_max_bytes_, memory_order_relaxed))
+      return 0;
+    uptr size = *map_size;
+    uptr map_beg = 0;
+    {
+      SpinMutexLock l(&cache_mutex_);
+      uptr best = n_cached_;
+      for (uptr i = 0; i < n_cached_; i++) {
+        uptr cached_size = cache_[i].map_size;
+        if (cached_size >= size &&
+            cached_size - size <= size / kMaxCacheWaste &&
+            (best == n_cached_ || cached_size < cache_[best].map_size))
+          best = i;
+      }
+      if (best == n_cached_) {
+        stat->Add(AllocatorStatLargeCacheMiss, 1);
+        return 0;
+      }
+      map_beg = cache_[best].map_beg;
+      *map_size = cache_[best].map_size;
+      cached_bytes_ -= *map_size;
+      internal_memmove(&cache_[best], &cache_[best + 1],
+                       (n_cached_ - best - 1) * sizeof(cache_[0]));
+      n_cached_--;
+      stat->Add(AllocatorStatLargeCacheHit, 1);
+    }
+    // ReleaseMemoryToOS zero-fills the pages only on Linux, and users of
+    // the secondary allocator expect fresh memory to be zeroed.
+    if (!SANITIZER_LINUX)
+      internal_memset(reinterpret_cast<void*>(map_beg), 0, *map_size);
+    return map_beg;
+  }
+
+  // Caches the mapping, evicting the least recently freed ones to stay
+  // within the limits. Returns false if the mapping should be unmapped.
+  bool PutToMappingCache(AllocatorStats *stat, uptr map_beg, uptr map_size) {
+    if (map_size > atomic_load(&cache_max_bytes_, memory_order_relaxed))
+      return false;
+    ReleaseMemoryToOS(map_beg, map_size);
+    CachedMapping evicted[kMaxCachedMappings];
+    uptr n_evicted = 0;
+    {
+      SpinMutexLock l(&cache_mutex_);
+      uptr max_bytes = atomic_load(&cache_max_bytes_, memory_order_relaxed);
+      if (map_size > max_bytes)
+        return false;
+      while (n_cached_ == kMaxCachedMappings ||
+             cached_bytes_ + map_size > max_bytes) {
+        evicted[n_evicted++] = cache_[0];
+        cached_bytes_ -= cache_[0].map_size;
+        n_cached_--;
+        internal_memmove(&cache_[0], &cache_[1],
+                         n_cached_ * sizeof(cache_[0]));
+      }
+      cache_[n_cached_].map_beg = map_beg;
+      cache_[n_cached_].map_size = map_size;
+      n_cached_++;
+      cached_bytes_ += map_size;
+    }
+    UnmapEvicted(stat, evicted, n_evicted);
+    return true;
+  }
+
+  void UnmapEvicted(AllocatorStats *stat, CachedMapping *evicted, uptr n) {
+    for (uptr i = 0; i < n; i++) {
+      UnmapOrDie(reinterpret_cast<void*>(evicted[i].map_beg),
+                 evicted[i].map_size);
+      stat->Add(AllocatorStatUnmapped, evicted[i].map_size);
+    }
+  }
+
   uptr page_size_;
-  Header *chunks_[kMaxNumChunks];
-  uptr n_chunks_;
-  uptr min_mmap_, max_mmap_;
-  bool chunks_sorted_;
-  struct Stats {
-    uptr n_allocs, n_frees, currently_allocated, max_allocated, by_size_log[64];
-  } stats;
-  SpinMutex mutex_;
+  Shard shards_[kNumShards];
+  // Freed mappings, from the least to the most recently freed.
+  StaticSpinMutex cache_mutex_;
+  CachedMapping cache_[kMaxCachedMappings];
+  uptr n_cached_;
+  uptr cached_bytes_;
+  atomic_uintptr_t cache_max_bytes_;
 };
 
 // This class implements a complete memory allocator by using two
 // internal allocators:
 // PrimaryAllocator is efficient, but may not allocate some sizes (alignments).
 //  When allocating 2^x bytes it should return 2^x aligned chunk.
-// PrimaryAllocator is used via a local AllocatorCache.
+// PrimaryAllocator is used via a local AllocatorCache (either a per-thread
+// SizeClassAllocatorLocalCache or a shared SizeClassAllocatorPerCPUCache).
 // SecondaryAllocator can allocate anything, but is not efficient.
 template <class PrimaryAllocator, class AllocatorCache,
           class SecondaryAllocator>  // NOLINT
@@ -1196,6 +1928,19 @@ class CombinedAllocator {
       secondary_.Deallocate(&stats_, p);
   }
 
+  // Returns the size class of a chunk from the primary allocator, or 0 if
+  // the chunk is from the secondary one.
+  uptr GetSizeClass(void *p) {
+    return primary_.PointerIsMine(p) ? primary_.GetSizeClass(p) : 0;
+  }
+
+  // Deallocates chunks of the primary allocator, all of the same class_id,
+  // putting them into the cache at once.
+  void BulkDeallocate(AllocatorCache *cache, uptr class_id, void **chunks,
+                      uptr count) {
+    cache->BulkDeallocate(&primary_, class_id, chunks, count);
+  }
+
   void *Reallocate(AllocatorCache *cache, void *p, uptr new_size,
                    uptr alignment) {
     if (!p)
@@ -1236,14 +1981,6 @@ class CombinedAllocator {
     return secondary_.GetBlockBegin(p);
   }
 
-  // This function does the same as GetBlockBegin, but is much faster.
-  // Must be called with the allocator locked.
-  void *GetBlockBeginFastLocked(void *p) {
-    if (primary_.PointerIsMine(p))
-      return primary_.GetBlockBegin(p);
-    return secondary_.GetBlockBeginFastLocked(p);
-  }
-
   uptr GetActuallyAllocatedSize(void *p) {
     if (primary_.PointerIsMine(p))
       return primary_.GetActuallyAllocatedSize(p);
@@ -1254,8 +1991,30 @@ class CombinedAllocator {
     return primary_.TotalMemoryUsed() + secondary_.TotalMemoryUsed();
   }
 
+  // Returns the address ranges containing all the chunks of the primary and
+  // of the secondary allocator. Must be called with the allocator locked.
+  void GetAddressRangesLocked(uptr *primary_beg, uptr *primary_end,
+                              uptr *secondary_beg, uptr *secondary_end) {
+    primary_.GetSpaceRange(primary_beg, primary_end);
+    secondary_.GetAddressRangeLocked(secondary_beg, secondary_end);
+  }
+
   void TestOnlyUnmap() { primary_.TestOnlyUnmap(); }
 
+  // Only available if the PrimaryAllocator supports it.
+  void SetReleaseToOSThreshold(uptr threshold) {
+    primary_.SetReleaseToOSThreshold(threshold);
+  }
+
+  void ReleaseToOS() {
+    primary_.ReleaseToOS();
+    secondary_.ReleaseToOS(&stats_);
+  }
+
+  void SetMappingCacheSize(uptr max_cached_bytes) {
+    secondary_.SetMappingCacheSize(max_cached_bytes);
+  }
+
   void InitCache(AllocatorCache *cache) {
     cache->Init(&stats_);
   }
@@ -45,6 +45,9 @@ uptr GetMaxVirtualAddress();
 // Threads
 uptr GetTid();
 uptr GetThreadSelf();
+// Returns the index of the CPU the calling thread is running on, or 0 if
+// it can not be determined. The result may be stale by the time it is used.
+uptr GetCurrentCPU();
 void GetThreadStackTopAndBottom(bool at_initialization, uptr *stack_top,
                                 uptr *stack_bottom);
 void GetThreadStackAndTls(bool main, uptr *stk_addr, uptr *stk_size,
@@ -61,6 +64,9 @@ void *MmapAlignedOrDie(uptr size, uptr alignment, const char *mem_type);
 // Used to check if we can map shadow memory to a fixed location.
 bool MemoryRangeIsAvailable(uptr range_start, uptr range_end);
 void FlushUnneededShadowMemory(uptr addr, uptr size);
+// Tells the OS that the pages in [addr, addr + size) are not needed. They
+// stay mapped and read as zeroes when touched next time.
+void ReleaseMemoryToOS(uptr addr, uptr size);
 
 // InternalScopedBuffer can be used instead of large stack arrays to
 // keep frame size low.
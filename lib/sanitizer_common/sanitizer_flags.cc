@@ -23,14 +23,22 @@ CommonFlags common_flags_dont_use_directly;
 void ParseCommonFlagsFromString(const char *str) {
   CommonFlags *f = common_flags();
   ParseFlag(str, &f->malloc_context_size, "malloc_context_size");
+  ParseFlag(str, &f->malloc_context_prefix_size,
+            "malloc_context_prefix_size");
   ParseFlag(str, &f->strip_path_prefix, "strip_path_prefix");
   ParseFlag(str, &f->fast_unwind_on_fatal, "fast_unwind_on_fatal");
   ParseFlag(str, &f->fast_unwind_on_malloc, "fast_unwind_on_malloc");
   ParseFlag(str, &f->symbolize, "symbolize");
+  ParseFlag(str, &f->symbolize_in_process, "symbolize_in_process");
   ParseFlag(str, &f->handle_ioctl, "handle_ioctl");
   ParseFlag(str, &f->log_path, "log_path");
   ParseFlag(str, &f->detect_leaks, "detect_leaks");
   ParseFlag(str, &f->leak_check_at_exit, "leak_check_at_exit");
+  ParseFlag(str, &f->heap_profile_sample_interval,
+            "heap_profile_sample_interval");
+  ParseFlag(str, &f->stack_depot_trie, "stack_depot_trie");
+  ParseFlag(str, &f->stack_depot_snapshot_path, "stack_depot_snapshot_path");
+  ParseFlag(str, &f->eh_frame_unwind, "eh_frame_unwind");
 }
 
 static bool GetFlagValue(const char *env, const char *name,
@@ -27,6 +27,10 @@ struct CommonFlags {
   bool symbolize;
   // Path to external symbolizer.
   const char *external_symbolizer_path;
+  // Symbolize using the ELF symbol tables and the DWARF line tables of the
+  // modules read in-process, instead of starting the external symbolizer.
+  // Inlined frames are not reported.
+  bool symbolize_in_process;
   // Strips this prefix from file paths in error reports.
   const char *strip_path_prefix;
   // Use fast (frame-pointer-based) unwinder on fatal errors (if available).
@@ -37,6 +41,10 @@ struct CommonFlags {
   bool handle_ioctl;
   // Max number of stack frames kept for each allocation/deallocation.
   int malloc_context_size;
+  // If not zero, only this many top frames of the allocation/deallocation
+  // stacks are unwound; malloc_context_size frames are unwound just once for
+  // every distinct set of top frames (see GetTruncatedStackTrace).
+  int malloc_context_prefix_size;
   // Write logs to "log_path.pid" instead of stderr.
   const char *log_path;
   // Enable memory leak detection.
@@ -45,6 +53,19 @@ struct CommonFlags {
   // detect_leaks=false, or if __lsan_do_leak_check() is called before the
   // handler has a chance to run.
   bool leak_check_at_exit;
+  // If not zero, sample on average one allocation per this many bytes
+  // allocated for the heap profile (see __sanitizer_print_heap_profile).
+  int heap_profile_sample_interval;
+  // Store stack traces in a trie, sharing the common outer frames (see
+  // StackDepotSetUseTrie).
+  bool stack_depot_trie;
+  // If set, the stack depot is written to "stack_depot_snapshot_path.<pid>"
+  // at exit and on fatal errors (see StackDepotDump).
+  const char *stack_depot_snapshot_path;
+  // Make the slow unwinder use the cached .eh_frame unwind rules instead of
+  // _Unwind_Backtrace (if available). Which unwinder is used where is still
+  // controlled by fast_unwind_on_malloc and fast_unwind_on_fatal.
+  bool eh_frame_unwind;
 };
 
 extern CommonFlags common_flags_dont_use_directly;
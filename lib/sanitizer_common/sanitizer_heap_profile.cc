@@ -0,0 +1,450 @@
+//===-- sanitizer_heap_profile.cc -----------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is shared between sanitizer run-time libraries.
+// Implementation of the sampling heap profiler.
+//===----------------------------------------------------------------------===//
+
+#include "sanitizer_heap_profile.h"
+#include "sanitizer_common.h"
+#include "sanitizer_flags.h"
+#include "sanitizer_libc.h"
+#include "sanitizer_mutex.h"
+#include "sanitizer_stackdepot.h"
+#include "sanitizer_stacktrace.h"
+
+namespace __sanitizer {
+
+atomic_uintptr_t heap_profile_live_samples;
+
+// Open addressing hash table of the addresses of sampled live chunks.
+static const uptr kLiveTableSizeLog = 16;
+static const uptr kLiveTableSize = 1 << kLiveTableSizeLog;
+// Keep the table sparse so that the lookups are short.
+static const uptr kMaxLiveSamples = kLiveTableSize / 4;
+// Marks a slot of a freed chunk; the slot can be reused by a later sample.
+static const uptr kRemovedChunk = 1;
+// The table is rehashed when this many slots are marked as removed.
+static const uptr kMaxRemovedChunks = kLiveTableSize / 4;
+
+// Open addressing hash table of allocation sites, keyed by stack id.
+static const uptr kSiteTableSizeLog = 14;
+static const uptr kSiteTableSize = 1 << kSiteTableSizeLog;
+static const uptr kMaxSites = kSiteTableSize / 2;
+
+// All byte counts are estimates computed from the samples.
+struct HeapProfileSite {
+  u32 stack_id;
+  uptr live_bytes;
+  uptr live_count;  // Number of live samples.
+  uptr peak_bytes;  // Maximal value of live_bytes.
+  uptr total_bytes;
+  uptr total_count;  // Number of samples, 0 for an unused slot.
+};
+
+struct LiveSample {
+  uptr site;  // Index in the site table.
+  uptr weight;
+};
+
+struct LiveChunk {
+  uptr p;
+  LiveSample sample;
+};
+
+static struct {
+  uptr sample_interval;
+  // Protects everything below. live_chunks may be read without it.
+  StaticSpinMutex mtx;
+  atomic_uintptr_t *live_chunks;  // [kLiveTableSize]
+  LiveSample *live_samples;  // [kLiveTableSize], parallel to live_chunks.
+  // Maximal distance between the hash of a chunk and its slot.
+  atomic_uintptr_t max_probe;
+  // Odd while the table is being rehashed.
+  atomic_uint32_t live_chunks_seq;
+  uptr n_removed;  // Slots marked with kRemovedChunk.
+  LiveChunk *rehash_buffer;  // [kMaxLiveSamples]
+  HeapProfileSite *sites;  // [kSiteTableSize]
+  uptr n_sites;
+  uptr live_bytes;
+  uptr peak_bytes;
+  uptr dropped_samples;
+} profile;
+
+void HeapProfileInit(uptr sample_interval) {
+  if (!sample_interval || profile.sample_interval)
+    return;
+  profile.live_chunks = (atomic_uintptr_t*)MmapOrDie(
+      kLiveTableSize * sizeof(profile.live_chunks[0]), "HeapProfile");
+  profile.live_samples = (LiveSample*)MmapOrDie(
+      kLiveTableSize * sizeof(profile.live_samples[0]), "HeapProfile");
+  profile.rehash_buffer = (LiveChunk*)MmapOrDie(
+      kMaxLiveSamples * sizeof(profile.rehash_buffer[0]), "HeapProfile");
+  profile.sites = (HeapProfileSite*)MmapOrDie(
+      kSiteTableSize * sizeof(profile.sites[0]), "HeapProfile");
+  profile.sample_interval = sample_interval;
+}
+
+bool HeapProfileEnabled() {
+  return profile.sample_interval != 0;
+}
+
+static uptr LiveChunkHash(uptr p) {
+  return (uptr)(((u64)p * 0x9E3779B97F4A7C15ULL) >> (64 - kLiveTableSizeLog));
+}
+
+static uptr SiteHash(u32 stack_id) {
+  return (uptr)(((u64)stack_id * 0x9E3779B97F4A7C15ULL) >>
+                (64 - kSiteTableSizeLog));
+}
+
+// xorshift64*.
+static u64 NextRandom(HeapProfileThreadState *s) {
+  u64 x = s->rand_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  s->rand_state = x;
+  return x * 2685821657736338717ULL;
+}
+
+static const double kLn2 = 0.69314718055994530942;
+
+// Returns -ln(u) for u in (0, 1].
+static double NegLog(double u) {
+  double res = 0;
+  while (u < 0.5) {
+    u *= 2;
+    res += kLn2;
+  }
+  // ln(u) = 2 * atanh((u - 1) / (u + 1)), and |z| <= 1/3 here.
+  double z = (u - 1) / (u + 1);
+  double z2 = z * z;
+  double atanh = z * (1 + z2 * (1.0 / 3 + z2 * (1.0 / 5 + z2 * (1.0 / 7 +
+                 z2 * (1.0 / 9 + z2 * (1.0 / 11))))));
+  return res - 2 * atanh;
+}
+
+// Returns 1 - exp(-x) for x >= 0.
+static double OneMinusExpNeg(double x) {
+  if (x < 0.5)
+    return x * (1 - x / 2 * (1 - x / 3 * (1 - x / 4 * (1 - x / 5 *
+           (1 - x / 6 * (1 - x / 7))))));
+  if (x > 40)
+    return 1;
+  uptr k = 0;
+  while (x > 0.5) {
+    x /= 2;
+    k++;
+  }
+  double e = 1 - OneMinusExpNeg(x);
+  for (uptr i = 0; i < k; i++)
+    e *= e;
+  return 1 - e;
+}
+
+static uptr NextSampleDistance(HeapProfileThreadState *s) {
+  // 53 random bits, shifted to make u non-zero.
+  double u = ((NextRandom(s) >> 11) + 0.5) * (1.0 / (1ULL << 53));
+  double res = NegLog(u) * profile.sample_interval;
+  const double kMaxDistance = (double)((uptr)-1 / 2);
+  if (res > kMaxDistance)
+    return (uptr)kMaxDistance;
+  return res < 1 ? 1 : (uptr)res;
+}
+
+static uptr SampleWeight(uptr size) {
+  double interval = profile.sample_interval;
+  return (uptr)(size / OneMinusExpNeg(size / interval));
+}
+
+// Returns kSiteTableSize if there is no room for a new site.
+static uptr FindOrAddSiteLocked(u32 stack_id) {
+  uptr idx = SiteHash(stack_id);
+  for (;;) {
+    HeapProfileSite *site = &profile.sites[idx];
+    if (site->total_count == 0)
+      break;
+    if (site->stack_id == stack_id)
+      return idx;
+    idx = (idx + 1) & (kSiteTableSize - 1);
+  }
+  if (profile.n_sites == kMaxSites)
+    return kSiteTableSize;
+  profile.n_sites++;
+  profile.sites[idx].stack_id = stack_id;
+  return idx;
+}
+
+static void AddLiveChunkLocked(uptr p, uptr site, uptr weight) {
+  uptr idx = LiveChunkHash(p);
+  uptr probe = 0;
+  for (;;) {
+    uptr v = atomic_load(&profile.live_chunks[idx], memory_order_relaxed);
+    if (v == 0)
+      break;
+    if (v == kRemovedChunk) {
+      profile.n_removed--;
+      break;
+    }
+    idx = (idx + 1) & (kLiveTableSize - 1);
+    probe++;
+  }
+  if (probe > atomic_load(&profile.max_probe, memory_order_relaxed))
+    atomic_store(&profile.max_probe, probe, memory_order_relaxed);
+  profile.live_samples[idx].site = site;
+  profile.live_samples[idx].weight = weight;
+  atomic_store(&profile.live_chunks[idx], p, memory_order_release);
+}
+
+// Takes no locks: retries if the table is rehashed meanwhile. Returns
+// kLiveTableSize if p is not a sampled chunk.
+static uptr FindLiveChunk(uptr p) {
+  for (;;) {
+    u32 seq = atomic_load(&profile.live_chunks_seq, memory_order_acquire);
+    if (seq & 1) {
+      proc_yield(10);
+      continue;
+    }
+    uptr res = kLiveTableSize;
+    uptr max_probe = atomic_load(&profile.max_probe, memory_order_relaxed);
+    uptr idx = LiveChunkHash(p);
+    for (uptr i = 0; i <= max_probe; i++) {
+      uptr v = atomic_load(&profile.live_chunks[idx], memory_order_acquire);
+      if (v == p) {
+        res = idx;
+        break;
+      }
+      if (v == 0)
+        break;
+      idx = (idx + 1) & (kLiveTableSize - 1);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load(&profile.live_chunks_seq, memory_order_relaxed) == seq)
+      return res;
+  }
+}
+
+// Removed chunk marks are reused by new samples, but under churn they pile
+// up and max_probe only grows. Reinserts the live chunks into a clean table
+// and recomputes max_probe.
+static void RehashLiveChunksLocked() {
+  LiveChunk *live = profile.rehash_buffer;
+  uptr n = 0;
+  for (uptr i = 0; i < kLiveTableSize; i++) {
+    uptr v = atomic_load(&profile.live_chunks[i], memory_order_relaxed);
+    if (v == 0 || v == kRemovedChunk)
+      continue;
+    CHECK_LT(n, kMaxLiveSamples);
+    live[n].p = v;
+    live[n].sample = profile.live_samples[i];
+    n++;
+  }
+  u32 seq = atomic_load(&profile.live_chunks_seq, memory_order_relaxed);
+  atomic_store(&profile.live_chunks_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  for (uptr i = 0; i < kLiveTableSize; i++)
+    atomic_store(&profile.live_chunks[i], 0, memory_order_relaxed);
+  atomic_store(&profile.max_probe, 0, memory_order_relaxed);
+  profile.n_removed = 0;
+  for (uptr i = 0; i < n; i++)
+    AddLiveChunkLocked(live[i].p, live[i].sample.site, live[i].sample.weight);
+  atomic_store(&profile.live_chunks_seq, seq + 2, memory_order_release);
+}
+
+static void RecordSample(uptr p, uptr size, const uptr *trace,
+                         uptr trace_size) {
+  uptr weight = SampleWeight(size);
+  u32 stack_id = StackDepotPut(trace, trace_size);
+  SpinMutexLock l(&profile.mtx);
+  uptr site_idx = kSiteTableSize;
+  if (atomic_load(&heap_profile_live_samples, memory_order_relaxed) <
+      kMaxLiveSamples)
+    site_idx = FindOrAddSiteLocked(stack_id);
+  if (site_idx == kSiteTableSize) {
+    profile.dropped_samples++;
+    return;
+  }
+  HeapProfileSite *site = &profile.sites[site_idx];
+  site->live_bytes += weight;
+  site->live_count++;
+  site->peak_bytes = Max(site->peak_bytes, site->live_bytes);
+  site->total_bytes += weight;
+  site->total_count++;
+  profile.live_bytes += weight;
+  profile.peak_bytes = Max(profile.peak_bytes, profile.live_bytes);
+  AddLiveChunkLocked(p, site_idx, weight);
+  atomic_fetch_add(&heap_profile_live_samples, 1, memory_order_relaxed);
+}
+
+void HeapProfileMallocSlow(HeapProfileThreadState *s, uptr p, uptr size,
+                           const uptr *trace, uptr trace_size) {
+  if (!profile.sample_interval) {
+    // Never come back here.
+    s->bytes_until_sample = (uptr)-1;
+    return;
+  }
+  if (!s->rand_state) {
+    // The first allocation in this thread.
+    s->rand_state = (NanoTime() ^ reinterpret_cast<uptr>(s)) | 1;
+    s->bytes_until_sample = NextSampleDistance(s);
+    if (s->bytes_until_sample > size) {
+      s->bytes_until_sample -= size;
+      return;
+    }
+  }
+  s->bytes_until_sample = NextSampleDistance(s);
+  RecordSample(p, size, trace, trace_size);
+}
+
+void HeapProfileFreeSlow(uptr p) {
+  uptr idx = FindLiveChunk(p);
+  if (idx == kLiveTableSize)
+    return;
+  SpinMutexLock l(&profile.mtx);
+  if (atomic_load(&profile.live_chunks[idx], memory_order_relaxed) != p) {
+    // The table has been rehashed since we looked.
+    idx = FindLiveChunk(p);
+    if (idx == kLiveTableSize)
+      return;
+  }
+  LiveSample *sample = &profile.live_samples[idx];
+  HeapProfileSite *site = &profile.sites[sample->site];
+  site->live_bytes -= sample->weight;
+  site->live_count--;
+  profile.live_bytes -= sample->weight;
+  atomic_store(&profile.live_chunks[idx], kRemovedChunk, memory_order_relaxed);
+  atomic_fetch_sub(&heap_profile_live_samples, 1, memory_order_relaxed);
+  if (++profile.n_removed >= kMaxRemovedChunks)
+    RehashLiveChunksLocked();
+}
+
+void HeapProfileGetStats(HeapProfileStats *stats) {
+  SpinMutexLock l(&profile.mtx);
+  stats->live_bytes = profile.live_bytes;
+  stats->peak_bytes = profile.peak_bytes;
+  stats->n_sites = profile.n_sites;
+  stats->dropped_samples = profile.dropped_samples;
+}
+
+static bool CompareSitesByLiveBytes(const HeapProfileSite &a,
+                                    const HeapProfileSite &b) {
+  if (a.live_bytes != b.live_bytes)
+    return a.live_bytes > b.live_bytes;
+  return a.peak_bytes > b.peak_bytes;
+}
+
+// Copies the sites sorted by live bytes to res (of size kMaxSites) and
+// returns their number.
+static uptr GetSortedSites(HeapProfileSite *res, uptr *live_bytes,
+                           uptr *peak_bytes, uptr *dropped_samples) {
+  uptr n = 0;
+  {
+    SpinMutexLock l(&profile.mtx);
+    for (uptr i = 0; i < kSiteTableSize; i++)
+      if (profile.sites[i].total_count)
+        res[n++] = profile.sites[i];
+    *live_bytes = profile.live_bytes;
+    *peak_bytes = profile.peak_bytes;
+    *dropped_samples = profile.dropped_samples;
+  }
+  InternalSort(&res, n, CompareSitesByLiveBytes);
+  return n;
+}
+
+void HeapProfilePrint(uptr max_sites) {
+  if (!profile.sample_interval) {
+    Printf("Heap profile is disabled, set heap_profile_sample_interval "
+           "to enable it.\n");
+    return;
+  }
+  InternalScopedBuffer<HeapProfileSite> sites(kMaxSites);
+  uptr live_bytes, peak_bytes, dropped_samples;
+  uptr n = GetSortedSites(sites.data(), &live_bytes, &peak_bytes,
+                          &dropped_samples);
+  Printf("Heap profile: %zd bytes live, peak %zd bytes (estimated from 1 "
+         "sample per %zd bytes allocated, %zd samples dropped)\n",
+         live_bytes, peak_bytes, profile.sample_interval, dropped_samples);
+  for (uptr i = 0; i < n && (!max_sites || i < max_sites); i++) {
+    HeapProfileSite *site = &sites[i];
+    Printf("%zd bytes in %zd sampled allocations live (peak %zd bytes, %zd "
+           "bytes in %zd sampled allocations in total) from:\n",
+           site->live_bytes, site->live_count, site->peak_bytes,
+           site->total_bytes, site->total_count);
+    uptr trace[kStackTraceMax];
+    uptr size = StackDepotGet(site->stack_id, trace, kStackTraceMax);
+    uptr n = StackTrace::PrintStack(trace, size, common_flags()->symbolize,
+                                    common_flags()->strip_path_prefix, 0);
+    PrintDeepStackTail(site->stack_id, n, common_flags()->symbolize,
+                       common_flags()->strip_path_prefix, 0);
+  }
+}
+
+static bool WriteString(fd_t fd, const char *s) {
+  uptr length = internal_strlen(s);
+  return internal_write(fd, s, length) == length;
+}
+
+// Format: a header line, then one line per allocation site:
+// <live bytes> <live samples> <peak bytes> <total bytes> <total samples> @
+// <pc> <pc> ...
+bool HeapProfileDump(const char *path) {
+  if (!profile.sample_interval)
+    return false;
+  InternalScopedBuffer<char> file_name(4096);
+  internal_snprintf(file_name.data(), file_name.size(), "%s.%d", path,
+                    internal_getpid());
+  uptr openrv = OpenFile(file_name.data(), true);
+  if (internal_iserror(openrv)) {
+    Report("ERROR: Can't open file: %s\n", file_name.data());
+    return false;
+  }
+  fd_t fd = openrv;
+  InternalScopedBuffer<HeapProfileSite> sites(kMaxSites);
+  uptr live_bytes, peak_bytes, dropped_samples;
+  uptr n = GetSortedSites(sites.data(), &live_bytes, &peak_bytes,
+                          &dropped_samples);
+  InternalScopedBuffer<char> line(256);
+  internal_snprintf(line.data(), line.size(),
+                    "heap profile: sample_interval=%zd live_bytes=%zd "
+                    "peak_bytes=%zd dropped_samples=%zd\n",
+                    profile.sample_interval, live_bytes, peak_bytes,
+                    dropped_samples);
+  bool ok = WriteString(fd, line.data());
+  for (uptr i = 0; i < n && ok; i++) {
+    HeapProfileSite *site = &sites[i];
+    internal_snprintf(line.data(), line.size(), "%zd %zd %zd %zd %zd @",
+                      site->live_bytes, site->live_count, site->peak_bytes,
+                      site->total_bytes, site->total_count);
+    ok = WriteString(fd, line.data());
+    uptr trace[kStackTraceMax];
+    uptr size = StackDepotGet(site->stack_id, trace, kStackTraceMax);
+    for (uptr j = 0; j < size && ok; j++) {
+      internal_snprintf(line.data(), line.size(), " 0x%zx", trace[j]);
+      ok = WriteString(fd, line.data());
+    }
+    ok = ok && WriteString(fd, "\n");
+  }
+  internal_close(fd);
+  return ok;
+}
+
+}  // namespace __sanitizer
+
+using namespace __sanitizer;  // NOLINT
+
+extern "C" {
+void __sanitizer_print_heap_profile(uptr max_sites) {
+  HeapProfilePrint(max_sites);
+}
+
+int __sanitizer_dump_heap_profile(const char *path) {
+  return HeapProfileDump(path);
+}
+}  // extern "C"
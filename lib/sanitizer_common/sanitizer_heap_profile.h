@@ -0,0 +1,82 @@
+//===-- sanitizer_heap_profile.h --------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Sampling heap profiler shared between sanitizer run-time libraries.
+//
+// The tool reports every allocation and deallocation to the profiler. On
+// average one allocation per sample_interval allocated bytes is sampled: the
+// distances between samples (in bytes) are exponentially distributed, so
+// every allocated byte has the same chance to be sampled. A sampled chunk of
+// size S stands for S / (1 - exp(-S / sample_interval)) bytes, which makes
+// the per-stack sums unbiased estimates of the real numbers.
+//===----------------------------------------------------------------------===//
+#ifndef SANITIZER_HEAP_PROFILE_H
+#define SANITIZER_HEAP_PROFILE_H
+
+#include "sanitizer_atomic.h"
+#include "sanitizer_internal_defs.h"
+
+namespace __sanitizer {
+
+// Per-thread state of the sampler. Zero-initialized state is valid.
+struct HeapProfileThreadState {
+  uptr bytes_until_sample;
+  u64 rand_state;
+};
+
+// Enables the profiler if sample_interval is not zero. Must be called
+// before the first call to HeapProfileMalloc.
+void HeapProfileInit(uptr sample_interval);
+bool HeapProfileEnabled();
+
+void HeapProfileMallocSlow(HeapProfileThreadState *s, uptr p, uptr size,
+                           const uptr *trace, uptr trace_size);
+void HeapProfileFreeSlow(uptr p);
+
+// Number of sampled chunks which are not freed yet.
+extern atomic_uintptr_t heap_profile_live_samples;
+
+// Called by the tool after allocating a chunk at p. The stack trace is put
+// into the stack depot only if the chunk is sampled.
+INLINE void HeapProfileMalloc(HeapProfileThreadState *s, uptr p, uptr size,
+                              const uptr *trace, uptr trace_size) {
+  if (LIKELY(s->bytes_until_sample > size)) {
+    s->bytes_until_sample -= size;
+    return;
+  }
+  HeapProfileMallocSlow(s, p, size, trace, trace_size);
+}
+
+// Called by the tool when the chunk at p is freed by the user.
+INLINE void HeapProfileFree(uptr p) {
+  if (LIKELY(atomic_load(&heap_profile_live_samples,
+                         memory_order_relaxed) == 0))
+    return;
+  HeapProfileFreeSlow(p);
+}
+
+struct HeapProfileStats {
+  uptr live_bytes;
+  uptr peak_bytes;
+  uptr n_sites;
+  // Samples not recorded because the profiler tables are full.
+  uptr dropped_samples;
+};
+
+void HeapProfileGetStats(HeapProfileStats *stats);
+
+// Prints up to max_sites (all if 0) allocation stacks holding the most live
+// memory.
+void HeapProfilePrint(uptr max_sites);
+// Writes the profile with unsymbolized stacks to "path.<pid>".
+bool HeapProfileDump(const char *path);
+
+}  // namespace __sanitizer
+
+#endif  // SANITIZER_HEAP_PROFILE_H
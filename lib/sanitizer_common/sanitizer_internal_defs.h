@@ -101,6 +101,21 @@ extern "C" {
   // the error message. This function can be overridden by the client.
   void __sanitizer_report_error_summary(const char *error_summary)
       SANITIZER_WEAK_ATTRIBUTE SANITIZER_INTERFACE_ATTRIBUTE;
+
+  // Prints up to max_sites (all if 0) allocation stacks holding the most
+  // live heap memory, as estimated by the sampling heap profiler.
+  void __sanitizer_print_heap_profile(__sanitizer::uptr max_sites)
+      SANITIZER_INTERFACE_ATTRIBUTE;
+
+  // Writes the heap profile with unsymbolized stacks to "path.<pid>".
+  // Returns 0 if the profiler is disabled or the file can't be written.
+  int __sanitizer_dump_heap_profile(const char *path)
+      SANITIZER_INTERFACE_ATTRIBUTE;
+
+  // Writes the stack depot and the list of loaded modules to "path.<pid>",
+  // for offline symbolization. Returns 0 if the file can't be written.
+  int __sanitizer_dump_stack_depot(const char *path)
+      SANITIZER_INTERFACE_ATTRIBUTE;
 }  // extern "C"
 
 
@@ -152,6 +167,14 @@ using namespace __sanitizer;  // NOLINT
 # endif
 #endif  // _MSC_VER
 
+// THREADLOCAL is not supported on some of the platforms we care about
+// (OSX 10.6, Android), so common code may use it only where this is 1.
+#if SANITIZER_LINUX && !SANITIZER_ANDROID
+# define SANITIZER_CAN_USE_THREADLOCAL 1
+#else
+# define SANITIZER_CAN_USE_THREADLOCAL 0
+#endif
+
 // Unaligned versions of basic types.
 typedef ALIGNED(1) u16 uu16;
 typedef ALIGNED(1) u32 uu32;
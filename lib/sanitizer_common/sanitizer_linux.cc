@@ -215,6 +215,13 @@ uptr GetTid() {
   return internal_syscall(__NR_gettid);
 }
 
+uptr GetCurrentCPU() {
+  unsigned cpu = 0;
+  if (internal_iserror(internal_syscall(__NR_getcpu, &cpu, 0, 0)))
+    return 0;
+  return cpu;
+}
+
 u64 NanoTime() {
   kernel_timeval tv = {};
   internal_syscall(__NR_gettimeofday, &tv, 0);
@@ -551,6 +558,46 @@ uptr internal_sigaltstack(const struct sigaltstack *ss,
   return internal_syscall(__NR_sigaltstack, ss, oss);
 }
 
+#ifdef __x86_64__
+uptr internal_clone(int (*fn)(void *), void *child_stack, int flags,
+                    void *arg) {
+  if (!fn || !child_stack)
+    return -EINVAL;
+  CHECK_EQ(0, (uptr)child_stack % 16);
+  // The child pops fn and arg from its new stack.
+  child_stack = (char *)child_stack - 2 * sizeof(u64);
+  ((u64 *)child_stack)[0] = (uptr)fn;
+  ((u64 *)child_stack)[1] = (uptr)arg;
+  u64 res;
+  asm volatile(
+      // %rax = syscall(%rax = __NR_clone, %rdi = flags, %rsi = child_stack,
+      //                %rdx = parent_tid = 0, %r10 = child_tid = 0,
+      //                %r8 = tls = 0)
+      "xorq   %%rdx, %%rdx\n"
+      "xorq   %%r10, %%r10\n"
+      "xorq   %%r8, %%r8\n"
+      "syscall\n"
+      // The parent returns.
+      "testq  %%rax, %%rax\n"
+      "jnz    1f\n"
+      // The child terminates the frame chain and calls fn(arg) ...
+      "xorq   %%rbp, %%rbp\n"
+      "popq   %%rax\n"
+      "popq   %%rdi\n"
+      "call   *%%rax\n"
+      // ... and exits with its return value, without touching libc.
+      "movq   %%rax, %%rdi\n"
+      "movq   %2, %%rax\n"
+      "syscall\n"
+      "1:\n"
+      : "=a"(res)
+      : "a"((u64)__NR_clone), "i"(__NR_exit), "S"(child_stack),
+        "D"((u64)flags)
+      : "rcx", "rdx", "r8", "r10", "r11", "memory");
+  return res;
+}
+#endif  // __x86_64__
+
 // ThreadLister implementation.
 ThreadLister::ThreadLister(int pid)
   : pid_(pid),
@@ -29,6 +29,13 @@ uptr internal_getdents(fd_t fd, struct linux_dirent *dirp, unsigned int count);
 uptr internal_prctl(int option, uptr arg2, uptr arg3, uptr arg4, uptr arg5);
 uptr internal_sigaltstack(const struct sigaltstack* ss,
                           struct sigaltstack* oss);
+#ifdef __x86_64__
+// Runs fn(arg) in a new task on child_stack, which must be 16-byte aligned,
+// and exits the task with its return value. Unlike clone() from libc, this
+// can be called when libc must not be used, e.g. in the StopTheWorld tracer.
+uptr internal_clone(int (*fn)(void *), void *child_stack, int flags,
+                    void *arg);
+#endif
 
 // This class reads thread IDs from /proc/<pid>/task using only syscalls.
 class ThreadLister {
@@ -16,6 +16,7 @@
 #if SANITIZER_LINUX
 
 #include "sanitizer_common.h"
+#include "sanitizer_flags.h"
 #include "sanitizer_procmaps.h"
 #include "sanitizer_stacktrace.h"
 
@@ -147,10 +148,20 @@ static bool MatchPc(uptr cur_pc, uptr trace_pc) {
 }
 
 void StackTrace::SlowUnwindStack(uptr pc, uptr max_depth) {
+  // Up to that many frames of the unwinder itself are popped below.
+  static const uptr kMaxPoppedFrames = 5;
   this->size = 0;
-  this->max_size = max_depth;
+  // Unwind the frames to be popped in addition to max_depth.
+  this->max_size = Min(max_depth + kMaxPoppedFrames, kStackTraceMax);
   if (max_depth > 1) {
+#if SANITIZER_CAN_EH_FRAME_UNWIND
+    if (!common_flags()->eh_frame_unwind || !EhFrameUnwindStack(max_size)) {
+      this->size = 0;
+      _Unwind_Backtrace(Unwind_Trace, this);
+    }
+#else
     _Unwind_Backtrace(Unwind_Trace, this);
+#endif
     // We need to pop a few frames so that pc is on top.
     // trace[0] belongs to the current function so we always pop it.
     int to_pop = 1;
@@ -160,7 +171,10 @@ void StackTrace::SlowUnwindStack(uptr pc, uptr max_depth) {
     else if (size > 4 && MatchPc(pc, trace[4])) to_pop = 4;
     else if (size > 5 && MatchPc(pc, trace[5])) to_pop = 5;
     this->PopStackFrames(to_pop);
+    if (size > max_depth)
+      size = max_depth;
   }
+  this->max_size = max_depth;
   this->trace[0] = pc;
 }
 
@@ -132,6 +132,10 @@ uptr GetTid() {
   return reinterpret_cast<uptr>(pthread_self());
 }
 
+uptr GetCurrentCPU() {
+  return 0;
+}
+
 void GetThreadStackTopAndBottom(bool at_initialization, uptr *stack_top,
                                 uptr *stack_bottom) {
   CHECK(stack_top);
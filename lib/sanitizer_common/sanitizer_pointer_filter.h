@@ -0,0 +1,111 @@
+//===-- sanitizer_pointer_filter.h ------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is shared between sanitizer run-time libraries.
+// Quick filter of the words which may point into the heap, used by the leak
+// checker to skip the words of the scanned memory several at a time.
+//===----------------------------------------------------------------------===//
+#ifndef SANITIZER_POINTER_FILTER_H
+#define SANITIZER_POINTER_FILTER_H
+
+#include "sanitizer_common.h"
+#include "sanitizer_internal_defs.h"
+
+namespace __sanitizer {
+
+// Covers each of two address ranges (e.g. the ones returned by
+// CombinedAllocator::GetAddressRangesLocked) with an aligned power-of-two
+// block, so that a word is tested with an AND and a compare per range, and
+// several words are tested at once with vector instructions. The filter may
+// pass words outside of the ranges. Zero-initialized, it passes every word.
+class PointerFilter {
+ public:
+  // An empty range is ignored; if both are empty, only 0 passes.
+  void Init(uptr beg0, uptr end0, uptr beg1, uptr end1) {
+    if (beg0 == end0) {
+      beg0 = beg1;
+      end0 = end1;
+    }
+    if (beg1 == end1) {
+      beg1 = beg0;
+      end1 = end0;
+    }
+    SetBlock(0, beg0, end0);
+    SetBlock(1, beg1, end1);
+  }
+
+  bool MayBeHeapPointer(uptr p) const {
+    return (p & mask_[0]) == base_[0] || (p & mask_[1]) == base_[1];
+  }
+
+  // Returns the address of the first word in [beg, end) which passes the
+  // filter, or an address past end - sizeof(uptr) if there are none. beg
+  // must be aligned to sizeof(uptr).
+  uptr FindCandidate(uptr beg, uptr end) const {
+    uptr p = beg;
+#if defined(__GNUC__) && SANITIZER_WORDSIZE == 64
+    // Two words at a time in SSE2 registers, unrolled twice.
+    Words mask0, base0, mask1, base1, zero;
+    for (uptr i = 0; i < 2; i++) {
+      mask0[i] = mask_[0];
+      base0[i] = base_[0];
+      mask1[i] = mask_[1];
+      base1[i] = base_[1];
+      zero[i] = 0;
+    }
+    for (; p + 2 * sizeof(Words) <= end; p += 2 * sizeof(Words)) {
+      Words w0 = *reinterpret_cast<const WordAlignedWords *>(p);
+      Words w1 = *reinterpret_cast<const WordAlignedWords *>(p + sizeof(w0));
+      Words hit = Hits(w0, mask0, base0, zero) | Hits(w0, mask1, base1, zero) |
+                  Hits(w1, mask0, base0, zero) | Hits(w1, mask1, base1, zero);
+      if (hit[0] | hit[1])
+        break;
+    }
+#endif
+    for (; p + sizeof(uptr) <= end; p += sizeof(uptr)) {
+      if (MayBeHeapPointer(*reinterpret_cast<uptr *>(p)))
+        break;
+    }
+    return p;
+  }
+
+ private:
+#if defined(__GNUC__) && SANITIZER_WORDSIZE == 64
+  typedef u64 Words __attribute__((vector_size(16)));
+  typedef u64 WordAlignedWords __attribute__((vector_size(16), aligned(8)));
+  typedef u32 Halves __attribute__((vector_size(16)));
+
+  // Returns non-zero in the words which are in the block. SSE2 can't compare
+  // 64-bit words, so the 32-bit halves are compared, which gives -1 where
+  // they are equal, and the results for the halves are ANDed.
+  static Words Hits(Words w, Words mask, Words base, Words zero) {
+    Words eq = (Words)((Halves)((w & mask) ^ base) == (Halves)zero);
+    return eq & (eq >> 32);
+  }
+#endif
+
+  void SetBlock(uptr i, uptr beg, uptr end) {
+    if (beg == end) {
+      mask_[i] = ~(uptr)0;
+      base_[i] = 0;
+      return;
+    }
+    uptr diff = beg ^ (end - 1);
+    uptr bits = diff ? MostSignificantSetBitIndex(diff) + 1 : 0;
+    mask_[i] = bits == SANITIZER_WORDSIZE ? 0 : ~(uptr)0 << bits;
+    base_[i] = beg & mask_[i];
+  }
+
+  uptr mask_[2];
+  uptr base_[2];
+};
+
+}  // namespace __sanitizer
+
+#endif  // SANITIZER_POINTER_FILTER_H
@@ -41,6 +41,10 @@ void FlushUnneededShadowMemory(uptr addr, uptr size) {
   madvise((void*)addr, size, MADV_DONTNEED);
 }
 
+void ReleaseMemoryToOS(uptr addr, uptr size) {
+  madvise((void*)addr, size, MADV_DONTNEED);
+}
+
 void DisableCoreDumper() {
   struct rlimit nocore;
   nocore.rlim_cur = 0;
@@ -12,6 +12,16 @@
 // then evicts to global FIFO queue. When the queue reaches specified threshold,
 // oldest memory is recycled.
 //
+// The global queue is split into shards, each one a FIFO queue with its own
+// lock, so that threads evicting their caches and recycling memory do not
+// serialize on a single mutex.
+//
+// The tool may tag the memory blocks with a size class. Per-thread caches
+// keep blocks of different classes in different batches, and every batch is
+// recycled with a single callback call, so that the tool can return it to
+// the allocator in bulk. A cache has only a few batches open; the blocks of
+// a class which finds its batch slot taken go to a batch of class 0 (mixed).
+//
 //===----------------------------------------------------------------------===//
 
 #ifndef SANITIZER_QUARANTINE_H
@@ -30,11 +40,13 @@ struct QuarantineBatch {
   QuarantineBatch *next;
   uptr size;
   uptr count;
+  uptr class_id;  // All blocks in the batch have been put with this class.
+  u64 seq;  // When the batch got into the global queue; 0 before that.
   void *batch[kSize];
 };
 
 // The callback interface is:
-// void Callback::Recycle(Node *ptr);
+// void Callback::Recycle(Node **ptrs, uptr count, uptr class_id);
 // void *cb.Allocate(uptr size);
 // void cb.Deallocate(void *ptr);
 template<typename Callback, typename Node>
@@ -42,8 +54,7 @@ class Quarantine {
  public:
   typedef QuarantineCache<Callback> Cache;
 
-  explicit Quarantine(LinkerInitialized)
-      : cache_(LINKER_INITIALIZED) {
+  explicit Quarantine(LinkerInitialized) {
   }
 
   void Init(uptr size, uptr cache_size) {
@@ -52,55 +63,115 @@ class Quarantine {
     max_cache_size_ = cache_size;
   }
 
-  void Put(Cache *c, Callback cb, Node *ptr, uptr size) {
-    c->Enqueue(cb, ptr, size);
+  void Put(Cache *c, Callback cb, Node *ptr, uptr size, uptr class_id = 0) {
+    c->Enqueue(cb, ptr, size, class_id);
     if (c->Size() > max_cache_size_)
       Drain(c, cb);
   }
 
+  // Moves the contents of c to the shard c hashes to, or to any other shard
+  // if that one is busy. Batches are stamped with a global sequence number,
+  // which keeps the whole quarantine approximately FIFO: recycling always
+  // takes the oldest batch of all shards. The thread which pushed the
+  // quarantine over its limit recycles no more than a few times what it has
+  // added, so that the recycling work is spread between the threads and
+  // done in parallel.
   void NOINLINE Drain(Cache *c, Callback cb) {
-    {
-      SpinMutexLock l(&cache_mutex_);
-      cache_.Transfer(c);
-    }
-    if (cache_.Size() > max_size_ && recycle_mutex_.TryLock())
-      Recycle(cb);
+    uptr size = c->Size();
+    Shard *s = LockShard(c);
+    u64 seq = atomic_fetch_add(&seq_, 1, memory_order_relaxed) + 1;
+    s->cache.Transfer(c, seq);
+    UpdateOldest(s);
+    // Under the shard mutex, so that nobody can recycle the batches and
+    // subtract their size before it is added.
+    uptr new_size = atomic_fetch_add(&size_, size, memory_order_relaxed) + size;
+    s->mutex.Unlock();
+    if (new_size > max_size_)
+      Recycle(cb, kMaxRecycleFactor *
+                      (size > max_cache_size_ ? size : max_cache_size_));
+  }
+
+  uptr GetSize() const {
+    return atomic_load(&size_, memory_order_relaxed);
   }
 
  private:
+  static const uptr kNumShards = 16;
+  static const uptr kMaxRecycleFactor = 4;
+
+  struct Shard {
+    Shard() : cache(LINKER_INITIALIZED) {}
+    StaticSpinMutex mutex;
+    // seq of the first batch in the shard, 0 if it's empty.
+    atomic_uint64_t oldest;
+    Cache cache;
+    char pad[kCacheLineSize];
+  };
+
   // Read-only data.
   char pad0_[kCacheLineSize];
   uptr max_size_;
   uptr min_size_;
   uptr max_cache_size_;
   char pad1_[kCacheLineSize];
-  SpinMutex cache_mutex_;
-  SpinMutex recycle_mutex_;
-  Cache cache_;
+  atomic_uintptr_t size_;
+  atomic_uint64_t seq_;
   char pad2_[kCacheLineSize];
+  Shard shards_[kNumShards];
 
-  void NOINLINE Recycle(Callback cb) {
-    Cache tmp;
-    {
-      SpinMutexLock l(&cache_mutex_);
-      while (cache_.Size() > min_size_) {
-        QuarantineBatch *b = cache_.DequeueBatch();
-        tmp.EnqueueBatch(b);
+  Shard *LockShard(Cache *c) {
+    uptr idx = ((u64)reinterpret_cast<uptr>(c) * 0x9E3779B97F4A7C15ULL) >> 32;
+    for (uptr i = 0; i < kNumShards; i++) {
+      Shard *s = &shards_[(idx + i) % kNumShards];
+      if (s->mutex.TryLock())
+        return s;
+    }
+    Shard *s = &shards_[idx % kNumShards];
+    s->mutex.Lock();
+    return s;
+  }
+
+  static void UpdateOldest(Shard *s) {
+    atomic_store(&s->oldest, s->cache.OldestSeq(), memory_order_relaxed);
+  }
+
+  // Returns the shard with the oldest first batch, or 0 if all are empty.
+  Shard *OldestShard() {
+    Shard *res = 0;
+    u64 res_seq = 0;
+    for (uptr i = 0; i < kNumShards; i++) {
+      u64 seq = atomic_load(&shards_[i].oldest, memory_order_relaxed);
+      if (seq && (!res || seq < res_seq)) {
+        res = &shards_[i];
+        res_seq = seq;
       }
     }
-    recycle_mutex_.Unlock();
+    return res;
+  }
+
+  void NOINLINE Recycle(Callback cb, uptr max_recycle) {
+    Cache tmp;
+    uptr recycled = 0;
+    while (recycled < max_recycle &&
+           atomic_load(&size_, memory_order_relaxed) > min_size_) {
+      Shard *s = OldestShard();
+      if (!s)
+        break;
+      SpinMutexLock l(&s->mutex);
+      QuarantineBatch *b = s->cache.DequeueBatch();
+      UpdateOldest(s);
+      if (!b)
+        continue;
+      atomic_fetch_sub(&size_, b->size, memory_order_relaxed);
+      recycled += b->size;
+      tmp.EnqueueBatch(b);
+    }
     DoRecycle(&tmp, cb);
   }
 
   void NOINLINE DoRecycle(Cache *c, Callback cb) {
     while (QuarantineBatch *b = c->DequeueBatch()) {
-      const uptr kPrefetch = 16;
-      for (uptr i = 0; i < kPrefetch; i++)
-        PREFETCH(b->batch[i]);
-      for (uptr i = 0; i < b->count; i++) {
-        PREFETCH(b->batch[i + kPrefetch]);
-        cb.Recycle((Node*)b->batch[i]);
-      }
+      cb.Recycle((Node**)b->batch, b->count, b->class_id);
       cb.Deallocate(b);
     }
   }
@@ -116,27 +187,51 @@ class QuarantineCache {
   QuarantineCache()
       : size_() {
     list_.clear();
+    for (uptr i = 0; i < kNumOpenBatches; i++)
+      open_[i] = 0;
   }
 
   uptr Size() const {
     return atomic_load(&size_, memory_order_relaxed);
   }
 
-  void Enqueue(Callback cb, void *ptr, uptr size) {
-    if (list_.empty() || list_.back()->count == QuarantineBatch::kSize)
-      AllocBatch(cb);
-    QuarantineBatch *b = list_.back();
+  // Blocks are added to the open batch of their class. A batch is closed
+  // only when it gets full; until then the blocks of the other classes which
+  // map to its slot go to the mixed batch, open_[0].
+  void Enqueue(Callback cb, void *ptr, uptr size, uptr class_id) {
+    QuarantineBatch **open =
+        &open_[class_id ? 1 + class_id % (kNumOpenBatches - 1) : 0];
+    if (*open && (*open)->class_id != class_id &&
+        (*open)->count != QuarantineBatch::kSize) {
+      class_id = 0;
+      open = &open_[0];
+    }
+    QuarantineBatch *b = *open;
+    if (UNLIKELY(!b || b->count == QuarantineBatch::kSize))
+      b = *open = AllocBatch(cb, class_id);
     b->batch[b->count++] = ptr;
     b->size += size;
     SizeAdd(size);
   }
 
-  void Transfer(QuarantineCache *c) {
+  // Moves all batches of c, including the open ones, to the end of this
+  // cache, setting their seq.
+  void Transfer(QuarantineCache *c, u64 seq) {
+    for (uptr i = 0; i < kNumOpenBatches; i++)
+      c->open_[i] = 0;
+    if (!c->list_.empty()) {
+      for (QuarantineBatch *b = c->list_.front(); b; b = b->next)
+        b->seq = seq;
+    }
     list_.append_back(&c->list_);
     SizeAdd(c->Size());
     atomic_store(&c->size_, 0, memory_order_relaxed);
   }
 
+  u64 OldestSeq() {
+    return list_.empty() ? 0 : list_.front()->seq;
+  }
+
   void EnqueueBatch(QuarantineBatch *b) {
     list_.push_back(b);
     SizeAdd(b->size);
@@ -154,17 +249,22 @@ class QuarantineCache {
   }
 
  private:
+  static const uptr kNumOpenBatches = 8;
   IntrusiveList<QuarantineBatch> list_;
   atomic_uintptr_t size_;
+  // Batches blocks are still being added to. They are in list_ as well.
+  QuarantineBatch *open_[kNumOpenBatches];
 
   void SizeAdd(uptr add) {
     atomic_store(&size_, Size() + add, memory_order_relaxed);
   }
 
-  NOINLINE QuarantineBatch* AllocBatch(Callback cb) {
+  NOINLINE QuarantineBatch* AllocBatch(Callback cb, uptr class_id) {
     QuarantineBatch *b = (QuarantineBatch *)cb.Allocate(sizeof(*b));
     b->count = 0;
     b->size = 0;
+    b->class_id = class_id;
+    b->seq = 0;
     list_.push_back(b);
     return b;
   }
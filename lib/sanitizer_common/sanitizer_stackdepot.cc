@@ -19,53 +19,119 @@
 
 namespace __sanitizer {
 
-const int kTabSize = 1024 * 1024;  // Hash table size.
-const int kPartBits = 8;
-const int kPartShift = sizeof(u32) * 8 - kPartBits - 1;
-const int kPartCount = 1 << kPartBits;  // Number of subparts in the table.
-const int kPartSize = kTabSize / kPartCount;
-const int kMaxId = 1 << kPartShift;
+// The hash table of StackDesc's. It starts small and is replaced by a twice
+// larger one when it holds more stacks than buckets. Ids are assigned
+// sequentially, and a two-level id map finds the StackDesc by its id.
+const uptr kInitialTabSize = 1 << 16;
+const uptr kMaxTabSize = 1 << 22;
+// A bucket of a table which has been replaced. It has the lock bit set.
+const uptr kMovedBucket = 3;
+// Ids of the trie backend (see below) have this bit set.
+const u32 kTrieIdBit = 1u << 30;
+const u32 kMaxId = kTrieIdBit;
+const uptr kIdMapL2Size = 1 << 16;
+const uptr kIdMapL1Size = kMaxId / kIdMapL2Size;
+// Per-thread cache of recently put stacks. Without THREADLOCAL the puts go
+// straight to the depot.
+const uptr kCacheSize = 256;
+// How often a thread adds its cache hit counters to the global ones.
+const u32 kCacheStatsPeriod = 1024;
 
 struct StackDesc {
   StackDesc *link;
   u32 id;
   u32 hash;
-  uptr size;
-  uptr stack[1];  // [size]
+  u32 size;  // Number of frames.
+  u32 data_size;
+  // Encoded frames, see encodeStack. The data is word-aligned and padded
+  // with zeros to a whole word, so that it's compared a word at a time.
+  u8 data[1];
+};
+
+const uptr kDescHeaderSize = sizeof(StackDesc*) + 4 * sizeof(u32);
+COMPILER_CHECK(kDescHeaderSize % sizeof(uptr) == 0);
+
+struct StackTable {
+  uptr size;  // Power of two.
+  atomic_uintptr_t tab[1];  // [size]
 };
 
 static struct {
   StaticSpinMutex mtx;  // Protects alloc of new blocks for region allocator.
   atomic_uintptr_t region_pos;  // Region allocator for StackDesc's.
   atomic_uintptr_t region_end;
-  atomic_uintptr_t tab[kTabSize];  // Hash table of StackDesc's.
-  atomic_uint32_t seq[kPartCount];  // Unique id generators.
+  StaticSpinMutex table_mtx;  // Protects table replacement.
+  atomic_uintptr_t table;  // Current StackTable.
+  atomic_uint32_t seq;  // Unique id generator.
+  StaticSpinMutex id_map_mtx;  // Protects alloc of the id map blocks.
+  atomic_uintptr_t id_map[kIdMapL1Size];  // Maps id to StackDesc.
+  atomic_uint8_t use_trie;
+  atomic_uintptr_t mapped;
+  atomic_uintptr_t cache_hits;
+  atomic_uintptr_t cache_misses;
+  StaticSpinMutex deep_links_mtx;  // Protects alloc of the deep links table.
+  atomic_uintptr_t deep_links;  // Current DeepLinkTable.
 } depot;
 
+struct StackDepotCache {
+  // Indexed by the stack hash. Holds either a StackDesc pointer, or a trie
+  // id shifted left by one with the low bit set.
+  uptr entries[kCacheSize];
+  // Not yet added to depot.cache_hits/cache_misses.
+  u32 hits;
+  u32 misses;
+};
+
+#if SANITIZER_CAN_USE_THREADLOCAL
+static THREADLOCAL StackDepotCache cache;
+#endif
+
+static uptr trieSize();
+
 static StackDepotStats stats;
 
 StackDepotStats *StackDepotGetStats() {
+  stats.n_uniq_ids = atomic_load(&depot.seq, memory_order_relaxed) +
+                     trieSize();
+  stats.mapped = atomic_load(&depot.mapped, memory_order_relaxed);
+  stats.cache_hits = atomic_load(&depot.cache_hits, memory_order_relaxed);
+  stats.cache_misses = atomic_load(&depot.cache_misses, memory_order_relaxed);
   return &stats;
 }
 
+static void *mapDepot(uptr size) {
+  void *res = MmapOrDie(size, "stack depot");
+  atomic_fetch_add(&depot.mapped, size, memory_order_relaxed);
+  return res;
+}
+
+static u64 hashMix(u64 h, u64 k) {
+  h = (h ^ k) * 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 32);
+}
+
+// Hashes the full frames in four independent lanes with one multiplication
+// per frame, so that the multiplications for consecutive frames overlap
+// instead of forming one long dependency chain.
 static u32 hash(const uptr *stack, uptr size) {
-  // murmur2
-  const u32 m = 0x5bd1e995;
-  const u32 seed = 0x9747b28c;
-  const u32 r = 24;
-  u32 h = seed ^ (size * sizeof(uptr));
-  for (uptr i = 0; i < size; i++) {
-    u32 k = stack[i];
-    k *= m;
-    k ^= k >> r;
-    k *= m;
-    h *= m;
-    h ^= k;
+  u64 h0 = 0x9747b28c ^ size;
+  u64 h1 = h0 + 1;
+  u64 h2 = h0 + 2;
+  u64 h3 = h0 + 3;
+  uptr i = 0;
+  for (; i + 4 <= size; i += 4) {
+    h0 = hashMix(h0, stack[i]);
+    h1 = hashMix(h1, stack[i + 1]);
+    h2 = hashMix(h2, stack[i + 2]);
+    h3 = hashMix(h3, stack[i + 3]);
   }
-  h ^= h >> 13;
-  h *= m;
-  h ^= h >> 15;
-  return h;
+  for (; i < size; i++)
+    h0 = hashMix(h0, stack[i]);
+  u64 h = hashMix(hashMix(hashMix(h0, h1), h2), h3);
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+  return (u32)h;
 }
 
 static StackDesc *tryallocDesc(uptr memsz) {
@@ -82,9 +148,103 @@ static StackDesc *tryallocDesc(uptr memsz) {
   }
 }
 
-static StackDesc *allocDesc(uptr size) {
-  // First, try to allocate optimisitically.
-  uptr memsz = sizeof(StackDesc) + (size - 1) * sizeof(uptr);
+// Frames are stored as differences from the previous frame (the first one
+// from 0), zigzag-encoded into LEB128 varints. Return addresses within a
+// module are close to each other, so most frames take 2-4 bytes instead of
+// sizeof(uptr).
+static uptr zigzag(uptr delta) {
+  return (delta << 1) ^ (uptr)((sptr)delta >> (SANITIZER_WORDSIZE - 1));
+}
+
+static uptr encodedSize(const uptr *stack, uptr size) {
+  uptr res = 0;
+  uptr prev = 0;
+  for (uptr i = 0; i < size; i++) {
+    uptr v = zigzag(stack[i] - prev);
+    prev = stack[i];
+    do {
+      res++;
+      v >>= 7;
+    } while (v);
+  }
+  return res;
+}
+
+// Returns the number of bytes written.
+static uptr encodeStack(u8 *data, const uptr *stack, uptr size) {
+  u8 *p = data;
+  uptr prev = 0;
+  for (uptr i = 0; i < size; i++) {
+    uptr v = zigzag(stack[i] - prev);
+    prev = stack[i];
+    // Fast path for the common one and two byte frames.
+    if (v < 0x80) {
+      *p++ = (u8)v;
+      continue;
+    }
+    if (v < 0x4000) {
+      p[0] = (u8)(v | 0x80);
+      p[1] = (u8)(v >> 7);
+      p += 2;
+      continue;
+    }
+    while (v >= 0x80) {
+      *p++ = (u8)(v | 0x80);
+      v >>= 7;
+    }
+    *p++ = (u8)v;
+  }
+  return p - data;
+}
+
+// Upper bound of the encoded size of a frame.
+const uptr kMaxFrameBytes = (sizeof(uptr) * 8 + 6) / 7;
+// Stacks up to this size are encoded on the stack of the caller for lookup.
+const uptr kMaxKeyWords = 256;
+
+// A stack being looked up in the depot. Before a search of the hash table
+// it is encoded once, and then compared with the stored stacks a word at a
+// time. Otherwise (a check of the per-thread cache, or a stack too large for
+// the buffer) it is compared by decoding the stored stacks.
+struct StackKey {
+  const uptr *stack;
+  uptr size;
+  u32 hash;
+  uptr data_size;
+  uptr *data;  // Zero-padded to a whole word, or 0.
+
+  StackKey(const uptr *stack, uptr size, u32 hash)
+      : stack(stack), size(size), hash(hash), data_size(0), data(0) {}
+
+  // buf must hold kMaxKeyWords words.
+  void Encode(uptr *buf) {
+    if (size * kMaxFrameBytes > kMaxKeyWords * sizeof(uptr))
+      return;
+    data = buf;
+    data_size = encodeStack((u8*)data, stack, size);
+    for (uptr i = data_size; i % sizeof(uptr); i++)
+      ((u8*)data)[i] = 0;
+  }
+};
+
+// Reads the frame following prev and advances *data past it.
+static uptr decodeFrame(const u8 **data, uptr prev) {
+  const u8 *p = *data;
+  uptr v = 0;
+  for (uptr shift = 0;; shift += 7) {
+    u8 b = *p++;
+    v |= (uptr)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      break;
+  }
+  *data = p;
+  return prev + ((v >> 1) ^ (0 - (v & 1)));
+}
+
+static StackDesc *allocDesc(uptr data_size) {
+  // First, try to allocate optimisitically. The region memory is fresh, so
+  // the padding of the data is zero.
+  uptr memsz = RoundUpTo(kDescHeaderSize + data_size, sizeof(uptr));
   StackDesc *s = tryallocDesc(memsz);
   if (s)
     return s;
@@ -98,25 +258,41 @@ static StackDesc *allocDesc(uptr size) {
     uptr allocsz = 64 * 1024;
     if (allocsz < memsz)
       allocsz = memsz;
-    uptr mem = (uptr)MmapOrDie(allocsz, "stack depot");
-    stats.mapped += allocsz;
+    uptr mem = (uptr)mapDepot(allocsz);
     atomic_store(&depot.region_end, mem + allocsz, memory_order_release);
     atomic_store(&depot.region_pos, mem, memory_order_release);
   }
 }
 
-static u32 find(StackDesc *s, const uptr *stack, uptr size, u32 hash) {
-  // Searches linked list s for the stack, returns its id.
-  for (; s; s = s->link) {
-    if (s->hash == hash && s->size == size) {
-      uptr i = 0;
-      for (; i < size; i++) {
-        if (stack[i] != s->stack[i])
-          break;
-      }
-      if (i == size)
-        return s->id;
+static bool equal(StackDesc *s, const StackKey &k) {
+  if (s->hash != k.hash || s->size != k.size)
+    return false;
+  if (k.data) {
+    if (s->data_size != k.data_size)
+      return false;
+    const uptr *data = (const uptr*)s->data;
+    uptr n = RoundUpTo(k.data_size, sizeof(uptr)) / sizeof(uptr);
+    for (uptr i = 0; i < n; i++) {
+      if (data[i] != k.data[i])
+        return false;
     }
+    return true;
+  }
+  const u8 *data = s->data;
+  uptr pc = 0;
+  for (uptr i = 0; i < k.size; i++) {
+    pc = decodeFrame(&data, pc);
+    if (k.stack[i] != pc)
+      return false;
+  }
+  return true;
+}
+
+static StackDesc *find(StackDesc *s, const StackKey &k) {
+  // Searches linked list s for the stack.
+  for (; s; s = s->link) {
+    if (equal(s, k))
+      return s;
   }
   return 0;
 }
@@ -125,6 +301,8 @@ static StackDesc *lock(atomic_uintptr_t *p) {
   // Uses the pointer lsb as mutex.
   for (int i = 0;; i++) {
     uptr cmp = atomic_load(p, memory_order_relaxed);
+    if (cmp == kMovedBucket)
+      return (StackDesc*)kMovedBucket;
     if ((cmp & 1) == 0
         && atomic_compare_exchange_weak(p, &cmp, cmp | 1,
                                         memory_order_acquire))
@@ -141,64 +319,579 @@ static void unlock(atomic_uintptr_t *p, StackDesc *s) {
   atomic_store(p, (uptr)s, memory_order_release);
 }
 
+static StackTable *allocTable(uptr size) {
+  StackTable *t = (StackTable*)mapDepot(
+      sizeof(StackTable) + (size - 1) * sizeof(t->tab[0]));
+  t->size = size;
+  return t;
+}
+
+static StackTable *getTable() {
+  StackTable *t =
+      (StackTable*)atomic_load(&depot.table, memory_order_acquire);
+  if (t)
+    return t;
+  SpinMutexLock l(&depot.table_mtx);
+  t = (StackTable*)atomic_load(&depot.table, memory_order_relaxed);
+  if (!t) {
+    t = allocTable(kInitialTabSize);
+    atomic_store(&depot.table, (uptr)t, memory_order_release);
+  }
+  return t;
+}
+
+// Replaces t with a twice larger table. Every bucket of t is locked, its
+// stacks are relinked into the new table, and it is left locked with
+// kMovedBucket, which sends inserters to the new table. Lock-free readers
+// of t may follow the relinked lists and miss their stack; they retry under
+// the bucket lock then. The old table stays mapped, as readers may still
+// be looking at it.
+static void growTable(StackTable *t) {
+  SpinMutexLock l(&depot.table_mtx);
+  if (atomic_load(&depot.table, memory_order_relaxed) != (uptr)t ||
+      t->size >= kMaxTabSize)
+    return;
+  StackTable *nt = allocTable(t->size * 2);
+  for (uptr i = 0; i < t->size; i++) {
+    atomic_uintptr_t *p = &t->tab[i];
+    StackDesc *s = lock(p);
+    while (s) {
+      StackDesc *next = s->link;
+      atomic_uintptr_t *np = &nt->tab[s->hash & (nt->size - 1)];
+      s->link = (StackDesc*)atomic_load(np, memory_order_relaxed);
+      atomic_store(np, (uptr)s, memory_order_relaxed);
+      s = next;
+    }
+    atomic_store(p, kMovedBucket, memory_order_release);
+  }
+  atomic_store(&depot.table, (uptr)nt, memory_order_release);
+}
+
+static atomic_uintptr_t *idMapSlot(u32 id, bool create) {
+  atomic_uintptr_t *l1 = &depot.id_map[id / kIdMapL2Size];
+  uptr l2 = atomic_load(l1, memory_order_acquire);
+  if (!l2) {
+    if (!create)
+      return 0;
+    SpinMutexLock l(&depot.id_map_mtx);
+    l2 = atomic_load(l1, memory_order_relaxed);
+    if (!l2) {
+      l2 = (uptr)mapDepot(kIdMapL2Size * sizeof(atomic_uintptr_t));
+      atomic_store(l1, l2, memory_order_release);
+    }
+  }
+  return &((atomic_uintptr_t*)l2)[id % kIdMapL2Size];
+}
+
+static StackDesc *insert(const StackKey &k) {
+  for (;;) {
+    StackTable *t = getTable();
+    atomic_uintptr_t *p = &t->tab[k.hash & (t->size - 1)];
+    uptr v = atomic_load(p, memory_order_consume);
+    StackDesc *s = 0;
+    if (v != kMovedBucket) {
+      // First, try to find the existing stack.
+      s = find((StackDesc*)(v & ~1), k);
+      if (s)
+        return s;
+    }
+    // If failed, lock, retry and insert new.
+    StackDesc *s2 = lock(p);
+    if ((uptr)s2 == kMovedBucket) {
+      // The table is being replaced, wait for the new one.
+      while (atomic_load(&depot.table, memory_order_acquire) == (uptr)t)
+        internal_sched_yield();
+      continue;
+    }
+    s = find(s2, k);
+    if (s) {
+      unlock(p, s2);
+      return s;
+    }
+    u32 id = atomic_fetch_add(&depot.seq, 1, memory_order_relaxed) + 1;
+    CHECK_LT(id, kMaxId);
+    uptr data_size = k.data ? k.data_size : encodedSize(k.stack, k.size);
+    s = allocDesc(data_size);
+    s->id = id;
+    s->hash = k.hash;
+    s->size = k.size;
+    s->data_size = data_size;
+    if (k.data)
+      internal_memcpy(s->data, k.data, data_size);
+    else
+      encodeStack(s->data, k.stack, k.size);
+    atomic_store(idMapSlot(id, true), (uptr)s, memory_order_release);
+    s->link = s2;
+    unlock(p, s);
+    if (id > t->size)
+      growTable(t);
+    return s;
+  }
+}
+
+// Keeps the encoding buffer off the stack frame of the cache hit path.
+static NOINLINE StackDesc *encodeAndInsert(StackKey k) {
+  uptr buf[kMaxKeyWords];
+  k.Encode(buf);
+  return insert(k);
+}
+
+#if SANITIZER_CAN_USE_THREADLOCAL
+static void flushCacheStats(StackDepotCache *c) {
+  atomic_fetch_add(&depot.cache_hits, c->hits, memory_order_relaxed);
+  atomic_fetch_add(&depot.cache_misses, c->misses, memory_order_relaxed);
+  c->hits = 0;
+  c->misses = 0;
+}
+#endif
+
+// The trie backend.
+//
+// A stack is a path in a trie whose root is the outermost frame, and its id
+// is the index of the node of its innermost frame, with kTrieIdBit set. A
+// node holds its pc and the index of its parent, so stacks sharing outer
+// frames share nodes, and a stack is read by walking up to the root. Nodes
+// are found by (parent, pc) in a hash table of node indices, which grows
+// the same way as the table of StackDesc's. The lock bit of a bucket is the
+// high bit of the index.
+const uptr kTrieBlockSize = 1 << 16;  // Nodes are allocated in blocks.
+const uptr kTrieMaxNodes = kTrieIdBit;
+const u32 kTrieLockBit = 1u << 31;
+const u32 kTrieMovedBucket = (u32)-1;
+
+struct TrieNode {
+  uptr pc;
+  u32 parent;  // 0 for the outermost frames.
+  u32 link;  // Next node in the hash table bucket.
+};
+
+struct TrieTable {
+  uptr size;  // Power of two.
+  atomic_uint32_t tab[1];  // [size]
+};
+
+static struct {
+  StaticSpinMutex mtx;  // Protects alloc of node blocks.
+  StaticSpinMutex table_mtx;  // Protects table replacement.
+  atomic_uintptr_t table;  // Current TrieTable.
+  atomic_uint32_t seq;  // Node index generator.
+  atomic_uintptr_t blocks[kTrieMaxNodes / kTrieBlockSize];
+} trie;
+
+static uptr trieSize() {
+  return atomic_load(&trie.seq, memory_order_relaxed);
+}
+
+static TrieNode *trieNode(u32 idx) {
+  uptr block = atomic_load(&trie.blocks[idx / kTrieBlockSize],
+                           memory_order_acquire);
+  return &((TrieNode*)block)[idx % kTrieBlockSize];
+}
+
+static TrieNode *trieAllocNode(u32 idx) {
+  atomic_uintptr_t *b = &trie.blocks[idx / kTrieBlockSize];
+  if (!atomic_load(b, memory_order_acquire)) {
+    SpinMutexLock l(&trie.mtx);
+    if (!atomic_load(b, memory_order_relaxed)) {
+      uptr block = (uptr)mapDepot(kTrieBlockSize * sizeof(TrieNode));
+      atomic_store(b, block, memory_order_release);
+    }
+  }
+  return trieNode(idx);
+}
+
+static u32 trieHash(u32 parent, uptr pc) {
+  u64 x = ((u64)pc ^ ((u64)parent << 32)) * 0x9E3779B97F4A7C15ULL;
+  return (u32)(x >> 32);
+}
+
+static u32 trieFind(u32 idx, u32 parent, uptr pc) {
+  for (; idx; idx = trieNode(idx)->link) {
+    TrieNode *n = trieNode(idx);
+    if (n->pc == pc && n->parent == parent)
+      return idx;
+  }
+  return 0;
+}
+
+static u32 trieLock(atomic_uint32_t *p) {
+  for (int i = 0;; i++) {
+    u32 cmp = atomic_load(p, memory_order_relaxed);
+    if (cmp == kTrieMovedBucket)
+      return kTrieMovedBucket;
+    if ((cmp & kTrieLockBit) == 0
+        && atomic_compare_exchange_weak(p, &cmp, cmp | kTrieLockBit,
+                                        memory_order_acquire))
+      return cmp;
+    if (i < 10)
+      proc_yield(10);
+    else
+      internal_sched_yield();
+  }
+}
+
+static TrieTable *trieAllocTable(uptr size) {
+  TrieTable *t = (TrieTable*)mapDepot(
+      sizeof(TrieTable) + (size - 1) * sizeof(t->tab[0]));
+  t->size = size;
+  return t;
+}
+
+static TrieTable *trieGetTable() {
+  TrieTable *t = (TrieTable*)atomic_load(&trie.table, memory_order_acquire);
+  if (t)
+    return t;
+  SpinMutexLock l(&trie.table_mtx);
+  t = (TrieTable*)atomic_load(&trie.table, memory_order_relaxed);
+  if (!t) {
+    t = trieAllocTable(kInitialTabSize);
+    atomic_store(&trie.table, (uptr)t, memory_order_release);
+  }
+  return t;
+}
+
+// See growTable.
+static void trieGrowTable(TrieTable *t) {
+  SpinMutexLock l(&trie.table_mtx);
+  if (atomic_load(&trie.table, memory_order_relaxed) != (uptr)t ||
+      t->size >= kMaxTabSize)
+    return;
+  TrieTable *nt = trieAllocTable(t->size * 2);
+  for (uptr i = 0; i < t->size; i++) {
+    atomic_uint32_t *p = &t->tab[i];
+    u32 idx = trieLock(p);
+    while (idx) {
+      TrieNode *n = trieNode(idx);
+      u32 next = n->link;
+      atomic_uint32_t *np =
+          &nt->tab[trieHash(n->parent, n->pc) & (nt->size - 1)];
+      n->link = atomic_load(np, memory_order_relaxed);
+      atomic_store(np, idx, memory_order_relaxed);
+      idx = next;
+    }
+    atomic_store(p, kTrieMovedBucket, memory_order_release);
+  }
+  atomic_store(&trie.table, (uptr)nt, memory_order_release);
+}
+
+// Returns the index of the node for pc called from the parent node,
+// inserting it if needed.
+static u32 trieChild(u32 parent, uptr pc) {
+  u32 h = trieHash(parent, pc);
+  for (;;) {
+    TrieTable *t = trieGetTable();
+    atomic_uint32_t *p = &t->tab[h & (t->size - 1)];
+    u32 v = atomic_load(p, memory_order_acquire);
+    if (v != kTrieMovedBucket) {
+      u32 idx = trieFind(v & ~kTrieLockBit, parent, pc);
+      if (idx)
+        return idx;
+    }
+    u32 v2 = trieLock(p);
+    if (v2 == kTrieMovedBucket) {
+      while (atomic_load(&trie.table, memory_order_acquire) == (uptr)t)
+        internal_sched_yield();
+      continue;
+    }
+    u32 idx = trieFind(v2, parent, pc);
+    if (idx) {
+      atomic_store(p, v2, memory_order_release);
+      return idx;
+    }
+    idx = atomic_fetch_add(&trie.seq, 1, memory_order_relaxed) + 1;
+    CHECK_LT(idx, kTrieMaxNodes);
+    TrieNode *n = trieAllocNode(idx);
+    n->pc = pc;
+    n->parent = parent;
+    n->link = v2;
+    atomic_store(p, idx, memory_order_release);
+    if (idx > t->size)
+      trieGrowTable(t);
+    return idx;
+  }
+}
+
+static u32 triePut(const uptr *stack, uptr size) {
+  u32 idx = 0;
+  for (uptr i = size; i > 0; i--)
+    idx = trieChild(idx, stack[i - 1]);
+  return idx | kTrieIdBit;
+}
+
+static bool trieEqual(u32 id, const uptr *stack, uptr size) {
+  u32 idx = id & ~kTrieIdBit;
+  for (uptr i = 0; i < size; i++) {
+    if (!idx)
+      return false;
+    TrieNode *n = trieNode(idx);
+    if (n->pc != stack[i])
+      return false;
+    idx = n->parent;
+  }
+  return idx == 0;
+}
+
+// Returns the node index for a trie id, 0 if it is unknown.
+static u32 trieIndex(u32 id) {
+  u32 idx = id & ~kTrieIdBit;
+  return idx <= atomic_load(&trie.seq, memory_order_acquire) ? idx : 0;
+}
+
+static uptr trieGet(u32 id, uptr *trace, uptr max_size) {
+  uptr size = 0;
+  for (u32 idx = trieIndex(id); idx && size < max_size; size++) {
+    TrieNode *n = trieNode(idx);
+    trace[size] = n->pc;
+    idx = n->parent;
+  }
+  return size;
+}
+
+static uptr trieGetSize(u32 id) {
+  uptr size = 0;
+  for (u32 idx = trieIndex(id); idx; size++)
+    idx = trieNode(idx)->parent;
+  return size;
+}
+
+void StackDepotSetUseTrie(bool use_trie) {
+  atomic_store(&depot.use_trie, use_trie, memory_order_relaxed);
+}
+
 u32 StackDepotPut(const uptr *stack, uptr size) {
   if (stack == 0 || size == 0)
     return 0;
-  uptr h = hash(stack, size);
-  atomic_uintptr_t *p = &depot.tab[h % kTabSize];
-  uptr v = atomic_load(p, memory_order_consume);
-  StackDesc *s = (StackDesc*)(v & ~1);
-  // First, try to find the existing stack.
-  u32 id = find(s, stack, size, h);
-  if (id)
+  CHECK_LE(size, (u32)-1);
+  u32 h = hash(stack, size);
+  StackKey k(stack, size, h);
+  u32 id = 0;
+#if SANITIZER_CAN_USE_THREADLOCAL
+  StackDepotCache *c = &cache;
+  uptr *cached = &c->entries[h % kCacheSize];
+  uptr e = *cached;
+  if (e & 1) {
+    if (trieEqual(e >> 1, stack, size))
+      id = e >> 1;
+  } else if (e && equal((StackDesc*)e, k)) {
+    id = ((StackDesc*)e)->id;
+  }
+  if (id) {
+    if (UNLIKELY(++c->hits + c->misses >= kCacheStatsPeriod))
+      flushCacheStats(c);
     return id;
-  // If failed, lock, retry and insert new.
-  StackDesc *s2 = lock(p);
-  if (s2 != s) {
-    id = find(s2, stack, size, h);
-    if (id) {
-      unlock(p, s2);
-      return id;
-    }
   }
-  uptr part = (h % kTabSize) / kPartSize;
-  id = atomic_fetch_add(&depot.seq[part], 1, memory_order_relaxed) + 1;
-  stats.n_uniq_ids++;
-  CHECK_LT(id, kMaxId);
-  id |= part << kPartShift;
-  CHECK_NE(id, 0);
-  CHECK_EQ(id & (1u << 31), 0);
-  s = allocDesc(size);
-  s->id = id;
-  s->hash = h;
-  s->size = size;
-  internal_memcpy(s->stack, stack, size * sizeof(uptr));
-  s->link = s2;
-  unlock(p, s);
+  if (UNLIKELY(c->hits + ++c->misses >= kCacheStatsPeriod))
+    flushCacheStats(c);
+#else
+  uptr cached_entry;
+  uptr *cached = &cached_entry;
+#endif
+  if (atomic_load(&depot.use_trie, memory_order_relaxed)) {
+    id = triePut(stack, size);
+    *cached = ((uptr)id << 1) | 1;
+  } else {
+    StackDesc *s = encodeAndInsert(k);
+    *cached = (uptr)s;
+    id = s->id;
+  }
   return id;
 }
 
-const uptr *StackDepotGet(u32 id, uptr *size) {
+static StackDesc *getDesc(u32 id) {
   if (id == 0)
     return 0;
   CHECK_EQ(id & (1u << 31), 0);
-  // High kPartBits contain part id, so we need to scan at most kPartSize lists.
-  uptr part = id >> kPartShift;
-  for (int i = 0; i != kPartSize; i++) {
-    uptr idx = part * kPartSize + i;
-    CHECK_LT(idx, kTabSize);
-    atomic_uintptr_t *p = &depot.tab[idx];
-    uptr v = atomic_load(p, memory_order_consume);
-    StackDesc *s = (StackDesc*)(v & ~1);
-    for (; s; s = s->link) {
-      if (s->id == id) {
-        *size = s->size;
-        return s->stack;
+  CHECK_EQ(id & kTrieIdBit, 0);
+  atomic_uintptr_t *p = idMapSlot(id, false);
+  return p ? (StackDesc*)atomic_load(p, memory_order_consume) : 0;
+}
+
+// The deep links are kept in an open-addressed table of
+// (id << 32 | deep id). Like the StackTable, it is replaced by a twice larger
+// one, here when it is half full. The empty slots of the replaced table are
+// sealed with kMovedLink, which sends inserters and readers to the new table.
+struct DeepLinkTable {
+  uptr size;  // Power of two.
+  atomic_uintptr_t n_links;
+  atomic_uint64_t tab[1];  // [size]
+};
+
+const uptr kInitialDeepLinksSize = 1 << 12;
+const uptr kMaxDeepLinksSize = 1 << 22;
+// Id 0 is never linked.
+const u64 kMovedLink = 1;
+// Linking into a full table of the maximum size gives up on ids which need
+// more probes.
+const uptr kMaxDeepLinkProbes = 64;
+
+static DeepLinkTable *allocDeepLinks(uptr size) {
+  DeepLinkTable *t = (DeepLinkTable*)mapDepot(
+      sizeof(DeepLinkTable) + (size - 1) * sizeof(t->tab[0]));
+  t->size = size;
+  return t;
+}
+
+static DeepLinkTable *getDeepLinks() {
+  DeepLinkTable *t =
+      (DeepLinkTable*)atomic_load(&depot.deep_links, memory_order_acquire);
+  if (t)
+    return t;
+  SpinMutexLock l(&depot.deep_links_mtx);
+  t = (DeepLinkTable*)atomic_load(&depot.deep_links, memory_order_relaxed);
+  if (!t) {
+    t = allocDeepLinks(kInitialDeepLinksSize);
+    atomic_store(&depot.deep_links, (uptr)t, memory_order_release);
+  }
+  return t;
+}
+
+static atomic_uint64_t *deepLinkSlot(DeepLinkTable *t, u32 id, uptr probe) {
+  return &t->tab[(id * 0x9E3779B1u + probe) & (t->size - 1)];
+}
+
+// Replaces t with a twice larger table. The old table stays mapped, as
+// readers may still be looking at it.
+static void growDeepLinks(DeepLinkTable *t) {
+  SpinMutexLock l(&depot.deep_links_mtx);
+  if (atomic_load(&depot.deep_links, memory_order_relaxed) != (uptr)t ||
+      t->size >= kMaxDeepLinksSize)
+    return;
+  DeepLinkTable *nt = allocDeepLinks(t->size * 2);
+  uptr n = 0;
+  for (uptr i = 0; i < t->size; i++) {
+    u64 link = 0;
+    if (atomic_compare_exchange_strong(&t->tab[i], &link, kMovedLink,
+                                       memory_order_acquire))
+      continue;
+    // The links are never changed once set. A link which would need too
+    // many probes is dropped, and is added again by the next allocation.
+    for (uptr probe = 0; probe < kMaxDeepLinkProbes; probe++) {
+      atomic_uint64_t *p = deepLinkSlot(nt, link >> 32, probe);
+      if (atomic_load(p, memory_order_relaxed) == 0) {
+        atomic_store(p, link, memory_order_relaxed);
+        n++;
+        break;
       }
     }
   }
-  *size = 0;
+  atomic_store(&nt->n_links, n, memory_order_relaxed);
+  atomic_store(&depot.deep_links, (uptr)nt, memory_order_release);
+}
+
+void StackDepotLinkDeepStack(u32 id, u32 deep_id) {
+  if (id == 0 || deep_id == 0)
+    return;
+  u64 link = ((u64)id << 32) | deep_id;
+  for (;;) {
+    DeepLinkTable *t = getDeepLinks();
+    bool moved = false;
+    for (uptr i = 0; i < kMaxDeepLinkProbes && !moved; i++) {
+      atomic_uint64_t *p = deepLinkSlot(t, id, i);
+      u64 cmp = atomic_load(p, memory_order_relaxed);
+      if (cmp == 0 &&
+          atomic_compare_exchange_strong(p, &cmp, link,
+                                         memory_order_relaxed)) {
+        uptr n = atomic_fetch_add(&t->n_links, 1, memory_order_relaxed) + 1;
+        if (n > t->size / 2)
+          growDeepLinks(t);
+        return;
+      }
+      if ((u32)(cmp >> 32) == id)
+        return;
+      moved = cmp == kMovedLink;
+    }
+    if (moved) {
+      // The table is being replaced, wait for the new one.
+      while (atomic_load(&depot.deep_links, memory_order_acquire) == (uptr)t)
+        internal_sched_yield();
+      continue;
+    }
+    if (t->size >= kMaxDeepLinksSize)
+      return;
+    growDeepLinks(t);
+  }
+}
+
+u32 StackDepotGetDeepStack(u32 id) {
+  if (id == 0)
+    return 0;
+  DeepLinkTable *t =
+      (DeepLinkTable*)atomic_load(&depot.deep_links, memory_order_acquire);
+  while (t) {
+    bool moved = false;
+    for (uptr i = 0; i < kMaxDeepLinkProbes && !moved; i++) {
+      u64 link = atomic_load(deepLinkSlot(t, id, i), memory_order_relaxed);
+      if (link == 0)
+        return 0;
+      if ((u32)(link >> 32) == id)
+        return (u32)link;
+      moved = link == kMovedLink;
+    }
+    if (!moved)
+      return 0;
+    // The table is being replaced, wait for the new one.
+    while (atomic_load(&depot.deep_links, memory_order_acquire) == (uptr)t)
+      internal_sched_yield();
+    t = (DeepLinkTable*)atomic_load(&depot.deep_links, memory_order_acquire);
+  }
   return 0;
 }
 
+static uptr descGet(StackDesc *s, uptr *trace, uptr max_size) {
+  uptr size = Min((uptr)s->size, max_size);
+  const u8 *data = s->data;
+  uptr pc = 0;
+  for (uptr i = 0; i < size; i++) {
+    pc = decodeFrame(&data, pc);
+    trace[i] = pc;
+  }
+  return size;
+}
+
+uptr StackDepotGet(u32 id, uptr *trace, uptr max_size) {
+  if (id & kTrieIdBit)
+    return trieGet(id, trace, max_size);
+  StackDesc *s = getDesc(id);
+  return s ? descGet(s, trace, max_size) : 0;
+}
+
+uptr StackDepotGetSize(u32 id) {
+  if (id & kTrieIdBit)
+    return trieGetSize(id);
+  StackDesc *s = getDesc(id);
+  return s ? s->size : 0;
+}
+
+void StackDepotIterate(StackDepotIterateCallback cb, void *arg) {
+  uptr *trace = 0;
+  uptr trace_size = 0;
+  bool ok = true;
+  u32 n = atomic_load(&depot.seq, memory_order_acquire);
+  for (u32 id = 1; id <= n && ok; id++) {
+    StackDesc *s = getDesc(id);
+    if (!s)
+      continue;
+    if (s->size > trace_size) {
+      if (trace)
+        UnmapOrDie(trace, trace_size * sizeof(*trace));
+      trace_size = RoundUpTo(s->size, GetPageSizeCached() / sizeof(*trace));
+      trace = (uptr*)MmapOrDie(trace_size * sizeof(*trace), "StackDepot");
+    }
+    uptr size = descGet(s, trace, s->size);
+    ok = cb(id, 0, StackDepotGetDeepStack(id), trace, size, arg);
+  }
+  if (trace)
+    UnmapOrDie(trace, trace_size * sizeof(*trace));
+  n = atomic_load(&trie.seq, memory_order_acquire);
+  for (u32 idx = 1; idx <= n && ok; idx++) {
+    // The block of the last nodes may be not mapped yet.
+    if (!atomic_load(&trie.blocks[idx / kTrieBlockSize], memory_order_acquire))
+      continue;
+    TrieNode *node = trieNode(idx);
+    u32 id = idx | kTrieIdBit;
+    ok = cb(id, node->parent ? node->parent | kTrieIdBit : 0,
+            StackDepotGetDeepStack(id), &node->pc, 1, arg);
+  }
+}
+
 }  // namespace __sanitizer
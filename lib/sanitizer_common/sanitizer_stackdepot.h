@@ -21,16 +21,64 @@ namespace __sanitizer {
 
 // Maps stack trace to an unique id.
 u32 StackDepotPut(const uptr *stack, uptr size);
-// Retrieves a stored stack trace by the id.
-const uptr *StackDepotGet(u32 id, uptr *size);
+// Retrieves a stored stack trace by the id. The depot keeps the traces
+// compressed, so up to max_size frames are decoded into trace. Returns the
+// number of frames written, 0 for an unknown id. The deep stack linked to
+// the id, if any, is not retrieved (see PrintDeepStackTail). The report
+// paths decode into kStackTraceMax-frame arrays (2KB on 64-bit) on their
+// stacks, which in LSan include the 2MB stack of the StopTheWorld tracer
+// thread.
+uptr StackDepotGet(u32 id, uptr *trace, uptr max_size);
+// Returns the number of frames in the stored stack trace.
+uptr StackDepotGetSize(u32 id);
+// Links the stack with deep_id to the stack with id, its truncated version
+// (see GetTruncatedStackTrace). The first link of an id wins. A stack linked
+// to itself has no deeper frames.
+void StackDepotLinkDeepStack(u32 id, u32 deep_id);
+// Returns the id of the deep stack linked to id, or 0.
+u32 StackDepotGetDeepStack(u32 id);
+// Selects how the stacks put from now on are stored. By default every stack
+// is stored separately, compressed. In the trie mode, stacks are paths in a
+// trie of frames, so the outer frames common to many stacks are stored once;
+// puts and gets take a hash table lookup per frame. Ids of both modes stay
+// valid.
+void StackDepotSetUseTrie(bool use_trie);
 
 struct StackDepotStats {
+  // In the trie mode, every trie node has an id.
   uptr n_uniq_ids;
   uptr mapped;
+  // StackDepotPut calls served by the per-thread caches of recently put
+  // stacks, and the ones which had to look up the depot. Threads report
+  // them in batches, so the numbers lag a bit. Both stay 0 on the platforms
+  // without THREADLOCAL, which have no such caches.
+  uptr cache_hits;
+  uptr cache_misses;
 };
 
 StackDepotStats *StackDepotGetStats();
 
+// Calls cb for every stored stack, until it returns false. The stack with
+// the given id consists of the size frames, innermost first, followed by
+// the stack with parent_id, if it is not 0. deep_id is the stack linked to
+// this one with StackDepotLinkDeepStack, or 0; the reports print its frames
+// beyond the ones of this stack, marked as borrowed (see
+// PrintDeepStackTail). Stacks put concurrently with the iteration may be
+// missed.
+typedef bool (*StackDepotIterateCallback)(u32 id, u32 parent_id, u32 deep_id,
+                                          const uptr *frames, uptr size,
+                                          void *arg);
+void StackDepotIterate(StackDepotIterateCallback cb, void *arg);
+
+// Writes the depot and the list of the loaded modules to "path.<pid>", so
+// that the stacks can be symbolized offline. See the format description in
+// sanitizer_stackdepot_libcdep.cc.
+bool StackDepotDump(const char *path);
+// Dumps the depot to the path given by the stack_depot_snapshot_path flag,
+// if it is set. Only the first call writes the snapshot, so the tools may
+// call it both at exit and on fatal errors.
+void StackDepotDumpSnapshot();
+
 }  // namespace __sanitizer
 
 #endif  // SANITIZER_STACKDEPOT_H
@@ -0,0 +1,209 @@
+//===-- sanitizer_stackdepot_libcdep.cc -----------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is shared between sanitizer run-time libraries.
+// Writing of the stack depot snapshots for offline symbolization.
+//===----------------------------------------------------------------------===//
+
+#include "sanitizer_stackdepot.h"
+#include "sanitizer_allocator_internal.h"
+#include "sanitizer_atomic.h"
+#include "sanitizer_common.h"
+#include "sanitizer_flags.h"
+#include "sanitizer_libc.h"
+#include "sanitizer_stacktrace.h"
+#include "sanitizer_symbolizer.h"
+
+namespace __sanitizer {
+
+// The snapshot format. All numbers are in the host byte order.
+//   "SANDEPOT" magic, u32 version, u32 sizeof(uptr),
+//   u32 number of modules, then for every module:
+//     u32 name length, name, uptr base address, u32 number of ranges,
+//     uptr begin and uptr end of every range,
+//   stack records up to the end of file:
+//     u32 id, u32 parent id, u32 deep id, u32 number of frames, frames.
+// The stack with the id consists of the frames, innermost first, followed by
+// the stack with the parent id, if it is not 0. If the deep id is not 0, the
+// reports follow this stack with the frames of the stack with the deep id
+// beyond its size, marked as borrowed (see PrintDeepStackTail). Frames are
+// stored as LEB128 varints of zigzag-encoded differences from the previous
+// frame, the first one from 0.
+static const char kSnapshotMagic[] = "SANDEPOT";
+static const u32 kSnapshotVersion = 2;
+static const uptr kMaxModules = 1 << 14;
+
+class SnapshotWriter {
+ public:
+  explicit SnapshotWriter(fd_t fd)
+      : fd_(fd), pos_(0), ok_(true), buf_(kBufferSize) {}
+
+  void Write(const void *data, uptr size) {
+    const u8 *p = (const u8*)data;
+    while (size) {
+      if (pos_ == kBufferSize)
+        Flush();
+      uptr n = Min(size, kBufferSize - pos_);
+      internal_memcpy(buf_.data() + pos_, p, n);
+      pos_ += n;
+      p += n;
+      size -= n;
+    }
+  }
+
+  void WriteU32(u32 v) { Write(&v, sizeof(v)); }
+  void WriteUptr(uptr v) { Write(&v, sizeof(v)); }
+
+  void WriteVarint(uptr v) {
+    u8 data[sizeof(uptr) * 8 / 7 + 1];
+    uptr n = 0;
+    for (; v >= 0x80; v >>= 7)
+      data[n++] = (u8)(v | 0x80);
+    data[n++] = (u8)v;
+    Write(data, n);
+  }
+
+  bool Flush() {
+    // A write may be short, e.g. to a pipe or when interrupted by a signal.
+    for (uptr written = 0; ok_ && written < pos_;) {
+      uptr res = internal_write(fd_, buf_.data() + written, pos_ - written);
+      if (internal_iserror(res) || res == 0)
+        ok_ = false;
+      else
+        written += res;
+    }
+    pos_ = 0;
+    return ok_;
+  }
+
+ private:
+  static const uptr kBufferSize = 1 << 16;
+  fd_t fd_;
+  uptr pos_;
+  bool ok_;
+  InternalScopedBuffer<u8> buf_;
+};
+
+static void WriteModules(SnapshotWriter *w) {
+  InternalScopedBuffer<LoadedModule> modules(kMaxModules);
+  uptr n = GetListOfModules(modules.data(), kMaxModules, 0);
+  w->WriteU32(n);
+  for (uptr i = 0; i < n; i++) {
+    LoadedModule *m = &modules[i];
+    uptr name_len = internal_strlen(m->full_name());
+    w->WriteU32(name_len);
+    w->Write(m->full_name(), name_len);
+    w->WriteUptr(m->base_address());
+    w->WriteU32(m->n_ranges());
+    for (uptr j = 0; j < m->n_ranges(); j++) {
+      w->WriteUptr(m->range_beg(j));
+      w->WriteUptr(m->range_end(j));
+    }
+    m->clear();
+  }
+}
+
+static bool WriteStack(u32 id, u32 parent_id, u32 deep_id,
+                       const uptr *frames, uptr size, void *arg) {
+  SnapshotWriter *w = (SnapshotWriter*)arg;
+  w->WriteU32(id);
+  w->WriteU32(parent_id);
+  w->WriteU32(deep_id);
+  w->WriteU32(size);
+  uptr prev = 0;
+  for (uptr i = 0; i < size; i++) {
+    uptr delta = frames[i] - prev;
+    w->WriteVarint((delta << 1) ^
+                   (uptr)((sptr)delta >> (SANITIZER_WORDSIZE - 1)));
+    prev = frames[i];
+  }
+  return true;
+}
+
+bool StackDepotDump(const char *path) {
+  InternalScopedBuffer<char> file_name(4096);
+  internal_snprintf(file_name.data(), file_name.size(), "%s.%d", path,
+                    internal_getpid());
+  uptr openrv = OpenFile(file_name.data(), true);
+  if (internal_iserror(openrv)) {
+    Report("ERROR: Can't open file: %s\n", file_name.data());
+    return false;
+  }
+  fd_t fd = openrv;
+  SnapshotWriter w(fd);
+  w.Write(kSnapshotMagic, sizeof(kSnapshotMagic) - 1);
+  w.WriteU32(kSnapshotVersion);
+  w.WriteU32(sizeof(uptr));
+  WriteModules(&w);
+  StackDepotIterate(WriteStack, &w);
+  bool ok = w.Flush();
+  internal_close(fd);
+  return ok;
+}
+
+void StackDepotDumpSnapshot() {
+  static atomic_uint8_t dumped;
+  const char *path = common_flags()->stack_depot_snapshot_path;
+  if (!path || !path[0] ||
+      atomic_exchange(&dumped, 1, memory_order_relaxed))
+    return;
+  StackDepotDump(path);
+}
+
+void GetTruncatedStackTrace(StackTrace *stack, uptr max_s, uptr prefix_size,
+                            uptr pc, uptr bp, uptr stack_top,
+                            uptr stack_bottom, bool fast) {
+  if (prefix_size == 0 || prefix_size >= max_s) {
+    GetStackTrace(stack, max_s, pc, bp, stack_top, stack_bottom, fast);
+    return;
+  }
+  GetStackTrace(stack, prefix_size, pc, bp, stack_top, stack_bottom, fast);
+  u32 id = StackDepotPut(stack->trace, stack->size);
+  if (id == 0 || StackDepotGetDeepStack(id))
+    return;
+  if (stack->size < prefix_size) {
+    StackDepotLinkDeepStack(id, id);
+    return;
+  }
+  StackTrace deep;
+  GetStackTrace(&deep, max_s, pc, bp, stack_top, stack_bottom, fast);
+  StackDepotLinkDeepStack(id, StackDepotPut(deep.trace, deep.size));
+}
+
+void PrintDeepStackTail(u32 id, uptr first_frame_num, bool symbolize,
+                        const char *strip_file_prefix,
+                        StackTrace::SymbolizeCallback symbolize_callback) {
+  u32 deep_id = StackDepotGetDeepStack(id);
+  if (deep_id == 0 || deep_id == id)
+    return;
+  uptr own_size = StackDepotGetSize(id);
+  uptr deep_size = StackDepotGetSize(deep_id);
+  if (deep_size <= own_size)
+    return;
+  InternalScopedBuffer<uptr> trace(deep_size);
+  deep_size = StackDepotGet(deep_id, trace.data(), deep_size);
+  if (deep_size <= own_size)
+    return;
+  Printf("    (the frames below were unwound for the first stack with the "
+         "same %zd top frames and may belong to another call path)\n",
+         own_size);
+  StackTrace::PrintStack(trace.data() + own_size, deep_size - own_size,
+                         symbolize, strip_file_prefix, symbolize_callback,
+                         first_frame_num);
+}
+
+}  // namespace __sanitizer
+
+using namespace __sanitizer;  // NOLINT
+
+extern "C" {
+int __sanitizer_dump_stack_depot(const char *path) {
+  return StackDepotDump(path);
+}
+}  // extern "C"
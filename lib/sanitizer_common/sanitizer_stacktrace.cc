@@ -62,13 +62,22 @@ static void PrintModuleAndOffset(const char *module, uptr offset,
   Printf(" (%s+0x%zx)", StripPathPrefix(module, strip_file_prefix), offset);
 }
 
-void StackTrace::PrintStack(const uptr *addr, uptr size,
+uptr StackTrace::PrintStack(const uptr *addr, uptr size,
                             bool symbolize, const char *strip_file_prefix,
-                            SymbolizeCallback symbolize_callback ) {
+                            SymbolizeCallback symbolize_callback,
+                            uptr first_frame_num) {
   MemoryMappingLayout proc_maps(/*cache_enabled*/true);
   InternalScopedBuffer<char> buff(GetPageSizeCached() * 2);
   InternalScopedBuffer<AddressInfo> addr_frames(64);
-  uptr frame_num = 0;
+  if (symbolize && !symbolize_callback && &PrefetchSymbolizeCode) {
+    // Symbolize all the frames in one batch.
+    InternalScopedBuffer<uptr> pcs(size);
+    uptr n = 0;
+    for (; n < size && addr[n]; n++)
+      pcs[n] = GetPreviousInstructionPc(addr[n]);
+    PrefetchSymbolizeCode(pcs.data(), n);
+  }
+  uptr frame_num = first_frame_num;
   for (uptr i = 0; i < size && addr[i]; i++) {
     // PCs in stack traces are actually the return addresses, that is,
     // addresses of the next instructions after the call.
@@ -112,16 +121,21 @@ void StackTrace::PrintStack(const uptr *addr, uptr size,
       // If online symbolization failed, try to output at least module and
       // offset for instruction.
       PrintStackFramePrefix(frame_num, pc);
+      const char *module_name;
       uptr offset;
-      if (proc_maps.GetObjectNameAndOffset(pc, &offset,
-                                           buff.data(), buff.size(),
-                                           /* protection */0)) {
+      if (&GetModuleNameAndOffsetForPC &&
+          GetModuleNameAndOffsetForPC(pc, &module_name, &offset)) {
+        PrintModuleAndOffset(module_name, offset, strip_file_prefix);
+      } else if (proc_maps.GetObjectNameAndOffset(pc, &offset,
+                                                  buff.data(), buff.size(),
+                                                  /* protection */0)) {
         PrintModuleAndOffset(buff.data(), offset, strip_file_prefix);
       }
       Printf("\n");
       frame_num++;
     }
   }
+  return frame_num;
 }
 
 uptr StackTrace::GetCurrentPc() {
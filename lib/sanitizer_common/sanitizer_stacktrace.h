@@ -28,15 +28,24 @@ static const uptr kStackTraceMax = 256;
 #define SANITIZER_CAN_FAST_UNWIND 1
 #endif
 
+#if SANITIZER_LINUX && !SANITIZER_ANDROID && defined(__x86_64__)
+#define SANITIZER_CAN_EH_FRAME_UNWIND 1
+#else
+#define SANITIZER_CAN_EH_FRAME_UNWIND 0
+#endif
+
 struct StackTrace {
   typedef bool (*SymbolizeCallback)(const void *pc, char *out_buffer,
                                      int out_size);
   uptr size;
   uptr max_size;
   uptr trace[kStackTraceMax];
-  static void PrintStack(const uptr *addr, uptr size,
+  // Prints the frames numbered from first_frame_num and returns the number
+  // of the frame that would follow them.
+  static uptr PrintStack(const uptr *addr, uptr size,
                          bool symbolize, const char *strip_file_prefix,
-                         SymbolizeCallback symbolize_callback);
+                         SymbolizeCallback symbolize_callback,
+                         uptr first_frame_num = 0);
   void CopyTo(uptr *dst, uptr dst_size) {
     for (uptr i = 0; i < size && i < dst_size; i++)
       dst[i] = trace[i];
@@ -54,6 +63,10 @@ struct StackTrace {
 
   void FastUnwindStack(uptr pc, uptr bp, uptr stack_top, uptr stack_bottom);
   void SlowUnwindStack(uptr pc, uptr max_depth);
+  // Unwinds the caller's stack using the .eh_frame unwind tables, caching
+  // the rules decoded for every pc (see the eh_frame_unwind flag). Returns
+  // false if the stack has a frame whose unwind rules can't be followed.
+  bool EhFrameUnwindStack(uptr max_depth);
 
   void PopStackFrames(uptr count);
 
@@ -73,6 +86,29 @@ const char *StripPathPrefix(const char *filepath,
 void GetStackTrace(StackTrace *stack, uptr max_s, uptr pc, uptr bp,
                    uptr stack_top, uptr stack_bottom, bool fast);
 
+// Same as GetStackTrace, but if prefix_size is not 0, unwinds only the top
+// prefix_size frames. The first time a stack with these top frames is
+// seen, max_s frames are unwound too and linked to the truncated stack in
+// the stack depot, so that the reports can show the deeper frames (which
+// may come from a different call path) for all the stacks with these top
+// frames. To look the link up, the truncated stack is put into the depot
+// here, so the caller's own StackDepotPut of it is a second put. Where
+// THREADLOCAL works that put is served by the per-thread cache of recently
+// put stacks; elsewhere it hashes the prefix_size frames again.
+void GetTruncatedStackTrace(StackTrace *stack, uptr max_s, uptr prefix_size,
+                            uptr pc, uptr bp, uptr stack_top,
+                            uptr stack_bottom, bool fast);
+
+// Prints the frames of the deep stack linked to the stack with id (see
+// GetTruncatedStackTrace) beyond the frames of the stack itself, numbered
+// from first_frame_num. These frames were unwound for the first stack with
+// the same top frames, so a line saying that they may come from another
+// call path precedes them. Prints nothing if no deeper frames are linked.
+// Call it right after printing the stack with id.
+void PrintDeepStackTail(u32 id, uptr first_frame_num, bool symbolize,
+                        const char *strip_file_prefix,
+                        StackTrace::SymbolizeCallback symbolize_callback);
+
 }  // namespace __sanitizer
 
 // Use this macro if you want to print stack trace with the caller
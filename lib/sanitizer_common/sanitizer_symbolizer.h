@@ -69,6 +69,11 @@ struct DataInfo {
 uptr SymbolizeCode(uptr address, AddressInfo *frames, uptr max_frames)
     SANITIZER_WEAK_ATTRIBUTE;
 bool SymbolizeData(uptr address, DataInfo *info);
+// Symbolizes the code addresses in one batch, pipelining the requests to
+// the external symbolizer, so that the following SymbolizeCode calls for
+// them are served from the cache of the replies.
+void PrefetchSymbolizeCode(const uptr *addresses, uptr count)
+    SANITIZER_WEAK_ATTRIBUTE;
 
 bool IsSymbolizerAvailable();
 void FlushSymbolizer();  // releases internal caches (if any)
@@ -87,11 +92,16 @@ const int kSymbolizerStartupTimeMillis = 10;
 class LoadedModule {
  public:
   LoadedModule(const char *module_name, uptr base_address);
+  // Releases the name.
+  void clear();
   void addAddressRange(uptr beg, uptr end);
   bool containsAddress(uptr address) const;
 
   const char *full_name() const { return full_name_; }
   uptr base_address() const { return base_address_; }
+  uptr n_ranges() const { return n_ranges_; }
+  uptr range_beg(uptr i) const { return ranges_[i].beg; }
+  uptr range_end(uptr i) const { return ranges_[i].end; }
 
  private:
   struct AddressRange {
@@ -118,6 +128,60 @@ typedef bool (*string_predicate_t)(const char *);
 uptr GetListOfModules(LoadedModule *modules, uptr max_modules,
                       string_predicate_t filter);
 
+// Returns a number that changes whenever a module is loaded or unloaded, or
+// false if such changes can't be detected on this platform.
+bool GetLoadedModulesGeneration(u64 *generation);
+
+// Sorted index of the address ranges of the loaded modules, so that finding
+// the module of an address takes O(log n) even with thousands of modules.
+// The list of modules is reread when it has changed (see
+// GetLoadedModulesGeneration), or, if the changes can't be detected, when
+// an address is not found. The class has no constructor, so that it can be
+// linker initialized. Not thread-safe.
+class LoadedModuleIndex {
+ public:
+  // Rereads the list of modules if it has changed.
+  void Update();
+  // Returns the module containing the address, or 0. Doesn't update the
+  // index, so the modules returned earlier stay valid.
+  LoadedModule *Lookup(uptr address) const;
+  // Same as Update and Lookup.
+  LoadedModule *FindModule(uptr address);
+  // Changes whenever the list of modules is reread, so that the data keyed
+  // by the module names can be dropped.
+  uptr n_reloads() const { return n_reloads_; }
+
+ private:
+  struct Range {
+    uptr beg;
+    uptr end;
+    LoadedModule *module;
+  };
+
+  void Reload();
+  static bool CompareRanges(const Range &a, const Range &b) {
+    return a.beg < b.beg;
+  }
+
+  // 16K loaded modules should be enough for everyone.
+  static const uptr kMaxNumberOfModules = 1 << 14;
+  LoadedModule *modules_;
+  uptr n_modules_;
+  // Sorted by the address.
+  Range *ranges_;
+  uptr n_ranges_;
+  uptr ranges_capacity_;
+  bool loaded_;
+  bool has_generation_;
+  u64 generation_;
+  uptr n_reloads_;
+};
+
+// Finds the module of the pc in the index of the symbolizer. The name is
+// valid until the next symbolizer call.
+bool GetModuleNameAndOffsetForPC(uptr pc, const char **module_name,
+                                 uptr *module_offset) SANITIZER_WEAK_ATTRIBUTE;
+
 void SymbolizerPrepareForSandboxing();
 
 }  // namespace __sanitizer
@@ -0,0 +1,173 @@
+//===-- sanitizer_symbolizer_cache.h ----------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is shared between sanitizer run-time libraries.
+// LRU cache of the symbolizer replies, so that the frames repeated in many
+// reports are sent to the external symbolizer only once.
+//===----------------------------------------------------------------------===//
+#ifndef SANITIZER_SYMBOLIZER_CACHE_H
+#define SANITIZER_SYMBOLIZER_CACHE_H
+
+#include "sanitizer_allocator_internal.h"
+#include "sanitizer_common.h"
+#include "sanitizer_libc.h"
+
+namespace __sanitizer {
+
+// Maps (code or data, module name, module offset) to the symbolizer reply.
+// The class has no constructor, so that it can be linker initialized; the
+// entries are allocated on the first Put. Not thread-safe, same as the
+// symbolizer itself.
+class SymbolizerCache {
+ public:
+  static const uptr kSize = 4096;
+
+  // Returns the cached reply, valid until the next Put or Clear, or 0.
+  const char *Get(bool is_data, const char *module, uptr offset) {
+    if (Entry *e = Find(is_data, module, offset)) {
+      hits_++;
+      return e->reply;
+    }
+    misses_++;
+    return 0;
+  }
+
+  // Same as Get, but doesn't count the lookup in the stats.
+  bool Contains(bool is_data, const char *module, uptr offset) {
+    return Find(is_data, module, offset) != 0;
+  }
+
+  // Caches the reply, evicting the least recently used one if full.
+  void Put(bool is_data, const char *module, uptr offset, const char *reply) {
+    if (!entries_)
+      Init();
+    Entry *e;
+    if (n_used_ < kSize) {
+      e = &entries_[n_used_++];
+    } else {
+      e = lru_.lru_prev;
+      Unlink(e);
+      RemoveFromBucket(e);
+      InternalFree(e->module);
+      InternalFree(e->reply);
+    }
+    e->hash = Hash(is_data, module, offset);
+    e->is_data = is_data;
+    e->offset = offset;
+    e->module = internal_strdup(module);
+    e->reply = internal_strdup(reply);
+    Entry **bucket = &buckets_[e->hash % kNumBuckets];
+    e->hash_next = *bucket;
+    *bucket = e;
+    LinkFront(e);
+  }
+
+  // Drops all the replies and releases the memory of the cache; the next
+  // Put allocates it again.
+  void Clear() {
+    if (!entries_)
+      return;
+    for (uptr i = 0; i < n_used_; i++) {
+      InternalFree(entries_[i].module);
+      InternalFree(entries_[i].reply);
+    }
+    n_used_ = 0;
+    UnmapOrDie(entries_, kSize * sizeof(Entry));
+    UnmapOrDie(buckets_, kNumBuckets * sizeof(Entry*));
+    entries_ = 0;
+    buckets_ = 0;
+  }
+
+  uptr size() const { return n_used_; }
+  uptr hits() const { return hits_; }
+  uptr misses() const { return misses_; }
+
+ private:
+  static const uptr kNumBuckets = kSize;
+
+  struct Entry {
+    Entry *hash_next;
+    // Most recently used first.
+    Entry *lru_next;
+    Entry *lru_prev;
+    u32 hash;
+    bool is_data;
+    uptr offset;
+    char *module;
+    char *reply;
+  };
+
+  // Finds the entry and marks it as the most recently used.
+  Entry *Find(bool is_data, const char *module, uptr offset) {
+    if (!entries_)
+      return 0;
+    u32 hash = Hash(is_data, module, offset);
+    for (Entry *e = buckets_[hash % kNumBuckets]; e; e = e->hash_next) {
+      if (e->hash == hash && e->is_data == is_data && e->offset == offset &&
+          0 == internal_strcmp(e->module, module)) {
+        MoveToFront(e);
+        return e;
+      }
+    }
+    return 0;
+  }
+
+  void Init() {
+    entries_ = (Entry*)MmapOrDie(kSize * sizeof(Entry), "SymbolizerCache");
+    buckets_ = (Entry**)MmapOrDie(kNumBuckets * sizeof(Entry*),
+                                  "SymbolizerCache");
+    lru_.lru_next = lru_.lru_prev = &lru_;
+  }
+
+  static u32 Hash(bool is_data, const char *module, uptr offset) {
+    // FNV-1a.
+    u32 h = 2166136261u ^ (u32)is_data;
+    for (const char *p = module; *p; p++)
+      h = (h ^ (u8)*p) * 16777619u;
+    for (uptr i = 0; i < sizeof(offset); i++)
+      h = (h ^ (u8)(offset >> (i * 8))) * 16777619u;
+    return h;
+  }
+
+  void LinkFront(Entry *e) {
+    e->lru_prev = &lru_;
+    e->lru_next = lru_.lru_next;
+    lru_.lru_next->lru_prev = e;
+    lru_.lru_next = e;
+  }
+
+  void Unlink(Entry *e) {
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+  }
+
+  void MoveToFront(Entry *e) {
+    Unlink(e);
+    LinkFront(e);
+  }
+
+  void RemoveFromBucket(Entry *e) {
+    Entry **p = &buckets_[e->hash % kNumBuckets];
+    while (*p != e)
+      p = &(*p)->hash_next;
+    *p = e->hash_next;
+  }
+
+  Entry *entries_;
+  Entry **buckets_;
+  uptr n_used_;
+  // Head of the circular LRU list.
+  Entry lru_;
+  uptr hits_;
+  uptr misses_;
+};
+
+}  // namespace __sanitizer
+
+#endif  // SANITIZER_SYMBOLIZER_CACHE_H
@@ -0,0 +1,59 @@
+//===-- sanitizer_symbolizer_elf.h ------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is shared between sanitizer run-time libraries.
+// In-process symbolizer reading the ELF symbol tables and the DWARF line
+// tables of the modules, so that the reports can be symbolized without
+// starting the external symbolizer (see symbolize_in_process flag).
+//===----------------------------------------------------------------------===//
+#ifndef SANITIZER_SYMBOLIZER_ELF_H
+#define SANITIZER_SYMBOLIZER_ELF_H
+
+#include "sanitizer_common.h"
+
+namespace __sanitizer {
+
+// The module files are mapped into memory on the first request for them.
+// The symbol tables are indexed at once. The line programs are indexed by
+// their address ranges, which are found by running them in order until one
+// covers the looked up address, and a line program is decoded on the first
+// lookup of an address in its range. Inlined frames are not reported.
+// Not thread-safe, same as the rest of the symbolizer.
+class ElfSymbolizer {
+ public:
+  // Returns 0 if the in-process symbolization is not supported.
+  static ElfSymbolizer *get(LowLevelAllocator *allocator);
+
+  // Returns the reply in the format of the external symbolizer (see
+  // ExternalSymbolizer), valid until the next call, or 0 if the module
+  // can't be read. module_offset is the virtual address in the module file.
+  const char *SendCommand(bool is_data, const char *module_name,
+                          uptr module_offset);
+  // Releases the decoded line programs.
+  void Flush();
+
+ private:
+  struct Module;
+
+  explicit ElfSymbolizer(LowLevelAllocator *allocator)
+      : allocator_(allocator), modules_(0), last_module_(0) { }
+  Module *GetModule(const char *module_name);
+
+  LowLevelAllocator *allocator_;
+  // The modules are leaked, the same as the module list of the symbolizer.
+  Module *modules_;
+  Module *last_module_;
+
+  static const uptr kBufferSize = 16 * 1024;
+  char buffer_[kBufferSize];
+};
+
+}  // namespace __sanitizer
+
+#endif  // SANITIZER_SYMBOLIZER_ELF_H
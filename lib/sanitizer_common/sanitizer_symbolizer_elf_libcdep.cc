@@ -0,0 +1,969 @@
+//===-- sanitizer_symbolizer_elf_libcdep.cc -------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is shared between sanitizer run-time libraries.
+// See sanitizer_symbolizer_elf.h for details.
+//===----------------------------------------------------------------------===//
+
+#include "sanitizer_platform.h"
+#include "sanitizer_symbolizer_elf.h"
+
+#if SANITIZER_LINUX
+#include "sanitizer_allocator_internal.h"
+#include "sanitizer_libc.h"
+#include "sanitizer_placement_new.h"
+#include "sanitizer_symbolizer.h"
+
+// Android NDK r8e elf.h depends on stdint.h without including the latter.
+#include <stdint.h>
+
+#include <elf.h>
+#include <link.h>
+#include <sys/mman.h>
+
+namespace __sanitizer {
+
+typedef ElfW(Ehdr) Elf_Ehdr;
+typedef ElfW(Shdr) Elf_Shdr;
+typedef ElfW(Sym) Elf_Sym;
+
+#if SANITIZER_WORDSIZE == 64
+static const u8 kElfClass = ELFCLASS64;
+#else
+static const u8 kElfClass = ELFCLASS32;
+#endif
+// Not defined by the older elf.h.
+static const uptr kShfCompressed = 0x800;
+
+// DW_FORM_* codes used in the DWARF 5 line table headers.
+enum {
+  kFormBlock2 = 0x03,
+  kFormBlock4 = 0x04,
+  kFormData2 = 0x05,
+  kFormData4 = 0x06,
+  kFormData8 = 0x07,
+  kFormString = 0x08,
+  kFormBlock = 0x09,
+  kFormBlock1 = 0x0a,
+  kFormData1 = 0x0b,
+  kFormStrp = 0x0e,
+  kFormUdata = 0x0f,
+  kFormData16 = 0x1e,
+  kFormLineStrp = 0x1f
+};
+
+// DW_LNCT_* content types.
+enum {
+  kLnctPath = 0x1,
+  kLnctDirectoryIndex = 0x2
+};
+
+// DW_LNS_* and DW_LNE_* opcodes.
+enum {
+  kLnsCopy = 1,
+  kLnsAdvancePc = 2,
+  kLnsAdvanceLine = 3,
+  kLnsSetFile = 4,
+  kLnsSetColumn = 5,
+  kLnsConstAddPc = 8,
+  kLnsFixedAdvancePc = 9,
+  kLneEndSequence = 1,
+  kLneSetAddress = 2
+};
+
+// Bounds-checked reader of the (possibly malformed) file contents. After an
+// out of bounds read, all reads return zeroes and failed is set.
+struct DataReader {
+  const u8 *p;
+  const u8 *end;
+  bool failed;
+
+  DataReader(const u8 *beg, const u8 *end) : p(beg), end(end), failed(false) {}
+
+  bool Has(uptr size) {
+    if (failed || (uptr)(end - p) < size) {
+      failed = true;
+      return false;
+    }
+    return true;
+  }
+  void Skip(uptr size) {
+    if (Has(size))
+      p += size;
+  }
+  u64 Fixed(uptr size) {
+    u64 res = 0;
+    if (Has(size)) {
+      // Little endian, the bytes above 8 are ignored.
+      for (uptr i = 0; i < size && i < sizeof(res); i++)
+        res |= (u64)p[i] << (i * 8);
+      p += size;
+    }
+    return res;
+  }
+  u8 U8() { return (u8)Fixed(1); }
+  u16 U16() { return (u16)Fixed(2); }
+  u32 U32() { return (u32)Fixed(4); }
+  uptr Uleb() {
+    uptr res = 0;
+    for (uptr shift = 0; Has(1); shift += 7) {
+      u8 b = *p++;
+      if (shift < SANITIZER_WORDSIZE)
+        res |= (uptr)(b & 0x7f) << shift;
+      if (b < 0x80)
+        break;
+    }
+    return res;
+  }
+  sptr Sleb() {
+    uptr res = 0;
+    uptr shift = 0;
+    for (; Has(1); shift += 7) {
+      u8 b = *p++;
+      if (shift < SANITIZER_WORDSIZE)
+        res |= (uptr)(b & 0x7f) << shift;
+      if (b < 0x80) {
+        if ((b & 0x40) && shift + 7 < SANITIZER_WORDSIZE)
+          res |= (uptr)-1 << (shift + 7);
+        break;
+      }
+    }
+    return (sptr)res;
+  }
+  const char *Str() {
+    const u8 *s = p;
+    while (Has(1)) {
+      if (*p++ == 0)
+        return (const char*)s;
+    }
+    return 0;
+  }
+};
+
+static const char *StringAt(const u8 *section, uptr size, u64 offset) {
+  if (section == 0 || offset >= size)
+    return 0;
+  const char *s = (const char*)section + offset;
+  if (internal_memchr(s, 0, size - offset) == 0)
+    return 0;
+  return s;
+}
+
+// The tables may be larger than the internal allocator serves, so they are
+// mapped separately.
+template<class T>
+static T *MapTable(uptr n, const char *name) {
+  return n ? (T*)MmapOrDie(n * sizeof(T), name) : 0;
+}
+
+template<class T>
+static void UnmapTable(T *table, uptr n) {
+  UnmapOrDie(table, n * sizeof(T));
+}
+
+struct ElfSymbol {
+  uptr address;
+  uptr size;
+  const char *name;
+  // Demangled on the first use, leaked.
+  const char *demangled_name;
+};
+
+static bool CompareSymbols(const ElfSymbol &a, const ElfSymbol &b) {
+  return a.address < b.address;
+}
+
+struct LineFile {
+  const char *dir;
+  const char *name;
+};
+
+struct LineRow {
+  uptr address;
+  u32 file;
+  u32 line;
+  u32 column;
+};
+
+// Rows of a sequence have increasing addresses, the sequences of a line
+// program don't overlap.
+struct LineSequence {
+  uptr beg;
+  uptr end;
+  uptr first_row;
+  uptr n_rows;
+};
+
+static bool CompareSequences(const LineSequence &a, const LineSequence &b) {
+  return a.beg < b.beg;
+}
+
+struct LineProgram {
+  // Found by IndexLineProgramsFor.
+  const u8 *unit;
+  uptr beg;
+  uptr end;
+  // The largest end of this and the preceding programs in the index.
+  uptr max_end;
+  uptr n_rows;
+  uptr n_sequences;
+  // Filled by DecodeLineProgram.
+  bool decoded;
+  uptr n_decoded_sequences;
+  LineFile *files;
+  uptr n_files;
+  LineRow *rows;
+  LineSequence *sequences;
+};
+
+struct LineProgramHeader {
+  u16 version;
+  bool is_dwarf64;
+  uptr address_size;
+  u8 min_inst_length;
+  s8 line_base;
+  u8 line_range;
+  u8 opcode_base;
+  const u8 *standard_opcode_lengths;
+  // Directory and file tables.
+  const u8 *tables;
+  const u8 *program;
+  const u8 *end;
+};
+
+struct ElfSymbolizer::Module {
+  Module *next;
+  char *name;
+  bool loaded;
+  const u8 *file;
+  uptr file_size;
+
+  ElfSymbol *functions;
+  uptr n_functions;
+  ElfSymbol *objects;
+  uptr n_objects;
+
+  const u8 *debug_line;
+  uptr debug_line_size;
+  const u8 *debug_line_str;
+  uptr debug_line_str_size;
+  const u8 *debug_str;
+  uptr debug_str_size;
+  bool line_index_initialized;
+  // The line programs run so far, sorted by beg.
+  LineProgram *line_programs;
+  uptr n_line_programs;
+  // The first unit not run yet, or 0.
+  const u8 *next_line_unit;
+
+  void Load();
+  void LoadSymbols(const Elf_Shdr *symtab, const Elf_Shdr *sections,
+                   uptr n_sections, bool count_only);
+  ElfSymbol *FindSymbol(bool is_data, uptr address);
+  void InitLineIndex();
+  bool IndexLineProgramsFor(uptr address);
+  bool DecodeLineProgram(LineProgram *prog);
+  bool ReadFileTables(const LineProgramHeader &h, LineProgram *prog);
+  bool ReadEntryFormatString(DataReader *r, const LineProgramHeader &h,
+                             uptr form, const char **str);
+  bool FindLine(uptr address, LineFile *file, LineRow *row);
+  bool FindLineInProgram(LineProgram *prog, uptr address, LineFile *file,
+                         LineRow *row);
+  void Flush();
+};
+
+// Symbols.
+
+void ElfSymbolizer::Module::Load() {
+  loaded = true;
+  uptr openrv = OpenFile(name, false);
+  if (internal_iserror(openrv))
+    return;
+  fd_t fd = openrv;
+  uptr size = internal_filesize(fd);
+  uptr map = (uptr)-1;
+  if (size != (uptr)-1 && size > 0)
+    map = internal_mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  internal_close(fd);
+  if (map == (uptr)-1 || internal_iserror(map))
+    return;
+  const Elf_Ehdr *ehdr = (const Elf_Ehdr*)map;
+  if (size < sizeof(*ehdr) ||
+      internal_memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != kElfClass ||
+      ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+      ehdr->e_shentsize != sizeof(Elf_Shdr) ||
+      ehdr->e_shoff >= size ||
+      (size - ehdr->e_shoff) / sizeof(Elf_Shdr) < ehdr->e_shnum ||
+      ehdr->e_shstrndx >= ehdr->e_shnum) {
+    internal_munmap((void*)map, size);
+    return;
+  }
+  file = (const u8*)map;
+  file_size = size;
+  const Elf_Shdr *sections = (const Elf_Shdr*)(file + ehdr->e_shoff);
+  uptr n_sections = ehdr->e_shnum;
+  const Elf_Shdr *shstrtab = &sections[ehdr->e_shstrndx];
+  const Elf_Shdr *symtabs[2];
+  uptr n_symtabs = 0;
+  for (uptr i = 0; i < n_sections; i++) {
+    const Elf_Shdr *sec = &sections[i];
+    if (sec->sh_type == SHT_NOBITS || (sec->sh_flags & kShfCompressed) ||
+        sec->sh_offset > size || sec->sh_size > size - sec->sh_offset)
+      continue;
+    if (sec->sh_type == SHT_SYMTAB || sec->sh_type == SHT_DYNSYM) {
+      if (n_symtabs < ARRAY_SIZE(symtabs))
+        symtabs[n_symtabs++] = sec;
+      continue;
+    }
+    if (shstrtab->sh_offset > size ||
+        shstrtab->sh_size > size - shstrtab->sh_offset)
+      continue;
+    const char *sec_name = StringAt(file + shstrtab->sh_offset,
+                                    shstrtab->sh_size, sec->sh_name);
+    if (sec_name == 0)
+      continue;
+    const u8 *data = file + sec->sh_offset;
+    if (0 == internal_strcmp(sec_name, ".debug_line")) {
+      debug_line = data;
+      debug_line_size = sec->sh_size;
+    } else if (0 == internal_strcmp(sec_name, ".debug_line_str")) {
+      debug_line_str = data;
+      debug_line_str_size = sec->sh_size;
+    } else if (0 == internal_strcmp(sec_name, ".debug_str")) {
+      debug_str = data;
+      debug_str_size = sec->sh_size;
+    }
+  }
+  // .symtab and .dynsym may overlap, which doesn't matter.
+  for (uptr i = 0; i < n_symtabs; i++)
+    LoadSymbols(symtabs[i], sections, n_sections, /*count_only*/ true);
+  functions = MapTable<ElfSymbol>(n_functions, "ElfSymbolizer symbols");
+  objects = MapTable<ElfSymbol>(n_objects, "ElfSymbolizer symbols");
+  n_functions = n_objects = 0;
+  for (uptr i = 0; i < n_symtabs; i++)
+    LoadSymbols(symtabs[i], sections, n_sections, /*count_only*/ false);
+  InternalSort(&functions, n_functions, CompareSymbols);
+  InternalSort(&objects, n_objects, CompareSymbols);
+}
+
+// Appends the defined function and object symbols of the table to the
+// arrays, or only counts them.
+void ElfSymbolizer::Module::LoadSymbols(const Elf_Shdr *symtab,
+                                        const Elf_Shdr *sections,
+                                        uptr n_sections, bool count_only) {
+  if (symtab->sh_link >= n_sections || symtab->sh_entsize != sizeof(Elf_Sym))
+    return;
+  const Elf_Shdr *strtab = &sections[symtab->sh_link];
+  if (strtab->sh_offset > file_size ||
+      strtab->sh_size > file_size - strtab->sh_offset)
+    return;
+  const Elf_Sym *syms = (const Elf_Sym*)(file + symtab->sh_offset);
+  uptr n_syms = symtab->sh_size / sizeof(Elf_Sym);
+  for (uptr i = 0; i < n_syms; i++) {
+    const Elf_Sym *sym = &syms[i];
+    if (sym->st_shndx == SHN_UNDEF || sym->st_value == 0)
+      continue;
+    // Same as ELF64_ST_TYPE.
+    uptr type = ELF32_ST_TYPE(sym->st_info);
+    bool is_function = type == STT_FUNC || type == STT_GNU_IFUNC;
+    if (!is_function && type != STT_OBJECT)
+      continue;
+    const char *sym_name = StringAt(file + strtab->sh_offset,
+                                    strtab->sh_size, sym->st_name);
+    if (sym_name == 0 || sym_name[0] == '\0')
+      continue;
+    uptr *n = is_function ? &n_functions : &n_objects;
+    if (!count_only) {
+      ElfSymbol *s = is_function ? &functions[*n] : &objects[*n];
+      s->address = sym->st_value;
+      s->size = sym->st_size;
+      s->name = sym_name;
+      s->demangled_name = 0;
+    }
+    (*n)++;
+  }
+}
+
+ElfSymbol *ElfSymbolizer::Module::FindSymbol(bool is_data, uptr address) {
+  ElfSymbol *symbols = is_data ? objects : functions;
+  uptr n = is_data ? n_objects : n_functions;
+  // Find the first symbol above the address.
+  uptr lo = 0, hi = n;
+  while (lo < hi) {
+    uptr mid = lo + (hi - lo) / 2;
+    if (symbols[mid].address <= address)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return 0;
+  uptr start = symbols[lo - 1].address;
+  // Of the aliases, prefer the one with the size covering the address.
+  // Symbols without a size (e.g. written in assembly) cover everything up
+  // to the next symbol.
+  ElfSymbol *res = 0;
+  for (uptr i = lo; i > 0 && symbols[i - 1].address == start; i--) {
+    ElfSymbol *s = &symbols[i - 1];
+    if (address - start < s->size)
+      return s;
+    if (s->size == 0 && res == 0)
+      res = s;
+  }
+  return res;
+}
+
+// Line tables.
+
+static bool ReadLineProgramHeader(const u8 *unit, const u8 *section_end,
+                                  LineProgramHeader *h) {
+  DataReader r(unit, section_end);
+  u64 unit_length = r.U32();
+  h->is_dwarf64 = unit_length == 0xffffffffU;
+  if (h->is_dwarf64)
+    unit_length = r.Fixed(8);
+  if (r.failed || unit_length > (uptr)(section_end - r.p))
+    return false;
+  h->end = r.p + unit_length;
+  r.end = h->end;
+  h->version = r.U16();
+  if (h->version < 2 || h->version > 5)
+    return false;
+  h->address_size = sizeof(uptr);
+  if (h->version >= 5) {
+    h->address_size = r.U8();
+    r.Skip(1);  // segment_selector_size
+  }
+  u64 header_length = r.Fixed(h->is_dwarf64 ? 8 : 4);
+  if (r.failed || header_length > (uptr)(r.end - r.p))
+    return false;
+  h->program = r.p + header_length;
+  h->min_inst_length = r.U8();
+  if (h->version >= 4)
+    r.Skip(1);  // maximum_operations_per_instruction
+  r.Skip(1);  // default_is_stmt
+  h->line_base = (s8)r.U8();
+  h->line_range = r.U8();
+  h->opcode_base = r.U8();
+  h->standard_opcode_lengths = r.p;
+  if (h->opcode_base > 0)
+    r.Skip(h->opcode_base - 1);
+  h->tables = r.p;
+  return !r.failed && h->line_range != 0 && h->opcode_base != 0 &&
+         h->address_size <= sizeof(u64) && h->tables <= h->program;
+}
+
+// Runs the line program, calling the visitor for every row of every
+// sequence starting at a non-zero address (the sequences at zero belong to
+// the functions discarded by the linker), and at the end of the sequence.
+template<class Visitor>
+static bool RunLineProgram(const LineProgramHeader &h, Visitor *v) {
+  DataReader r(h.program, h.end);
+  uptr address = 0;
+  sptr line = 1;
+  uptr file = 1, column = 0;
+  bool sequence_started = false, sequence_dead = false;
+  while (r.p < r.end && !r.failed) {
+    u8 op = r.U8();
+    bool emit_row = false, end_sequence = false;
+    if (op >= h.opcode_base) {
+      uptr adjusted = op - h.opcode_base;
+      address += (adjusted / h.line_range) * h.min_inst_length;
+      line += h.line_base + (sptr)(adjusted % h.line_range);
+      emit_row = true;
+    } else if (op == 0) {
+      uptr length = r.Uleb();
+      if (length == 0 || !r.Has(length))
+        return false;
+      const u8 *next = r.p + length;
+      u8 sub_op = r.U8();
+      if (sub_op == kLneEndSequence) {
+        emit_row = end_sequence = true;
+      } else if (sub_op == kLneSetAddress) {
+        address = (uptr)r.Fixed(length - 1);
+      }
+      r.p = next;
+    } else if (op == kLnsCopy) {
+      emit_row = true;
+    } else if (op == kLnsAdvancePc) {
+      address += r.Uleb() * h.min_inst_length;
+    } else if (op == kLnsAdvanceLine) {
+      line += r.Sleb();
+    } else if (op == kLnsSetFile) {
+      file = r.Uleb();
+    } else if (op == kLnsSetColumn) {
+      column = r.Uleb();
+    } else if (op == kLnsConstAddPc) {
+      address += ((255 - h.opcode_base) / h.line_range) * h.min_inst_length;
+    } else if (op == kLnsFixedAdvancePc) {
+      address += r.U16();
+    } else {
+      // Skip the operands of the other standard opcodes.
+      for (u8 i = 0; i < h.standard_opcode_lengths[op - 1]; i++)
+        r.Uleb();
+    }
+    if (!emit_row)
+      continue;
+    if (!sequence_started) {
+      sequence_started = true;
+      sequence_dead = address == 0;
+    }
+    if (!sequence_dead) {
+      if (end_sequence)
+        v->EndSequence(address);
+      else
+        v->Row(address, file, line > 0 ? line : 0, column);
+    }
+    if (end_sequence) {
+      address = 0;
+      line = 1;
+      file = 1;
+      column = 0;
+      sequence_started = false;
+    }
+  }
+  return !r.failed;
+}
+
+// Computes the address range and the size of the decoded program.
+struct LineProgramIndexer {
+  LineProgram *prog;
+  uptr sequence_beg;
+  uptr sequence_rows;
+
+  void Row(uptr address, uptr file, uptr line, uptr column) {
+    if (sequence_rows++ == 0)
+      sequence_beg = address;
+  }
+  void EndSequence(uptr address) {
+    if (sequence_rows > 0 && sequence_beg < address) {
+      prog->beg = Min(prog->beg, sequence_beg);
+      prog->end = Max(prog->end, address);
+      prog->n_rows += sequence_rows;
+      prog->n_sequences++;
+    }
+    sequence_rows = 0;
+  }
+};
+
+// Stores the rows of the sequences the indexer has counted. The other
+// sequences (e.g. an empty one, or one left without an end at the end of the
+// program) are dropped, and their rows may not fit.
+struct LineProgramDecoder {
+  LineProgram *prog;
+  uptr n_rows;
+  uptr n_sequences;
+  uptr sequence_first_row;
+  bool rows_dropped;
+
+  void Row(uptr address, uptr file, uptr line, uptr column) {
+    if (n_rows == prog->n_rows) {
+      rows_dropped = true;
+      return;
+    }
+    LineRow *row = &prog->rows[n_rows++];
+    row->address = address;
+    row->file = (u32)file;
+    row->line = (u32)line;
+    row->column = (u32)column;
+  }
+  void EndSequence(uptr address) {
+    uptr first_row = sequence_first_row;
+    bool rows_complete = !rows_dropped;
+    rows_dropped = false;
+    if (!rows_complete || n_rows == first_row ||
+        prog->rows[first_row].address >= address ||
+        n_sequences == prog->n_sequences) {
+      n_rows = first_row;
+      return;
+    }
+    sequence_first_row = n_rows;
+    LineSequence *seq = &prog->sequences[n_sequences++];
+    seq->beg = prog->rows[first_row].address;
+    seq->end = address;
+    seq->first_row = first_row;
+    seq->n_rows = n_rows - first_row;
+  }
+};
+
+static bool CompareLinePrograms(const LineProgram &a, const LineProgram &b) {
+  return a.beg < b.beg;
+}
+
+// Allocates the index for all the line programs of the module. A program
+// has to be run to find its address range, so the programs are run only
+// when a lookup needs them (see IndexLineProgramsFor).
+void ElfSymbolizer::Module::InitLineIndex() {
+  line_index_initialized = true;
+  if (debug_line == 0)
+    return;
+  const u8 *section_end = debug_line + debug_line_size;
+  uptr n_units = 0;
+  LineProgramHeader h;
+  for (const u8 *unit = debug_line; unit < section_end; unit = h.end) {
+    if (!ReadLineProgramHeader(unit, section_end, &h))
+      break;
+    n_units++;
+  }
+  if (n_units == 0)
+    return;
+  line_programs = MapTable<LineProgram>(n_units, "ElfSymbolizer line index");
+  next_line_unit = debug_line;
+}
+
+// Runs the line programs not indexed yet, up to the one whose address range
+// covers the address. Returns false if none of them does.
+bool ElfSymbolizer::Module::IndexLineProgramsFor(uptr address) {
+  const u8 *section_end = debug_line + debug_line_size;
+  uptr n_indexed = n_line_programs;
+  bool found = false;
+  while (next_line_unit && !found) {
+    const u8 *unit = next_line_unit;
+    LineProgramHeader h;
+    if (unit >= section_end || !ReadLineProgramHeader(unit, section_end, &h)) {
+      next_line_unit = 0;
+      break;
+    }
+    next_line_unit = h.end;
+    LineProgram *prog = &line_programs[n_line_programs];
+    internal_memset(prog, 0, sizeof(*prog));
+    prog->unit = unit;
+    prog->beg = (uptr)-1;
+    LineProgramIndexer indexer = {prog, 0, 0};
+    if (!RunLineProgram(h, &indexer) || prog->n_sequences == 0)
+      continue;
+    n_line_programs++;
+    found = prog->beg <= address && address < prog->end;
+  }
+  if (n_line_programs > n_indexed) {
+    InternalSort(&line_programs, n_line_programs, CompareLinePrograms);
+    uptr max_end = 0;
+    for (uptr i = 0; i < n_line_programs; i++) {
+      max_end = Max(max_end, line_programs[i].end);
+      line_programs[i].max_end = max_end;
+    }
+  }
+  return found;
+}
+
+bool ElfSymbolizer::Module::ReadEntryFormatString(DataReader *r,
+                                                  const LineProgramHeader &h,
+                                                  uptr form,
+                                                  const char **str) {
+  switch (form) {
+    case kFormString:
+      *str = r->Str();
+      return true;
+    case kFormLineStrp:
+      *str = StringAt(debug_line_str, debug_line_str_size,
+                      r->Fixed(h.is_dwarf64 ? 8 : 4));
+      return true;
+    case kFormStrp:
+      *str = StringAt(debug_str, debug_str_size,
+                      r->Fixed(h.is_dwarf64 ? 8 : 4));
+      return true;
+    case kFormUdata: r->Uleb(); return true;
+    case kFormData1: r->Skip(1); return true;
+    case kFormData2: r->Skip(2); return true;
+    case kFormData4: r->Skip(4); return true;
+    case kFormData8: r->Skip(8); return true;
+    case kFormData16: r->Skip(16); return true;
+    case kFormBlock1: r->Skip(r->U8()); return true;
+    case kFormBlock2: r->Skip(r->U16()); return true;
+    case kFormBlock4: r->Skip(r->U32()); return true;
+    case kFormBlock: r->Skip(r->Uleb()); return true;
+  }
+  // E.g. DW_FORM_strx, which needs .debug_str_offsets and the unit DIE.
+  return false;
+}
+
+// Reads the directory and file name tables into prog->files. Entry 0 is the
+// primary source file in DWARF 5 and unused before.
+bool ElfSymbolizer::Module::ReadFileTables(const LineProgramHeader &h,
+                                           LineProgram *prog) {
+  DataReader r(h.tables, h.program);
+  if (h.version < 5) {
+    uptr n_dirs = 1;
+    const u8 *dirs_beg = r.p;
+    while (r.Has(1) && *r.p != 0) {
+      r.Str();
+      n_dirs++;
+    }
+    r.Skip(1);
+    const u8 *files_beg = r.p;
+    uptr n_files = 1;
+    while (r.Has(1) && *r.p != 0) {
+      r.Str();
+      r.Uleb();
+      r.Uleb();
+      r.Uleb();
+      n_files++;
+    }
+    if (r.failed)
+      return false;
+    InternalScopedBuffer<const char*> dirs(n_dirs);
+    // Directory 0 is the compilation directory, which is not in the table.
+    dirs[0] = 0;
+    r.p = dirs_beg;
+    for (uptr i = 1; i < n_dirs; i++)
+      dirs[i] = r.Str();
+    prog->files = MapTable<LineFile>(n_files, "ElfSymbolizer files");
+    prog->n_files = n_files;
+    prog->files[0].dir = prog->files[0].name = 0;
+    r.p = files_beg;
+    for (uptr i = 1; i < n_files; i++) {
+      prog->files[i].name = r.Str();
+      uptr dir = r.Uleb();
+      prog->files[i].dir = dir < n_dirs ? dirs[dir] : 0;
+      r.Uleb();
+      r.Uleb();
+    }
+    return !r.failed;
+  }
+  const char **dirs = 0;
+  uptr n_dirs = 0;
+  bool ok = true;
+  for (uptr table = 0; table < 2 && ok; table++) {
+    static const uptr kMaxFormats = 16;
+    uptr content_types[kMaxFormats], forms[kMaxFormats];
+    uptr n_formats = r.U8();
+    uptr n_entries = 0;
+    if (n_formats <= kMaxFormats) {
+      for (uptr i = 0; i < n_formats; i++) {
+        content_types[i] = r.Uleb();
+        forms[i] = r.Uleb();
+      }
+      n_entries = r.Uleb();
+    }
+    // Every entry takes at least a byte.
+    if (n_formats > kMaxFormats || r.failed ||
+        n_entries > (uptr)(r.end - r.p)) {
+      ok = false;
+      break;
+    }
+    if (table == 0) {
+      dirs = MapTable<const char*>(n_entries, "ElfSymbolizer files");
+      n_dirs = n_entries;
+    } else {
+      prog->files = MapTable<LineFile>(n_entries, "ElfSymbolizer files");
+      prog->n_files = n_entries;
+    }
+    for (uptr e = 0; e < n_entries && ok; e++) {
+      const char *path = 0;
+      uptr dir = 0;
+      for (uptr i = 0; i < n_formats && ok; i++) {
+        if (content_types[i] == kLnctDirectoryIndex) {
+          if (forms[i] == kFormUdata)
+            dir = r.Uleb();
+          else if (forms[i] == kFormData1)
+            dir = r.U8();
+          else if (forms[i] == kFormData2)
+            dir = r.U16();
+          else
+            ok = false;
+        } else {
+          const char *str = 0;
+          ok = ReadEntryFormatString(&r, h, forms[i], &str);
+          if (content_types[i] == kLnctPath)
+            path = str;
+        }
+      }
+      if (table == 0) {
+        dirs[e] = path;
+      } else {
+        prog->files[e].name = path;
+        prog->files[e].dir = dir < n_dirs ? dirs[dir] : 0;
+      }
+    }
+  }
+  UnmapTable(dirs, n_dirs);
+  return ok && !r.failed;
+}
+
+bool ElfSymbolizer::Module::DecodeLineProgram(LineProgram *prog) {
+  prog->decoded = true;
+  LineProgramHeader h;
+  if (!ReadLineProgramHeader(prog->unit, debug_line + debug_line_size, &h))
+    return false;
+  prog->rows = MapTable<LineRow>(prog->n_rows, "ElfSymbolizer lines");
+  prog->sequences =
+      MapTable<LineSequence>(prog->n_sequences, "ElfSymbolizer lines");
+  LineProgramDecoder decoder = {prog, 0, 0, 0, false};
+  if (!ReadFileTables(h, prog) || !RunLineProgram(h, &decoder))
+    return false;
+  prog->n_decoded_sequences = decoder.n_sequences;
+  InternalSort(&prog->sequences, prog->n_decoded_sequences, CompareSequences);
+  return true;
+}
+
+bool ElfSymbolizer::Module::FindLineInProgram(LineProgram *prog,
+                                              uptr address, LineFile *file,
+                                              LineRow *row) {
+  if (!prog->decoded)
+    DecodeLineProgram(prog);
+  // The last sequence starting at or below the address.
+  uptr lo = 0, hi = prog->n_decoded_sequences;
+  while (lo < hi) {
+    uptr mid = lo + (hi - lo) / 2;
+    if (prog->sequences[mid].beg <= address)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0 || address >= prog->sequences[lo - 1].end)
+    return false;
+  const LineSequence *seq = &prog->sequences[lo - 1];
+  // The last row at or below the address (the first row is).
+  const LineRow *rows = prog->rows + seq->first_row;
+  lo = 1;
+  hi = seq->n_rows;
+  while (lo < hi) {
+    uptr mid = lo + (hi - lo) / 2;
+    if (rows[mid].address <= address)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *row = rows[lo - 1];
+  if (row->file < prog->n_files) {
+    *file = prog->files[row->file];
+  } else {
+    file->dir = file->name = 0;
+  }
+  return true;
+}
+
+bool ElfSymbolizer::Module::FindLine(uptr address, LineFile *file,
+                                     LineRow *row) {
+  if (!line_index_initialized)
+    InitLineIndex();
+  do {
+    // The last program starting at or below the address. The address ranges
+    // of the programs may overlap, so the preceding ones which reach the
+    // address are tried too.
+    uptr lo = 0, hi = n_line_programs;
+    while (lo < hi) {
+      uptr mid = lo + (hi - lo) / 2;
+      if (line_programs[mid].beg <= address)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    for (uptr i = lo; i > 0 && line_programs[i - 1].max_end > address; i--) {
+      LineProgram *prog = &line_programs[i - 1];
+      if (address >= prog->end)
+        continue;
+      if (FindLineInProgram(prog, address, file, row))
+        return true;
+    }
+  } while (IndexLineProgramsFor(address));
+  return false;
+}
+
+void ElfSymbolizer::Module::Flush() {
+  for (uptr i = 0; i < n_line_programs; i++) {
+    LineProgram *prog = &line_programs[i];
+    if (!prog->decoded)
+      continue;
+    UnmapTable(prog->files, prog->n_files);
+    UnmapTable(prog->rows, prog->n_rows);
+    UnmapTable(prog->sequences, prog->n_sequences);
+    prog->files = 0;
+    prog->n_files = 0;
+    prog->rows = 0;
+    prog->sequences = 0;
+    prog->n_decoded_sequences = 0;
+    prog->decoded = false;
+  }
+}
+
+// ElfSymbolizer.
+
+ElfSymbolizer *ElfSymbolizer::get(LowLevelAllocator *allocator) {
+  void *mem = allocator->Allocate(sizeof(ElfSymbolizer));
+  return new(mem) ElfSymbolizer(allocator);
+}
+
+ElfSymbolizer::Module *ElfSymbolizer::GetModule(const char *module_name) {
+  if (last_module_ && 0 == internal_strcmp(last_module_->name, module_name))
+    return last_module_;
+  Module *m = modules_;
+  while (m && internal_strcmp(m->name, module_name) != 0)
+    m = m->next;
+  if (m == 0) {
+    m = (Module*)allocator_->Allocate(sizeof(Module));
+    internal_memset(m, 0, sizeof(*m));
+    m->name = internal_strdup(module_name);
+    m->next = modules_;
+    modules_ = m;
+  }
+  if (!m->loaded)
+    m->Load();
+  last_module_ = m;
+  return m;
+}
+
+const char *ElfSymbolizer::SendCommand(bool is_data, const char *module_name,
+                                       uptr module_offset) {
+  Module *m = GetModule(module_name);
+  if (m->file == 0)
+    return 0;
+  ElfSymbol *sym = m->FindSymbol(is_data, module_offset);
+  const char *sym_name = "??";
+  if (sym) {
+    if (sym->demangled_name == 0)
+      sym->demangled_name = DemangleCXXABI(sym->name);
+    sym_name = sym->demangled_name;
+  }
+  if (is_data) {
+    internal_snprintf(buffer_, kBufferSize, "%s\n%zu %zu\n\n", sym_name,
+                      sym ? sym->address : 0, sym ? sym->size : 0);
+    return buffer_;
+  }
+  LineFile file;
+  LineRow row;
+  if (!m->FindLine(module_offset, &file, &row) || file.name == 0) {
+    internal_snprintf(buffer_, kBufferSize, "%s\n??:0:0\n\n", sym_name);
+  } else if (file.name[0] == '/' || file.dir == 0) {
+    internal_snprintf(buffer_, kBufferSize, "%s\n%s:%d:%d\n\n", sym_name,
+                      file.name, (int)row.line, (int)row.column);
+  } else {
+    internal_snprintf(buffer_, kBufferSize, "%s\n%s/%s:%d:%d\n\n", sym_name,
+                      file.dir, file.name, (int)row.line, (int)row.column);
+  }
+  return buffer_;
+}
+
+void ElfSymbolizer::Flush() {
+  for (Module *m = modules_; m; m = m->next)
+    m->Flush();
+}
+
+}  // namespace __sanitizer
+
+#else  // SANITIZER_LINUX
+
+namespace __sanitizer {
+
+ElfSymbolizer *ElfSymbolizer::get(LowLevelAllocator *allocator) {
+  return 0;
+}
+
+const char *ElfSymbolizer::SendCommand(bool is_data, const char *module_name,
+                                       uptr module_offset) {
+  return 0;
+}
+
+void ElfSymbolizer::Flush() {
+}
+
+}  // namespace __sanitizer
+
+#endif  // SANITIZER_LINUX
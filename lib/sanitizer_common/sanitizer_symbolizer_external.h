@@ -0,0 +1,196 @@
+//===-- sanitizer_symbolizer_external.h -------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is shared between sanitizer run-time libraries.
+// Client of the external symbolizer program, see sanitizer_symbolizer.h.
+//===----------------------------------------------------------------------===//
+#ifndef SANITIZER_SYMBOLIZER_EXTERNAL_H
+#define SANITIZER_SYMBOLIZER_EXTERNAL_H
+
+#include "sanitizer_common.h"
+#include "sanitizer_libc.h"
+#include "sanitizer_symbolizer.h"
+
+namespace __sanitizer {
+
+// ExternalSymbolizer encapsulates communication between the tool and
+// external symbolizer program, running in a different subprocess,
+// For now we assume the following protocol:
+// For each request of the form
+//   <module_name> <module_offset>
+// passed to STDIN, external symbolizer prints to STDOUT response:
+//   <function_name>
+//   <file_name>:<line_number>:<column_number>
+//   <function_name>
+//   <file_name>:<line_number>:<column_number>
+//   ...
+//   <empty line>
+class ExternalSymbolizer {
+ public:
+  ExternalSymbolizer(const char *path, int input_fd, int output_fd)
+      : path_(path),
+        input_fd_(input_fd),
+        output_fd_(output_fd),
+        times_restarted_(0) {
+    CHECK(path_);
+    CHECK_NE(input_fd_, kInvalidFd);
+    CHECK_NE(output_fd_, kInvalidFd);
+  }
+
+  char *SendCommand(bool is_data, const char *module_name, uptr module_offset) {
+    CHECK(module_name);
+    uptr length = formatRequest(buffer_, kBufferSize, is_data, module_name,
+                                module_offset);
+    if (!writeToSymbolizer(buffer_, length))
+      return 0;
+    if (!readFromSymbolizer(buffer_, kBufferSize))
+      return 0;
+    return buffer_;
+  }
+
+  typedef void (*ReplyCallback)(uptr index, const char *reply, void *arg);
+
+  // Sends n requests, pipelining them: the requests are written ahead of
+  // reading the replies, as long as the unanswered ones are small enough to
+  // fit into the pipe. Otherwise the symbolizer could block on writing a
+  // reply while we block on writing a request. Calls cb for every reply, in
+  // order. Returns the number of replies received before an error, after
+  // which the symbolizer has to be restarted.
+  uptr SendBatch(bool is_data, const char *const *module_names,
+                 const uptr *module_offsets, uptr n, ReplyCallback cb,
+                 void *arg) {
+    static const uptr kMaxInFlightBytes = 16 * 1024;
+    static const uptr kMaxInFlight = 256;
+    static const uptr kMaxRequestSize = kMaxPathLength + 64;
+    uptr request_sizes[kMaxInFlight];
+    char request[kMaxRequestSize];
+    uptr sent = 0, answered = 0, in_flight_bytes = 0, buffered = 0;
+    while (answered < n) {
+      while (sent < n && sent - answered < kMaxInFlight) {
+        uptr length = formatRequest(request, kMaxRequestSize, is_data,
+                                    module_names[sent], module_offsets[sent]);
+        if (sent > answered && in_flight_bytes + length > kMaxInFlightBytes)
+          break;
+        if (!writeToSymbolizer(request, length))
+          return answered;
+        request_sizes[sent % kMaxInFlight] = length;
+        in_flight_bytes += length;
+        sent++;
+      }
+      // Replies end with an empty line.
+      uptr reply_length;
+      while ((reply_length = findReplyEnd(buffer_, buffered)) == 0) {
+        if (buffered + 1 >= kBufferSize) {
+          Report("WARNING: Symbolizer reply is too long\n");
+          return answered;
+        }
+        uptr just_read = internal_read(input_fd_, buffer_ + buffered,
+                                       kBufferSize - buffered - 1);
+        if (just_read == 0 || just_read == (uptr)-1) {
+          Report("WARNING: Can't read from symbolizer at fd %d\n", input_fd_);
+          return answered;
+        }
+        buffered += just_read;
+      }
+      char next = buffer_[reply_length];
+      buffer_[reply_length] = '\0';
+      cb(answered, buffer_, arg);
+      buffer_[reply_length] = next;
+      buffered -= reply_length;
+      internal_memmove(buffer_, buffer_ + reply_length, buffered);
+      in_flight_bytes -= request_sizes[answered % kMaxInFlight];
+      answered++;
+    }
+    return answered;
+  }
+
+  bool Restart() {
+    if (times_restarted_ >= kMaxTimesRestarted) return false;
+    times_restarted_++;
+    internal_close(input_fd_);
+    internal_close(output_fd_);
+    return StartSymbolizerSubprocess(path_, &input_fd_, &output_fd_);
+  }
+
+  void Flush() {
+  }
+
+ private:
+  static uptr formatRequest(char *buffer, uptr max_length, bool is_data,
+                            const char *module_name, uptr module_offset) {
+    uptr length = internal_snprintf(buffer, max_length, "%s\"%s\" 0x%zx\n",
+                                    is_data ? "DATA " : "", module_name,
+                                    module_offset);
+    return Min(length, max_length - 1);
+  }
+
+  // Returns the length of the first reply in the buffer, 0 if it's
+  // incomplete.
+  static uptr findReplyEnd(const char *buffer, uptr length) {
+    for (uptr i = 1; i < length; i++) {
+      if (buffer[i] == '\n' && buffer[i - 1] == '\n')
+        return i + 1;
+    }
+    return 0;
+  }
+
+  // Reads one reply and terminates it with '\0'.
+  bool readFromSymbolizer(char *buffer, uptr max_length) {
+    if (max_length == 0)
+      return true;
+    uptr read_len = 0;
+    while (true) {
+      if (read_len + 1 >= max_length) {
+        Report("WARNING: Symbolizer reply is too long\n");
+        return false;
+      }
+      uptr just_read = internal_read(input_fd_, buffer + read_len,
+                                     max_length - read_len - 1);
+      // We can't read 0 bytes, as we don't expect external symbolizer to close
+      // its stdout.
+      if (just_read == 0 || just_read == (uptr)-1) {
+        Report("WARNING: Can't read from symbolizer at fd %d\n", input_fd_);
+        return false;
+      }
+      read_len += just_read;
+      // Empty line marks the end of symbolizer output.
+      if (read_len >= 2 && buffer[read_len - 1] == '\n' &&
+                           buffer[read_len - 2] == '\n') {
+        break;
+      }
+    }
+    buffer[read_len] = '\0';
+    return true;
+  }
+
+  bool writeToSymbolizer(const char *buffer, uptr length) {
+    if (length == 0)
+      return true;
+    uptr write_len = internal_write(output_fd_, buffer, length);
+    if (write_len == 0 || write_len == (uptr)-1) {
+      Report("WARNING: Can't write to symbolizer at fd %d\n", output_fd_);
+      return false;
+    }
+    return true;
+  }
+
+  const char *path_;
+  int input_fd_;
+  int output_fd_;
+
+  static const uptr kBufferSize = 16 * 1024;
+  char buffer_[kBufferSize];
+
+  static const uptr kMaxTimesRestarted = 5;
+  uptr times_restarted_;
+};
+
+}  // namespace __sanitizer
+
+#endif  // SANITIZER_SYMBOLIZER_EXTERNAL_H
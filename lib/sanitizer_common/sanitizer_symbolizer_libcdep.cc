@@ -13,9 +13,13 @@
 
 #include "sanitizer_allocator_internal.h"
 #include "sanitizer_common.h"
+#include "sanitizer_flags.h"
 #include "sanitizer_placement_new.h"
 #include "sanitizer_procmaps.h"
 #include "sanitizer_symbolizer.h"
+#include "sanitizer_symbolizer_cache.h"
+#include "sanitizer_symbolizer_elf.h"
+#include "sanitizer_symbolizer_external.h"
 
 namespace __sanitizer {
 
@@ -32,6 +36,11 @@ LoadedModule::LoadedModule(const char *module_name, uptr base_address) {
   n_ranges_ = 0;
 }
 
+void LoadedModule::clear() {
+  InternalFree(full_name_);
+  full_name_ = 0;
+}
+
 void LoadedModule::addAddressRange(uptr beg, uptr end) {
   CHECK_LT(n_ranges_, kMaxNumberOfAddressRanges);
   ranges_[n_ranges_].beg = beg;
@@ -47,6 +56,88 @@ bool LoadedModule::containsAddress(uptr address) const {
   return false;
 }
 
+void LoadedModuleIndex::Update() {
+  if (!loaded_) {
+    Reload();
+    return;
+  }
+  u64 generation;
+  if (has_generation_ && GetLoadedModulesGeneration(&generation) &&
+      generation != generation_)
+    Reload();
+}
+
+LoadedModule *LoadedModuleIndex::Lookup(uptr address) const {
+  // Find the first range starting above the address.
+  uptr lo = 0, hi = n_ranges_;
+  while (lo < hi) {
+    uptr mid = lo + (hi - lo) / 2;
+    if (ranges_[mid].beg <= address)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0 || address >= ranges_[lo - 1].end)
+    return 0;
+  return ranges_[lo - 1].module;
+}
+
+LoadedModule *LoadedModuleIndex::FindModule(uptr address) {
+  bool reloaded = !loaded_;
+  Update();
+  if (LoadedModule *module = Lookup(address))
+    return module;
+  // Without the generation, a miss is the only sign of a new module.
+  // FIXME: It's too aggressive to reload the list of modules each time we
+  // fail to find a module for a given address.
+  if (has_generation_ || reloaded)
+    return 0;
+  Reload();
+  return Lookup(address);
+}
+
+void LoadedModuleIndex::Reload() {
+  // Read the generation first, so that a module loaded meanwhile makes the
+  // index stale.
+  has_generation_ = GetLoadedModulesGeneration(&generation_);
+  if (modules_ == 0) {
+    modules_ = (LoadedModule*)MmapOrDie(
+        kMaxNumberOfModules * sizeof(LoadedModule), "LoadedModuleIndex");
+  }
+  for (uptr i = 0; i < n_modules_; i++)
+    modules_[i].clear();
+  n_modules_ = GetListOfModules(modules_, kMaxNumberOfModules,
+                                /* filter */ 0);
+  // FIXME: Return this check when GetListOfModules is implemented on Mac.
+  // CHECK_GT(n_modules_, 0);
+  CHECK_LT(n_modules_, kMaxNumberOfModules);
+  uptr n_ranges = 0;
+  for (uptr i = 0; i < n_modules_; i++)
+    n_ranges += modules_[i].n_ranges();
+  if (n_ranges > ranges_capacity_) {
+    if (ranges_)
+      UnmapOrDie(ranges_, ranges_capacity_ * sizeof(Range));
+    ranges_capacity_ = RoundUpToPowerOfTwo(n_ranges);
+    ranges_ = (Range*)MmapOrDie(ranges_capacity_ * sizeof(Range),
+                                "LoadedModuleIndex");
+  }
+  n_ranges_ = 0;
+  for (uptr i = 0; i < n_modules_; i++) {
+    LoadedModule *module = &modules_[i];
+    for (uptr j = 0; j < module->n_ranges(); j++) {
+      if (module->range_beg(j) >= module->range_end(j))
+        continue;
+      Range *r = &ranges_[n_ranges_++];
+      r->beg = module->range_beg(j);
+      r->end = module->range_end(j);
+      r->module = module;
+    }
+  }
+  InternalSort(&ranges_, n_ranges_, CompareRanges);
+  loaded_ = true;
+  n_reloads_++;
+}
+
 // Extracts the prefix of "str" that consists of any characters not
 // present in "delims" string, and copies this prefix to "result", allocating
 // space for it.
@@ -86,98 +177,6 @@ static const char *ExtractUptr(const char *str, const char *delims,
   return ret;
 }
 
-// ExternalSymbolizer encapsulates communication between the tool and
-// external symbolizer program, running in a different subprocess,
-// For now we assume the following protocol:
-// For each request of the form
-//   <module_name> <module_offset>
-// passed to STDIN, external symbolizer prints to STDOUT response:
-//   <function_name>
-//   <file_name>:<line_number>:<column_number>
-//   <function_name>
-//   <file_name>:<line_number>:<column_number>
-//   ...
-//   <empty line>
-class ExternalSymbolizer {
- public:
-  ExternalSymbolizer(const char *path, int input_fd, int output_fd)
-      : path_(path),
-        input_fd_(input_fd),
-        output_fd_(output_fd),
-        times_restarted_(0) {
-    CHECK(path_);
-    CHECK_NE(input_fd_, kInvalidFd);
-    CHECK_NE(output_fd_, kInvalidFd);
-  }
-
-  char *SendCommand(bool is_data, const char *module_name, uptr module_offset) {
-    CHECK(module_name);
-    internal_snprintf(buffer_, kBufferSize, "%s\"%s\" 0x%zx\n",
-                      is_data ? "DATA " : "", module_name, module_offset);
-    if (!writeToSymbolizer(buffer_, internal_strlen(buffer_)))
-      return 0;
-    if (!readFromSymbolizer(buffer_, kBufferSize))
-      return 0;
-    return buffer_;
-  }
-
-  bool Restart() {
-    if (times_restarted_ >= kMaxTimesRestarted) return false;
-    times_restarted_++;
-    internal_close(input_fd_);
-    internal_close(output_fd_);
-    return StartSymbolizerSubprocess(path_, &input_fd_, &output_fd_);
-  }
-
-  void Flush() {
-  }
-
- private:
-  bool readFromSymbolizer(char *buffer, uptr max_length) {
-    if (max_length == 0)
-      return true;
-    uptr read_len = 0;
-    while (true) {
-      uptr just_read = internal_read(input_fd_, buffer + read_len,
-                                     max_length - read_len);
-      // We can't read 0 bytes, as we don't expect external symbolizer to close
-      // its stdout.
-      if (just_read == 0 || just_read == (uptr)-1) {
-        Report("WARNING: Can't read from symbolizer at fd %d\n", input_fd_);
-        return false;
-      }
-      read_len += just_read;
-      // Empty line marks the end of symbolizer output.
-      if (read_len >= 2 && buffer[read_len - 1] == '\n' &&
-                           buffer[read_len - 2] == '\n') {
-        break;
-      }
-    }
-    return true;
-  }
-
-  bool writeToSymbolizer(const char *buffer, uptr length) {
-    if (length == 0)
-      return true;
-    uptr write_len = internal_write(output_fd_, buffer, length);
-    if (write_len == 0 || write_len == (uptr)-1) {
-      Report("WARNING: Can't write to symbolizer at fd %d\n", output_fd_);
-      return false;
-    }
-    return true;
-  }
-
-  const char *path_;
-  int input_fd_;
-  int output_fd_;
-
-  static const uptr kBufferSize = 16 * 1024;
-  char buffer_[kBufferSize];
-
-  static const uptr kMaxTimesRestarted = 5;
-  uptr times_restarted_;
-};
-
 static LowLevelAllocator symbolizer_allocator;  // Linker initialized.
 
 #if SANITIZER_SUPPORTS_WEAK_HOOKS
@@ -345,6 +344,9 @@ class Symbolizer {
   }
 
   bool InitializeExternalSymbolizer(const char *path_to_symbolizer) {
+    // The in-process symbolizer makes the subprocess unnecessary.
+    if (GetElfSymbolizer())
+      return true;
     int input_fd, output_fd;
     if (!StartSymbolizerSubprocess(path_to_symbolizer, &input_fd, &output_fd))
       return false;
@@ -357,12 +359,15 @@ class Symbolizer {
   bool IsSymbolizerAvailable() {
     if (internal_symbolizer_ == 0)
       internal_symbolizer_ = InternalSymbolizer::get();
-    return internal_symbolizer_ || external_symbolizer_;
+    return internal_symbolizer_ || GetElfSymbolizer() || external_symbolizer_;
   }
 
   void Flush() {
+    cache_.Clear();
     if (internal_symbolizer_)
       internal_symbolizer_->Flush();
+    if (elf_symbolizer_)
+      elf_symbolizer_->Flush();
     if (external_symbolizer_)
       external_symbolizer_->Flush();
   }
@@ -373,8 +378,63 @@ class Symbolizer {
     return DemangleCXXABI(name);
   }
 
+  void PrefetchCode(const uptr *addresses, uptr count) {
+    if (count == 0 || !IsSymbolizerAvailable() || internal_symbolizer_ ||
+        GetElfSymbolizer() || !external_symbolizer_)
+      return;
+    // Don't evict the replies fetched by this batch with the batch itself.
+    static const uptr kMaxBatchSize = SymbolizerCache::kSize / 2;
+    InternalScopedBuffer<const char*> module_names(kMaxBatchSize);
+    InternalScopedBuffer<uptr> module_offsets(kMaxBatchSize);
+    // Sorted, so that the repeated addresses are skipped in one pass.
+    InternalScopedBuffer<uptr> sorted(count);
+    internal_memcpy(sorted.data(), addresses, count * sizeof(uptr));
+    SortArray(sorted.data(), count);
+    uptr n = 0;
+    // The module names must stay valid until the batch is sent.
+    modules_.Update();
+    ClearCacheIfModulesReloaded();
+    for (uptr i = 0; i < count && n < kMaxBatchSize; i++) {
+      if (i > 0 && sorted[i] == sorted[i - 1])
+        continue;
+      LoadedModule *module = modules_.Lookup(sorted[i]);
+      if (module == 0)
+        continue;
+      const char *module_name = module->full_name();
+      uptr module_offset = sorted[i] - module->base_address();
+      if (cache_.Contains(false, module_name, module_offset))
+        continue;
+      module_names[n] = module_name;
+      module_offsets[n] = module_offset;
+      n++;
+    }
+    if (n == 0)
+      return;
+    PrefetchBatch batch = {this, module_names.data(), module_offsets.data()};
+    uptr answered = external_symbolizer_->SendBatch(
+        false, module_names.data(), module_offsets.data(), n, CacheReply,
+        &batch);
+    // The unanswered requests would confuse the following ones.
+    if (answered < n && !external_symbolizer_->Restart()) {
+      ReportExternalSymbolizerError(
+          "WARNING: Failed to use and restart external symbolizer!\n");
+      external_symbolizer_ = 0;
+    }
+  }
+
+  bool GetModuleNameAndOffsetForPC(uptr pc, const char **module_name,
+                                   uptr *module_offset) {
+    LoadedModule *module = FindModuleForAddress(pc);
+    if (module == 0)
+      return false;
+    *module_name = module->full_name();
+    *module_offset = pc - module->base_address();
+    return true;
+  }
+
  private:
-  char *SendCommand(bool is_data, const char *module_name, uptr module_offset) {
+  const char *SendCommand(bool is_data, const char *module_name,
+                          uptr module_offset) {
     // First, try to use internal symbolizer.
     if (!IsSymbolizerAvailable()) {
       return 0;
@@ -383,6 +443,8 @@ class Symbolizer {
       return internal_symbolizer_->SendCommand(is_data, module_name,
                                                module_offset);
     }
+    if (ElfSymbolizer *elf_symbolizer = GetElfSymbolizer())
+      return elf_symbolizer->SendCommand(is_data, module_name, module_offset);
     // Otherwise, fall back to external symbolizer.
     if (external_symbolizer_ == 0) {
       ReportExternalSymbolizerError(
@@ -390,11 +452,16 @@ class Symbolizer {
           "symbolizer is not initialized!\n");
       return 0;
     }
+    ClearCacheIfModulesReloaded();
+    if (const char *reply = cache_.Get(is_data, module_name, module_offset))
+      return reply;
     for (;;) {
       char *reply = external_symbolizer_->SendCommand(is_data, module_name,
           module_offset);
-      if (reply)
+      if (reply) {
+        cache_.Put(is_data, module_name, module_offset, reply);
         return reply;
+      }
       // Try to restart symbolizer subprocess. If we don't succeed, forget
       // about it and don't try to use it later.
       if (!external_symbolizer_->Restart()) {
@@ -406,34 +473,39 @@ class Symbolizer {
     }
   }
 
+  // Returns the in-process symbolizer if it's enabled and supported.
+  ElfSymbolizer *GetElfSymbolizer() {
+    if (!common_flags()->symbolize_in_process)
+      return 0;
+    if (elf_symbolizer_ == 0)
+      elf_symbolizer_ = ElfSymbolizer::get(&symbolizer_allocator);
+    return elf_symbolizer_;
+  }
+
+  struct PrefetchBatch {
+    Symbolizer *symbolizer;
+    const char *const *module_names;
+    const uptr *module_offsets;
+  };
+
+  static void CacheReply(uptr index, const char *reply, void *arg) {
+    PrefetchBatch *batch = (PrefetchBatch*)arg;
+    batch->symbolizer->cache_.Put(false, batch->module_names[index],
+                                  batch->module_offsets[index], reply);
+  }
+
   LoadedModule *FindModuleForAddress(uptr address) {
-    bool modules_were_reloaded = false;
-    if (modules_ == 0 || !modules_fresh_) {
-      modules_ = (LoadedModule*)(symbolizer_allocator.Allocate(
-          kMaxNumberOfModuleContexts * sizeof(LoadedModule)));
-      CHECK(modules_);
-      n_modules_ = GetListOfModules(modules_, kMaxNumberOfModuleContexts,
-                                    /* filter */ 0);
-      // FIXME: Return this check when GetListOfModules is implemented on Mac.
-      // CHECK_GT(n_modules_, 0);
-      CHECK_LT(n_modules_, kMaxNumberOfModuleContexts);
-      modules_fresh_ = true;
-      modules_were_reloaded = true;
-    }
-    for (uptr i = 0; i < n_modules_; i++) {
-      if (modules_[i].containsAddress(address)) {
-        return &modules_[i];
-      }
-    }
-    // Reload the modules and look up again, if we haven't tried it yet.
-    if (!modules_were_reloaded) {
-      // FIXME: set modules_fresh_ from dlopen()/dlclose() interceptors.
-      // It's too aggressive to reload the list of modules each time we fail
-      // to find a module for a given address.
-      modules_fresh_ = false;
-      return FindModuleForAddress(address);
-    }
-    return 0;
+    return modules_.FindModule(address);
+  }
+
+  // The replies are keyed by the module names, which may refer to other
+  // files once the list of modules has been reread (e.g. a library was
+  // unloaded and another one loaded from the same path).
+  void ClearCacheIfModulesReloaded() {
+    if (cache_modules_reloads_ == modules_.n_reloads())
+      return;
+    cache_.Clear();
+    cache_modules_reloads_ = modules_.n_reloads();
   }
 
   void ReportExternalSymbolizerError(const char *msg) {
@@ -446,15 +518,15 @@ class Symbolizer {
     }
   }
 
-  // 16K loaded modules should be enough for everyone.
-  static const uptr kMaxNumberOfModuleContexts = 1 << 14;
-  LoadedModule *modules_;  // Array of module descriptions is leaked.
-  uptr n_modules_;
-  // If stale, need to reload the modules before looking up addresses.
-  bool modules_fresh_;
+  LoadedModuleIndex modules_;
 
   ExternalSymbolizer *external_symbolizer_;  // Leaked.
   InternalSymbolizer *internal_symbolizer_;  // Leaked.
+  ElfSymbolizer *elf_symbolizer_;  // Leaked.
+  // Replies of the external symbolizer.
+  SymbolizerCache cache_;
+  // modules_.n_reloads() when the cache was last cleared.
+  uptr cache_modules_reloads_;
 };
 
 static Symbolizer symbolizer;  // Linker initialized.
@@ -479,6 +551,16 @@ void FlushSymbolizer() {
   symbolizer.Flush();
 }
 
+void PrefetchSymbolizeCode(const uptr *addresses, uptr count) {
+  symbolizer.PrefetchCode(addresses, count);
+}
+
+bool GetModuleNameAndOffsetForPC(uptr pc, const char **module_name,
+                                 uptr *module_offset) {
+  return symbolizer.GetModuleNameAndOffsetForPC(pc, module_name,
+                                                module_offset);
+}
+
 const char *Demangle(const char *name) {
   return symbolizer.Demangle(name);
 }
@@ -43,6 +43,10 @@ uptr GetListOfModules(LoadedModule *modules, uptr max_modules,
                       string_predicate_t filter) {
   return 0;
 }
+
+bool GetLoadedModulesGeneration(u64 *generation) {
+  return false;
+}
 #else  // SANITIZER_ANDROID
 typedef ElfW(Phdr) Elf_Phdr;
 
@@ -93,6 +97,18 @@ uptr GetListOfModules(LoadedModule *modules, uptr max_modules,
   dl_iterate_phdr(dl_iterate_phdr_cb, &data);
   return data.current_n;
 }
+
+static int GetGenerationCallback(dl_phdr_info *info, size_t size, void *arg) {
+  // The counters are the same for every module.
+  *(u64*)arg = info->dlpi_adds + info->dlpi_subs;
+  return 1;
+}
+
+bool GetLoadedModulesGeneration(u64 *generation) {
+  *generation = 0;
+  dl_iterate_phdr(GetGenerationCallback, generation);
+  return true;
+}
 #endif  // SANITIZER_ANDROID
 
 }  // namespace __sanitizer
@@ -53,6 +53,10 @@ uptr GetListOfModules(LoadedModule *modules, uptr max_modules,
   return n_modules;
 }
 
+bool GetLoadedModulesGeneration(u64 *generation) {
+  return false;
+}
+
 void SymbolizerPrepareForSandboxing() {
   // Do nothing on Mac.
 }
@@ -31,6 +31,10 @@ uptr GetListOfModules(LoadedModule *modules, uptr max_modules,
   UNIMPLEMENTED();
 };
 
+bool GetLoadedModulesGeneration(u64 *generation) {
+  return false;
+}
+
 void SymbolizerPrepareForSandboxing() {
   // Do nothing on Windows.
 }
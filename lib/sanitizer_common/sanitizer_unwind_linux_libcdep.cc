@@ -0,0 +1,689 @@
+//===-- sanitizer_unwind_linux_libcdep.cc ---------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is shared between sanitizer run-time libraries.
+// Stack unwinder driven by the .eh_frame unwind tables of the loaded modules.
+// Unlike _Unwind_Backtrace, it does not take the dynamic loader lock and does
+// not interpret the CFI program for every frame: the unwind rules decoded
+// for a pc are kept in a lock-free cache, so unwinding a frame usually costs
+// a hash table lookup and two loads.
+//===----------------------------------------------------------------------===//
+
+#include "sanitizer_platform.h"
+#include "sanitizer_stacktrace.h"
+#if SANITIZER_CAN_EH_FRAME_UNWIND
+
+#include "sanitizer_atomic.h"
+#include "sanitizer_common.h"
+#include "sanitizer_libc.h"
+#include "sanitizer_mutex.h"
+
+#include <link.h>
+
+namespace __sanitizer {
+
+// DWARF register numbers of the x86_64 frame and stack pointers.
+static const uptr kRegFp = 6;
+static const uptr kRegSp = 7;
+
+// DW_EH_PE_* pointer encodings.
+enum {
+  kPeAbsPtr = 0x00,
+  kPeUleb128 = 0x01,
+  kPeUdata2 = 0x02,
+  kPeUdata4 = 0x03,
+  kPeUdata8 = 0x04,
+  kPeSleb128 = 0x09,
+  kPeSdata2 = 0x0a,
+  kPeSdata4 = 0x0b,
+  kPeSdata8 = 0x0c,
+  kPePcRel = 0x10,
+  kPeDataRel = 0x30,
+  kPeIndirect = 0x80,
+  kPeOmit = 0xff
+};
+
+static uptr ReadUleb(const u8 **p) {
+  uptr res = 0;
+  for (uptr shift = 0; ; shift += 7) {
+    u8 b = *(*p)++;
+    if (shift < SANITIZER_WORDSIZE)
+      res |= (uptr)(b & 0x7f) << shift;
+    if (b < 0x80)
+      return res;
+  }
+}
+
+static sptr ReadSleb(const u8 **p) {
+  uptr res = 0;
+  uptr shift = 0;
+  u8 b;
+  do {
+    b = *(*p)++;
+    if (shift < SANITIZER_WORDSIZE)
+      res |= (uptr)(b & 0x7f) << shift;
+    shift += 7;
+  } while (b >= 0x80);
+  if (shift < SANITIZER_WORDSIZE && (b & 0x40))
+    res |= ~(uptr)0 << shift;
+  return (sptr)res;
+}
+
+template<typename T>
+static T ReadValue(const u8 **p) {
+  T res;
+  internal_memcpy(&res, *p, sizeof(res));
+  *p += sizeof(res);
+  return res;
+}
+
+// Reads a pointer in the given encoding. data_base is the base of the
+// data-relative pointers (the .eh_frame_hdr section).
+static bool ReadEncoded(const u8 **p, u8 enc, uptr data_base, uptr *res) {
+  if (enc == kPeOmit)
+    return false;
+  uptr base = 0;
+  switch (enc & 0x70) {
+    case kPeAbsPtr: break;
+    case kPePcRel: base = (uptr)*p; break;
+    case kPeDataRel: base = data_base; break;
+    default: return false;
+  }
+  uptr v;
+  switch (enc & 0x0f) {
+    case kPeAbsPtr: v = ReadValue<uptr>(p); break;
+    case kPeUleb128: v = ReadUleb(p); break;
+    case kPeUdata2: v = ReadValue<u16>(p); break;
+    case kPeUdata4: v = ReadValue<u32>(p); break;
+    case kPeUdata8: v = (uptr)ReadValue<u64>(p); break;
+    case kPeSleb128: v = (uptr)ReadSleb(p); break;
+    case kPeSdata2: v = (uptr)(sptr)ReadValue<s16>(p); break;
+    case kPeSdata4: v = (uptr)(sptr)ReadValue<s32>(p); break;
+    case kPeSdata8: v = (uptr)ReadValue<s64>(p); break;
+    default: return false;
+  }
+  v += base;
+  if (enc & kPeIndirect)
+    v = *(uptr*)v;
+  *res = v;
+  return true;
+}
+
+//------------------------- Module table --------------------------------------
+
+struct EhFrameModule {
+  // Covers all loadable segments of the module.
+  uptr beg;
+  uptr end;
+  uptr hdr;  // .eh_frame_hdr
+  // Sorted pairs of (initial location, FDE address), relative to hdr.
+  const s32 *table;
+  uptr fde_count;
+};
+
+struct EhFrameModules {
+  // dl_iterate_phdr counters of the loaded and unloaded modules at the time
+  // the table was built.
+  u64 adds;
+  u64 subs;
+  uptr n;
+  EhFrameModule modules[1];
+};
+
+// Readers don't lock, so the replaced tables are never unmapped.
+static atomic_uintptr_t module_table;
+static StaticSpinMutex module_table_mu;
+
+struct ModuleTableBuilder {
+  EhFrameModules *table;
+  uptr capacity;
+};
+
+static bool ParseEhFrameHdr(uptr hdr, EhFrameModule *m) {
+  const u8 *p = (const u8*)hdr;
+  u8 version = p[0];
+  u8 eh_frame_ptr_enc = p[1];
+  u8 fde_count_enc = p[2];
+  u8 table_enc = p[3];
+  p += 4;
+  uptr eh_frame, fde_count;
+  // Only the binary search table in the encoding emitted by the linkers is
+  // supported.
+  if (version != 1 || table_enc != (kPeDataRel | kPeSdata4) ||
+      !ReadEncoded(&p, eh_frame_ptr_enc, hdr, &eh_frame) ||
+      !ReadEncoded(&p, fde_count_enc, hdr, &fde_count))
+    return false;
+  m->hdr = hdr;
+  m->table = (const s32*)p;
+  m->fde_count = fde_count;
+  return true;
+}
+
+static int AddModule(struct dl_phdr_info *info, size_t size, void *arg) {
+  ModuleTableBuilder *b = (ModuleTableBuilder*)arg;
+  EhFrameModules *t = b->table;
+  if (t->n == 0) {
+    t->adds = info->dlpi_adds;
+    t->subs = info->dlpi_subs;
+  }
+  if (t->n == b->capacity)
+    return 1;
+  EhFrameModule m;
+  internal_memset(&m, 0, sizeof(m));
+  m.beg = (uptr)-1;
+  bool has_hdr = false;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    uptr beg = info->dlpi_addr + phdr->p_vaddr;
+    if (phdr->p_type == PT_LOAD) {
+      m.beg = Min(m.beg, beg);
+      m.end = Max(m.end, beg + (uptr)phdr->p_memsz);
+    } else if (phdr->p_type == PT_GNU_EH_FRAME) {
+      has_hdr = ParseEhFrameHdr(beg, &m);
+    }
+  }
+  if (!has_hdr || m.beg >= m.end)
+    return 0;
+  // Keep the modules sorted by address.
+  uptr i = t->n++;
+  for (; i > 0 && t->modules[i - 1].beg > m.beg; i--)
+    t->modules[i] = t->modules[i - 1];
+  t->modules[i] = m;
+  return 0;
+}
+
+static int CountModules(struct dl_phdr_info *info, size_t size, void *arg) {
+  (*(uptr*)arg)++;
+  return 0;
+}
+
+static int GetModuleCounters(struct dl_phdr_info *info, size_t size,
+                             void *arg) {
+  u64 *counters = (u64*)arg;
+  counters[0] = info->dlpi_adds;
+  counters[1] = info->dlpi_subs;
+  return 1;
+}
+
+static void FlushRuleCache();
+
+// Rebuilds the table if modules were loaded or unloaded since it was built.
+// Returns true if it was rebuilt. The unwinder may run in a signal handler
+// which interrupted a rebuild on this thread, so it doesn't wait for the
+// lock: *busy is set if another rebuild is in progress.
+static bool UpdateModuleTable(bool *busy) {
+  if (!module_table_mu.TryLock()) {
+    *busy = true;
+    return false;
+  }
+  EhFrameModules *old =
+      (EhFrameModules*)atomic_load(&module_table, memory_order_acquire);
+  u64 counters[2] = {0, 0};
+  dl_iterate_phdr(GetModuleCounters, counters);
+  if (old && old->adds == counters[0] && old->subs == counters[1]) {
+    module_table_mu.Unlock();
+    return false;
+  }
+  uptr n = 0;
+  dl_iterate_phdr(CountModules, &n);
+  // Leave some room for the modules loaded meanwhile.
+  ModuleTableBuilder b;
+  b.capacity = n + 16;
+  uptr size = sizeof(EhFrameModules) + b.capacity * sizeof(EhFrameModule);
+  b.table = (EhFrameModules*)MmapOrDie(size, "EhFrameModules");
+  dl_iterate_phdr(AddModule, &b);
+  // The cached rules of the unloaded modules may be wrong for the code
+  // mapped at their place.
+  if (old && old->subs != b.table->subs)
+    FlushRuleCache();
+  atomic_store(&module_table, (uptr)b.table, memory_order_release);
+  module_table_mu.Unlock();
+  return true;
+}
+
+static const EhFrameModule *FindModule(uptr pc, bool *busy) {
+  for (int attempt = 0; ; attempt++) {
+    EhFrameModules *t =
+        (EhFrameModules*)atomic_load(&module_table, memory_order_acquire);
+    if (t) {
+      uptr l = 0, r = t->n;
+      while (l < r) {
+        uptr mid = (l + r) / 2;
+        if (t->modules[mid].beg <= pc)
+          l = mid + 1;
+        else
+          r = mid;
+      }
+      if (l > 0 && pc < t->modules[l - 1].end)
+        return &t->modules[l - 1];
+    }
+    if (attempt > 0 || !UpdateModuleTable(busy))
+      return 0;
+  }
+}
+
+// Returns the FDE which may cover pc, or 0.
+static const u8 *FindFde(uptr pc, bool *busy) {
+  const EhFrameModule *m = FindModule(pc, busy);
+  if (!m || m->fde_count == 0)
+    return 0;
+  sptr rel_pc = (sptr)(pc - m->hdr);
+  uptr l = 0, r = m->fde_count;
+  while (l < r) {
+    uptr mid = (l + r) / 2;
+    if (m->table[2 * mid] <= rel_pc)
+      l = mid + 1;
+    else
+      r = mid;
+  }
+  if (l == 0)
+    return 0;
+  return (const u8*)(m->hdr + (sptr)m->table[2 * (l - 1) + 1]);
+}
+
+//------------------------- CFI interpreter -----------------------------------
+
+struct CieInfo {
+  uptr code_align;
+  sptr data_align;
+  uptr ra_reg;
+  u8 fde_enc;
+  bool has_augmentation_data;
+  const u8 *instructions;
+  const u8 *end;
+};
+
+// Rules of a frame which matter for the unwinding: how to compute the
+// CFA (the stack pointer of the caller) and where the return address and the
+// frame pointer of the caller are saved.
+struct FrameRules {
+  uptr cfa_reg;
+  sptr cfa_offset;
+  bool ra_undefined;
+  bool ra_saved;
+  sptr ra_offset;
+  bool fp_saved;
+  sptr fp_offset;
+};
+
+// Reads a CIE or FDE header. Returns the end of the entry.
+static const u8 *ReadEntryHeader(const u8 **p) {
+  uptr length = ReadValue<u32>(p);
+  if (length == 0xffffffff)
+    length = (uptr)ReadValue<u64>(p);
+  return *p + length;
+}
+
+static bool ParseCie(const u8 *p, CieInfo *cie) {
+  cie->end = ReadEntryHeader(&p);
+  if (ReadValue<u32>(&p) != 0)  // CIE id
+    return false;
+  u8 version = *p++;
+  if (version != 1 && version != 3)
+    return false;
+  const char *aug = (const char*)p;
+  p += internal_strlen(aug) + 1;
+  cie->code_align = ReadUleb(&p);
+  cie->data_align = ReadSleb(&p);
+  cie->ra_reg = version == 1 ? *p++ : ReadUleb(&p);
+  cie->fde_enc = kPeAbsPtr;
+  cie->has_augmentation_data = aug[0] == 'z';
+  if (cie->has_augmentation_data) {
+    uptr aug_len = ReadUleb(&p);
+    const u8 *aug_end = p + aug_len;
+    for (const char *a = aug + 1; *a; a++) {
+      if (*a == 'R') {
+        cie->fde_enc = *p++;
+      } else if (*a == 'P') {
+        u8 enc = *p++;
+        uptr personality;
+        if (!ReadEncoded(&p, enc, 0, &personality))
+          return false;
+      } else if (*a == 'L') {
+        p++;
+      } else if (*a != 'S') {
+        // Unknown augmentations are skipped thanks to the length.
+        break;
+      }
+    }
+    p = aug_end;
+  } else if (aug[0]) {
+    return false;
+  }
+  cie->instructions = p;
+  return true;
+}
+
+static bool SetRegisterOffset(const CieInfo &cie, uptr reg, sptr offset,
+                              FrameRules *rules) {
+  if (reg == cie.ra_reg) {
+    rules->ra_undefined = false;
+    rules->ra_saved = true;
+    rules->ra_offset = offset;
+  } else if (reg == kRegFp) {
+    rules->fp_saved = true;
+    rules->fp_offset = offset;
+  }
+  return true;
+}
+
+// Sets the rule of reg to one we can't follow. Only matters for the return
+// address and the frame pointer.
+static bool SetUnsupportedRule(const CieInfo &cie, uptr reg) {
+  return reg != cie.ra_reg && reg != kRegFp;
+}
+
+static void RestoreRegister(const CieInfo &cie, uptr reg,
+                            const FrameRules &initial, FrameRules *rules) {
+  if (reg == cie.ra_reg) {
+    rules->ra_undefined = initial.ra_undefined;
+    rules->ra_saved = initial.ra_saved;
+    rules->ra_offset = initial.ra_offset;
+  } else if (reg == kRegFp) {
+    rules->fp_saved = initial.fp_saved;
+    rules->fp_offset = initial.fp_offset;
+  }
+}
+
+// Executes the call frame instructions in [p, end) for the code starting at
+// loc, until the rules for pc are established. Returns false if the
+// instructions can't be followed.
+static bool ExecuteCfi(const u8 *p, const u8 *end, const CieInfo &cie,
+                       uptr loc, uptr pc, const FrameRules &initial,
+                       FrameRules *rules) {
+  static const uptr kMaxRememberedStates = 8;
+  FrameRules remembered[kMaxRememberedStates];
+  uptr n_remembered = 0;
+  while (p < end) {
+    u8 op = *p++;
+    u8 low = op & 0x3f;
+    uptr reg, delta;
+    switch (op & 0xc0) {
+      case 0x40:  // DW_CFA_advance_loc
+        loc += low * cie.code_align;
+        if (loc > pc)
+          return true;
+        continue;
+      case 0x80:  // DW_CFA_offset
+        SetRegisterOffset(cie, low, (sptr)ReadUleb(&p) * cie.data_align,
+                          rules);
+        continue;
+      case 0xc0:  // DW_CFA_restore
+        RestoreRegister(cie, low, initial, rules);
+        continue;
+    }
+    switch (op) {
+      case 0x00:  // DW_CFA_nop
+        break;
+      case 0x01:  // DW_CFA_set_loc
+        if (!ReadEncoded(&p, cie.fde_enc, 0, &loc))
+          return false;
+        if (loc > pc)
+          return true;
+        break;
+      case 0x02:  // DW_CFA_advance_loc1
+      case 0x03:  // DW_CFA_advance_loc2
+      case 0x04:  // DW_CFA_advance_loc4
+        delta = op == 0x02 ? *p++ :
+                op == 0x03 ? ReadValue<u16>(&p) : ReadValue<u32>(&p);
+        loc += delta * cie.code_align;
+        if (loc > pc)
+          return true;
+        break;
+      case 0x05:  // DW_CFA_offset_extended
+        reg = ReadUleb(&p);
+        SetRegisterOffset(cie, reg, (sptr)ReadUleb(&p) * cie.data_align,
+                          rules);
+        break;
+      case 0x06:  // DW_CFA_restore_extended
+        RestoreRegister(cie, ReadUleb(&p), initial, rules);
+        break;
+      case 0x07:  // DW_CFA_undefined
+        reg = ReadUleb(&p);
+        if (reg == cie.ra_reg)
+          rules->ra_undefined = true;
+        else if (reg == kRegFp)
+          rules->fp_saved = false;
+        break;
+      case 0x08:  // DW_CFA_same_value
+        reg = ReadUleb(&p);
+        if (reg == cie.ra_reg)
+          rules->ra_saved = false;
+        else if (reg == kRegFp)
+          rules->fp_saved = false;
+        break;
+      case 0x09:  // DW_CFA_register
+        reg = ReadUleb(&p);
+        ReadUleb(&p);
+        if (!SetUnsupportedRule(cie, reg))
+          return false;
+        break;
+      case 0x0a:  // DW_CFA_remember_state
+        if (n_remembered == kMaxRememberedStates)
+          return false;
+        remembered[n_remembered++] = *rules;
+        break;
+      case 0x0b:  // DW_CFA_restore_state
+        if (n_remembered == 0)
+          return false;
+        *rules = remembered[--n_remembered];
+        break;
+      case 0x0c:  // DW_CFA_def_cfa
+        rules->cfa_reg = ReadUleb(&p);
+        rules->cfa_offset = (sptr)ReadUleb(&p);
+        break;
+      case 0x0d:  // DW_CFA_def_cfa_register
+        rules->cfa_reg = ReadUleb(&p);
+        break;
+      case 0x0e:  // DW_CFA_def_cfa_offset
+        rules->cfa_offset = (sptr)ReadUleb(&p);
+        break;
+      case 0x0f:  // DW_CFA_def_cfa_expression
+        return false;
+      case 0x10:  // DW_CFA_expression
+      case 0x16:  // DW_CFA_val_expression
+        reg = ReadUleb(&p);
+        p += ReadUleb(&p);
+        if (!SetUnsupportedRule(cie, reg))
+          return false;
+        break;
+      case 0x11:  // DW_CFA_offset_extended_sf
+        reg = ReadUleb(&p);
+        SetRegisterOffset(cie, reg, ReadSleb(&p) * cie.data_align, rules);
+        break;
+      case 0x12:  // DW_CFA_def_cfa_sf
+        rules->cfa_reg = ReadUleb(&p);
+        rules->cfa_offset = ReadSleb(&p) * cie.data_align;
+        break;
+      case 0x13:  // DW_CFA_def_cfa_offset_sf
+        rules->cfa_offset = ReadSleb(&p) * cie.data_align;
+        break;
+      case 0x14:  // DW_CFA_val_offset
+      case 0x15:  // DW_CFA_val_offset_sf
+        reg = ReadUleb(&p);
+        if (op == 0x14)
+          ReadUleb(&p);
+        else
+          ReadSleb(&p);
+        if (!SetUnsupportedRule(cie, reg))
+          return false;
+        break;
+      case 0x2e:  // DW_CFA_GNU_args_size
+        ReadUleb(&p);
+        break;
+      case 0x2f:  // DW_CFA_GNU_negative_offset_extended
+        reg = ReadUleb(&p);
+        SetRegisterOffset(cie, reg, -(sptr)ReadUleb(&p) * cie.data_align,
+                          rules);
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+//------------------------- Rule cache ----------------------------------------
+
+// The rules of a pc are packed into a u64: the CFA offset in the low 31 bits,
+// bit 31 set if the CFA is based on the frame pointer rather than the stack
+// pointer, then the s16 offsets of the saved return address and frame
+// pointer from the CFA (0 if the frame pointer is not saved). Small values
+// which can't be valid rules mark the frames we can't unwind through.
+static const u64 kRuleNoFde = 1;        // Unknown code, e.g. JIT-ed.
+static const u64 kRuleOutermost = 2;    // The return address is undefined.
+static const u64 kRuleUnsupported = 3;  // The CFI can't be followed.
+static const u64 kRuleCfaFp = 1ULL << 31;
+// The rules of a frame which saves the frame pointer in the standard way: the
+// CFA is fp + 16, the return address is at CFA - 8 and the frame pointer at
+// CFA - 16. Used when the module table can't be looked up.
+static const u64 kRuleFramePointer =
+    16 | kRuleCfaFp | ((u64)(u16)-8 << 32) | ((u64)(u16)-16 << 48);
+
+static u64 PackRules(const FrameRules &r) {
+  if (r.ra_undefined)
+    return kRuleOutermost;
+  if ((r.cfa_reg != kRegSp && r.cfa_reg != kRegFp) || !r.ra_saved ||
+      r.cfa_offset < (sptr)sizeof(uptr) || r.cfa_offset >= (1 << 30) ||
+      r.ra_offset != (s16)r.ra_offset || r.ra_offset == 0 ||
+      (r.fp_saved && (r.fp_offset != (s16)r.fp_offset || r.fp_offset == 0)))
+    return kRuleUnsupported;
+  return (u64)r.cfa_offset | (r.cfa_reg == kRegFp ? kRuleCfaFp : 0) |
+         ((u64)(u16)r.ra_offset << 32) |
+         ((u64)(u16)(r.fp_saved ? r.fp_offset : 0) << 48);
+}
+
+// Sets *cacheable to false if the rules are only a guess.
+static u64 ComputeRules(uptr pc, bool *cacheable) {
+  bool busy = false;
+  const u8 *fde = FindFde(pc, &busy);
+  if (busy) {
+    *cacheable = false;
+    return kRuleFramePointer;
+  }
+  if (!fde)
+    return kRuleNoFde;
+  const u8 *p = fde;
+  const u8 *fde_end = ReadEntryHeader(&p);
+  const u8 *cie_id_pos = p;
+  u32 cie_id = ReadValue<u32>(&p);
+  CieInfo cie;
+  if (cie_id == 0 || !ParseCie(cie_id_pos - cie_id, &cie))
+    return kRuleUnsupported;
+  uptr pc_begin, pc_range;
+  if (!ReadEncoded(&p, cie.fde_enc, 0, &pc_begin) ||
+      !ReadEncoded(&p, cie.fde_enc & 0x0f, 0, &pc_range))
+    return kRuleUnsupported;
+  if (pc < pc_begin || pc - pc_begin >= pc_range)
+    return kRuleNoFde;
+  if (cie.has_augmentation_data)
+    p += ReadUleb(&p);
+  FrameRules initial;
+  internal_memset(&initial, 0, sizeof(initial));
+  if (!ExecuteCfi(cie.instructions, cie.end, cie, pc_begin, (uptr)-1, initial,
+                  &initial))
+    return kRuleUnsupported;
+  FrameRules rules = initial;
+  if (!ExecuteCfi(p, fde_end, cie, pc_begin, pc, initial, &rules))
+    return kRuleUnsupported;
+  return PackRules(rules);
+}
+
+// The cache is a direct-mapped table of (pc, rules). Each slot has a sequence
+// number which is odd while the slot is written, so a reader which sees the
+// same even number before and after reading the slot has read a consistent
+// entry, even if the slot was refilled with the same pc meanwhile. Flushing
+// the cache bumps the epoch, which invalidates the entries computed before.
+struct RuleCacheSlot {
+  atomic_uint64_t seq;
+  atomic_uint64_t epoch;
+  atomic_uintptr_t pc;
+  atomic_uint64_t rules;
+};
+
+static const uptr kRuleCacheSize = 1 << 14;
+static RuleCacheSlot rule_cache[kRuleCacheSize];
+static atomic_uint64_t rule_cache_epoch;
+
+static RuleCacheSlot *GetSlot(uptr pc) {
+  u64 h = (u64)pc * 0x9E3779B97F4A7C15ULL;
+  return &rule_cache[(uptr)(h >> 40) % kRuleCacheSize];
+}
+
+static void FlushRuleCache() {
+  atomic_fetch_add(&rule_cache_epoch, 1, memory_order_release);
+}
+
+static u64 GetRules(uptr pc) {
+  RuleCacheSlot *s = GetSlot(pc);
+  u64 epoch = atomic_load(&rule_cache_epoch, memory_order_acquire);
+  u64 seq = atomic_load(&s->seq, memory_order_acquire);
+  if ((seq & 1) == 0) {
+    uptr key = atomic_load(&s->pc, memory_order_relaxed);
+    u64 key_epoch = atomic_load(&s->epoch, memory_order_relaxed);
+    u64 rules = atomic_load(&s->rules, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (key == pc && key_epoch == epoch &&
+        atomic_load(&s->seq, memory_order_relaxed) == seq)
+      return rules;
+  }
+  bool cacheable = true;
+  u64 rules = ComputeRules(pc, &cacheable);
+  // If the module table was rebuilt meanwhile, the entry is stored with a
+  // stale epoch and is never used.
+  if (cacheable && (seq & 1) == 0 &&
+      atomic_compare_exchange_strong(&s->seq, &seq, seq + 1,
+                                     memory_order_acquire)) {
+    atomic_thread_fence(memory_order_release);
+    atomic_store(&s->epoch, epoch, memory_order_relaxed);
+    atomic_store(&s->pc, pc, memory_order_relaxed);
+    atomic_store(&s->rules, rules, memory_order_relaxed);
+    atomic_store(&s->seq, seq + 2, memory_order_release);
+  }
+  return rules;
+}
+
+//------------------------- Unwinder ------------------------------------------
+
+NOINLINE
+bool StackTrace::EhFrameUnwindStack(uptr max_depth) {
+  // Any bigger frame is considered a sign of a broken stack.
+  static const uptr kMaxFrameSize = 1 << 24;
+  // Start with the caller's frame, as _Unwind_Backtrace does.
+  uptr frame = GET_CURRENT_FRAME();
+  uptr pc = GET_CALLER_PC();
+  uptr sp = frame + 2 * sizeof(uptr);
+  uptr fp = *(uptr*)frame;
+  size = 0;
+  while (size < max_depth) {
+    trace[size++] = pc;
+    // pc is a return address, look up the call instruction.
+    u64 rules = GetRules(pc - 1);
+    if (rules == kRuleNoFde || rules == kRuleOutermost)
+      break;
+    if (rules == kRuleUnsupported)
+      return false;
+    uptr cfa = ((rules & kRuleCfaFp) ? fp : sp) + (uptr)(rules & 0x7fffffff);
+    if (cfa <= sp || cfa - sp > kMaxFrameSize ||
+        !IsAligned(cfa, sizeof(uptr)))
+      break;
+    pc = *(uptr*)(cfa + (sptr)(s16)(rules >> 32));
+    s16 fp_offset = (s16)(rules >> 48);
+    if (fp_offset)
+      fp = *(uptr*)(cfa + (sptr)fp_offset);
+    sp = cfa;
+    if (pc < GetPageSizeCached())
+      break;
+  }
+  return true;
+}
+
+}  // namespace __sanitizer
+
+#endif  // SANITIZER_CAN_EH_FRAME_UNWIND
@@ -64,6 +64,10 @@ uptr GetThreadSelf() {
   return GetTid();
 }
 
+uptr GetCurrentCPU() {
+  return GetCurrentProcessorNumber();
+}
+
 void GetThreadStackTopAndBottom(bool at_initialization, uptr *stack_top,
                                 uptr *stack_bottom) {
   CHECK(stack_top);
@@ -120,6 +124,10 @@ void FlushUnneededShadowMemory(uptr addr, uptr size) {
   // FIXME: add madvice-analog when we move to 64-bits.
 }
 
+void ReleaseMemoryToOS(uptr addr, uptr size) {
+  // FIXME: use VirtualAlloc(MEM_RESET) when the allocator needs it.
+}
+
 bool MemoryRangeIsAvailable(uptr range_start, uptr range_end) {
   // FIXME: shall we do anything here on Windows?
   return true;
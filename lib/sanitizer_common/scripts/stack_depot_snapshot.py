@@ -0,0 +1,165 @@
+#!/usr/bin/env python
+#===- lib/sanitizer_common/scripts/stack_depot_snapshot.py -----------------===#
+#
+#                     The LLVM Compiler Infrastructure
+#
+# This file is distributed under the University of Illinois Open Source
+# License. See LICENSE.TXT for details.
+#
+#===------------------------------------------------------------------------===#
+#
+# Prints the stacks from a stack depot snapshot (written with
+# stack_depot_snapshot_path=<path> or __sanitizer_dump_stack_depot) in the
+# format of the sanitizer reports, so that they can be symbolized offline:
+#
+#   stack_depot_snapshot.py <path>.<pid> [id ...] | asan_symbolize.py
+#
+# See sanitizer_stackdepot_libcdep.cc for the format of the snapshot.
+#
+#===------------------------------------------------------------------------===#
+import struct
+import sys
+
+MAGIC = b'SANDEPOT'
+VERSION = 2
+
+
+class Reader(object):
+  def __init__(self, data):
+    self.data = data
+    self.pos = 0
+
+  def at_end(self):
+    return self.pos >= len(self.data)
+
+  def read(self, size):
+    if self.pos + size > len(self.data):
+      raise Exception('Truncated snapshot')
+    res = self.data[self.pos:self.pos + size]
+    self.pos += size
+    return res
+
+  def read_int(self, fmt):
+    return struct.unpack(fmt, self.read(struct.calcsize(fmt)))[0]
+
+  def read_varint(self):
+    res = 0
+    shift = 0
+    while True:
+      byte = struct.unpack('B', self.read(1))[0]
+      res |= (byte & 0x7f) << shift
+      shift += 7
+      if byte < 0x80:
+        return res
+
+
+class Module(object):
+  def __init__(self, name, base, ranges):
+    self.name = name
+    self.base = base
+    self.ranges = ranges
+
+  def contains(self, addr):
+    for beg, end in self.ranges:
+      if beg <= addr < end:
+        return True
+    return False
+
+
+class Snapshot(object):
+  def __init__(self, data):
+    r = Reader(data)
+    if r.read(len(MAGIC)) != MAGIC:
+      raise Exception('Not a stack depot snapshot')
+    version = r.read_int('=I')
+    if version != VERSION:
+      raise Exception('Unsupported snapshot version %d' % version)
+    self.pointer_size = r.read_int('=I')
+    uptr = '=Q' if self.pointer_size == 8 else '=I'
+    mask = (1 << (8 * self.pointer_size)) - 1
+    self.modules = []
+    for _ in range(r.read_int('=I')):
+      name = r.read(r.read_int('=I')).decode('utf-8', 'replace')
+      base = r.read_int(uptr)
+      ranges = []
+      for _ in range(r.read_int('=I')):
+        beg = r.read_int(uptr)
+        ranges.append((beg, r.read_int(uptr)))
+      self.modules.append(Module(name, base, ranges))
+    # Maps the id to the frames, the parent id and the deep id.
+    self.records = {}
+    while not r.at_end():
+      stack_id = r.read_int('=I')
+      parent_id = r.read_int('=I')
+      deep_id = r.read_int('=I')
+      frames = []
+      pc = 0
+      for _ in range(r.read_int('=I')):
+        v = r.read_varint()
+        delta = (v >> 1) ^ -(v & 1)
+        pc = (pc + delta) & mask
+        frames.append(pc)
+      self.records[stack_id] = (frames, parent_id, deep_id)
+
+  def stack(self, stack_id):
+    res = []
+    while stack_id:
+      frames, stack_id, _ = self.records[stack_id]
+      res.extend(frames)
+    return res
+
+  def deep_tail(self, stack_id):
+    # The frames of the deep stack linked to a truncated one beyond its own
+    # frames. They come from the first stack with the same top frames.
+    deep_id = self.records[stack_id][2]
+    if not deep_id or deep_id == stack_id or deep_id not in self.records:
+      return []
+    return self.stack(deep_id)[len(self.stack(stack_id)):]
+
+  def module_offset(self, addr):
+    for m in self.modules:
+      if m.contains(addr):
+        return m.name, addr - m.base
+    return None
+
+
+def print_frame(snapshot, i, pc):
+  # The depot stores the return addresses, the reports show the calls
+  # (see GetPreviousInstructionPc).
+  pc -= 1
+  module = snapshot.module_offset(pc)
+  if module:
+    print('    #%d 0x%x (%s+0x%x)' % (i, pc, module[0], module[1]))
+  else:
+    print('    #%d 0x%x' % (i, pc))
+
+
+def print_stack(snapshot, stack_id):
+  print('Stack %d:' % stack_id)
+  frames = snapshot.stack(stack_id)
+  for i, pc in enumerate(frames):
+    print_frame(snapshot, i, pc)
+  tail = snapshot.deep_tail(stack_id)
+  if tail:
+    print('    (the frames below were unwound for the first stack with the '
+          'same %d top frames and may belong to another call path)' %
+          len(frames))
+    for i, pc in enumerate(tail):
+      print_frame(snapshot, len(frames) + i, pc)
+  print('')
+
+
+if __name__ == '__main__':
+  if len(sys.argv) < 2:
+    sys.stderr.write('Usage: %s <snapshot> [id ...]\n' % sys.argv[0])
+    sys.exit(1)
+  snapshot = Snapshot(open(sys.argv[1], 'rb').read())
+  if len(sys.argv) > 2:
+    ids = [int(a, 0) for a in sys.argv[2:]]
+  else:
+    ids = sorted(snapshot.records.keys())
+  for stack_id in ids:
+    if stack_id not in snapshot.records:
+      sys.stderr.write('Unknown stack id %d\n' % stack_id)
+      continue
+    print_stack(snapshot, stack_id)
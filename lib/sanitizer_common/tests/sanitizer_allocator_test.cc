@@ -38,6 +38,9 @@ typedef SizeClassAllocator64<
 
 typedef SizeClassAllocator64<
   kAllocatorSpace, kAllocatorSize, 16, CompactSizeClassMap> Allocator64Compact;
+
+typedef SizeClassAllocator64<
+  kAllocatorSpace, kAllocatorSize, 16, DenseSizeClassMap> Allocator64Dense;
 #else
 static const u64 kAddressSpaceSize = 1ULL << 32;
 #endif
@@ -53,6 +56,14 @@ typedef SizeClassAllocator32<
   FlatByteMap<kFlatByteMapSize> >
   Allocator32Compact;
 
+typedef SizeClassAllocator32<
+  0, kAddressSpaceSize,
+  /*kMetadataSize*/16,
+  CompactSizeClassMap,
+  kRegionSizeLog,
+  TwoLevelByteMap<(kFlatByteMapSize >> 12), 1 << 12> >
+  Allocator32TwoLevel;
+
 template <class SizeClassMap>
 void TestSizeClassMap() {
   typedef SizeClassMap SCMap;
@@ -72,6 +83,14 @@ TEST(SanitizerCommon, InternalSizeClassMap) {
   TestSizeClassMap<InternalSizeClassMap>();
 }
 
+TEST(SanitizerCommon, DenseSizeClassMap) {
+  TestSizeClassMap<DenseSizeClassMap>();
+}
+
+TEST(SanitizerCommon, SparseSizeClassMap) {
+  TestSizeClassMap<SizeClassMap<17, 128, 16, 1> >();
+}
+
 template <class Allocator>
 void TestSizeClassAllocator() {
   Allocator *a = new Allocator;
@@ -147,12 +166,20 @@ TEST(SanitizerCommon, SizeClassAllocator64) {
 TEST(SanitizerCommon, SizeClassAllocator64Compact) {
   TestSizeClassAllocator<Allocator64Compact>();
 }
+
+TEST(SanitizerCommon, SizeClassAllocator64Dense) {
+  TestSizeClassAllocator<Allocator64Dense>();
+}
 #endif
 
 TEST(SanitizerCommon, SizeClassAllocator32Compact) {
   TestSizeClassAllocator<Allocator32Compact>();
 }
 
+TEST(SanitizerCommon, SizeClassAllocator32TwoLevel) {
+  TestSizeClassAllocator<Allocator32TwoLevel>();
+}
+
 template <class Allocator>
 void SizeClassAllocatorMetadataStress() {
   Allocator *a = new Allocator;
@@ -230,6 +257,9 @@ TEST(SanitizerCommon, SizeClassAllocator64CompactGetBlockBegin) {
 TEST(SanitizerCommon, SizeClassAllocator32CompactGetBlockBegin) {
   SizeClassAllocatorGetBlockBeginStress<Allocator32Compact>();
 }
+TEST(SanitizerCommon, SizeClassAllocator32TwoLevelGetBlockBegin) {
+  SizeClassAllocatorGetBlockBeginStress<Allocator32TwoLevel>();
+}
 #endif  // SANITIZER_WORDSIZE == 64
 
 struct TestMapUnmapCallback {
@@ -327,6 +357,33 @@ TEST(SanitizerCommon, SizeClassAllocator64Overflow) {
 }
 #endif
 
+TEST(SanitizerCommon, TwoLevelByteMap) {
+  const u64 kSize1 = 1 << 6, kSize2 = 1 << 12;
+  const u64 n = kSize1 * kSize2;
+  TestMapUnmapCallback::map_count = 0;
+  TestMapUnmapCallback::unmap_count = 0;
+  TwoLevelByteMap<kSize1, kSize2, TestMapUnmapCallback> *m =
+      new TwoLevelByteMap<kSize1, kSize2, TestMapUnmapCallback>;
+  m->TestOnlyInit();
+  for (uptr i = 0; i < n; i += 7)
+    EXPECT_EQ(0U, (*m)[i]);
+  // Reads do not map the second level.
+  EXPECT_EQ(0, TestMapUnmapCallback::map_count);
+  for (uptr i = 0; i < n / 2; i += 7)
+    m->set(i, (i % 100) + 1);
+  EXPECT_EQ((int)kSize1 / 2, TestMapUnmapCallback::map_count);
+  for (uptr i = 0; i < n; i++) {
+    if (i < n / 2 && i % 7 == 0)
+      EXPECT_EQ((i % 100) + 1, (*m)[i]);
+    else
+      EXPECT_EQ(0U, (*m)[i]);
+  }
+  m->TestOnlyUnmap();
+  EXPECT_EQ(TestMapUnmapCallback::map_count,
+            TestMapUnmapCallback::unmap_count);
+  delete m;
+}
+
 TEST(SanitizerCommon, LargeMmapAllocator) {
   LargeMmapAllocator<> a;
   a.Init();
@@ -474,6 +531,83 @@ TEST(SanitizerCommon, CombinedAllocator32Compact) {
       SizeClassAllocatorLocalCache<Allocator32Compact> > ();
 }
 
+#if SANITIZER_WORDSIZE == 64
+TEST(SanitizerCommon, CombinedAllocator64PerCPUCache) {
+  TestCombinedAllocator<Allocator64Compact,
+      LargeMmapAllocator<>,
+      SizeClassAllocatorPerCPUCache<Allocator64Compact, 4> > ();
+}
+#endif
+
+TEST(SanitizerCommon, CombinedAllocator32CompactPerCPUCache) {
+  TestCombinedAllocator<Allocator32Compact,
+      LargeMmapAllocator<>,
+      SizeClassAllocatorPerCPUCache<Allocator32Compact, 4> > ();
+}
+
+template
+<class PrimaryAllocator, class SecondaryAllocator, class AllocatorCache>
+void TestCombinedAllocatorBulkDeallocate() {
+  typedef
+      CombinedAllocator<PrimaryAllocator, AllocatorCache, SecondaryAllocator>
+      Allocator;
+  Allocator *a = new Allocator;
+  a->Init();
+
+  AllocatorCache cache;
+  memset(&cache, 0, sizeof(cache));
+  a->InitCache(&cache);
+
+  const uptr kNumClasses = PrimaryAllocator::kNumClasses;
+  const uptr kNumAllocs = 20000;
+  const uptr kNumIter = 10;
+  uptr total_memory_used = 0;
+  for (uptr iter = 0; iter < kNumIter; iter++) {
+    std::vector<void*> by_class[kNumClasses];
+    std::vector<void*> secondary;
+    for (uptr i = 0; i < kNumAllocs; i++) {
+      uptr size = (i % 4096) + 1;
+      if ((i % 1024) == 0)
+        size = 1 << 20;
+      void *x = a->Allocate(&cache, size, 1);
+      uptr class_id = a->GetSizeClass(x);
+      EXPECT_EQ(class_id != 0, a->FromPrimary(x));
+      if (class_id)
+        by_class[class_id].push_back(x);
+      else
+        secondary.push_back(x);
+    }
+    for (uptr class_id = 1; class_id < kNumClasses; class_id++) {
+      if (!by_class[class_id].empty())
+        a->BulkDeallocate(&cache, class_id, &by_class[class_id][0],
+                          by_class[class_id].size());
+    }
+    for (uptr i = 0; i < secondary.size(); i++)
+      a->Deallocate(&cache, secondary[i]);
+    // Every chunk is reused: the allocator does not grow after the first
+    // iteration.
+    if (iter == 0)
+      total_memory_used = a->TotalMemoryUsed();
+    EXPECT_EQ(total_memory_used, a->TotalMemoryUsed());
+  }
+  a->DestroyCache(&cache);
+  a->TestOnlyUnmap();
+}
+
+#if SANITIZER_WORDSIZE == 64
+TEST(SanitizerCommon, CombinedAllocator64BulkDeallocate) {
+  TestCombinedAllocatorBulkDeallocate<Allocator64,
+      LargeMmapAllocator<>,
+      SizeClassAllocatorLocalCache<Allocator64> > ();
+}
+#endif
+
+TEST(SanitizerCommon, CombinedAllocator32CompactBulkDeallocate) {
+  TestCombinedAllocatorBulkDeallocate<Allocator32Compact,
+      LargeMmapAllocator<>,
+      SizeClassAllocatorPerCPUCache<Allocator32Compact, 4> > ();
+}
+
 template <class AllocatorCache>
 void TestSizeClassAllocatorLocalCache() {
   AllocatorCache cache;
@@ -525,6 +659,69 @@ TEST(SanitizerCommon, SizeClassAllocator32CompactLocalCache) {
       SizeClassAllocatorLocalCache<Allocator32Compact> >();
 }
 
+#if SANITIZER_WORDSIZE == 64
+TEST(SanitizerCommon, SizeClassAllocator64CompactPerCPUCache) {
+  TestSizeClassAllocatorLocalCache<
+      SizeClassAllocatorPerCPUCache<Allocator64Compact, 4> >();
+}
+
+typedef SizeClassAllocatorPerCPUCache<Allocator64Compact, 4> PerCPUCache;
+static PerCPUCache static_per_cpu_cache;
+
+struct PerCPUCacheWorkerParams {
+  PerCPUCache::Allocator *allocator;
+  uptr class_id;
+};
+
+void *PerCPUCacheStressWorker(void *arg) {
+  PerCPUCacheWorkerParams *params =
+      reinterpret_cast<PerCPUCacheWorkerParams*>(arg);
+  const uptr kNumAllocs = 1000;
+  void *allocated[kNumAllocs];
+  for (int it = 0; it < 10; it++) {
+    for (uptr i = 0; i < kNumAllocs; i++) {
+      allocated[i] =
+          static_per_cpu_cache.Allocate(params->allocator, params->class_id);
+      *reinterpret_cast<uptr*>(allocated[i]) = i;
+    }
+    for (uptr i = 0; i < kNumAllocs; i++) {
+      CHECK_EQ(*reinterpret_cast<uptr*>(allocated[i]), i);
+      static_per_cpu_cache.Deallocate(params->allocator, params->class_id,
+                                      allocated[i]);
+    }
+  }
+  return 0;
+}
+
+// Many short-lived threads share the same per-CPU cache and never drain it
+// on exit; a single Drain() must return everything they have cached.
+TEST(SanitizerCommon, SizeClassAllocatorPerCPUCacheThreads) {
+  PerCPUCache::Allocator a;
+  a.Init();
+  static_per_cpu_cache.Init(0);
+  const int kNumThreads = 8;
+  PerCPUCacheWorkerParams params[kNumThreads];
+  for (int round = 0; round < 5; round++) {
+    pthread_t t[kNumThreads];
+    for (int i = 0; i < kNumThreads; i++) {
+      params[i].allocator = &a;
+      params[i].class_id = 1 + i % 4;
+      EXPECT_EQ(0, pthread_create(&t[i], 0, PerCPUCacheStressWorker,
+                                  &params[i]));
+    }
+    for (int i = 0; i < kNumThreads; i++)
+      EXPECT_EQ(0, pthread_join(t[i], 0));
+    static_per_cpu_cache.Drain(&a);
+    for (uptr cpu = 0; cpu < ARRAY_SIZE(static_per_cpu_cache.per_cpu_); cpu++) {
+      PerCPUCache::LocalCache *c = &static_per_cpu_cache.per_cpu_[cpu].cache;
+      for (uptr class_id = 0; class_id < PerCPUCache::kNumClasses; class_id++)
+        EXPECT_EQ(0U, c->per_class_[class_id].count);
+    }
+  }
+  a.TestOnlyUnmap();
+}
+#endif
+
 #if SANITIZER_WORDSIZE == 64
 typedef SizeClassAllocatorLocalCache<Allocator64> AllocatorCache;
 static AllocatorCache static_allocator_cache;
@@ -718,6 +915,37 @@ TEST(SanitizerCommon, LargeMmapAllocatorIteration) {
     a.Deallocate(&stats, allocated[i]);
 }
 
+TEST(SanitizerCommon, LargeMmapAllocatorAddressRange) {
+  LargeMmapAllocator<> a;
+  a.Init();
+  AllocatorStats stats;
+  stats.Init();
+  uptr beg, end;
+  a.GetAddressRangeLocked(&beg, &end);
+  EXPECT_EQ(beg, end);
+
+  static const uptr kNumAllocs = 100;
+  char *allocated[kNumAllocs];
+  static const uptr size = 40;
+  for (uptr i = 0; i < kNumAllocs; i++)
+    allocated[i] = (char *)a.Allocate(&stats, size, 1);
+  a.ForceLock();
+  a.GetAddressRangeLocked(&beg, &end);
+  a.ForceUnlock();
+  uptr min_beg = (uptr)-1, max_end = 0;
+  for (uptr i = 0; i < kNumAllocs; i++) {
+    min_beg = Min(min_beg, (uptr)allocated[i]);
+    max_end = Max(max_end, (uptr)allocated[i] + size);
+  }
+  EXPECT_LE(beg, min_beg);
+  EXPECT_GE(end, max_end);
+  // Only the header page and the page rounding are outside of the chunks.
+  EXPECT_LT(min_beg - beg, 2 * GetPageSizeCached());
+  EXPECT_LT(end - max_end, 2 * GetPageSizeCached());
+  for (uptr i = 0; i < kNumAllocs; i++)
+    a.Deallocate(&stats, allocated[i]);
+}
+
 TEST(SanitizerCommon, LargeMmapAllocatorBlockBegin) {
   LargeMmapAllocator<> a;
   a.Init();
@@ -736,25 +964,259 @@ TEST(SanitizerCommon, LargeMmapAllocatorBlockBegin) {
   for (uptr i = 0; i < kNumAllocs  * kNumAllocs; i++) {
     // if ((i & (i - 1)) == 0) fprintf(stderr, "[%zd]\n", i);
     char *p1 = allocated[i % kNumAllocs];
-    EXPECT_EQ(p1, a.GetBlockBeginFastLocked(p1));
-    EXPECT_EQ(p1, a.GetBlockBeginFastLocked(p1 + size / 2));
-    EXPECT_EQ(p1, a.GetBlockBeginFastLocked(p1 + size - 1));
-    EXPECT_EQ(p1, a.GetBlockBeginFastLocked(p1 - 100));
+    EXPECT_EQ(p1, a.GetBlockBegin(p1));
+    EXPECT_EQ(p1, a.GetBlockBegin(p1 + size / 2));
+    EXPECT_EQ(p1, a.GetBlockBegin(p1 + size - 1));
+    EXPECT_EQ(p1, a.GetBlockBegin(p1 - 100));
   }
 
   for (uptr i = 0; i < kNumExpectedFalseLookups; i++) {
     void *p = reinterpret_cast<void *>(i % 1024);
-    EXPECT_EQ((void *)0, a.GetBlockBeginFastLocked(p));
+    EXPECT_EQ((void *)0, a.GetBlockBegin(p));
     p = reinterpret_cast<void *>(~0L - (i % 1024));
-    EXPECT_EQ((void *)0, a.GetBlockBeginFastLocked(p));
+    EXPECT_EQ((void *)0, a.GetBlockBegin(p));
   }
 
   for (uptr i = 0; i < kNumAllocs; i++)
     a.Deallocate(&stats, allocated[i]);
+
+  // Chunks spanning the address ranges of several shards, up to all of them.
+  static const uptr kBigSizes[] = {3 << 20, 17 << 20, 40 << 20};
+  for (uptr i = 0; i < ARRAY_SIZE(kBigSizes); i++) {
+    uptr big_size = kBigSizes[i];
+    char *p = (char *)a.Allocate(&stats, big_size, 1);
+    for (uptr off = 0; off < big_size; off += 1 << 18)
+      EXPECT_EQ(p, a.GetBlockBegin(p + off));
+    EXPECT_EQ(p, a.GetBlockBegin(p + big_size - 1));
+    EXPECT_EQ(big_size, a.TotalMemoryUsed() - GetPageSizeCached());
+    a.Deallocate(&stats, p);
+    EXPECT_EQ((void *)0, a.GetBlockBegin(p + big_size / 2));
+    EXPECT_EQ(0U, a.TotalMemoryUsed());
+  }
 }
 
+TEST(SanitizerCommon, LargeMmapAllocatorMappingCache) {
+  LargeMmapAllocator<> a;
+  a.Init();
+  AllocatorStats stats;
+  stats.Init();
+  static const uptr size = 1 << 20;
+  a.SetMappingCacheSize(4 * size);
+
+  char *p = (char *)a.Allocate(&stats, size, 1);
+  EXPECT_EQ(1U, stats.Get(AllocatorStatLargeCacheMiss));
+  internal_memset(p, 0xab, size);
+  a.Deallocate(&stats, p);
+  EXPECT_EQ(0U, stats.Get(AllocatorStatUnmapped));
+  EXPECT_FALSE(a.PointerIsMine(p));
+
+  // A slightly smaller allocation reuses the cached mapping, which must be
+  // zeroed.
+  char *q = (char *)a.Allocate(&stats, size - 4096, 1);
+  EXPECT_EQ(p, q);
+  EXPECT_EQ(1U, stats.Get(AllocatorStatLargeCacheHit));
+  EXPECT_EQ(q, a.GetBlockBegin(q + size / 2));
+  for (uptr i = 0; i < size - 4096; i += 1024)
+    EXPECT_EQ(0, q[i]);
+  a.Deallocate(&stats, q);
+
+  // A much smaller allocation does not.
+  q = (char *)a.Allocate(&stats, size / 4, 1);
+  EXPECT_EQ(1U, stats.Get(AllocatorStatLargeCacheHit));
+  a.Deallocate(&stats, q);
+
+  // The cache never holds more than the limit.
+  static const uptr kNumAllocs = 16;
+  char *allocated[kNumAllocs];
+  for (uptr i = 0; i < kNumAllocs; i++)
+    allocated[i] = (char *)a.Allocate(&stats, size, 1);
+  for (uptr i = 0; i < kNumAllocs; i++)
+    a.Deallocate(&stats, allocated[i]);
+  u64 mapped = stats.Get(AllocatorStatMmapped) -
+               stats.Get(AllocatorStatUnmapped);
+  EXPECT_LE(mapped, 4 * size);
+  EXPECT_GT(mapped, 0U);
+
+  a.ReleaseToOS(&stats);
+  EXPECT_EQ(stats.Get(AllocatorStatMmapped), stats.Get(AllocatorStatUnmapped));
+  u64 misses = stats.Get(AllocatorStatLargeCacheMiss);
+  a.Deallocate(&stats, a.Allocate(&stats, size, 1));
+  EXPECT_EQ(misses + 1, stats.Get(AllocatorStatLargeCacheMiss));
+
+  a.SetMappingCacheSize(0);
+  a.Deallocate(&stats, a.Allocate(&stats, size, 1));
+  EXPECT_EQ(misses + 1, stats.Get(AllocatorStatLargeCacheMiss));
+  EXPECT_EQ(stats.Get(AllocatorStatMmapped) - stats.Get(AllocatorStatUnmapped),
+            size + 4096);
+  a.ReleaseToOS(&stats);
+  EXPECT_EQ(stats.Get(AllocatorStatMmapped), stats.Get(AllocatorStatUnmapped));
+}
+
+struct LargeMmapAllocatorLookupParams {
+  LargeMmapAllocator<> *allocator;
+  char **chunks;
+  uptr n_chunks;
+  uptr chunk_size;
+  atomic_uint8_t *done;
+};
+
+static void *LargeMmapAllocatorLookupWorker(void *arg) {
+  LargeMmapAllocatorLookupParams *params =
+      reinterpret_cast<LargeMmapAllocatorLookupParams*>(arg);
+  while (!atomic_load(params->done, memory_order_relaxed)) {
+    for (uptr i = 0; i < params->n_chunks; i++) {
+      char *p = params->chunks[i];
+      CHECK_EQ(p, params->allocator->GetBlockBegin(p));
+      CHECK_EQ(p, params->allocator->GetBlockBegin(p + params->chunk_size / 2));
+    }
+  }
+  return 0;
+}
+
+// GetBlockBegin takes no locks: it must find the live chunks while other
+// threads allocate and deallocate.
+TEST(SanitizerCommon, LargeMmapAllocatorConcurrentLookup) {
+  LargeMmapAllocator<> a;
+  a.Init();
+  AllocatorStats stats;
+  stats.Init();
+
+  static const uptr kNumLiveAllocs = 2000;
+  static const uptr size = 4096;
+  char *live[kNumLiveAllocs];
+  for (uptr i = 0; i < kNumLiveAllocs; i++)
+    live[i] = (char *)a.Allocate(&stats, size, 1);
+
+  atomic_uint8_t done;
+  atomic_store(&done, 0, memory_order_relaxed);
+  LargeMmapAllocatorLookupParams params = {&a, live, kNumLiveAllocs, size,
+                                           &done};
+  pthread_t t;
+  EXPECT_EQ(0, pthread_create(&t, 0, LargeMmapAllocatorLookupWorker, &params));
+  for (uptr i = 0; i < 20000; i++) {
+    char *p = (char *)a.Allocate(&stats, size * (1 + i % 4), 1);
+    EXPECT_EQ(p, a.GetBlockBegin(p + size - 1));
+    a.Deallocate(&stats, p);
+  }
+  atomic_store(&done, 1, memory_order_relaxed);
+  EXPECT_EQ(0, pthread_join(t, 0));
+
+  for (uptr i = 0; i < kNumLiveAllocs; i++)
+    a.Deallocate(&stats, live[i]);
+  EXPECT_EQ(0U, a.TotalMemoryUsed());
+}
 
 #if SANITIZER_WORDSIZE == 64
+struct PopulateWorkerParams {
+  Allocator64 *allocator;
+  AllocatorStats stats;
+  std::vector<void*> chunks;
+};
+
+static void *PopulateFreeListWorker(void *arg) {
+  PopulateWorkerParams *params = reinterpret_cast<PopulateWorkerParams*>(arg);
+  SizeClassAllocatorLocalCache<Allocator64> cache;
+  memset(&cache, 0, sizeof(cache));
+  cache.Init(0);
+  params->stats.Init();
+  for (int i = 0; i < 200; i++) {
+    // Use AllocateBatch directly so that every call hits the region.
+    Allocator64::Batch *b =
+        params->allocator->AllocateBatch(&params->stats, &cache, 48);
+    for (uptr j = 0; j < b->count; j++)
+      params->chunks.push_back(b->batch[j]);
+  }
+  return 0;
+}
+
+// Threads populating the same cold size class concurrently must get
+// distinct, mapped chunks.
+TEST(SanitizerCommon, SizeClassAllocator64ConcurrentPopulate) {
+  Allocator64 *a = new Allocator64;
+  a->Init();
+  const int kNumThreads = 8;
+  PopulateWorkerParams params[kNumThreads];
+  pthread_t t[kNumThreads];
+  for (int i = 0; i < kNumThreads; i++) {
+    params[i].allocator = a;
+    EXPECT_EQ(0, pthread_create(&t[i], 0, PopulateFreeListWorker, &params[i]));
+  }
+  std::set<void*> all_chunks;
+  uptr n_chunks = 0;
+  uptr size = DefaultSizeClassMap::Size(48);
+  for (int i = 0; i < kNumThreads; i++) {
+    EXPECT_EQ(0, pthread_join(t[i], 0));
+    for (uptr j = 0; j < params[i].chunks.size(); j++) {
+      char *p = reinterpret_cast<char*>(params[i].chunks[j]);
+      p[0] = p[size - 1] = 1;
+      EXPECT_EQ(p, a->GetBlockBegin(p + size - 1));
+      *reinterpret_cast<uptr*>(a->GetMetaData(p)) = 1;
+      all_chunks.insert(p);
+      n_chunks++;
+    }
+    // Contention is not guaranteed, but the counter must be sane.
+    EXPECT_LE(params[i].stats.Get(AllocatorStatPopulateContended), 200U);
+  }
+  EXPECT_EQ(n_chunks, all_chunks.size());
+  a->TestOnlyUnmap();
+  delete a;
+}
+
+template <class Allocator>
+void TestReleaseToOS(uptr threshold) {
+  Allocator *a = new Allocator;
+  a->Init();
+  a->SetReleaseToOSThreshold(threshold);
+  SizeClassAllocatorLocalCache<Allocator> cache;
+  memset(&cache, 0, sizeof(cache));
+  cache.Init(0);
+
+  static const uptr sizes[] = {16, 100, 1000, 4096, 10000, 50000};
+  std::vector<void *> allocated;
+  for (uptr s = 0; s < ARRAY_SIZE(sizes); s++) {
+    uptr class_id = Allocator::SizeClassMapT::ClassID(sizes[s]);
+    for (uptr i = 0; i < (4 << 20) / sizes[s]; i++) {
+      char *x = (char*)cache.Allocate(a, class_id);
+      internal_memset(x, 0xab, sizes[s]);
+      allocated.push_back(x);
+    }
+  }
+  uptr total_used = a->TotalMemoryUsed();
+  for (uptr i = 0; i < allocated.size(); i++)
+    cache.Deallocate(a, a->GetSizeClass(allocated[i]), allocated[i]);
+  cache.Drain(a);
+  if (!threshold) {
+    a->ReleaseToOS();
+  } else {
+    // The next refill of each class releases its pages.
+    EXPECT_EQ(0U, a->TotalReleasedBytes());
+    for (uptr s = 0; s < ARRAY_SIZE(sizes); s++) {
+      uptr class_id = Allocator::SizeClassMapT::ClassID(sizes[s]);
+      cache.Deallocate(a, class_id, cache.Allocate(a, class_id));
+    }
+  }
+  // Almost all of the freed memory must have been released.
+  EXPECT_GT(a->TotalReleasedBytes(), total_used / 2);
+
+  // The released chunks are still usable.
+  for (uptr i = 0; i < allocated.size(); i++) {
+    uptr class_id = a->GetSizeClass(allocated[i]);
+    char *x = (char*)cache.Allocate(a, class_id);
+    x[0] = x[Allocator::SizeClassMapT::Size(class_id) - 1] = 1;
+  }
+
+  a->TestOnlyUnmap();
+  delete a;
+}
+
+TEST(SanitizerCommon, SizeClassAllocator64ReleaseToOS) {
+  TestReleaseToOS<Allocator64>(0);
+}
+
+TEST(SanitizerCommon, SizeClassAllocator64ReleaseToOSThreshold) {
+  TestReleaseToOS<Allocator64>(1 << 20);
+}
+
 // Regression test for out-of-memory condition in PopulateFreeList().
 TEST(SanitizerCommon, SizeClassAllocator64PopulateFreeListOOM) {
   // In a world where regions are small and chunks are huge...
@@ -0,0 +1,161 @@
+//===-- sanitizer_heap_profile_test.cc ------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is a part of ThreadSanitizer/AddressSanitizer runtime.
+//
+//===----------------------------------------------------------------------===//
+#include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_heap_profile.h"
+#include "sanitizer_common/sanitizer_libc.h"
+#include "gtest/gtest.h"
+
+#include <pthread.h>
+
+namespace __sanitizer {
+
+static const uptr kSampleInterval = 4096;
+
+// The profiler never touches the chunks, so the tests use fake addresses.
+static uptr FakeChunk(uptr stack, uptr i) {
+  return (stack << 26) + i * 16 + 16;
+}
+
+static void AllocateAndFree(HeapProfileThreadState *s, uptr stack_pc,
+                            uptr n, uptr size, double tolerance) {
+  uptr trace[] = {stack_pc, stack_pc + 1, stack_pc + 2};
+  HeapProfileStats before;
+  HeapProfileGetStats(&before);
+  for (uptr i = 0; i < n; i++)
+    HeapProfileMalloc(s, FakeChunk(stack_pc, i), size, trace,
+                      ARRAY_SIZE(trace));
+  HeapProfileStats after;
+  HeapProfileGetStats(&after);
+  double expected = (double)n * size;
+  double estimated = (double)after.live_bytes - before.live_bytes;
+  EXPECT_GT(estimated, expected * (1 - tolerance));
+  EXPECT_LT(estimated, expected * (1 + tolerance));
+  EXPECT_GE(after.peak_bytes, after.live_bytes);
+  EXPECT_EQ(before.dropped_samples, after.dropped_samples);
+  for (uptr i = 0; i < n; i++)
+    HeapProfileFree(FakeChunk(stack_pc, i));
+  HeapProfileGetStats(&after);
+  EXPECT_EQ(before.live_bytes, after.live_bytes);
+}
+
+TEST(SanitizerCommon, HeapProfileSampling) {
+  HeapProfileInit(kSampleInterval);
+  ASSERT_TRUE(HeapProfileEnabled());
+  HeapProfileThreadState s;
+  internal_memset(&s, 0, sizeof(s));
+  // ~6400 samples of small chunks, each standing for ~kSampleInterval bytes.
+  AllocateAndFree(&s, 1, 1 << 18, 100, 0.06);
+  // Chunks much larger than the interval are all sampled with their sizes.
+  AllocateAndFree(&s, 2, 100, 1 << 20, 0.001);
+  // ~1000 samples of chunks of about the interval size.
+  AllocateAndFree(&s, 3, 4000, 1000, 0.15);
+}
+
+TEST(SanitizerCommon, HeapProfileFreeUnsampled) {
+  HeapProfileInit(kSampleInterval);
+  HeapProfileThreadState s;
+  internal_memset(&s, 0, sizeof(s));
+  uptr trace[] = {4};
+  HeapProfileStats before, after;
+  HeapProfileGetStats(&before);
+  HeapProfileMalloc(&s, FakeChunk(4, 0), 1 << 20, trace, ARRAY_SIZE(trace));
+  // Frees of chunks the profiler has never seen are ignored.
+  for (uptr i = 1; i < 1000; i++)
+    HeapProfileFree(FakeChunk(4, i));
+  HeapProfileGetStats(&after);
+  EXPECT_EQ(before.live_bytes + (1 << 20), after.live_bytes);
+  HeapProfileFree(FakeChunk(4, 0));
+  HeapProfileGetStats(&after);
+  EXPECT_EQ(before.live_bytes, after.live_bytes);
+}
+
+TEST(SanitizerCommon, HeapProfileChurn) {
+  HeapProfileInit(kSampleInterval);
+  HeapProfileThreadState s;
+  internal_memset(&s, 0, sizeof(s));
+  uptr trace[] = {5};
+  HeapProfileStats before, after;
+  HeapProfileGetStats(&before);
+  // Every chunk is sampled. Far more chunks are freed than the live chunk
+  // table has slots, while some of them stay live across the rehashes.
+  static const uptr kLive = 1000;
+  for (uptr i = 0; i < 200000; i++) {
+    HeapProfileMalloc(&s, FakeChunk(5, i), 1 << 20, trace, ARRAY_SIZE(trace));
+    if (i >= kLive)
+      HeapProfileFree(FakeChunk(5, i - kLive));
+  }
+  HeapProfileGetStats(&after);
+  EXPECT_EQ(before.live_bytes + kLive * (1 << 20), after.live_bytes);
+  EXPECT_EQ(before.dropped_samples, after.dropped_samples);
+  for (uptr i = 200000 - kLive; i < 200000; i++)
+    HeapProfileFree(FakeChunk(5, i));
+  HeapProfileGetStats(&after);
+  EXPECT_EQ(before.live_bytes, after.live_bytes);
+}
+
+static void *HeapProfileThread(void *arg) {
+  uptr stack_pc = (uptr)arg;
+  HeapProfileThreadState s;
+  internal_memset(&s, 0, sizeof(s));
+  uptr trace[] = {stack_pc};
+  for (uptr iter = 0; iter < 10; iter++) {
+    for (uptr i = 0; i < 10000; i++)
+      HeapProfileMalloc(&s, FakeChunk(stack_pc, i), 64 + i % 512, trace,
+                        ARRAY_SIZE(trace));
+    for (uptr i = 0; i < 10000; i++)
+      HeapProfileFree(FakeChunk(stack_pc, i));
+  }
+  return 0;
+}
+
+TEST(SanitizerCommon, HeapProfileThreads) {
+  HeapProfileInit(kSampleInterval);
+  HeapProfileStats before, after;
+  HeapProfileGetStats(&before);
+  static const uptr kNumThreads = 4;
+  pthread_t threads[kNumThreads];
+  for (uptr i = 0; i < kNumThreads; i++)
+    EXPECT_EQ(0, pthread_create(&threads[i], 0, HeapProfileThread,
+                                (void*)(10 + i)));
+  for (uptr i = 0; i < kNumThreads; i++)
+    EXPECT_EQ(0, pthread_join(threads[i], 0));
+  HeapProfileGetStats(&after);
+  EXPECT_EQ(before.live_bytes, after.live_bytes);
+  EXPECT_EQ(before.dropped_samples, after.dropped_samples);
+}
+
+TEST(SanitizerCommon, HeapProfileDump) {
+  HeapProfileInit(kSampleInterval);
+  HeapProfileThreadState s;
+  internal_memset(&s, 0, sizeof(s));
+  uptr trace[] = {0x123456, 0x654321};
+  HeapProfileMalloc(&s, FakeChunk(20, 0), 1 << 20, trace, ARRAY_SIZE(trace));
+
+  char path[] = "/tmp/sanitizer_heap_profile_test";
+  EXPECT_TRUE(HeapProfileDump(path));
+  char file_name[256];
+  internal_snprintf(file_name, sizeof(file_name), "%s.%d", path,
+                    internal_getpid());
+  char *buf = 0;
+  uptr buf_size = 0;
+  uptr len = ReadFileToBuffer(file_name, &buf, &buf_size, 1 << 20);
+  ASSERT_GT(len, 0U);
+  EXPECT_EQ(0, internal_strncmp(buf, "heap profile: ", 14));
+  EXPECT_NE((char*)0, internal_strstr(buf, "1048576 1 1048576 1048576 1 @ "
+                                           "0x123456 0x654321\n"));
+  UnmapOrDie(buf, buf_size);
+  internal_unlink(file_name);
+  HeapProfileFree(FakeChunk(20, 0));
+}
+
+}  // namespace __sanitizer
@@ -0,0 +1,134 @@
+//===-- sanitizer_pointer_filter_test.cc ----------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is a part of ThreadSanitizer/AddressSanitizer runtime.
+//
+//===----------------------------------------------------------------------===//
+#include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_pointer_filter.h"
+#include "gtest/gtest.h"
+
+#include <stdlib.h>
+
+namespace __sanitizer {
+
+#if SANITIZER_WORDSIZE == 64
+// The same ranges as in LSan: the primary allocator space, and the large
+// chunks mapped next to the libraries.
+static const uptr kPrimaryBeg = 0x600000000000ULL;
+static const uptr kPrimaryEnd = 0x640000000000ULL;
+static const uptr kSecondaryBeg = 0x7f0000001000ULL;
+static const uptr kSecondaryEnd = 0x7f0000103000ULL;
+
+TEST(PointerFilter, MayBeHeapPointer) {
+  PointerFilter filter;
+  internal_memset(&filter, 0, sizeof(filter));
+  // Zero-initialized, it passes every word.
+  EXPECT_TRUE(filter.MayBeHeapPointer(0));
+  EXPECT_TRUE(filter.MayBeHeapPointer(12345));
+
+  filter.Init(kPrimaryBeg, kPrimaryEnd, kSecondaryBeg, kSecondaryEnd);
+  EXPECT_TRUE(filter.MayBeHeapPointer(kPrimaryBeg));
+  EXPECT_TRUE(filter.MayBeHeapPointer(kPrimaryEnd - 1));
+  EXPECT_TRUE(filter.MayBeHeapPointer(kSecondaryBeg));
+  EXPECT_TRUE(filter.MayBeHeapPointer(kSecondaryEnd - 1));
+  EXPECT_FALSE(filter.MayBeHeapPointer(0));
+  EXPECT_FALSE(filter.MayBeHeapPointer(12345));
+  EXPECT_FALSE(filter.MayBeHeapPointer(kPrimaryBeg - 1));
+  EXPECT_FALSE(filter.MayBeHeapPointer(kPrimaryEnd));
+  EXPECT_FALSE(filter.MayBeHeapPointer(0x7e0000000000ULL));
+  EXPECT_FALSE(filter.MayBeHeapPointer((uptr)-1));
+
+  // Without large chunks only the primary space passes.
+  filter.Init(kPrimaryBeg, kPrimaryEnd, 0, 0);
+  EXPECT_TRUE(filter.MayBeHeapPointer(kPrimaryBeg));
+  EXPECT_FALSE(filter.MayBeHeapPointer(kSecondaryBeg));
+
+  // Without chunks at all nothing but 0 passes.
+  filter.Init(0, 0, 0, 0);
+  EXPECT_FALSE(filter.MayBeHeapPointer(kPrimaryBeg));
+  EXPECT_FALSE(filter.MayBeHeapPointer(1));
+
+  // A range up to the end of the address space.
+  filter.Init(1, (uptr)-1, 0, 0);
+  EXPECT_TRUE(filter.MayBeHeapPointer((uptr)-2));
+}
+
+static uptr FindCandidateSlow(PointerFilter *filter, uptr beg, uptr end) {
+  uptr p = beg;
+  for (; p + sizeof(uptr) <= end; p += sizeof(uptr)) {
+    if (filter->MayBeHeapPointer(*(uptr*)p))
+      break;
+  }
+  return p;
+}
+
+TEST(PointerFilter, FindCandidate) {
+  PointerFilter filter;
+  filter.Init(kPrimaryBeg, kPrimaryEnd, kSecondaryBeg, kSecondaryEnd);
+  const uptr kSize = 64;
+  uptr words[kSize];
+  srand(42);
+  for (uptr iter = 0; iter < 10000; iter++) {
+    for (uptr i = 0; i < kSize; i++)
+      words[i] = (uptr)rand() * rand();
+    uptr n_hits = rand() % 3;
+    for (uptr i = 0; i < n_hits; i++) {
+      words[rand() % kSize] =
+          rand() % 2 ? kPrimaryBeg + rand() : kSecondaryBeg + rand() % 4096;
+    }
+    uptr beg = (uptr)&words[rand() % kSize];
+    // The end may be in the middle of a word.
+    uptr end = beg + rand() % ((uptr)&words[kSize] - beg + 1);
+    uptr res = filter.FindCandidate(beg, end);
+    EXPECT_EQ(FindCandidateSlow(&filter, beg, end), res);
+    if (res + sizeof(uptr) <= end) {
+      EXPECT_TRUE(filter.MayBeHeapPointer(*(uptr*)res));
+    }
+  }
+}
+
+// Scans 2GB of a root set without heap pointers, as in a process holding
+// image buffers or hash tables of integers: a 64MB region, 32 times, so
+// that the data doesn't fit into the caches and the test maps little.
+TEST(DISABLED_BENCH_PointerFilter, FindCandidate) {
+  const uptr kSize = 64 << 20;
+  const uptr kIters = 32;
+  PointerFilter filter;
+  filter.Init(kPrimaryBeg, kPrimaryEnd, kSecondaryBeg, kSecondaryEnd);
+  uptr *words = (uptr*)MmapOrDie(kSize, "PointerFilterBenchmark");
+  uptr n = kSize / sizeof(uptr);
+  u32 x = 1;
+  for (uptr i = 0; i < n; i++) {
+    x = x * 1103515245 + 12345;
+    words[i] = (i % 2) ? x : ((uptr)x << 32) | x;
+    if (filter.MayBeHeapPointer(words[i]))
+      words[i] = x;
+  }
+  uptr beg = (uptr)words, end = beg + kSize;
+  uptr slow_res = 0, fast_res = 0;
+  u64 t0 = NanoTime();
+  for (uptr iter = 0; iter < kIters; iter++)
+    slow_res += FindCandidateSlow(&filter, beg, end);
+  u64 t1 = NanoTime();
+  for (uptr iter = 0; iter < kIters; iter++)
+    fast_res += filter.FindCandidate(beg, end);
+  u64 t2 = NanoTime();
+  EXPECT_EQ(end * kIters, slow_res);
+  EXPECT_EQ(end * kIters, fast_res);
+  uptr mb = (kSize >> 20) * kIters;
+  Printf("PointerFilter over %zdM: word by word %zdM/s, vectorized %zdM/s\n",
+         mb, (uptr)(mb * 1000000000ULL / (t1 - t0 + 1)),
+         (uptr)(mb * 1000000000ULL / (t2 - t1 + 1)));
+  UnmapOrDie(words, kSize);
+}
+#endif  // SANITIZER_WORDSIZE == 64
+
+}  // namespace __sanitizer
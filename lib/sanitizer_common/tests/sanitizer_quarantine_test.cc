@@ -0,0 +1,161 @@
+//===-- sanitizer_quarantine_test.cc --------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is a part of ThreadSanitizer/AddressSanitizer runtime.
+//
+//===----------------------------------------------------------------------===//
+#include "sanitizer_common/sanitizer_atomic.h"
+#include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_quarantine.h"
+#include "gtest/gtest.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+namespace __sanitizer {
+
+struct QuarantineTestNode {
+  uptr size;
+  u64 put_time;  // In bytes put into the quarantine before this node.
+  uptr class_id;
+};
+
+static atomic_uintptr_t recycled_bytes;
+static atomic_uint64_t put_bytes;
+// Maximal number of bytes put into the quarantine after the node which is
+// being recycled.
+static atomic_uint64_t max_age_at_recycle;
+static atomic_uintptr_t min_age_at_recycle;
+static atomic_uintptr_t recycled_batches;
+static atomic_uintptr_t mixed_class_batches;
+
+struct QuarantineTestCallback {
+  void Recycle(QuarantineTestNode **nodes, uptr count, uptr class_id) {
+    atomic_fetch_add(&recycled_batches, 1, memory_order_relaxed);
+    bool mixed = false;
+    for (uptr i = 0; i < count; i++) {
+      QuarantineTestNode *n = nodes[i];
+      // Batches of class 0 may hold blocks of any class.
+      mixed |= class_id && n->class_id != class_id;
+      atomic_fetch_add(&recycled_bytes, n->size, memory_order_relaxed);
+      u64 age = atomic_load(&put_bytes, memory_order_relaxed) - n->put_time;
+      if (age > atomic_load(&max_age_at_recycle, memory_order_relaxed))
+        atomic_store(&max_age_at_recycle, age, memory_order_relaxed);
+      if (age < atomic_load(&min_age_at_recycle, memory_order_relaxed))
+        atomic_store(&min_age_at_recycle, age, memory_order_relaxed);
+      free(n);
+    }
+    if (mixed)
+      atomic_fetch_add(&mixed_class_batches, 1, memory_order_relaxed);
+  }
+  void *Allocate(uptr size) {
+    return malloc(size);
+  }
+  void Deallocate(void *p) {
+    free(p);
+  }
+};
+
+typedef Quarantine<QuarantineTestCallback, QuarantineTestNode> TestQuarantine;
+
+static const uptr kQuarantineSize = 1 << 24;
+static const uptr kQuarantineCacheSize = 1 << 16;
+static const uptr kNodeSize = 1024;
+
+static void PutNodes(TestQuarantine *q, TestQuarantine::Cache *cache,
+                     uptr n, uptr num_classes = 1) {
+  for (uptr i = 0; i < n; i++) {
+    QuarantineTestNode *node =
+        (QuarantineTestNode*)malloc(sizeof(QuarantineTestNode));
+    node->size = kNodeSize;
+    node->put_time =
+        atomic_fetch_add(&put_bytes, kNodeSize, memory_order_relaxed);
+    node->class_id = (i * 7) % num_classes;
+    q->Put(cache, QuarantineTestCallback(), node, kNodeSize, node->class_id);
+  }
+}
+
+static void ResetQuarantineTestCounters() {
+  atomic_store(&recycled_bytes, 0, memory_order_relaxed);
+  atomic_store(&put_bytes, 0, memory_order_relaxed);
+  atomic_store(&max_age_at_recycle, 0, memory_order_relaxed);
+  atomic_store(&min_age_at_recycle, (uptr)-1, memory_order_relaxed);
+  atomic_store(&recycled_batches, 0, memory_order_relaxed);
+  atomic_store(&mixed_class_batches, 0, memory_order_relaxed);
+}
+
+TEST(SanitizerCommon, QuarantineFIFO) {
+  ResetQuarantineTestCounters();
+  static TestQuarantine q(LINKER_INITIALIZED);
+  q.Init(kQuarantineSize, kQuarantineCacheSize);
+  TestQuarantine::Cache cache;
+  // Put 4 times the quarantine size.
+  PutNodes(&q, &cache, 4 * kQuarantineSize / kNodeSize);
+  EXPECT_LE(q.GetSize(), kQuarantineSize + kQuarantineCacheSize);
+  EXPECT_GE(q.GetSize(), kQuarantineSize / 10 * 9 - kQuarantineCacheSize);
+  EXPECT_EQ(atomic_load(&put_bytes, memory_order_relaxed),
+            atomic_load(&recycled_bytes, memory_order_relaxed) +
+            q.GetSize() + cache.Size());
+  // Nothing is recycled much earlier or later than in a strict FIFO.
+  EXPECT_GE(atomic_load(&min_age_at_recycle, memory_order_relaxed),
+            kQuarantineSize / 10 * 9 - kQuarantineCacheSize);
+  EXPECT_LE(atomic_load(&max_age_at_recycle, memory_order_relaxed),
+            kQuarantineSize + 2 * kQuarantineCacheSize);
+}
+
+TEST(SanitizerCommon, QuarantineSizeClasses) {
+  ResetQuarantineTestCounters();
+  static TestQuarantine q(LINKER_INITIALIZED);
+  q.Init(kQuarantineSize, kQuarantineCacheSize);
+  TestQuarantine::Cache cache;
+  // More classes than the cache has open batches, so that some classes
+  // share a batch slot and go to the mixed batches.
+  const uptr kNumClasses = 100;
+  PutNodes(&q, &cache, 4 * kQuarantineSize / kNodeSize, kNumClasses);
+  EXPECT_EQ(atomic_load(&put_bytes, memory_order_relaxed),
+            atomic_load(&recycled_bytes, memory_order_relaxed) +
+            q.GetSize() + cache.Size());
+  EXPECT_GT(atomic_load(&recycled_batches, memory_order_relaxed), 0U);
+  EXPECT_EQ(0U, atomic_load(&mixed_class_batches, memory_order_relaxed));
+}
+
+static TestQuarantine *threads_quarantine;
+
+static void *QuarantineThread(void *arg) {
+  TestQuarantine::Cache cache;
+  PutNodes(threads_quarantine, &cache, (uptr)arg);
+  threads_quarantine->Drain(&cache, QuarantineTestCallback());
+  return 0;
+}
+
+TEST(SanitizerCommon, QuarantineThreads) {
+  ResetQuarantineTestCounters();
+  static TestQuarantine q(LINKER_INITIALIZED);
+  q.Init(kQuarantineSize, kQuarantineCacheSize);
+  threads_quarantine = &q;
+  static const uptr kNumThreads = 8;
+  pthread_t threads[kNumThreads];
+  for (uptr i = 0; i < kNumThreads; i++) {
+    // The threads put different amounts of memory.
+    uptr n = (i + 1) * kQuarantineSize / kNodeSize;
+    EXPECT_EQ(0, pthread_create(&threads[i], 0, QuarantineThread, (void*)n));
+  }
+  for (uptr i = 0; i < kNumThreads; i++)
+    EXPECT_EQ(0, pthread_join(threads[i], 0));
+  EXPECT_LE(q.GetSize(), kQuarantineSize + kNumThreads * kQuarantineCacheSize);
+  EXPECT_EQ(atomic_load(&put_bytes, memory_order_relaxed),
+            atomic_load(&recycled_bytes, memory_order_relaxed) +
+            q.GetSize());
+  // Even the thread putting the most memory does not recycle other
+  // threads' memory too early.
+  EXPECT_GE(atomic_load(&min_age_at_recycle, memory_order_relaxed),
+            kQuarantineSize / 2);
+}
+
+}  // namespace __sanitizer
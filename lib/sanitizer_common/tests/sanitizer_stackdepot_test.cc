@@ -10,40 +10,41 @@
 // This file is a part of ThreadSanitizer/AddressSanitizer runtime.
 //
 //===----------------------------------------------------------------------===//
+#include "sanitizer_common/sanitizer_common.h"
 #include "sanitizer_common/sanitizer_stackdepot.h"
 #include "sanitizer_common/sanitizer_internal_defs.h"
 #include "sanitizer_common/sanitizer_libc.h"
 #include "gtest/gtest.h"
 
+#include <pthread.h>
+
 namespace __sanitizer {
 
 TEST(SanitizerCommon, StackDepotBasic) {
   uptr s1[] = {1, 2, 3, 4, 5};
   u32 i1 = StackDepotPut(s1, ARRAY_SIZE(s1));
-  uptr sz1 = 0;
-  const uptr *sp1 = StackDepotGet(i1, &sz1);
-  EXPECT_NE(sp1, (uptr*)0);
+  uptr sp1[ARRAY_SIZE(s1)];
+  uptr sz1 = StackDepotGet(i1, sp1, ARRAY_SIZE(sp1));
   EXPECT_EQ(sz1, ARRAY_SIZE(s1));
+  EXPECT_EQ(StackDepotGetSize(i1), ARRAY_SIZE(s1));
   EXPECT_EQ(internal_memcmp(sp1, s1, sizeof(s1)), 0);
 }
 
 TEST(SanitizerCommon, StackDepotAbsent) {
-  uptr sz1 = 0;
-  const uptr *sp1 = StackDepotGet((1 << 30) - 1, &sz1);
-  EXPECT_EQ(sp1, (uptr*)0);
+  uptr sp1[1];
+  EXPECT_EQ(0U, StackDepotGet((1 << 30) - 1, sp1, ARRAY_SIZE(sp1)));
+  EXPECT_EQ(0U, StackDepotGetSize((1 << 30) - 1));
 }
 
 TEST(SanitizerCommon, StackDepotEmptyStack) {
   u32 i1 = StackDepotPut(0, 0);
-  uptr sz1 = 0;
-  const uptr *sp1 = StackDepotGet(i1, &sz1);
-  EXPECT_EQ(sp1, (uptr*)0);
+  uptr sp1[1];
+  EXPECT_EQ(0U, StackDepotGet(i1, sp1, ARRAY_SIZE(sp1)));
 }
 
 TEST(SanitizerCommon, StackDepotZeroId) {
-  uptr sz1 = 0;
-  const uptr *sp1 = StackDepotGet(0, &sz1);
-  EXPECT_EQ(sp1, (uptr*)0);
+  uptr sp1[1];
+  EXPECT_EQ(0U, StackDepotGet(0, sp1, ARRAY_SIZE(sp1)));
 }
 
 TEST(SanitizerCommon, StackDepotSame) {
@@ -51,9 +52,8 @@ TEST(SanitizerCommon, StackDepotSame) {
   u32 i1 = StackDepotPut(s1, ARRAY_SIZE(s1));
   u32 i2 = StackDepotPut(s1, ARRAY_SIZE(s1));
   EXPECT_EQ(i1, i2);
-  uptr sz1 = 0;
-  const uptr *sp1 = StackDepotGet(i1, &sz1);
-  EXPECT_NE(sp1, (uptr*)0);
+  uptr sp1[ARRAY_SIZE(s1)];
+  uptr sz1 = StackDepotGet(i1, sp1, ARRAY_SIZE(sp1));
   EXPECT_EQ(sz1, ARRAY_SIZE(s1));
   EXPECT_EQ(internal_memcmp(sp1, s1, sizeof(s1)), 0);
 }
@@ -66,4 +66,294 @@ TEST(SanitizerCommon, StackDepotSeveral) {
   EXPECT_NE(i1, i2);
 }
 
+TEST(SanitizerCommon, StackDepotEncoding) {
+  // Frames far apart, going back and forth, and at the address space ends.
+  uptr s1[] = {(uptr)-1, 0, 1, 0x400000, 0x400010, 0x3ffff0,
+               (uptr)0x7f0012345678ULL, 0x400000, (uptr)-2, 0x80,
+               (uptr)1 << (SANITIZER_WORDSIZE - 1), 0x7f};
+  u32 i1 = StackDepotPut(s1, ARRAY_SIZE(s1));
+  uptr sp1[ARRAY_SIZE(s1)];
+  EXPECT_EQ(ARRAY_SIZE(s1), StackDepotGet(i1, sp1, ARRAY_SIZE(sp1)));
+  EXPECT_EQ(internal_memcmp(sp1, s1, sizeof(s1)), 0);
+  EXPECT_EQ(i1, StackDepotPut(s1, ARRAY_SIZE(s1)));
+  // A stack differing only in the last frame.
+  s1[ARRAY_SIZE(s1) - 1]++;
+  EXPECT_NE(i1, StackDepotPut(s1, ARRAY_SIZE(s1)));
+  // Only the requested number of frames is decoded.
+  uptr sp2[3] = {};
+  EXPECT_EQ(2U, StackDepotGet(i1, sp2, 2));
+  EXPECT_EQ((uptr)-1, sp2[0]);
+  EXPECT_EQ(0U, sp2[1]);
+  EXPECT_EQ(0U, sp2[2]);
+}
+
+#if SANITIZER_CAN_USE_THREADLOCAL
+TEST(SanitizerCommon, StackDepotCache) {
+  uptr s1[] = {1, 2, 3, 4, 10};
+  u32 i1 = StackDepotPut(s1, ARRAY_SIZE(s1));
+  StackDepotStats before = *StackDepotGetStats();
+  const uptr kNumPuts = 10000;
+  for (uptr i = 0; i < kNumPuts; i++)
+    EXPECT_EQ(i1, StackDepotPut(s1, ARRAY_SIZE(s1)));
+  StackDepotStats after = *StackDepotGetStats();
+  EXPECT_EQ(before.n_uniq_ids, after.n_uniq_ids);
+  EXPECT_GE(after.cache_hits - before.cache_hits, kNumPuts - 1024);
+  EXPECT_LE(after.cache_misses - before.cache_misses, 1024U);
+}
+#endif
+
+TEST(SanitizerCommon, StackDepotTrie) {
+  StackDepotSetUseTrie(true);
+  uptr s1[] = {1, 2, 3, 4, 11};
+  uptr s2[] = {5, 2, 3, 4, 11};
+  uptr s3[] = {2, 3, 4, 11};
+  u32 i1 = StackDepotPut(s1, ARRAY_SIZE(s1));
+  u32 i2 = StackDepotPut(s2, ARRAY_SIZE(s2));
+  u32 i3 = StackDepotPut(s3, ARRAY_SIZE(s3));
+  EXPECT_NE(i1, i2);
+  EXPECT_NE(i1, i3);
+  EXPECT_NE(i2, i3);
+  EXPECT_EQ(i1, StackDepotPut(s1, ARRAY_SIZE(s1)));
+  EXPECT_EQ(i3, StackDepotPut(s3, ARRAY_SIZE(s3)));
+  uptr sp[ARRAY_SIZE(s1)];
+  EXPECT_EQ(ARRAY_SIZE(s1), StackDepotGet(i1, sp, ARRAY_SIZE(sp)));
+  EXPECT_EQ(0, internal_memcmp(sp, s1, sizeof(s1)));
+  EXPECT_EQ(ARRAY_SIZE(s2), StackDepotGet(i2, sp, ARRAY_SIZE(sp)));
+  EXPECT_EQ(0, internal_memcmp(sp, s2, sizeof(s2)));
+  EXPECT_EQ(ARRAY_SIZE(s3), StackDepotGetSize(i3));
+  EXPECT_EQ(ARRAY_SIZE(s3), StackDepotGet(i3, sp, ARRAY_SIZE(sp)));
+  EXPECT_EQ(0, internal_memcmp(sp, s3, sizeof(s3)));
+  EXPECT_EQ(2U, StackDepotGet(i1, sp, 2));
+  StackDepotSetUseTrie(false);
+  // Stacks put in the other mode are still found.
+  EXPECT_EQ(i1, StackDepotPut(s1, ARRAY_SIZE(s1)));
+  EXPECT_EQ(ARRAY_SIZE(s1), StackDepotGet(i1, sp, ARRAY_SIZE(sp)));
+  EXPECT_EQ(0, internal_memcmp(sp, s1, sizeof(s1)));
+}
+
+TEST(SanitizerCommon, StackDepotDeepStack) {
+  uptr deep[] = {0x3001, 0x3002, 0x3003, 0x3004, 0x3005, 0x3006};
+  u32 id = StackDepotPut(deep, 2);
+  u32 deep_id = StackDepotPut(deep, ARRAY_SIZE(deep));
+  EXPECT_EQ(0U, StackDepotGetDeepStack(id));
+  EXPECT_EQ(2U, StackDepotGetSize(id));
+  StackDepotLinkDeepStack(id, deep_id);
+  EXPECT_EQ(deep_id, StackDepotGetDeepStack(id));
+  EXPECT_EQ(0U, StackDepotGetDeepStack(deep_id));
+  // The truncated stack is retrieved without the deeper frames, which the
+  // reports print separately.
+  uptr sp[ARRAY_SIZE(deep)];
+  EXPECT_EQ(2U, StackDepotGetSize(id));
+  EXPECT_EQ(2U, StackDepotGet(id, sp, ARRAY_SIZE(sp)));
+  EXPECT_EQ(0, internal_memcmp(sp, deep, 2 * sizeof(uptr)));
+  // The first link wins.
+  u32 other_id = StackDepotPut(deep, 4);
+  StackDepotLinkDeepStack(id, other_id);
+  EXPECT_EQ(deep_id, StackDepotGetDeepStack(id));
+  // Trie stacks can be linked too.
+  StackDepotSetUseTrie(true);
+  u32 trie_id = StackDepotPut(deep + 1, 2);
+  StackDepotSetUseTrie(false);
+  StackDepotLinkDeepStack(trie_id, other_id);
+  EXPECT_EQ(other_id, StackDepotGetDeepStack(trie_id));
+  EXPECT_EQ(2U, StackDepotGetSize(trie_id));
+}
+
+TEST(SanitizerCommon, StackDepotManyDeepStacks) {
+  // More links than the initial table has slots. The ids are not put, as
+  // linking doesn't look at the stacks.
+  const u32 kBase = 1 << 29;
+  const u32 kNumLinks = 1 << 15;
+  for (u32 i = 0; i < kNumLinks; i++)
+    StackDepotLinkDeepStack(kBase + i, kBase + kNumLinks + i);
+  for (u32 i = 0; i < kNumLinks; i++)
+    EXPECT_EQ(kBase + kNumLinks + i, StackDepotGetDeepStack(kBase + i));
+}
+
+struct IterateState {
+  u32 flat_id;
+  u32 trie_id;
+  u32 truncated_id;
+  u32 deep_id;
+  bool found_flat;
+  bool found_trie;
+  bool found_truncated;
+};
+
+static bool IterateCallback(u32 id, u32 parent_id, u32 deep_id,
+                            const uptr *frames, uptr size, void *arg) {
+  IterateState *st = (IterateState*)arg;
+  if (id == st->flat_id) {
+    EXPECT_EQ(0U, parent_id);
+    EXPECT_EQ(0U, deep_id);
+    EXPECT_EQ(3U, size);
+    EXPECT_EQ(0x7f0000001234ULL, frames[0]);
+    EXPECT_EQ(0x10ULL, frames[2]);
+    st->found_flat = true;
+  }
+  // A trie stack is reported as its innermost node, linked to the rest.
+  if (id == st->trie_id) {
+    EXPECT_NE(0U, parent_id);
+    EXPECT_EQ(1U, size);
+    EXPECT_EQ(0x2001ULL, frames[0]);
+    st->found_trie = true;
+  }
+  // A truncated stack is reported with its own frames and its deep link.
+  if (id == st->truncated_id) {
+    EXPECT_EQ(st->deep_id, deep_id);
+    EXPECT_EQ(2U, size);
+    EXPECT_EQ(0x4001ULL, frames[0]);
+    EXPECT_EQ(0x4002ULL, frames[1]);
+    st->found_truncated = true;
+  }
+  return true;
+}
+
+TEST(SanitizerCommon, StackDepotIterate) {
+  uptr s1[] = {0x7f0000001234ULL, 0x400000, 0x10};
+  uptr s2[] = {0x2001, 0x2002, 0x2003};
+  IterateState st;
+  internal_memset(&st, 0, sizeof(st));
+  st.flat_id = StackDepotPut(s1, ARRAY_SIZE(s1));
+  StackDepotSetUseTrie(true);
+  st.trie_id = StackDepotPut(s2, ARRAY_SIZE(s2));
+  StackDepotSetUseTrie(false);
+  uptr s3[] = {0x4001, 0x4002, 0x4003, 0x4004};
+  st.truncated_id = StackDepotPut(s3, 2);
+  st.deep_id = StackDepotPut(s3, ARRAY_SIZE(s3));
+  StackDepotLinkDeepStack(st.truncated_id, st.deep_id);
+  StackDepotIterate(IterateCallback, &st);
+  EXPECT_TRUE(st.found_flat);
+  EXPECT_TRUE(st.found_trie);
+  EXPECT_TRUE(st.found_truncated);
+}
+
+TEST(SanitizerCommon, StackDepotDump) {
+  uptr s1[] = {0x123456, 0x654321};
+  StackDepotPut(s1, ARRAY_SIZE(s1));
+  char path[] = "/tmp/sanitizer_stackdepot_test";
+  EXPECT_TRUE(StackDepotDump(path));
+  char file_name[256];
+  internal_snprintf(file_name, sizeof(file_name), "%s.%d", path,
+                    internal_getpid());
+  char *buf = 0;
+  uptr buf_size = 0;
+  uptr len = ReadFileToBuffer(file_name, &buf, &buf_size, 1 << 26);
+  ASSERT_GT(len, 16U);
+  EXPECT_EQ(0, internal_memcmp(buf, "SANDEPOT", 8));
+  u32 header[3];
+  internal_memcpy(header, buf + 8, sizeof(header));
+  EXPECT_EQ(2U, header[0]);  // Version.
+  EXPECT_EQ(sizeof(uptr), header[1]);
+  EXPECT_GT(header[2], 0U);  // At least the test binary is loaded.
+  UnmapOrDie(buf, buf_size);
+  internal_unlink(file_name);
+}
+
+// Server-like stacks: a few dispatch paths of deep outer frames, with a
+// varying tail of inner frames.
+static uptr ServerStack(uptr i, uptr *stack) {
+  const uptr kOuterFrames = 24;
+  const uptr kInnerFrames = 6;
+  uptr path = i % 64;
+  uptr q = i / 64;
+  uptr size = 0;
+  for (uptr j = 0; j < kInnerFrames; j++)
+    stack[size++] = 0x7f0000400000ULL + (q >> (j * 3)) * 0x40 + j * 0x1000;
+  for (uptr j = 0; j < kOuterFrames; j++)
+    stack[size++] = 0x7f0000800000ULL + (j < 8 ? path : 0) * 0x100 + j * 0x10;
+  return size;
+}
+
+static uptr PutServerStacks(uptr n, bool use_trie) {
+  StackDepotSetUseTrie(use_trie);
+  uptr mapped_before = StackDepotGetStats()->mapped;
+  for (uptr i = 0; i < n; i++) {
+    uptr stack[64];
+    uptr size = ServerStack(i + (use_trie ? n : 0), stack);
+    u32 id = StackDepotPut(stack, size);
+    uptr sp[64];
+    EXPECT_EQ(size, StackDepotGet(id, sp, ARRAY_SIZE(sp)));
+    EXPECT_EQ(0, internal_memcmp(sp, stack, size * sizeof(stack[0])));
+  }
+  StackDepotSetUseTrie(false);
+  return StackDepotGetStats()->mapped - mapped_before;
+}
+
+TEST(SanitizerCommon, StackDepotTrieMemoryBenchmark) {
+  const uptr kNumStacks = 200000;
+  uptr flat = PutServerStacks(kNumStacks, false);
+  uptr trie = PutServerStacks(kNumStacks, true);
+  Printf("StackDepot memory for %zd stacks: flat %zdK, trie %zdK\n",
+         kNumStacks, flat >> 10, trie >> 10);
+  EXPECT_LT(trie, flat);
+}
+
+// Deep stacks, as in TSan reports: a common outer part and a varying tail.
+static void DeepStack(uptr i, uptr *stack, uptr size) {
+  for (uptr j = 0; j < size; j++)
+    stack[j] = 0x7f0000400000ULL + j * 0x1234 + (j < 8 ? i * 0x10 : 0);
+}
+
+TEST(DISABLED_BENCH_StackDepot, DeepStack) {
+  const uptr kNumStacks = 20000;
+  const uptr kDepth = 64;
+  const uptr kIters = 10;
+  uptr stack[kDepth];
+  // Different stacks than in the other tests.
+  const uptr kBase = 1 << 20;
+  u64 t0 = NanoTime();
+  for (uptr i = 0; i < kNumStacks; i++) {
+    DeepStack(kBase + i, stack, kDepth);
+    StackDepotPut(stack, kDepth);
+  }
+  u64 t1 = NanoTime();
+  for (uptr iter = 0; iter < kIters; iter++) {
+    for (uptr i = 0; i < kNumStacks; i++) {
+      DeepStack(kBase + i, stack, kDepth);
+      EXPECT_NE(0U, StackDepotPut(stack, kDepth));
+    }
+  }
+  u64 t2 = NanoTime();
+  Printf("StackDepot %zd-frame stacks: insert %zdns, lookup %zdns\n", kDepth,
+         (uptr)((t1 - t0) / kNumStacks),
+         (uptr)((t2 - t1) / (kNumStacks * kIters)));
+}
+
+// Puts more stacks than the initial hash table has buckets.
+static void *StackDepotManyThread(void *arg) {
+  uptr seed = (uptr)arg;
+  const uptr kNumStacks = 100000;
+  u32 *ids = new u32[kNumStacks];
+  for (uptr i = 0; i < kNumStacks; i++) {
+    // Every other stack is shared by all threads.
+    uptr s[] = {100, (i % 2) ? seed : 0, i};
+    ids[i] = StackDepotPut(s, ARRAY_SIZE(s));
+    EXPECT_NE(0U, ids[i]);
+  }
+  for (uptr i = 0; i < kNumStacks; i++) {
+    uptr s[] = {100, (i % 2) ? seed : 0, i};
+    EXPECT_EQ(ids[i], StackDepotPut(s, ARRAY_SIZE(s)));
+    uptr sp[ARRAY_SIZE(s)];
+    uptr size = StackDepotGet(ids[i], sp, ARRAY_SIZE(sp));
+    EXPECT_EQ(ARRAY_SIZE(s), size);
+    EXPECT_EQ(0, internal_memcmp(sp, s, sizeof(s)));
+  }
+  delete[] ids;
+  return 0;
+}
+
+TEST(SanitizerCommon, StackDepotMany) {
+  StackDepotStats before = *StackDepotGetStats();
+  static const uptr kNumThreads = 4;
+  pthread_t threads[kNumThreads];
+  for (uptr i = 0; i < kNumThreads; i++)
+    EXPECT_EQ(0, pthread_create(&threads[i], 0, StackDepotManyThread,
+                                (void*)(i + 1)));
+  for (uptr i = 0; i < kNumThreads; i++)
+    EXPECT_EQ(0, pthread_join(threads[i], 0));
+  StackDepotStats after = *StackDepotGetStats();
+  EXPECT_EQ(before.n_uniq_ids + 50000 * (kNumThreads + 1), after.n_uniq_ids);
+}
+
 }  // namespace __sanitizer
@@ -12,9 +12,15 @@
 //===----------------------------------------------------------------------===//
 
 #include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_flags.h"
+#include "sanitizer_common/sanitizer_stackdepot.h"
 #include "sanitizer_common/sanitizer_stacktrace.h"
 #include "gtest/gtest.h"
 
+#if SANITIZER_CAN_EH_FRAME_UNWIND
+#include <unwind.h>
+#endif
+
 namespace __sanitizer {
 
 class FastUnwindTest : public ::testing::Test {
@@ -92,5 +98,107 @@ TEST_F(FastUnwindTest, MisalignedFramePointer) {
   }
 }
 
+#if SANITIZER_LINUX
+NOINLINE static uptr TruncatedUnwindFromDepth(int depth, StackTrace *stack) {
+  if (depth > 0)
+    return TruncatedUnwindFromDepth(depth - 1, stack) + 1;
+  GetTruncatedStackTrace(stack, 20, 3, StackTrace::GetCurrentPc(),
+                         GET_CURRENT_FRAME(), 0, 0, false);
+  return 0;
+}
+
+TEST(SlowUnwindTest, TruncatedStackTrace) {
+  StackTrace stack;
+  for (int i = 0; i < 2; i++) {
+    TruncatedUnwindFromDepth(10, &stack);
+    EXPECT_EQ(3U, stack.size);
+    u32 id = StackDepotPut(stack.trace, stack.size);
+    u32 deep_id = StackDepotGetDeepStack(id);
+    ASSERT_NE(0U, deep_id);
+    // The deep stack starts with the truncated one.
+    uptr trace[20];
+    EXPECT_EQ(20U, StackDepotGet(deep_id, trace, ARRAY_SIZE(trace)));
+    for (uptr j = 0; j < stack.size; j++)
+      EXPECT_EQ(stack.trace[j], trace[j]);
+  }
+}
+#endif  // SANITIZER_LINUX
+
+#if SANITIZER_CAN_EH_FRAME_UNWIND
+static void SlowUnwind(StackTrace *stack, bool eh_frame) {
+  bool old = common_flags()->eh_frame_unwind;
+  common_flags()->eh_frame_unwind = eh_frame;
+  stack->SlowUnwindStack(StackTrace::GetCurrentPc(), kStackTraceMax);
+  common_flags()->eh_frame_unwind = old;
+}
+
+static _Unwind_Reason_Code UnwindBacktraceCallback(
+    struct _Unwind_Context *ctx, void *param) {
+  StackTrace *stack = (StackTrace*)param;
+  stack->trace[stack->size++] = _Unwind_GetIP(ctx);
+  return stack->size == stack->max_size ? _URC_NORMAL_STOP : _URC_NO_REASON;
+}
+
+// Recurses to get a few frames of this file on the stack, then unwinds it
+// with EhFrameUnwindStack and with _Unwind_Backtrace directly, so that
+// SlowUnwindStack can not hide a failure of the .eh_frame unwinder by
+// falling back to _Unwind_Backtrace.
+NOINLINE static uptr UnwindFromDepth(int depth, bool *eh_frame_ok,
+                                     StackTrace *eh_frame,
+                                     StackTrace *libgcc) {
+  if (depth > 0) {
+    uptr res = UnwindFromDepth(depth - 1, eh_frame_ok, eh_frame, libgcc);
+    // Prevent the tail call.
+    return res + 1;
+  }
+  *eh_frame_ok = eh_frame->EhFrameUnwindStack(kStackTraceMax);
+  libgcc->size = 0;
+  libgcc->max_size = kStackTraceMax;
+  _Unwind_Backtrace(UnwindBacktraceCallback, libgcc);
+  return 0;
+}
+
+TEST(SlowUnwindTest, EhFrameMatchesUnwindBacktrace) {
+  StackTrace eh_frame, libgcc;
+  bool eh_frame_ok = false;
+  EXPECT_EQ(10U, UnwindFromDepth(10, &eh_frame_ok, &eh_frame, &libgcc));
+  ASSERT_TRUE(eh_frame_ok);
+  EXPECT_GT(eh_frame.size, 12U);
+  // _Unwind_Backtrace may report a null pc past the outermost frame.
+  uptr size = libgcc.size;
+  if (size > 0 && libgcc.trace[size - 1] == 0)
+    size--;
+  // Only the top frames, which are the pcs of the two calls, differ.
+  ASSERT_EQ(size, eh_frame.size);
+  for (uptr i = 1; i < eh_frame.size; i++)
+    EXPECT_EQ(libgcc.trace[i], eh_frame.trace[i]);
+}
+
+TEST(SlowUnwindTest, EhFrameUnwindStackMaxDepth) {
+  StackTrace stack;
+  EXPECT_TRUE(stack.EhFrameUnwindStack(3));
+  EXPECT_EQ(3U, stack.size);
+}
+
+NOINLINE static uptr BenchmarkFromDepth(int depth, bool eh_frame) {
+  if (depth > 0)
+    return BenchmarkFromDepth(depth - 1, eh_frame) + 1;
+  const uptr kIters = 2000;
+  StackTrace stack;
+  u64 t0 = NanoTime();
+  for (uptr i = 0; i < kIters; i++)
+    SlowUnwind(&stack, eh_frame);
+  u64 t1 = NanoTime();
+  Printf("SlowUnwindStack (%s) of %zd frames: %zdns\n",
+         eh_frame ? "eh_frame" : "_Unwind_Backtrace", stack.size,
+         (uptr)((t1 - t0) / kIters));
+  return 0;
+}
+
+TEST(DISABLED_BENCH_SlowUnwind, Benchmark) {
+  BenchmarkFromDepth(30, false);
+  BenchmarkFromDepth(30, true);
+}
+#endif  // SANITIZER_CAN_EH_FRAME_UNWIND
 
 }  // namespace __sanitizer
@@ -0,0 +1,128 @@
+//===-- sanitizer_symbolizer_cache_test.cc --------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is a part of ThreadSanitizer/AddressSanitizer runtime.
+//
+//===----------------------------------------------------------------------===//
+#include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_symbolizer_cache.h"
+#include "sanitizer_common/sanitizer_symbolizer_external.h"
+#include "gtest/gtest.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace __sanitizer {
+
+static SymbolizerCache *NewCache() {
+  SymbolizerCache *cache = new SymbolizerCache;
+  internal_memset(cache, 0, sizeof(*cache));
+  return cache;
+}
+
+TEST(SymbolizerCache, Basic) {
+  SymbolizerCache *cache = NewCache();
+  EXPECT_EQ(0, cache->Get(false, "/bin/a", 0x10));
+  cache->Put(false, "/bin/a", 0x10, "foo\na.cc:1:2\n\n");
+  cache->Put(true, "/bin/a", 0x10, "bar\n16 8\n");
+  cache->Put(false, "/bin/b", 0x10, "baz\nb.cc:3:4\n\n");
+  EXPECT_STREQ("foo\na.cc:1:2\n\n", cache->Get(false, "/bin/a", 0x10));
+  EXPECT_STREQ("bar\n16 8\n", cache->Get(true, "/bin/a", 0x10));
+  EXPECT_STREQ("baz\nb.cc:3:4\n\n", cache->Get(false, "/bin/b", 0x10));
+  EXPECT_EQ(0, cache->Get(false, "/bin/a", 0x11));
+  EXPECT_EQ(3U, cache->size());
+  EXPECT_EQ(3U, cache->hits());
+  EXPECT_EQ(2U, cache->misses());
+  cache->Clear();
+  EXPECT_EQ(0U, cache->size());
+  EXPECT_EQ(0, cache->Get(false, "/bin/a", 0x10));
+  // The cache is usable again after Clear.
+  cache->Put(false, "/bin/a", 0x10, "foo\na.cc:1:2\n\n");
+  EXPECT_STREQ("foo\na.cc:1:2\n\n", cache->Get(false, "/bin/a", 0x10));
+  EXPECT_EQ(1U, cache->size());
+  cache->Clear();
+  delete cache;
+}
+
+TEST(SymbolizerCache, EvictsLeastRecentlyUsed) {
+  SymbolizerCache *cache = NewCache();
+  const uptr kSize = SymbolizerCache::kSize;
+  char reply[32];
+  for (uptr i = 0; i < kSize; i++) {
+    internal_snprintf(reply, sizeof(reply), "f%zd\n", i);
+    cache->Put(false, "/bin/a", i, reply);
+  }
+  // Use the first entry, so that the second one is evicted.
+  EXPECT_STREQ("f0\n", cache->Get(false, "/bin/a", 0));
+  cache->Put(false, "/bin/a", kSize, "new\n");
+  EXPECT_EQ(kSize, cache->size());
+  EXPECT_STREQ("f0\n", cache->Get(false, "/bin/a", 0));
+  EXPECT_EQ(0, cache->Get(false, "/bin/a", 1));
+  EXPECT_STREQ("f2\n", cache->Get(false, "/bin/a", 2));
+  EXPECT_STREQ("new\n", cache->Get(false, "/bin/a", kSize));
+  // Then the third one, the least recently used now.
+  cache->Put(false, "/bin/a", kSize + 1, "newer\n");
+  EXPECT_EQ(0, cache->Get(false, "/bin/a", 3));
+  EXPECT_STREQ("f2\n", cache->Get(false, "/bin/a", 2));
+  cache->Clear();
+  delete cache;
+}
+
+#if SANITIZER_LINUX
+static const char kFakeReply[] = "fake_function\nfake.cc:12:3\n\n";
+
+static void CheckReply(uptr index, const char *reply, void *arg) {
+  uptr *n_replies = (uptr*)arg;
+  EXPECT_EQ(*n_replies, index);
+  EXPECT_STREQ(kFakeReply, reply);
+  (*n_replies)++;
+}
+
+TEST(ExternalSymbolizer, SendBatch) {
+  // Answers every request with the same frame.
+  char path[] = "/tmp/sanitizer_fake_symbolizer.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(-1, fd);
+  const char kScript[] =
+      "#!/bin/sh\n"
+      "while read -r line; do\n"
+      "  printf 'fake_function\\nfake.cc:12:3\\n\\n'\n"
+      "done\n";
+  ssize_t script_size = sizeof(kScript) - 1;
+  ASSERT_EQ(script_size, write(fd, kScript, script_size));
+  close(fd);
+  chmod(path, 0700);
+  int input_fd, output_fd;
+  ASSERT_TRUE(StartSymbolizerSubprocess(path, &input_fd, &output_fd));
+  ExternalSymbolizer *symbolizer =
+      new ExternalSymbolizer(path, input_fd, output_fd);
+  // More requests than are written ahead of the replies at once.
+  const uptr kNumRequests = 2000;
+  const char *module_names[kNumRequests];
+  uptr module_offsets[kNumRequests];
+  for (uptr i = 0; i < kNumRequests; i++) {
+    module_names[i] = "/bin/fake";
+    module_offsets[i] = i;
+  }
+  uptr n_replies = 0;
+  EXPECT_EQ(kNumRequests,
+            symbolizer->SendBatch(false, module_names, module_offsets,
+                                  kNumRequests, CheckReply, &n_replies));
+  EXPECT_EQ(kNumRequests, n_replies);
+  // No reply is left over for the following requests.
+  EXPECT_STREQ(kFakeReply, symbolizer->SendCommand(false, "/bin/fake", 1));
+  close(input_fd);
+  close(output_fd);
+  delete symbolizer;
+  unlink(path);
+}
+#endif  // SANITIZER_LINUX
+
+}  // namespace __sanitizer
@@ -0,0 +1,263 @@
+//===-- sanitizer_symbolizer_elf_test.cc ----------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is a part of ThreadSanitizer/AddressSanitizer runtime.
+//
+//===----------------------------------------------------------------------===//
+#include "sanitizer_common/sanitizer_allocator_internal.h"
+#include "sanitizer_common/sanitizer_flags.h"
+#include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_symbolizer.h"
+#include "sanitizer_common/sanitizer_symbolizer_elf.h"
+#include "gtest/gtest.h"
+
+#include <elf.h>
+#include <link.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace __sanitizer {
+
+#if SANITIZER_LINUX
+int elf_symbolizer_test_global[4];
+
+static NOINLINE uptr GetCallerPc() {
+  return (uptr)__builtin_return_address(0);
+}
+
+class ScopedSymbolizeInProcess {
+ public:
+  ScopedSymbolizeInProcess() {
+    old_ = common_flags()->symbolize_in_process;
+    common_flags()->symbolize_in_process = true;
+  }
+  ~ScopedSymbolizeInProcess() {
+    FlushSymbolizer();
+    common_flags()->symbolize_in_process = old_;
+  }
+
+ private:
+  bool old_;
+};
+
+TEST(ElfSymbolizer, Code) {
+  ScopedSymbolizeInProcess in_process;
+  ASSERT_TRUE(IsSymbolizerAvailable());
+  // The call instruction is on the line of the call.
+  uptr pc = GetCallerPc() - 1; int line = __LINE__;
+  AddressInfo info;
+  ASSERT_EQ(1U, SymbolizeCode(pc, &info, 1));
+  ASSERT_NE((char*)0, info.function);
+  EXPECT_NE((char*)0, internal_strstr(info.function, "ElfSymbolizer_Code"));
+  ASSERT_NE((char*)0, info.file);
+  EXPECT_NE((char*)0,
+            internal_strstr(info.file, "sanitizer_symbolizer_elf_test.cc"));
+  EXPECT_EQ(line, info.line);
+  info.Clear();
+
+  // The function start is found by the symbol table alone.
+  ASSERT_EQ(1U, SymbolizeCode((uptr)&GetCallerPc, &info, 1));
+  ASSERT_NE((char*)0, info.function);
+  EXPECT_NE((char*)0, internal_strstr(info.function, "GetCallerPc"));
+  info.Clear();
+}
+
+TEST(ElfSymbolizer, Data) {
+  ScopedSymbolizeInProcess in_process;
+  DataInfo info;
+  uptr addr = (uptr)&elf_symbolizer_test_global[2];
+  ASSERT_TRUE(SymbolizeData(addr, &info));
+  ASSERT_NE((char*)0, info.name);
+  EXPECT_NE((char*)0, internal_strstr(info.name, "elf_symbolizer_test_global"));
+  EXPECT_EQ((uptr)&elf_symbolizer_test_global[0], info.start);
+  EXPECT_EQ(sizeof(elf_symbolizer_test_global), info.size);
+  InternalFree(info.module);
+  InternalFree(info.name);
+}
+
+TEST(ElfSymbolizer, NoDebugInfo) {
+  ScopedSymbolizeInProcess in_process;
+  // libc usually has only the dynamic symbol table.
+  AddressInfo info;
+  ASSERT_EQ(1U, SymbolizeCode((uptr)&getpid, &info, 1));
+  EXPECT_NE((char*)0, info.module);
+  EXPECT_NE((char*)0, info.function);
+  info.Clear();
+}
+
+// A DWARF 4 line program of the file a.cc.
+struct LineProgramBuilder {
+  u8 program[256];
+  uptr size;
+
+  void Byte(u8 b) { program[size++] = b; }
+  void SetAddress(uptr address) {
+    Byte(0);
+    Byte(1 + sizeof(address));
+    Byte(2);  // DW_LNE_set_address
+    internal_memcpy(&program[size], &address, sizeof(address));
+    size += sizeof(address);
+  }
+  // The operands are ULEB128 and SLEB128, so they are less than 0x40 here.
+  void AdvancePc(u8 delta) { Byte(2); Byte(delta); }
+  void AdvanceLine(u8 delta) { Byte(3); Byte(delta); }
+  void Copy() { Byte(1); }
+  void EndSequence() { Byte(0); Byte(1); Byte(1); }
+
+  // A sequence of the lines line and line + 1 at [beg, beg + 0x10) and
+  // [beg + 0x10, beg + 0x20).
+  void AddLines(uptr beg, u8 line) {
+    SetAddress(beg);
+    AdvanceLine(line - 1);
+    Copy();
+    AdvancePc(0x10);
+    AdvanceLine(1);
+    Copy();
+    AdvancePc(0x10);
+    EndSequence();
+  }
+};
+
+// Writes an ELF file with only a .debug_line section holding the programs.
+static void WriteLinePrograms(char *path, const LineProgramBuilder *programs,
+                              uptr n_programs) {
+  static const u8 kHeader[] = {
+    1, 1, 1,     // min_inst_length, max_ops_per_inst, default_is_stmt
+    (u8)-5, 14,  // line_base, line_range
+    13,          // opcode_base
+    0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1,  // standard_opcode_lengths
+    0,  // include_directories
+    'a', '.', 'c', 'c', 0, 0, 0, 0,  // file_names
+    0
+  };
+  static const char kShstrtab[] = "\0.shstrtab\0.debug_line";
+  u8 file[1024];
+  internal_memset(file, 0, sizeof(file));
+  ElfW(Ehdr) *ehdr = (ElfW(Ehdr)*)file;
+  internal_memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+  ehdr->e_ident[EI_CLASS] = SANITIZER_WORDSIZE == 64 ? ELFCLASS64 : ELFCLASS32;
+  ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr->e_type = ET_DYN;
+  ehdr->e_version = EV_CURRENT;
+  ehdr->e_ehsize = sizeof(*ehdr);
+  ehdr->e_shentsize = sizeof(ElfW(Shdr));
+  ehdr->e_shnum = 3;
+  ehdr->e_shstrndx = 1;
+  uptr shstrtab = sizeof(*ehdr);
+  internal_memcpy(file + shstrtab, kShstrtab, sizeof(kShstrtab));
+  uptr debug_line = shstrtab + sizeof(kShstrtab);
+  u8 *p = file + debug_line;
+  for (uptr i = 0; i < n_programs; i++) {
+    const LineProgramBuilder &b = programs[i];
+    u32 unit_length = 2 + 4 + sizeof(kHeader) + b.size;
+    u16 version = 4;
+    u32 header_length = sizeof(kHeader);
+    ASSERT_LE(p + 4 + unit_length, file + sizeof(file));
+    internal_memcpy(p, &unit_length, 4);
+    internal_memcpy(p + 4, &version, 2);
+    internal_memcpy(p + 6, &header_length, 4);
+    internal_memcpy(p + 10, kHeader, sizeof(kHeader));
+    internal_memcpy(p + 10 + sizeof(kHeader), b.program, b.size);
+    p += 4 + unit_length;
+  }
+  uptr debug_line_size = p - (file + debug_line);
+  uptr shoff = RoundUpTo(debug_line + debug_line_size, sizeof(uptr));
+  ASSERT_LE(shoff + 3 * sizeof(ElfW(Shdr)), sizeof(file));
+  ehdr->e_shoff = shoff;
+  ElfW(Shdr) *sections = (ElfW(Shdr)*)(file + shoff);
+  sections[1].sh_name = 1;
+  sections[1].sh_type = SHT_STRTAB;
+  sections[1].sh_offset = shstrtab;
+  sections[1].sh_size = sizeof(kShstrtab);
+  sections[2].sh_name = 11;
+  sections[2].sh_type = SHT_PROGBITS;
+  sections[2].sh_offset = debug_line;
+  sections[2].sh_size = debug_line_size;
+  int fd = mkstemp(path);
+  ASSERT_NE(-1, fd);
+  ssize_t size = shoff + 3 * sizeof(ElfW(Shdr));
+  ASSERT_EQ(size, write(fd, file, size));
+  close(fd);
+}
+
+static LowLevelAllocator elf_test_allocator;
+
+static void ExpectLines(const LineProgramBuilder &b) {
+  char path[] = "/tmp/sanitizer_elf_symbolizer_test.XXXXXX";
+  WriteLinePrograms(path, &b, 1);
+  ElfSymbolizer *symbolizer = ElfSymbolizer::get(&elf_test_allocator);
+  EXPECT_STREQ("??\na.cc:10:0\n\n",
+               symbolizer->SendCommand(false, path, 0x1008));
+  EXPECT_STREQ("??\na.cc:11:0\n\n",
+               symbolizer->SendCommand(false, path, 0x1018));
+  EXPECT_STREQ("??\n??:0:0\n\n", symbolizer->SendCommand(false, path, 0x2000));
+  unlink(path);
+}
+
+TEST(ElfSymbolizer, LineProgram) {
+  LineProgramBuilder b;
+  b.size = 0;
+  b.AddLines(0x1000, 10);
+  ExpectLines(b);
+}
+
+TEST(ElfSymbolizer, LinePrograms) {
+  LineProgramBuilder b[2];
+  b[0].size = b[1].size = 0;
+  // The address range of the first program covers the second one.
+  b[0].AddLines(0x1000, 10);
+  b[0].AddLines(0x5000, 50);
+  b[1].AddLines(0x3000, 30);
+  char path[] = "/tmp/sanitizer_elf_symbolizer_test.XXXXXX";
+  WriteLinePrograms(path, b, 2);
+  ElfSymbolizer *symbolizer = ElfSymbolizer::get(&elf_test_allocator);
+  EXPECT_STREQ("??\na.cc:31:0\n\n",
+               symbolizer->SendCommand(false, path, 0x3018));
+  EXPECT_STREQ("??\na.cc:50:0\n\n",
+               symbolizer->SendCommand(false, path, 0x5008));
+  EXPECT_STREQ("??\na.cc:11:0\n\n",
+               symbolizer->SendCommand(false, path, 0x1018));
+  EXPECT_STREQ("??\n??:0:0\n\n", symbolizer->SendCommand(false, path, 0x4000));
+  unlink(path);
+}
+
+TEST(ElfSymbolizer, LineProgramLeadingEmptySequence) {
+  LineProgramBuilder b;
+  b.size = 0;
+  b.SetAddress(0x2000);
+  b.Copy();
+  b.EndSequence();
+  b.AddLines(0x1000, 10);
+  ExpectLines(b);
+}
+
+TEST(ElfSymbolizer, LineProgramTrailingEmptySequence) {
+  LineProgramBuilder b;
+  b.size = 0;
+  b.AddLines(0x1000, 10);
+  b.SetAddress(0x2000);
+  b.Copy();
+  b.EndSequence();
+  ExpectLines(b);
+}
+
+TEST(ElfSymbolizer, LineProgramTrailingUnterminatedSequence) {
+  LineProgramBuilder b;
+  b.size = 0;
+  b.AddLines(0x1000, 10);
+  b.SetAddress(0x2000);
+  b.Copy();
+  b.AdvancePc(0x10);
+  b.Copy();
+  ExpectLines(b);
+}
+#endif  // SANITIZER_LINUX
+
+}  // namespace __sanitizer
@@ -0,0 +1,82 @@
+//===-- sanitizer_symbolizer_test.cc --------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is a part of ThreadSanitizer/AddressSanitizer runtime.
+//
+//===----------------------------------------------------------------------===//
+#include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_symbolizer.h"
+#include "gtest/gtest.h"
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+namespace __sanitizer {
+
+#if SANITIZER_LINUX
+static LoadedModuleIndex *NewIndex() {
+  LoadedModuleIndex *index = new LoadedModuleIndex;
+  internal_memset(index, 0, sizeof(*index));
+  return index;
+}
+
+TEST(LoadedModuleIndex, FindModule) {
+  LoadedModuleIndex *index = NewIndex();
+  uptr code = (uptr)&NewIndex;
+  LoadedModule *exe = index->FindModule(code);
+  ASSERT_NE((LoadedModule*)0, exe);
+  EXPECT_TRUE(exe->containsAddress(code));
+  LoadedModule *libc = index->FindModule((uptr)&getpid);
+  ASSERT_NE((LoadedModule*)0, libc);
+  EXPECT_NE(exe, libc);
+  EXPECT_TRUE(libc->containsAddress((uptr)&getpid));
+  // Nothing is mapped at the zero page.
+  EXPECT_EQ((LoadedModule*)0, index->FindModule(16));
+  // Every range of a module maps back to it.
+  LoadedModule *modules[] = {exe, libc};
+  for (uptr i = 0; i < ARRAY_SIZE(modules); i++) {
+    LoadedModule *module = modules[i];
+    for (uptr j = 0; j < module->n_ranges(); j++) {
+      uptr beg = module->range_beg(j), end = module->range_end(j);
+      if (beg == end)
+        continue;
+      EXPECT_EQ(module, index->Lookup(beg));
+      EXPECT_EQ(module, index->Lookup(end - 1));
+    }
+  }
+}
+
+TEST(LoadedModuleIndex, UpdatesAfterDlopen) {
+  LoadedModuleIndex *index = NewIndex();
+  index->Update();
+  const char *kLibs[] = {"libz.so.1", "libutil.so.1", "libresolv.so.2"};
+  void *lib = 0;
+  for (uptr i = 0; i < ARRAY_SIZE(kLibs) && lib == 0; i++) {
+    if (dlopen(kLibs[i], RTLD_NOW | RTLD_NOLOAD) == 0)
+      lib = dlopen(kLibs[i], RTLD_NOW);
+  }
+  if (lib == 0)
+    return;
+  Dl_info info;
+  void *sym = dlsym(lib, "zlibVersion");
+  if (sym == 0)
+    sym = dlsym(lib, "openpty");
+  if (sym == 0)
+    sym = dlsym(lib, "__res_init");
+  ASSERT_NE((void*)0, sym);
+  ASSERT_NE(0, dladdr(sym, &info));
+  EXPECT_EQ((LoadedModule*)0, index->Lookup((uptr)sym));
+  LoadedModule *module = index->FindModule((uptr)sym);
+  ASSERT_NE((LoadedModule*)0, module);
+  EXPECT_EQ((uptr)info.dli_fbase, module->base_address());
+  dlclose(lib);
+}
+#endif  // SANITIZER_LINUX
+
+}  // namespace __sanitizer
@@ -96,6 +96,13 @@ ReportStack *SymbolizeCode(uptr addr) {
   return top;
 }
 
+void SymbolizeCodeBatch(const uptr *pcs, uptr n) {
+  if (!IsSymbolizerAvailable())
+    return;
+  ScopedInSymbolizer in_symbolizer;
+  PrefetchSymbolizeCode(pcs, n);
+}
+
 ReportLocation *SymbolizeData(uptr addr) {
   if (!IsSymbolizerAvailable())
     return 0;
@@ -19,6 +19,9 @@
 namespace __tsan {
 
 ReportStack *SymbolizeCode(uptr addr);
+// Symbolizes the pcs in one batch, so that the following SymbolizeCode
+// calls for them are fast.
+void SymbolizeCodeBatch(const uptr *pcs, uptr n);
 ReportLocation *SymbolizeData(uptr addr);
 void SymbolizeFlush();
 